@@ -0,0 +1,733 @@
+﻿#include "framework.h"
+#include "Benchmark.h"
+#include <TraceLoggingProvider.h>
+
+#pragma region Allocation counting
+
+// Counts C++ heap allocations made by the process, including those made by
+// DXHelpers on worker threads. Allocations made by Direct2D, DirectWrite,
+// and the driver use their own heaps and are not counted.
+static std::atomic<uint64_t> g_allocationCount{ 0 };
+static std::atomic<uint64_t> g_allocationBytes{ 0 };
+
+void* operator new(size_t size)
+{
+    g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    g_allocationBytes.fetch_add(size, std::memory_order_relaxed);
+
+    void* p = malloc(size != 0 ? size : 1);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc{};
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+#pragma endregion // Allocation counting
+
+#pragma region BenchmarkWindow
+
+ComPtr<BenchmarkWindow> BenchmarkWindow::Create(DXDevice* device, HINSTANCE hInstance, uint32_t lineCount)
+{
+    wchar_t const className[] = L"BenchmarkWindow";
+
+    // Register the window class on the first call.
+    static bool isClassRegistered = false;
+    if (!isClassRegistered)
+    {
+        WNDCLASSEXW wcex = {};
+
+        wcex.cbSize = sizeof(WNDCLASSEX);
+
+        wcex.style = CS_HREDRAW | CS_VREDRAW;
+        wcex.lpfnWndProc = WindowProc;
+        wcex.hInstance = hInstance;
+        wcex.hCursor = LoadCursor(nullptr, IDC_ARROW);
+        wcex.lpszClassName = className;
+
+        ATOM classAtom = RegisterClassExW(&wcex);
+        if (classAtom == 0)
+        {
+            ThrowLastError();
+        }
+
+        isClassRegistered = true;
+    }
+
+    // Create the window at a fixed size, so results are comparable.
+    HWND hwnd = CreateWindowW(
+        className,
+        L"HelloDesktop2D Benchmark",
+        WS_OVERLAPPEDWINDOW,
+        0, 0,
+        1024, 768,
+        nullptr,
+        nullptr,
+        hInstance,
+        nullptr
+    );
+
+    if (hwnd == nullptr)
+    {
+        ThrowLastError();
+    }
+
+    StartupTimeline::Mark(StartupMark::WindowCreated);
+
+    ShowWindow(hwnd, SW_SHOWNOACTIVATE);
+
+    ComPtr<BenchmarkWindow> windowContext{ new BenchmarkWindow{ device, hwnd, lineCount } };
+
+    return windowContext;
+}
+
+BenchmarkWindow::BenchmarkWindow(DXDevice* device, HWND hwnd, uint32_t lineCount) :
+    DXWindowContext{ device, hwnd },
+    m_hwnd{ hwnd }
+{
+    AddResource(&m_textBrush);
+
+    m_textFormat = device->GetTextFormatCache().Get(L"Segoe UI", 10.0f, DWRITE_WORD_WRAPPING_NO_WRAP);
+
+    // Font sizes cycle from 8 to 31 DIPs, like HelloWorldWindow.
+    m_fontSizes.resize(lineCount);
+    for (uint32_t i = 0; i < lineCount; i++)
+    {
+        m_fontSizes[i] = 8.0f + (i % 24);
+    }
+}
+
+LRESULT CALLBACK BenchmarkWindow::WindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    switch (message)
+    {
+    case WM_PAINT:
+        // Frames are rendered only by the benchmark, so that every frame
+        // is measured.
+        ValidateRect(hwnd, nullptr);
+        break;
+    case WM_SIZE:
+        DXWindowContext::OnResize(hwnd);
+        break;
+    case WM_DPICHANGED:
+        DXWindowContext::OnDpiChanged(hwnd, wParam, lParam);
+        break;
+    default:
+        return DefWindowProc(hwnd, message, wParam, lParam);
+    }
+    return 0;
+}
+
+void BenchmarkWindow::RenderContent()
+{
+    if (m_isDeviceLostPending)
+    {
+        m_isDeviceLostPending = false;
+        throw DeviceLostException{ DXGI_ERROR_DEVICE_REMOVED };
+    }
+
+    static wchar_t const text[] = L"Hello World! 😀";
+    constexpr uint32_t textLength = ARRAYSIZE(text) - 1;
+
+    auto context = GetD2dContext();
+    auto dwriteFactory = GetDWriteFactory();
+    auto& layoutCache = GetTextLayoutCache();
+
+    context->Clear(D2D1_COLOR_F{ 1.0f, 1.0f, 1.0f, 1.0f });
+
+    // Draw the lines in columns, so all of them are visible.
+    D2D_POINT_2F textPos{ 10.0f, 10.0f };
+    float const columnWidth = 300.0f;
+
+    for (float fontSize : m_fontSizes)
+    {
+        auto layout = layoutCache.Get(dwriteFactory, text, textLength, m_textFormat.Get(), 0, fontSize);
+
+        if (textPos.y + layout.metrics.height > GetHeightDips())
+        {
+            textPos.x += columnWidth;
+            textPos.y = 10.0f;
+        }
+
+        context->DrawTextLayout(textPos, layout.textLayout.Get(), m_textBrush.Get(), D2D1_DRAW_TEXT_OPTIONS_ENABLE_COLOR_FONT);
+        textPos.y += layout.metrics.height;
+    }
+}
+
+#pragma endregion // BenchmarkWindow
+
+#pragma region Scenarios
+
+// Dispatches pending messages, e.g., WM_SIZE sent by SetWindowPos.
+static void PumpMessages()
+{
+    MSG msg;
+    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+    {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+}
+
+static float GetPercentile(std::vector<float> const& sortedTimes, float percentile) noexcept
+{
+    if (sortedTimes.empty())
+    {
+        return 0;
+    }
+
+    size_t index = static_cast<size_t>(percentile * (sortedTimes.size() - 1) + 0.5f);
+    return sortedTimes[index];
+}
+
+// Renders frameCount frames, calling prepareFrame before each one, and
+// returns statistics for the time spent in Paint and prepareFrame.
+static ScenarioResult RunScenario(
+    char const* name,
+    BenchmarkWindow* window,
+    uint32_t frameCount,
+    std::function<void(uint32_t)> const& prepareFrame
+    )
+{
+    std::vector<float> frameTimes;
+    frameTimes.reserve(frameCount);
+
+    // Render one frame first, so lazily created objects aren't measured.
+    window->InvalidateAll();
+    window->Paint();
+    PumpMessages();
+
+    uint64_t allocationCount = g_allocationCount.load(std::memory_order_relaxed);
+    uint64_t allocationBytes = g_allocationBytes.load(std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < frameCount; i++)
+    {
+        int64_t startQpc = FrameProfiler::GetQpcTime();
+
+        prepareFrame(i);
+        PumpMessages();
+        window->InvalidateAll();
+        window->Paint();
+
+        frameTimes.push_back(FrameProfiler::QpcToMs(FrameProfiler::GetQpcTime() - startQpc));
+    }
+
+    allocationCount = g_allocationCount.load(std::memory_order_relaxed) - allocationCount;
+    allocationBytes = g_allocationBytes.load(std::memory_order_relaxed) - allocationBytes;
+
+    ScenarioResult result = {};
+    result.name = name;
+    result.frameCount = frameCount;
+
+    std::sort(frameTimes.begin(), frameTimes.end());
+
+    float totalMs = 0;
+    for (float ms : frameTimes)
+    {
+        totalMs += ms;
+    }
+
+    if (frameCount != 0)
+    {
+        result.meanMs = totalMs / frameCount;
+        result.p50Ms = GetPercentile(frameTimes, 0.50f);
+        result.p90Ms = GetPercentile(frameTimes, 0.90f);
+        result.p99Ms = GetPercentile(frameTimes, 0.99f);
+        result.maxMs = frameTimes.back();
+        result.allocationsPerFrame = static_cast<double>(allocationCount) / frameCount;
+        result.bytesPerFrame = static_cast<double>(allocationBytes) / frameCount;
+    }
+
+    return result;
+}
+
+static void SetClientSize(HWND hwnd, int width, int height)
+{
+    RECT rect = { 0, 0, width, height };
+    AdjustWindowRectExForDpi(&rect, WS_OVERLAPPEDWINDOW, FALSE, 0, GetDpiForWindow(hwnd));
+
+    SetWindowPos(
+        hwnd,
+        nullptr,
+        0,
+        0,
+        rect.right - rect.left,
+        rect.bottom - rect.top,
+        SWP_NOMOVE | SWP_NOZORDER | SWP_NOACTIVATE
+    );
+}
+
+static std::vector<ScenarioResult> RunScenarios(BenchmarkWindow* window, BenchmarkOptions const& options)
+{
+    std::vector<ScenarioResult> results;
+    HWND hwnd = window->GetHwnd();
+
+    // Text lines at varying sizes.
+    results.push_back(RunScenario("text", window, options.frameCount, [](uint32_t) {}));
+
+    // Several WM_SIZE messages per frame, which are coalesced into one
+    // ResizeBuffers call.
+    results.push_back(RunScenario("resizeStorm", window, options.frameCount, [hwnd](uint32_t frame)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            int delta = static_cast<int>((frame * 4 + i) % 64);
+            SetClientSize(hwnd, 960 + delta * 2, 720 + delta);
+        }
+    }));
+    SetClientSize(hwnd, 1024, 768);
+
+    // Alternate between 96 and 192 DPI. ForceDpi makes the window context
+    // use the specified DPI regardless of the monitor.
+    results.push_back(RunScenario("dpiFlip", window, options.frameCount, [hwnd](uint32_t frame)
+    {
+        uint16_t dpi = (frame % 2) == 0 ? 192 : 96;
+        DXWindowContext::ForceDpi(dpi);
+
+        RECT rect;
+        GetWindowRect(hwnd, &rect);
+        DXWindowContext::OnDpiChanged(hwnd, MAKEWPARAM(dpi, dpi), reinterpret_cast<LPARAM>(&rect));
+    }));
+    DXWindowContext::ForceDpi(0);
+
+    RECT rect;
+    GetWindowRect(hwnd, &rect);
+    DXWindowContext::OnDpiChanged(hwnd, MAKEWPARAM(96, 96), reinterpret_cast<LPARAM>(&rect));
+
+    // Recreate the device and all resources every frame. This is slow, so
+    // fewer frames are rendered.
+    uint32_t deviceLostFrames = std::max<uint32_t>(options.frameCount / 10, 5);
+    results.push_back(RunScenario("deviceLost", window, deviceLostFrames, [window](uint32_t)
+    {
+        window->SimulateDeviceLost();
+    }));
+
+    return results;
+}
+
+#pragma endregion // Scenarios
+
+#pragma region Report
+
+static std::string ToUtf8(std::wstring const& text)
+{
+    int length = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), static_cast<int>(text.size()), nullptr, 0, nullptr, nullptr);
+    std::string result(length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, text.c_str(), static_cast<int>(text.size()), &result[0], length, nullptr, nullptr);
+    return result;
+}
+
+static std::string EscapeJson(std::string const& text)
+{
+    std::string result;
+    for (char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+        {
+            result.push_back('\\');
+            result.push_back(ch);
+        }
+        else if (static_cast<unsigned char>(ch) >= 0x20)
+        {
+            result.push_back(ch);
+        }
+    }
+    return result;
+}
+
+static void WriteJson(FILE* file, DXAdapterInfo const& adapterInfo, size_t frameArenaHighWaterMark, std::vector<ScenarioResult> const& results)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"adapter\": \"%s\",\n", EscapeJson(ToUtf8(adapterInfo.description)).c_str());
+    fprintf(file, "  \"isWarp\": %s,\n", adapterInfo.isWarp ? "true" : "false");
+    fprintf(file, "  \"frameArenaHighWaterBytes\": %zu,\n", frameArenaHighWaterMark);
+
+    // Startup milestones, relative to process start.
+    fprintf(file, "  \"startup\": {\n");
+    for (uint32_t i = 1; i < StartupMarkCount; i++)
+    {
+        auto mark = static_cast<StartupMark>(i);
+        if (mark == StartupMark::ContentReady)
+        {
+            continue;
+        }
+
+        fprintf(file, "    \"%sMs\": %.3f%s\n",
+            GetStartupMarkName(mark),
+            StartupTimeline::GetElapsedMs(mark),
+            mark == StartupMark::FirstFramePresented ? "" : ",");
+    }
+    fprintf(file, "  },\n");
+
+    fprintf(file, "  \"scenarios\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto& result = results[i];
+        fprintf(file,
+            "    { \"name\": \"%s\", \"frames\": %u, \"meanMs\": %.3f, \"p50Ms\": %.3f, \"p90Ms\": %.3f, \"p99Ms\": %.3f, \"maxMs\": %.3f, \"allocationsPerFrame\": %.1f, \"bytesPerFrame\": %.1f }%s\n",
+            result.name,
+            result.frameCount,
+            result.meanMs,
+            result.p50Ms,
+            result.p90Ms,
+            result.p99Ms,
+            result.maxMs,
+            result.allocationsPerFrame,
+            result.bytesPerFrame,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+#pragma endregion // Report
+
+#pragma region Replay
+
+// Replayed phases are also written as ETW events, so they can be viewed with
+// other system activity, e.g., in Windows Performance Analyzer.
+TRACELOGGING_DEFINE_PROVIDER(
+    g_traceProvider,
+    "HelloDesktop2D.Benchmark",
+    // {5c2e9a41-7d63-4b0f-9e8a-31f4c6d2b7e5}
+    (0x5c2e9a41, 0x7d63, 0x4b0f, 0x9e, 0x8a, 0x31, 0xf4, 0xc6, 0xd2, 0xb7, 0xe5));
+
+CaptureReplayer::CaptureReplayer(DXDevice* device, wchar_t const* path) :
+    m_device{ device },
+    m_capture{ device->GetDWriteFactory() }
+{
+    m_capture.Load(path);
+}
+
+void CaptureReplayer::RenderFrame(uint32_t frameIndex)
+{
+    int64_t phaseStartQpc = FrameProfiler::GetQpcTime();
+    auto endPhase = [&](FramePhase phase)
+    {
+        int64_t const now = FrameProfiler::GetQpcTime();
+        m_events.push_back(PhaseEvent{ phase, frameIndex, phaseStartQpc, now });
+        phaseStartQpc = now;
+    };
+
+    EnsureInitialized();
+    endPhase(FramePhase::EnsureInitialized);
+
+    m_context->BeginDraw();
+    m_context->Clear(D2D1_COLOR_F{});
+    m_capture.Replay(m_context.Get());
+    endPhase(FramePhase::RenderContent);
+
+    HR(m_context->EndDraw());
+    endPhase(FramePhase::EndDraw);
+
+    WaitForGpu();
+    endPhase(FramePhase::Present);
+}
+
+void CaptureReplayer::EnsureInitialized()
+{
+    if (m_capture.IsInitialized())
+    {
+        return;
+    }
+
+    auto const& info = m_capture.GetInfo();
+    auto deviceObjects = m_device->Acquire();
+
+    HR(deviceObjects.d2dDevice->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &m_context));
+    m_context->SetDpi(info.dpi, info.dpi);
+
+    // Render to a bitmap in the format of the window's back buffer.
+    DXGI_FORMAT const format = info.bufferPrecision == D2D1_BUFFER_PRECISION_16BPC_FLOAT ? DXGI_FORMAT_R16G16B16A16_FLOAT : DXGI_FORMAT_B8G8R8A8_UNORM;
+    HR(m_context->CreateBitmap(
+        D2D1::SizeU(info.pixelWidth, info.pixelHeight),
+        nullptr,
+        0,
+        D2D1::BitmapProperties1(D2D1_BITMAP_OPTIONS_TARGET, D2D1::PixelFormat(format, D2D1_ALPHA_MODE_PREMULTIPLIED), info.dpi, info.dpi),
+        &m_target
+    ));
+    m_context->SetTarget(m_target.Get());
+
+    // An event query tells when the GPU has finished a frame.
+    ComPtr<ID3D11Device> d3dDevice;
+    deviceObjects.d3dContext->GetDevice(&d3dDevice);
+    CD3D11_QUERY_DESC queryDesc(D3D11_QUERY_EVENT);
+    HR(d3dDevice->CreateQuery(&queryDesc, &m_query));
+    m_d3dContext = deviceObjects.d3dContext;
+
+    m_capture.Initialize(m_context.Get());
+}
+
+void CaptureReplayer::WaitForGpu()
+{
+    // Direct2D also uses the immediate context, so each call is made under
+    // the device's API lock. The lock isn't held while spinning, so other
+    // threads can use the device meanwhile.
+    {
+        DXDevice::ApiLock lock{ *m_device };
+        m_d3dContext->End(m_query.Get());
+        m_d3dContext->Flush();
+    }
+
+    for (;;)
+    {
+        BOOL isDone = FALSE;
+        HRESULT hr;
+        {
+            DXDevice::ApiLock lock{ *m_device };
+            hr = m_d3dContext->GetData(m_query.Get(), &isDone, sizeof(isDone), D3D11_ASYNC_GETDATA_DONOTFLUSH);
+        }
+
+        if (hr != S_FALSE)
+        {
+            HR(hr);
+            return;
+        }
+        YieldProcessor();
+    }
+}
+
+static void WriteTraceEvent(FILE* file, char const* name, uint32_t pid, double startUs, double durationUs, uint64_t frameNumber)
+{
+    fprintf(file,
+        "    { \"name\": \"%s\", \"ph\": \"X\", \"pid\": %u, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"frame\": %llu } },\n",
+        name,
+        pid,
+        startUs,
+        durationUs,
+        static_cast<unsigned long long>(frameNumber));
+}
+
+// Writes the phases of a captured frame, which are contiguous.
+static void WriteCapturedFrame(FILE* file, FrameTiming const& timing, double startUs)
+{
+    for (uint32_t i = 0; i < FramePhaseCount; i++)
+    {
+        double const durationUs = timing.cpuMs[i] * 1000.0;
+        WriteTraceEvent(file, GetFramePhaseName(static_cast<FramePhase>(i)), 1, startUs, durationUs, timing.frameNumber);
+        startUs += durationUs;
+    }
+}
+
+// Writes a trace in the Chrome trace event format, which chrome://tracing
+// and Perfetto can open. Process 1 has the captured frame and the frames
+// before it, on the capturing machine's clock. Process 2 has the replayed
+// frames. Both start at zero.
+static void WriteChromeTrace(FILE* file, DXAdapterInfo const& adapterInfo, BenchmarkOptions const& options, CaptureReplayer const& replayer)
+{
+    auto const& info = replayer.GetCaptureInfo();
+    auto const& events = replayer.GetEvents();
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"traceEvents\": [\n");
+
+    int64_t const captureStartQpc = info.recentTimings.empty() ? info.timing.startQpc : std::min(info.recentTimings.front().startQpc, info.timing.startQpc);
+    auto captureQpcToUs = [&](int64_t qpc)
+    {
+        return info.qpcFrequency != 0 ? (qpc - captureStartQpc) * 1000000.0 / info.qpcFrequency : 0.0;
+    };
+
+    for (auto const& timing : info.recentTimings)
+    {
+        WriteCapturedFrame(file, timing, captureQpcToUs(timing.startQpc));
+    }
+    WriteCapturedFrame(file, info.timing, captureQpcToUs(info.timing.startQpc));
+
+    int64_t const replayStartQpc = events.empty() ? 0 : events.front().startQpc;
+    double phaseTotalMs[FramePhaseCount] = {};
+    for (auto const& event : events)
+    {
+        double const startUs = FrameProfiler::QpcToMs(event.startQpc - replayStartQpc) * 1000.0;
+        double const durationMs = FrameProfiler::QpcToMs(event.endQpc - event.startQpc);
+        phaseTotalMs[static_cast<uint32_t>(event.phase)] += durationMs;
+        WriteTraceEvent(file, GetFramePhaseName(event.phase), 2, startUs, durationMs * 1000.0, event.frameIndex);
+    }
+
+    // Process names are last, so each event above can end with a comma.
+    fprintf(file, "    { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": { \"name\": \"Captured frames\" } },\n");
+    fprintf(file, "    { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": { \"name\": \"Replay\" } }\n");
+    fprintf(file, "  ],\n");
+    fprintf(file, "  \"displayTimeUnit\": \"ms\",\n");
+
+    // Mean replay times per phase. The first frame's EnsureInitialized
+    // includes creating the captured resources.
+    uint32_t const frameCount = events.empty() ? 0 : events.back().frameIndex + 1;
+    fprintf(file, "  \"otherData\": {\n");
+    fprintf(file, "    \"capture\": \"%s\",\n", EscapeJson(ToUtf8(options.replayPath)).c_str());
+    fprintf(file, "    \"adapter\": \"%s\",\n", EscapeJson(ToUtf8(adapterInfo.description)).c_str());
+    fprintf(file, "    \"isWarp\": %s,\n", adapterInfo.isWarp ? "true" : "false");
+    fprintf(file, "    \"pixelWidth\": %u,\n", info.pixelWidth);
+    fprintf(file, "    \"pixelHeight\": %u,\n", info.pixelHeight);
+    fprintf(file, "    \"dpi\": %.1f,\n", info.dpi);
+    fprintf(file, "    \"resourceCount\": %u,\n", info.resourceCount);
+    fprintf(file, "    \"skippedCommands\": %u,\n", info.skippedCommandCount);
+    fprintf(file, "    \"frames\": %u", frameCount);
+    for (uint32_t i = 0; i < FramePhaseCount; i++)
+    {
+        fprintf(file, ",\n    \"replay%sMeanMs\": %.3f",
+            GetFramePhaseName(static_cast<FramePhase>(i)),
+            frameCount != 0 ? phaseTotalMs[i] / frameCount : 0.0);
+    }
+    fprintf(file, "\n  }\n");
+    fprintf(file, "}\n");
+}
+
+// Replays a captured frame, writing each phase as an ETW event as it
+// completes.
+static void RunReplay(CaptureReplayer& replayer, uint32_t frameCount)
+{
+    TraceLoggingRegister(g_traceProvider);
+
+    for (uint32_t i = 0; i < frameCount; i++)
+    {
+        size_t const firstEvent = replayer.GetEvents().size();
+        replayer.RenderFrame(i);
+
+        auto const& events = replayer.GetEvents();
+        for (size_t j = firstEvent; j < events.size(); j++)
+        {
+            auto const& event = events[j];
+            TraceLoggingWrite(
+                g_traceProvider,
+                "ReplayPhase",
+                TraceLoggingString(GetFramePhaseName(event.phase), "Phase"),
+                TraceLoggingUInt32(event.frameIndex, "Frame"),
+                TraceLoggingFloat32(FrameProfiler::QpcToMs(event.endQpc - event.startQpc), "DurationMs"),
+                TraceLoggingInt64(event.startQpc, "StartQpc"));
+        }
+    }
+
+    TraceLoggingUnregister(g_traceProvider);
+}
+
+#pragma endregion // Replay
+
+static BenchmarkOptions ParseOptions(int argc, wchar_t** argv)
+{
+    BenchmarkOptions options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+
+        if (wcscmp(argv[i], L"-frames") == 0 && hasValue)
+        {
+            options.frameCount = std::max(_wtoi(argv[++i]), 1);
+        }
+        else if (wcscmp(argv[i], L"-lines") == 0 && hasValue)
+        {
+            options.lineCount = std::max(_wtoi(argv[++i]), 1);
+        }
+        else if (wcscmp(argv[i], L"-out") == 0 && hasValue)
+        {
+            options.outputPath = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"-replay") == 0 && hasValue)
+        {
+            options.replayPath = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"-warp") == 0)
+        {
+            options.useWarp = true;
+        }
+        else
+        {
+            fwprintf(stderr, L"Usage: HelloDesktop2DBench [-frames N] [-lines N] [-replay capture.d2fc] [-out file.json] [-warp]\n");
+            exit(2);
+        }
+    }
+
+    return options;
+}
+
+// Opens the output file, or returns stdout if there is no path. Returns
+// nullptr if the file can't be opened.
+static FILE* OpenOutput(std::wstring const& path)
+{
+    FILE* file = stdout;
+    if (!path.empty() && _wfopen_s(&file, path.c_str(), L"w") != 0)
+    {
+        fwprintf(stderr, L"Cannot open %s\n", path.c_str());
+        return nullptr;
+    }
+    return file;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+    StartupTimeline::Mark(StartupMark::ProcessStart);
+
+    try
+    {
+        BenchmarkOptions options = ParseOptions(argc, argv);
+
+        // WARP gives comparable results on machines with different GPUs.
+        DXDeviceOptions deviceOptions;
+        if (options.useWarp)
+        {
+            deviceOptions.adapterPreference = AdapterPreference::Warp;
+        }
+
+        ComPtr<DXDevice> dxDevice{ new DXDevice{ deviceOptions } };
+
+        // Replay a captured frame without a window, and write a trace.
+        if (!options.replayPath.empty())
+        {
+            CaptureReplayer replayer{ dxDevice.Get(), options.replayPath.c_str() };
+            RunReplay(replayer, options.frameCount);
+
+            FILE* file = OpenOutput(options.outputPath);
+            if (file == nullptr)
+            {
+                return 1;
+            }
+
+            WriteChromeTrace(file, dxDevice->GetAdapterInfo(), options, replayer);
+
+            if (file != stdout)
+            {
+                fclose(file);
+            }
+            return 0;
+        }
+
+        auto window = BenchmarkWindow::Create(dxDevice.Get(), GetModuleHandle(nullptr), options.lineCount);
+
+        // Render the first frame, which records the startup time.
+        window->Paint();
+        PumpMessages();
+
+        auto results = RunScenarios(window.Get(), options);
+
+        FILE* file = OpenOutput(options.outputPath);
+        if (file == nullptr)
+        {
+            return 1;
+        }
+
+        WriteJson(file, dxDevice->GetAdapterInfo(), window->GetFrameArena().GetHighWaterMark(), results);
+
+        if (file != stdout)
+        {
+            fclose(file);
+        }
+
+        DestroyWindow(window->GetHwnd());
+        return 0;
+    }
+    catch (WinException& e)
+    {
+        fprintf(stderr, "Benchmark failed (0x%08X).\n", static_cast<uint32_t>(e.GetError()));
+        return 1;
+    }
+}
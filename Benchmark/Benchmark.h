@@ -0,0 +1,117 @@
+#pragma once
+
+#include "DXHelpers.h"
+
+//
+// BenchmarkOptions - command-line options of the benchmark.
+//
+struct BenchmarkOptions
+{
+    uint32_t frameCount = 200;
+    uint32_t lineCount = 24;
+    bool useWarp = false;
+    std::wstring outputPath;
+
+    // If set, replays this frame capture instead of running the scenarios.
+    std::wstring replayPath;
+};
+
+//
+// ScenarioResult - frame-time statistics for one scenario. Times are in
+// milliseconds, and allocations are C++ heap allocations on any thread.
+//
+struct ScenarioResult
+{
+    char const* name;
+    uint32_t frameCount;
+    float meanMs;
+    float p50Ms;
+    float p90Ms;
+    float p99Ms;
+    float maxMs;
+    double allocationsPerFrame;
+    double bytesPerFrame;
+};
+
+//
+// BenchmarkWindow - window that renders text lines at varying sizes, like
+// HelloWorldWindow, and renders frames only when the benchmark calls Paint.
+//
+class BenchmarkWindow : public DXWindowContext
+{
+public:
+    static ComPtr<BenchmarkWindow> Create(DXDevice* device, HINSTANCE hInstance, uint32_t lineCount);
+
+    // Causes the next frame to throw DeviceLostException from RenderContent,
+    // so the window context recreates the device and its resources.
+    void SimulateDeviceLost() noexcept
+    {
+        m_isDeviceLostPending = true;
+    }
+
+    HWND GetHwnd() const noexcept
+    {
+        return m_hwnd;
+    }
+
+private:
+    BenchmarkWindow(DXDevice* device, HWND hwnd, uint32_t lineCount);
+    static LRESULT CALLBACK WindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
+    void RenderContent() override;
+
+    HWND m_hwnd;
+    SolidColorBrush m_textBrush;
+    ComPtr<IDWriteTextFormat> m_textFormat;
+    std::vector<float> m_fontSizes;
+    bool m_isDeviceLostPending = false;
+};
+
+//
+// PhaseEvent - one phase of a replayed frame, in QueryPerformanceCounter
+// ticks.
+//
+struct PhaseEvent
+{
+    FramePhase phase;
+    uint32_t frameIndex;
+    int64_t startQpc;
+    int64_t endQpc;
+};
+
+//
+// CaptureReplayer - replays a frame captured by DXWindowContext to a bitmap
+// of the captured size and format, and times each frame in the phases that
+// DXWindowContext uses. There is no swap chain, so the Present phase is the
+// time spent waiting for the GPU to finish the frame.
+//
+class CaptureReplayer
+{
+public:
+    CaptureReplayer(DXDevice* device, wchar_t const* path);
+
+    // Replays the capture and adds an event for each phase of the frame. The
+    // first frame also creates the captured resources.
+    void RenderFrame(uint32_t frameIndex);
+
+    FrameCaptureInfo const& GetCaptureInfo() const noexcept
+    {
+        return m_capture.GetInfo();
+    }
+
+    std::vector<PhaseEvent> const& GetEvents() const noexcept
+    {
+        return m_events;
+    }
+
+private:
+    void EnsureInitialized();
+    void WaitForGpu();
+
+    const ComPtr<DXDevice> m_device;
+    FrameCapture m_capture;
+    ComPtr<ID3D11DeviceContext> m_d3dContext;
+    ComPtr<ID2D1DeviceContext6> m_context;
+    ComPtr<ID2D1Bitmap1> m_target;
+    ComPtr<ID3D11Query> m_query;
+    std::vector<PhaseEvent> m_events;
+};
@@ -2,8 +2,12 @@
 #include "HelloDesktop2D.h"
 
 #pragma comment(lib, "d3d11.lib")
+#pragma comment(lib, "dxgi.lib")
 #pragma comment(lib, "d2d1.lib")
 #pragma comment(lib, "dwrite.lib")
+#pragma comment(lib, "dcomp.lib")
+#pragma comment(lib, "dwmapi.lib")
+#pragma comment(lib, "dxguid.lib")
 
 #pragma region Helpers
 
@@ -22,411 +26,8251 @@ void WinException::Throw(HRESULT hr)
     }
 }
 
-HRESULT STDMETHODCALLTYPE ComObjectBase::QueryInterface(REFIID riid, _COM_Outptr_ void** ppvObject)
+#pragma endregion // Helpers
+
+#pragma region Threading
+
+namespace
+{
+    // The pool and queue of the current worker thread, if any.
+    thread_local WorkerPool* t_currentPool = nullptr;
+    thread_local uint32_t t_queueIndex = 0;
+}
+
+WorkerPool::WorkerPool(uint32_t threadCount)
 {
-    if (riid == __uuidof(IUnknown))
+    if (threadCount == 0)
     {
-        *ppvObject = this;
-        AddRef();
-        return S_OK;
+        // hardware_concurrency returns 0 if the count isn't known.
+        threadCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
     }
-    else
+
+    m_queues.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+
+    m_threads.reserve(threadCount);
+    try
+    {
+        for (uint32_t i = 0; i < threadCount; i++)
+        {
+            m_threads.emplace_back(&WorkerPool::ThreadProc, this, i);
+        }
+    }
+    catch (...)
     {
-        *ppvObject = nullptr;
-        return E_NOINTERFACE;
+        Stop();
+        throw;
     }
 }
 
-ULONG STDMETHODCALLTYPE ComObjectBase::AddRef()
+WorkerPool::~WorkerPool()
 {
-    return ++m_refCount;
+    Stop();
 }
 
-ULONG STDMETHODCALLTYPE ComObjectBase::Release()
+void WorkerPool::Stop() noexcept
 {
-    uint32_t newCount = --m_refCount;
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_isStopping.store(true, std::memory_order_relaxed);
+    }
+    m_condition.notify_all();
 
-    if (newCount == 0)
+    for (auto& thread : m_threads)
     {
-        delete this;
+        thread.join();
     }
+    m_threads.clear();
 
-    return newCount;
+    for (auto& queue : m_queues)
+    {
+        queue->items.clear();
+    }
 }
 
-#pragma endregion // Helpers
-
-#pragma region Resources
+WorkerPool& WorkerPool::GetDefault()
+{
+    static WorkerPool pool;
+    return pool;
+}
 
-void ResourceList2D::ResetAll() noexcept
+void WorkerPool::Submit(std::function<void()> work)
 {
-    for (IResource2D* p : m_resources)
+    uint32_t queueIndex = t_currentPool == this ?
+        t_queueIndex :
+        m_nextQueue.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+
+    // Count the item before publishing it, so a thread that takes it can't
+    // decrement the count below zero.
     {
-        p->Reset();
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_queuedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    try
+    {
+        auto& queue = *m_queues[queueIndex];
+        std::lock_guard<std::mutex> lock{ queue.mutex };
+        queue.items.push_back(std::move(work));
+    }
+    catch (...)
+    {
+        m_queuedCount.fetch_sub(1, std::memory_order_relaxed);
+        throw;
     }
+    m_condition.notify_one();
 }
 
-void ResourceList2D::EnsureInitialized(ID2D1DeviceContext6* device)
+bool WorkerPool::TryTake(uint32_t queueIndex, std::function<void()>& work)
 {
-    for (IResource2D* p : m_resources)
+    uint32_t const queueCount = static_cast<uint32_t>(m_queues.size());
+
+    for (uint32_t i = 0; i < queueCount; i++)
     {
-        if (!p->IsInitialized())
+        auto& queue = *m_queues[(queueIndex + i) % queueCount];
+        std::lock_guard<std::mutex> lock{ queue.mutex };
+        if (queue.items.empty())
         {
-            p->Initialize(device);
+            continue;
+        }
+
+        if (i == 0)
+        {
+            work = std::move(queue.items.front());
+            queue.items.pop_front();
         }
+        else
+        {
+            work = std::move(queue.items.back());
+            queue.items.pop_back();
+        }
+
+        m_queuedCount.fetch_sub(1, std::memory_order_relaxed);
+        return true;
     }
-}
 
-void SolidColorBrush::Initialize(ID2D1DeviceContext6* device)
-{
-    HR(device->CreateSolidColorBrush(m_color, m_ptr.ReleaseAndGetAddressOf()));
+    return false;
 }
 
-void SolidColorBrush::SetColor(D2D_COLOR_F newColor) noexcept
+void WorkerPool::ThreadProc(uint32_t queueIndex) noexcept
 {
-    if (m_ptr != nullptr)
-    {
-        m_ptr->SetColor(newColor);
-    }
-    m_color = newColor;
-}
+    t_currentPool = this;
+    t_queueIndex = queueIndex;
 
-#pragma endregion // Resources
+    for (;;)
+    {
+        if (m_isStopping.load(std::memory_order_relaxed))
+        {
+            return;
+        }
 
-#pragma region DXDevice
+        std::function<void()> work;
+        if (TryTake(queueIndex, work))
+        {
+            work();
+            continue;
+        }
 
-ComPtr<ID2D1Factory7> DXDevice::CreateD2DFactory()
-{
-    ComPtr<ID2D1Factory7> ptr;
-    HR(D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, ptr.GetAddressOf()));
-    return ptr;
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        m_condition.wait(lock, [this]()
+        {
+            return m_isStopping.load(std::memory_order_relaxed) || m_queuedCount.load(std::memory_order_relaxed) != 0;
+        });
+    }
 }
 
-ComPtr<IDWriteFactory7> DXDevice::CreateDWriteFactory()
+void WorkerPool::ParallelFor(uint32_t count, std::function<void(uint32_t)> const& work)
 {
-    ComPtr<IDWriteFactory7> ptr;
-    HR(DWriteCreateFactory(
-        DWRITE_FACTORY_TYPE_SHARED,
-        __uuidof(IDWriteFactory7),
-        reinterpret_cast<IUnknown**>(ptr.GetAddressOf())
-    ));
-    return ptr;
-}
+    // The state is shared with helpers, which may start after the calling
+    // thread has returned. A helper that finds no index left exits without
+    // using the work function.
+    struct State
+    {
+        std::function<void(uint32_t)> const* work;
+        uint32_t count;
+        std::atomic<uint32_t> nextIndex{ 0 };
+        std::atomic<uint32_t> completedCount{ 0 };
+        std::atomic<bool> isFailed{ false };
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
 
-void DXDevice::Reset() noexcept
-{
-    m_d3dContext.Reset();
-    m_dxgiDevice.Reset();
-    m_d2dDevice.Reset();
-}
+    auto runIndices = [](State& state) noexcept
+    {
+        for (;;)
+        {
+            uint32_t index = state.nextIndex.fetch_add(1, std::memory_order_relaxed);
+            if (index >= state.count)
+            {
+                return;
+            }
 
-void DXDevice::EnsureInitialized()
-{
-    if (IsInitialized())
+            if (!state.isFailed.load(std::memory_order_relaxed))
+            {
+                try
+                {
+                    (*state.work)(index);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock{ state.mutex };
+                    if (state.error == nullptr)
+                    {
+                        state.error = std::current_exception();
+                    }
+                    state.isFailed.store(true, std::memory_order_relaxed);
+                }
+            }
+
+            if (state.completedCount.fetch_add(1, std::memory_order_acq_rel) + 1 == state.count)
+            {
+                std::lock_guard<std::mutex> lock{ state.mutex };
+                state.condition.notify_all();
+            }
+        }
+    };
+
+    if (count == 0)
     {
         return;
     }
 
-    // Create the D3D device.
-    ComPtr<ID3D11Device> d3dDevice;
-    ComPtr<ID3D11DeviceContext> d3dContext;
-    HR(D3D11CreateDevice(
-        nullptr, // use the default adapter
-        D3D_DRIVER_TYPE_HARDWARE,
-        nullptr, // leave as null if hardware is used
-        D3D11_CREATE_DEVICE_BGRA_SUPPORT,
-        nullptr, // levels
-        0,
-        D3D11_SDK_VERSION,
-        &d3dDevice,
-        nullptr,
-        &d3dContext
-        ));
+    auto state = std::make_shared<State>();
+    state->work = &work;
+    state->count = count;
 
-    // Get the D3D device as a DXGI device.
-    ComPtr<IDXGIDevice> dxgiDevice;
-    HR(d3dDevice->QueryInterface(dxgiDevice.GetAddressOf()));
+    // If a helper can't be submitted, the error is reported like one thrown
+    // by the work function, after waiting for the helpers already submitted,
+    // because they use the work function on the calling thread's stack.
+    uint32_t const helperCount = std::min(count - 1, GetThreadCount());
+    try
+    {
+        for (uint32_t i = 0; i < helperCount; i++)
+        {
+            Submit([state, runIndices]() noexcept
+            {
+                runIndices(*state);
+            });
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock{ state->mutex };
+        state->error = std::current_exception();
+        state->isFailed.store(true, std::memory_order_relaxed);
+    }
 
-    // Create the D2D device.
-    ComPtr<ID2D1Device6> d2dDevice;
-    m_d2dFactory->CreateDevice(dxgiDevice.Get(), d2dDevice.GetAddressOf());
+    runIndices(*state);
 
-    // Initialize members.
-    m_d3dContext = std::move(d3dContext);
-    m_dxgiDevice = std::move(dxgiDevice);
-    m_d2dDevice = std::move(d2dDevice);
-    m_generation++;
+    std::unique_lock<std::mutex> lock{ state->mutex };
+    state->condition.wait(lock, [&state]()
+    {
+        return state->completedCount.load(std::memory_order_acquire) == state->count;
+    });
+
+    if (state->error != nullptr)
+    {
+        std::rethrow_exception(state->error);
+    }
 }
 
-#pragma endregion // DXDevice
+#pragma endregion // Threading
 
-#pragma region DXWindowContext
+#pragma region Memory
 
-uint32_t DXWindowContext::m_forceDpi = 0;
+constexpr size_t FrameArena::DefaultBlockSize;
 
-DXWindowContext::DXWindowContext(DXDevice* device, HWND hwnd) noexcept :
-    m_device{ device },
-    m_hwnd{ hwnd },
-    m_pixelSize{ GetWindowSize(hwnd) },
-    m_dpi{ m_forceDpi ? m_forceDpi : GetDpiForWindow(hwnd) }
+FrameArena::FrameArena(size_t initialSize)
 {
-    SetWindowLongPtr(hwnd, GWLP_USERDATA, reinterpret_cast<UINT_PTR>(this));
+    m_blocks.push_back(Block{ std::make_unique<uint8_t[]>(initialSize), initialSize });
 }
 
-D2D_SIZE_U DXWindowContext::GetWindowSize(HWND hwnd) noexcept
+void* FrameArena::Allocate(size_t size, size_t alignment)
 {
-    RECT clientRect;
-    GetClientRect(hwnd, &clientRect);
-    return D2D_SIZE_U
+    Block* block = &m_blocks.back();
+    uintptr_t base = reinterpret_cast<uintptr_t>(block->data.get());
+    uintptr_t start = (base + m_offset + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+    if (start - base + size > block->size)
     {
-        std::max<uint32_t>(1, clientRect.right - clientRect.left),
-        std::max<uint32_t>(1, clientRect.bottom - clientRect.top)
-    };
+        // Add a block big enough for this allocation. Blocks are merged by
+        // the next Reset.
+        size_t blockSize = std::max(DefaultBlockSize, size + alignment);
+        m_blocks.push_back(Block{ std::make_unique<uint8_t[]>(blockSize), blockSize });
+
+        m_previousBlocksUsed += m_offset;
+        m_offset = 0;
+
+        block = &m_blocks.back();
+        base = reinterpret_cast<uintptr_t>(block->data.get());
+        start = (base + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+    }
+
+    m_offset = start - base + size;
+    return reinterpret_cast<void*>(start);
 }
 
-void DXWindowContext::OnResize(HWND hwnd) noexcept
+void FrameArena::Free(void* p, size_t size) noexcept
 {
-    auto context = GetThis(hwnd);
-    if (context != nullptr)
+    uintptr_t base = reinterpret_cast<uintptr_t>(m_blocks.back().data.get());
+    uintptr_t address = reinterpret_cast<uintptr_t>(p);
+
+    if (address >= base && address - base + size == m_offset)
+    {
+        m_offset = address - base;
+    }
+}
+
+void FrameArena::Reset() noexcept
+{
+    m_highWaterMark = std::max(m_highWaterMark, GetBytesUsed());
+
+    // Replace multiple blocks with one, so the next frame of the same size
+    // fits without allocating. If that fails, keep the existing blocks.
+    if (m_blocks.size() > 1)
     {
+        size_t capacity = GetCapacity();
         try
         {
-            context->OnResizeInternal();
+            auto data = std::make_unique<uint8_t[]>(capacity);
+            m_blocks.clear();
+            m_blocks.push_back(Block{ std::move(data), capacity });
         }
-        catch (...)
+        catch (std::bad_alloc&)
         {
-            std::terminate();
+            m_blocks.erase(m_blocks.begin() + 1, m_blocks.end());
         }
     }
+
+    m_offset = 0;
+    m_previousBlocksUsed = 0;
 }
 
-void DXWindowContext::OnResizeInternal()
+size_t FrameArena::GetCapacity() const noexcept
 {
-    D2D_SIZE_U newSize = GetWindowSize(m_hwnd);
-    if (newSize.width != m_pixelSize.width || newSize.height != m_pixelSize.height)
+    size_t capacity = 0;
+    for (auto& block : m_blocks)
     {
-        m_pixelSize = newSize;
+        capacity += block.size;
+    }
+    return capacity;
+}
 
-        // Free all resources associated with this window (but not the device).
-        ResetWindow();
+#pragma endregion // Memory
 
-        // Recreate all resources.
-        EnsureInitialized();
+#pragma region Resources
 
-        // Call virtual method, so derived class can update its layout.
-        OnSizeChanged();
+void ResourceList2D::ResetAll() noexcept
+{
+    for (IResource2D* p : m_resources)
+    {
+        p->Reset();
     }
+    m_isDirty = true;
 }
 
-void DXWindowContext::OnDpiChanged(HWND hwnd, WPARAM wParam, LPARAM lParam) noexcept
+void ResourceList2D::OnDpiChanged() noexcept
 {
-    auto context = GetThis(hwnd);
-    if (context != nullptr)
+    for (IResource2D* p : m_resources)
     {
-        try
-        {
-            // The horizontal DPI is in LOWORD(wParam).
-            // The vertical DPI is in HIWORD(wParam) but always equals the horizontal DPI.
-            // LPARAM points to a RECT with the new window bounds.
-            context->OnDpiChangedInternal(
-                m_forceDpi ? m_forceDpi : LOWORD(wParam),
-                *reinterpret_cast<RECT*>(lParam)
-            );
-        }
-        catch (...)
-        {
-            std::terminate();
-        }
+        p->OnDpiChanged();
     }
+    m_isDirty = true;
 }
 
-void DXWindowContext::OnDpiChangedInternal(uint32_t newDpi, RECT newRect)
+void ResourceList2D::InitializeAll(ID2D1DeviceContext6* device)
 {
-    if (newDpi != m_dpi)
+    for (IResource2D* p : m_resources)
     {
-        // Save the new DPI.
-        m_dpi = newDpi;
-
-        // If the D2D context exists, set its DPI.
-        auto d2dContext = GetD2dContext();
-        if (d2dContext != nullptr)
+        if (!p->IsInitialized())
         {
-            d2dContext->SetDpi(static_cast<float>(newDpi), static_cast<float>(newDpi));
+            p->Initialize(device);
         }
-
-        // Call virtual method, so derived class can update its layout.
-        OnDpiChanged();
     }
 
-    // Set the new window bounds.
-    SetWindowPos(
-        m_hwnd,
-        nullptr,
-        newRect.left,
-        newRect.top,
-        newRect.right - newRect.left,
-        newRect.bottom - newRect.top,
-        SWP_NOZORDER | SWP_NOACTIVATE
-        );
+    // Only clear the flag if every resource was initialized successfully.
+    m_isDirty = false;
 }
 
-void DXWindowContext::OnPaint(HWND hwnd) noexcept
+void ResourceList2D::InitializeAllInParallel(ID2D1Device6* device, float dpi, D2D1_BUFFER_PRECISION bufferPrecision)
 {
-    auto context = GetThis(hwnd);
-    if (context != nullptr)
+    // Use one thread per batch of resources, up to the number of cores.
+    // Creating a device context is not free, so there is no point in
+    // starting a thread for only a few resources.
+    constexpr size_t resourcesPerThread = 8;
+    size_t const threadCount = std::max<size_t>(1, std::min<size_t>(
+        std::max(1u, std::thread::hardware_concurrency()),
+        (m_resources.size() + resourcesPerThread - 1) / resourcesPerThread
+        ));
+
+    // Each thread takes the next uninitialized resource from a shared index,
+    // so a few expensive resources don't leave the other threads idle.
+    std::atomic<size_t> nextIndex{ 0 };
+    std::vector<std::exception_ptr> errors(threadCount);
+
+    auto initializeResources = [&](size_t threadIndex) noexcept
     {
         try
         {
-            PAINTSTRUCT ps;
-            BeginPaint(hwnd, &ps);
+            ComPtr<ID2D1DeviceContext6> context;
+            HR(device->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &context));
+            context->SetDpi(dpi, dpi);
 
-            context->Paint();
+            if (bufferPrecision != D2D1_BUFFER_PRECISION_UNKNOWN)
+            {
+                D2D1_RENDERING_CONTROLS controls;
+                context->GetRenderingControls(&controls);
+                controls.bufferPrecision = bufferPrecision;
+                context->SetRenderingControls(controls);
+            }
 
-            EndPaint(hwnd, &ps);
+            for (;;)
+            {
+                size_t i = nextIndex.fetch_add(1, std::memory_order_relaxed);
+                if (i >= m_resources.size())
+                {
+                    break;
+                }
+
+                if (!m_resources[i]->IsInitialized())
+                {
+                    m_resources[i]->Initialize(context.Get());
+                }
+            }
         }
         catch (...)
         {
-            std::terminate();
+            errors[threadIndex] = std::current_exception();
         }
-    }
-    else
+    };
+
+    // The calling thread does its share of the work too. If a thread can't
+    // be started, the threads that are running pick up its resources.
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount - 1);
+    for (size_t threadIndex = 1; threadIndex < threadCount; threadIndex++)
     {
-        DefWindowProc(hwnd, WM_PAINT, 0, 0);
+        try
+        {
+            threads.emplace_back(initializeResources, threadIndex);
+        }
+        catch (std::system_error&)
+        {
+            break;
+        }
     }
-}
 
-void DXWindowContext::Paint()
-{
-    try
+    initializeResources(0);
+
+    for (auto& thread : threads)
     {
-        PaintInternal();
+        thread.join();
     }
-    catch (DeviceLostException&)
+
+    for (auto& error : errors)
     {
-        ResetDevice();
-        PaintInternal();
+        if (error != nullptr)
+        {
+            std::rethrow_exception(error);
+        }
     }
+
+    m_isDirty = false;
 }
 
-void DXWindowContext::PaintInternal()
+D2D_COLOR_F SrgbToScRgb(D2D_COLOR_F const& color) noexcept
 {
-    // Ensure device-dependent resources are initialized.
-    EnsureInitialized();
-
-    // Begin drawing.
-    GetD2dContext()->BeginDraw();
-
-    // Call derived class method to render the window content.
-    RenderContent();
+    auto toLinear = [](float value) noexcept
+    {
+        return value <= 0.04045f ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+    };
 
-    // End drawing and present.
-    HR(GetD2dContext()->EndDraw());
-    HR(m_swapChain->Present(0, 0));
+    return D2D_COLOR_F{ toLinear(color.r), toLinear(color.g), toLinear(color.b), color.a };
 }
 
-void DXWindowContext::ResetWindow() noexcept
+bool IsScRgbContext(ID2D1DeviceContext* context) noexcept
 {
+    D2D1_RENDERING_CONTROLS controls;
+    context->GetRenderingControls(&controls);
+    return controls.bufferPrecision == D2D1_BUFFER_PRECISION_16BPC_FLOAT;
+}
+
+void SolidColorBrush::Initialize(ID2D1DeviceContext6* device)
+{
+    m_isScRgb = IsScRgbContext(device);
+    HR(device->CreateSolidColorBrush(m_isScRgb ? SrgbToScRgb(m_color) : m_color, m_ptr.ReleaseAndGetAddressOf()));
+}
+
+void SolidColorBrush::SetColor(D2D_COLOR_F newColor) noexcept
+{
+    if (m_ptr != nullptr)
+    {
+        m_ptr->SetColor(m_isScRgb ? SrgbToScRgb(newColor) : newColor);
+    }
+    m_color = newColor;
+}
+
+void PathGeometry::Initialize(ID2D1DeviceContext6* device)
+{
+    // Path geometries are created by the factory, not the device.
+    ComPtr<ID2D1Factory> factory;
+    device->GetFactory(&factory);
+    HR(factory.As(&m_factory));
+
+    Build();
+}
+
+void PathGeometry::SetBuilder(Builder builder)
+{
+    m_builder = std::move(builder);
+
+    if (m_factory != nullptr)
+    {
+        Build();
+    }
+}
+
+void PathGeometry::Build()
+{
+    ComPtr<ID2D1PathGeometry1> geometry;
+    HR(m_factory->CreatePathGeometry(&geometry));
+
+    ComPtr<ID2D1GeometrySink> sink;
+    HR(geometry->Open(&sink));
+    if (m_builder)
+    {
+        m_builder(sink.Get());
+    }
+    HR(sink->Close());
+
+    m_ptr = std::move(geometry);
+}
+
+constexpr int GeometryRealization::MinScaleBucket;
+constexpr int GeometryRealization::MaxScaleBucket;
+constexpr size_t GeometryRealization::MaxCachedRealizations;
+
+int GeometryRealization::GetScaleBucket(D2D_MATRIX_3X2_F const& transform) noexcept
+{
+    // The geometric mean of the x and y scale factors.
+    float scale = sqrtf(fabsf(transform._11 * transform._22 - transform._12 * transform._21));
+    if (!(scale > 0))
+    {
+        return 0;
+    }
+
+    // Round up, so the realization is at least as precise as needed.
+    int bucket = static_cast<int>(ceilf(log2f(scale)));
+    return std::min(std::max(bucket, MinScaleBucket), MaxScaleBucket);
+}
+
+void GeometryRealization::Initialize(ID2D1DeviceContext6* device)
+{
+    GetRealization(device, 0);
+}
+
+void GeometryRealization::Draw(ID2D1DeviceContext6* context, ID2D1Brush* brush)
+{
+    D2D_MATRIX_3X2_F transform;
+    context->GetTransform(&transform);
+
+    auto realization = GetRealization(context, GetScaleBucket(transform));
+    context->DrawGeometryRealization(realization, brush);
+}
+
+ID2D1GeometryRealization* GeometryRealization::GetRealization(ID2D1DeviceContext6* context, int bucket)
+{
+    // Discard the cache if the source geometry was recreated or the context
+    // DPI doesn't match, e.g., if the DPI changed before OnDpiChanged.
+    float dpiX, dpiY;
+    context->GetDpi(&dpiX, &dpiY);
+    if (m_source != m_geometry.Get() || m_dpi != dpiX)
+    {
+        m_realizations.clear();
+        m_source = m_geometry.Get();
+        m_dpi = dpiX;
+    }
+
+    auto it = std::find_if(m_realizations.begin(), m_realizations.end(),
+        [bucket](CachedRealization const& item) { return item.bucket == bucket; });
+
+    if (it != m_realizations.end())
+    {
+        // Move the entry to the front.
+        std::rotate(m_realizations.begin(), it, it + 1);
+        return m_realizations.front().realization.Get();
+    }
+
+    if (m_source == nullptr)
+    {
+        // The source geometry must be initialized first.
+        throw WinException{ D2DERR_NOT_INITIALIZED };
+    }
+
+    float scale = ldexpf(1.0f, bucket);
+    float tolerance = D2D1::ComputeFlatteningTolerance(D2D1::Matrix3x2F::Scale(scale, scale), dpiX, dpiY);
+
+    ComPtr<ID2D1GeometryRealization> realization;
+    if (m_isStroked)
+    {
+        HR(context->CreateStrokedGeometryRealization(
+            m_source.Get(),
+            tolerance,
+            m_strokeWidth,
+            m_strokeStyle.Get(),
+            &realization
+            ));
+    }
+    else
+    {
+        HR(context->CreateFilledGeometryRealization(m_source.Get(), tolerance, &realization));
+    }
+
+    // Evict the least recently used realization if the cache is full.
+    if (m_realizations.size() >= MaxCachedRealizations)
+    {
+        m_realizations.pop_back();
+    }
+    m_realizations.insert(m_realizations.begin(), CachedRealization{ bucket, std::move(realization) });
+    return m_realizations.front().realization.Get();
+}
+
+AtlasBitmap::AtlasBitmap(D2D_SIZE_U size, std::vector<uint32_t> pixels) :
+    m_size{ size },
+    m_pixels{ std::move(pixels) }
+{
+    if (m_pixels.size() != static_cast<size_t>(size.width) * size.height)
+    {
+        throw WinException{ E_INVALIDARG };
+    }
+}
+
+void AtlasBitmap::Initialize(ID2D1DeviceContext6* device)
+{
+    ComPtr<ID2D1Device> d2dDevice;
+    device->GetDevice(&d2dDevice);
+    HR(d2dDevice.As(&m_device));
+
+    m_isScRgb = IsScRgbContext(device);
+    CreateBitmap(device);
+}
+
+void AtlasBitmap::CreateBitmap(ID2D1DeviceContext6* context)
+{
+    // Use 96 DPI so source rectangles are in pixels. In scRGB, an sRGB
+    // format makes the GPU linearize the pixels when sampling.
+    HR(context->CreateBitmap(
+        m_size,
+        m_pixels.data(),
+        m_size.width * sizeof(uint32_t),
+        D2D1::BitmapProperties1(
+            D2D1_BITMAP_OPTIONS_NONE,
+            D2D1::PixelFormat(
+                m_isScRgb ? DXGI_FORMAT_B8G8R8A8_UNORM_SRGB : DXGI_FORMAT_B8G8R8A8_UNORM,
+                D2D1_ALPHA_MODE_PREMULTIPLIED
+                )
+            ),
+        m_ptr.ReleaseAndGetAddressOf()
+        ));
+    m_version++;
+}
+
+void AtlasBitmap::SetPixels(D2D_SIZE_U size, std::vector<uint32_t> pixels)
+{
+    if (pixels.size() != static_cast<size_t>(size.width) * size.height)
+    {
+        throw WinException{ E_INVALIDARG };
+    }
+
+    bool const isSameSize = size.width == m_size.width && size.height == m_size.height;
+    m_size = size;
+    m_pixels = std::move(pixels);
+
+    // The resource list only initializes resources that it knows are reset,
+    // so an existing bitmap is updated here rather than on next use.
+    if (m_ptr != nullptr && isSameSize)
+    {
+        HR(m_ptr->CopyFromMemory(nullptr, m_pixels.data(), m_size.width * sizeof(uint32_t)));
+        m_version++;
+    }
+    else if (m_ptr != nullptr)
+    {
+        // A bitmap can be drawn by any context of the device that created
+        // it, so a temporary context is enough to recreate it.
+        ComPtr<ID2D1DeviceContext6> context;
+        HR(m_device->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &context));
+        CreateBitmap(context.Get());
+    }
+    else
+    {
+        m_version++;
+    }
+}
+
+void AtlasBitmap::UpdatePixels(D2D_RECT_U const& rect, uint32_t const* pixels, uint32_t pitch)
+{
+    if (rect.right > m_size.width || rect.bottom > m_size.height || rect.left > rect.right || rect.top > rect.bottom)
+    {
+        throw WinException{ E_INVALIDARG };
+    }
+
+    // Update the system memory copy.
+    uint32_t const width = rect.right - rect.left;
+    for (uint32_t y = rect.top; y < rect.bottom; y++)
+    {
+        auto source = reinterpret_cast<uint32_t const*>(reinterpret_cast<uint8_t const*>(pixels) + (y - rect.top) * pitch);
+        std::copy(source, source + width, m_pixels.data() + static_cast<size_t>(y) * m_size.width + rect.left);
+    }
+
+    if (m_ptr != nullptr)
+    {
+        HR(m_ptr->CopyFromMemory(&rect, pixels, pitch));
+    }
+    m_version++;
+}
+
+void SpriteBatch::Initialize(ID2D1DeviceContext6* device)
+{
+    HR(device->CreateSpriteBatch(m_ptr.ReleaseAndGetAddressOf()));
+
+    // All sprites are uploaded by the next Draw.
+    m_uploadedCount = 0;
+    m_dirtyBegin = m_dirtyEnd = 0;
+}
+
+uint32_t SpriteBatch::AddSprites(
+    uint32_t count,
+    D2D_RECT_F const* destinationRects,
+    D2D_RECT_U const* sourceRects,
+    D2D_COLOR_F const* colors,
+    D2D_MATRIX_3X2_F const* transforms
+    )
+{
+    if (destinationRects == nullptr && count != 0)
+    {
+        throw WinException{ E_INVALIDARG };
+    }
+
+    uint32_t const startIndex = GetSpriteCount();
+    size_t const newCount = static_cast<size_t>(startIndex) + count;
+
+    m_destinationRects.insert(m_destinationRects.end(), destinationRects, destinationRects + count);
+
+    if (sourceRects != nullptr)
+    {
+        m_sourceRects.insert(m_sourceRects.end(), sourceRects, sourceRects + count);
+    }
+    else
+    {
+        D2D_SIZE_U atlasSize = m_atlas.GetPixelSize();
+        m_sourceRects.resize(newCount, D2D_RECT_U{ 0, 0, atlasSize.width, atlasSize.height });
+    }
+
+    if (colors != nullptr)
+    {
+        m_colors.insert(m_colors.end(), colors, colors + count);
+    }
+    else
+    {
+        m_colors.resize(newCount, D2D_COLOR_F{ 1.0f, 1.0f, 1.0f, 1.0f });
+    }
+
+    if (transforms != nullptr)
+    {
+        m_transforms.insert(m_transforms.end(), transforms, transforms + count);
+    }
+    else
+    {
+        m_transforms.resize(newCount, D2D1::Matrix3x2F::Identity());
+    }
+
+    return startIndex;
+}
+
+void SpriteBatch::SetSprites(
+    uint32_t startIndex,
+    uint32_t count,
+    D2D_RECT_F const* destinationRects,
+    D2D_RECT_U const* sourceRects,
+    D2D_COLOR_F const* colors,
+    D2D_MATRIX_3X2_F const* transforms
+    )
+{
+    if (startIndex > GetSpriteCount() || count > GetSpriteCount() - startIndex)
+    {
+        throw WinException{ E_INVALIDARG };
+    }
+
+    if (destinationRects != nullptr)
+    {
+        std::copy(destinationRects, destinationRects + count, m_destinationRects.begin() + startIndex);
+    }
+    if (sourceRects != nullptr)
+    {
+        std::copy(sourceRects, sourceRects + count, m_sourceRects.begin() + startIndex);
+    }
+    if (colors != nullptr)
+    {
+        std::copy(colors, colors + count, m_colors.begin() + startIndex);
+    }
+    if (transforms != nullptr)
+    {
+        std::copy(transforms, transforms + count, m_transforms.begin() + startIndex);
+    }
+
+    // Extend the dirty range to cover the sprites that were already
+    // uploaded. Sprites past m_uploadedCount are added by the next upload.
+    uint32_t endIndex = std::min(startIndex + count, m_uploadedCount);
+    if (startIndex < endIndex)
+    {
+        if (m_dirtyBegin == m_dirtyEnd)
+        {
+            m_dirtyBegin = startIndex;
+            m_dirtyEnd = endIndex;
+        }
+        else
+        {
+            m_dirtyBegin = std::min(m_dirtyBegin, startIndex);
+            m_dirtyEnd = std::max(m_dirtyEnd, endIndex);
+        }
+    }
+}
+
+void SpriteBatch::Clear() noexcept
+{
+    m_destinationRects.clear();
+    m_sourceRects.clear();
+    m_colors.clear();
+    m_transforms.clear();
+
+    if (m_ptr != nullptr)
+    {
+        m_ptr->Clear();
+    }
+    m_uploadedCount = 0;
+    m_dirtyBegin = m_dirtyEnd = 0;
+}
+
+void SpriteBatch::Upload()
+{
+    // Update the changed range of existing sprites.
+    if (m_dirtyBegin < m_dirtyEnd)
+    {
+        HR(m_ptr->SetSprites(
+            m_dirtyBegin,
+            m_dirtyEnd - m_dirtyBegin,
+            &m_destinationRects[m_dirtyBegin],
+            &m_sourceRects[m_dirtyBegin],
+            &m_colors[m_dirtyBegin],
+            &m_transforms[m_dirtyBegin]
+            ));
+        m_dirtyBegin = m_dirtyEnd = 0;
+    }
+
+    // Add new sprites.
+    uint32_t const count = GetSpriteCount();
+    if (m_uploadedCount < count)
+    {
+        HR(m_ptr->AddSprites(
+            count - m_uploadedCount,
+            &m_destinationRects[m_uploadedCount],
+            &m_sourceRects[m_uploadedCount],
+            &m_colors[m_uploadedCount],
+            &m_transforms[m_uploadedCount]
+            ));
+        m_uploadedCount = count;
+    }
+}
+
+void SpriteBatch::Draw(ID2D1DeviceContext6* context)
+{
+    Upload();
+
+    if (m_uploadedCount == 0)
+    {
+        return;
+    }
+
+    auto oldMode = context->GetAntialiasMode();
+    context->SetAntialiasMode(D2D1_ANTIALIAS_MODE_ALIASED);
+
+    context->DrawSpriteBatch(m_ptr.Get(), 0, m_uploadedCount, m_atlas.Get(), m_interpolationMode);
+
+    context->SetAntialiasMode(oldMode);
+}
+
+void Effect2D::Initialize(ID2D1DeviceContext6* device)
+{
+    // A cached effect is rendered by the cache context.
+    EnsureEffect(m_isCached ? GetCacheContext(device) : device);
+}
+
+void Effect2D::Reset() noexcept
+{
+    m_effect = nullptr;
+    m_context = nullptr;
+    m_cacheContext = nullptr;
+    m_cacheBitmap = nullptr;
+    m_cacheVersion = 0;
+    m_cacheDpi = 0;
+    m_uncacheableVersion = 0;
+    m_uncacheableDpi = 0;
+
+    for (auto& input : m_inputs)
+    {
+        input.appliedImage = nullptr;
+    }
+}
+
+void Effect2D::EnsureEffect(ID2D1DeviceContext6* context)
+{
+    if (m_effect != nullptr && m_context.Get() == context)
+    {
+        return;
+    }
+
+    ComPtr<ID2D1Effect> effect;
+    HR(context->CreateEffect(m_effectId, &effect));
+
+    for (auto const& property : m_properties)
+    {
+        HR(effect->SetValue(property.index, D2D1_PROPERTY_TYPE_UNKNOWN, property.data.data(), static_cast<UINT32>(property.data.size())));
+    }
+
+    // Inputs are set by UpdateInputs, since the sources may not have been
+    // initialized yet.
+    for (auto& input : m_inputs)
+    {
+        input.appliedImage = nullptr;
+    }
+
+    m_effect = std::move(effect);
+    m_context = context;
+}
+
+ID2D1DeviceContext6* Effect2D::GetCacheContext(ID2D1DeviceContext6* context)
+{
+    if (m_cacheContext == nullptr)
+    {
+        ComPtr<ID2D1Device> device;
+        context->GetDevice(&device);
+
+        ComPtr<ID2D1Device6> device6;
+        HR(device.As(&device6));
+        HR(device6->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &m_cacheContext));
+    }
+
+    return m_cacheContext.Get();
+}
+
+void Effect2D::SetValueBytes(uint32_t index, void const* data, uint32_t size)
+{
+    auto bytes = static_cast<uint8_t const*>(data);
+    auto property = std::find_if(m_properties.begin(), m_properties.end(), [index](Property const& p) noexcept
+    {
+        return p.index == index;
+    });
+
+    if (property == m_properties.end())
+    {
+        m_properties.push_back(Property{ index, std::vector<uint8_t>(bytes, bytes + size) });
+    }
+    else if (property->data.size() == size && std::equal(bytes, bytes + size, property->data.begin()))
+    {
+        return;
+    }
+    else
+    {
+        property->data.assign(bytes, bytes + size);
+    }
+
+    if (m_effect != nullptr)
+    {
+        HR(m_effect->SetValue(index, D2D1_PROPERTY_TYPE_UNKNOWN, bytes, size));
+    }
+    m_version++;
+}
+
+void Effect2D::SetInput(uint32_t index, IImageSource2D* source)
+{
+    if (index >= m_inputs.size())
+    {
+        m_inputs.resize(index + 1, Input{});
+    }
+
+    if (m_inputs[index].source != source)
+    {
+        m_inputs[index].source = source;
+        m_version++;
+    }
+}
+
+ID2D1Image* Effect2D::GetImage(ID2D1DeviceContext6* context)
+{
+    EnsureEffect(context);
+
+    // Set inputs whose images have changed, e.g., because the source was
+    // reinitialized or its effect was recreated on this context.
+    uint32_t const inputCount = static_cast<uint32_t>(m_inputs.size());
+    if (m_effect->GetInputCount() < inputCount)
+    {
+        HR(m_effect->SetInputCount(inputCount));
+    }
+
+    for (uint32_t i = 0; i < inputCount; i++)
+    {
+        auto& input = m_inputs[i];
+        ID2D1Image* image = input.source != nullptr ? input.source->GetImage(context) : nullptr;
+        if (image != input.appliedImage)
+        {
+            m_effect->SetInput(i, image);
+            input.appliedImage = image;
+        }
+    }
+
+    // The effect holds a reference to its output.
+    ComPtr<ID2D1Image> output;
+    m_effect->GetOutput(&output);
+    return output.Get();
+}
+
+uint64_t Effect2D::GetImageVersion() const noexcept
+{
+    // Compare each source's version with the one last seen, rather than
+    // summing them, since a source may be replaced by one with a lower
+    // version. The effect's own version then only increases.
+    for (auto const& input : m_inputs)
+    {
+        uint64_t const sourceVersion = input.source != nullptr ? input.source->GetImageVersion() : 0;
+        if (sourceVersion != input.sourceVersion)
+        {
+            input.sourceVersion = sourceVersion;
+            m_version++;
+        }
+    }
+    return m_version;
+}
+
+void Effect2D::Draw(ID2D1DeviceContext6* context, D2D_POINT_2F offset)
+{
+    if (m_isCached && UpdateCache(context))
+    {
+        // The bitmap is at the context's DPI and pixel-aligned bounds, so it
+        // is drawn 1:1.
+        context->DrawBitmap(
+            m_cacheBitmap.Get(),
+            D2D_RECT_F{
+                offset.x + m_cacheBounds.left,
+                offset.y + m_cacheBounds.top,
+                offset.x + m_cacheBounds.right,
+                offset.y + m_cacheBounds.bottom
+            },
+            1.0f,
+            D2D1_INTERPOLATION_MODE_NEAREST_NEIGHBOR
+            );
+        return;
+    }
+
+    context->DrawImage(GetImage(context), offset);
+}
+
+bool Effect2D::UpdateCache(ID2D1DeviceContext6* context)
+{
+    uint64_t const version = GetImageVersion();
+
+    float dpiX, dpiY;
+    context->GetDpi(&dpiX, &dpiY);
+
+    // The pixel bounds depend on the DPI, so the cache is keyed on both.
+    if (m_cacheBitmap != nullptr && m_cacheVersion == version && m_cacheDpi == dpiX)
+    {
+        return true;
+    }
+    if (m_uncacheableVersion == version && m_uncacheableDpi == dpiX)
+    {
+        return false;
+    }
+
+    // Render with the same DPI and buffer precision as the drawing context.
+    auto cacheContext = GetCacheContext(context);
+    cacheContext->SetDpi(dpiX, dpiY);
+
+    D2D1_RENDERING_CONTROLS controls;
+    context->GetRenderingControls(&controls);
+    cacheContext->SetRenderingControls(controls);
+
+    ID2D1Image* output = GetImage(cacheContext);
+
+    // Snap the bounds outward to pixels. Empty or very large bounds, e.g.,
+    // those of a flood effect, aren't cached.
+    D2D_RECT_F bounds;
+    HR(cacheContext->GetImageLocalBounds(output, &bounds));
+
+    float const pixelsPerDip = dpiX / 96.0f;
+    float const left = floorf(bounds.left * pixelsPerDip);
+    float const top = floorf(bounds.top * pixelsPerDip);
+    float const width = ceilf(bounds.right * pixelsPerDip) - left;
+    float const height = ceilf(bounds.bottom * pixelsPerDip) - top;
+
+    float const maxSize = static_cast<float>(context->GetMaximumBitmapSize());
+    if (!(width >= 1 && height >= 1 && width <= maxSize && height <= maxSize))
+    {
+        m_cacheBitmap = nullptr;
+        m_uncacheableVersion = version;
+        m_uncacheableDpi = dpiX;
+        return false;
+    }
+
+    m_cacheBounds = D2D_RECT_F{
+        left / pixelsPerDip,
+        top / pixelsPerDip,
+        (left + width) / pixelsPerDip,
+        (top + height) / pixelsPerDip
+    };
+
+    // Reuse the bitmap if its size and DPI haven't changed.
+    D2D_SIZE_U const size{ static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+    float bitmapDpiX = 0, bitmapDpiY = 0;
+    if (m_cacheBitmap != nullptr)
+    {
+        m_cacheBitmap->GetDpi(&bitmapDpiX, &bitmapDpiY);
+    }
+
+    if (m_cacheBitmap == nullptr ||
+        m_cacheBitmap->GetPixelSize().width != size.width ||
+        m_cacheBitmap->GetPixelSize().height != size.height ||
+        bitmapDpiX != dpiX)
+    {
+        HR(cacheContext->CreateBitmap(
+            size,
+            nullptr,
+            0,
+            D2D1::BitmapProperties1(
+                D2D1_BITMAP_OPTIONS_TARGET,
+                D2D1::PixelFormat(
+                    IsScRgbContext(context) ? DXGI_FORMAT_R16G16B16A16_FLOAT : DXGI_FORMAT_B8G8R8A8_UNORM,
+                    D2D1_ALPHA_MODE_PREMULTIPLIED
+                    ),
+                dpiX,
+                dpiY
+                ),
+            m_cacheBitmap.ReleaseAndGetAddressOf()
+            ));
+    }
+
+    // The drawing context may have clips pushed, which prevent changing its
+    // target, so the cache has its own context. Both belong to the same
+    // device, which keeps their commands in order.
+    cacheContext->SetTarget(m_cacheBitmap.Get());
+    cacheContext->BeginDraw();
+    cacheContext->Clear(D2D1_COLOR_F{});
+    cacheContext->DrawImage(output, D2D_POINT_2F{ -m_cacheBounds.left, -m_cacheBounds.top });
+    HRESULT hr = cacheContext->EndDraw();
+    cacheContext->SetTarget(nullptr);
+    HR(hr);
+
+    m_cacheVersion = version;
+    m_cacheDpi = dpiX;
+    return true;
+}
+
+constexpr uint64_t BitmapCache::DefaultBudget;
+
+void BitmapCache::Add(Bitmap2D* bitmap)
+{
+    m_bitmaps.push_back(bitmap);
+}
+
+void BitmapCache::Remove(Bitmap2D* bitmap) noexcept
+{
+    auto it = std::find(m_bitmaps.begin(), m_bitmaps.end(), bitmap);
+    if (it != m_bitmaps.end())
+    {
+        *it = m_bitmaps.back();
+        m_bitmaps.pop_back();
+    }
+}
+
+uint64_t BitmapCache::GetUploadedBytes() const noexcept
+{
+    uint64_t total = 0;
+    for (Bitmap2D* bitmap : m_bitmaps)
+    {
+        total += bitmap->GetUploadedBytes();
+    }
+    return total;
+}
+
+void BitmapCache::Trim(DXDevice* device)
+{
+    m_frameNumber++;
+
+    // Get the adapter of the current device. QueryVideoMemoryInfo requires
+    // Windows 10; on older systems, only the fixed budget applies.
+    if (m_adapter == nullptr || m_adapterGeneration != device->GetGeneration())
+    {
+        auto deviceObjects = device->Acquire();
+
+        ComPtr<IDXGIAdapter> dxgiAdapter;
+        HR(deviceObjects.dxgiDevice->GetAdapter(&dxgiAdapter));
+
+        m_adapter.Reset();
+        dxgiAdapter.As(&m_adapter);
+        m_adapterGeneration = deviceObjects.generation;
+    }
+
+    uint64_t used = GetUploadedBytes();
+    uint64_t limit = m_budget;
+
+    // If the process is over the OS budget, free at least the excess.
+    DXGI_QUERY_VIDEO_MEMORY_INFO memoryInfo;
+    if (m_adapter != nullptr &&
+        SUCCEEDED(m_adapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &memoryInfo)) &&
+        memoryInfo.CurrentUsage > memoryInfo.Budget)
+    {
+        uint64_t excess = memoryInfo.CurrentUsage - memoryInfo.Budget;
+        limit = std::min(limit, used > excess ? used - excess : 0);
+    }
+
+    if (used <= limit)
+    {
+        return;
+    }
+
+    // Release the least recently drawn bitmaps first, but not those drawn
+    // in the previous frame, which would just be uploaded again.
+    m_evictionOrder = m_bitmaps;
+    std::sort(m_evictionOrder.begin(), m_evictionOrder.end(), [](Bitmap2D* a, Bitmap2D* b)
+    {
+        return a->GetLastDrawnFrame() < b->GetLastDrawnFrame();
+    });
+
+    for (Bitmap2D* bitmap : m_evictionOrder)
+    {
+        if (used <= limit || bitmap->GetLastDrawnFrame() + 1 >= m_frameNumber)
+        {
+            break;
+        }
+
+        used -= bitmap->GetUploadedBytes();
+        bitmap->ReleaseUploadedLevels();
+    }
+
+    m_evictionOrder.clear();
+}
+
+Bitmap2D::Bitmap2D(std::wstring path, BitmapCache* cache, bool useMemoryMapping) :
+    m_cache{ cache },
+    m_decodeState{ std::make_shared<DecodeState>() }
+{
+    if (m_cache != nullptr)
+    {
+        m_cache->Add(this);
+    }
+
+    std::shared_ptr<DecodeState> state = m_decodeState;
+
+    try
+    {
+        WorkerPool::GetDefault().Submit([state, path, useMemoryMapping]() noexcept
+        {
+            std::vector<Level> levels;
+            HRESULT hr = S_OK;
+
+            if (!state->isCanceled.load(std::memory_order_relaxed))
+            {
+                HRESULT hrInit = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+                try
+                {
+                    levels = Decode(path.c_str(), useMemoryMapping);
+                }
+                catch (WinException& e)
+                {
+                    hr = e.GetError();
+                }
+                catch (std::bad_alloc&)
+                {
+                    hr = E_OUTOFMEMORY;
+                }
+                if (SUCCEEDED(hrInit))
+                {
+                    CoUninitialize();
+                }
+            }
+
+            std::lock_guard<std::mutex> callbackLock{ state->callbackMutex };
+            std::function<void()> callback;
+            {
+                std::lock_guard<std::mutex> lock{ state->mutex };
+                state->levels = std::move(levels);
+                state->hr = hr;
+                state->isComplete = true;
+                callback = std::move(state->callback);
+            }
+
+            if (callback)
+            {
+                callback();
+            }
+        });
+    }
+    catch (...)
+    {
+        if (m_cache != nullptr)
+        {
+            m_cache->Remove(this);
+        }
+        throw;
+    }
+}
+
+Bitmap2D::~Bitmap2D()
+{
+    m_decodeState->isCanceled.store(true, std::memory_order_relaxed);
+
+    // Don't call back into a destroyed object, e.g., its window. If the
+    // callback is running, wait for it.
+    {
+        std::lock_guard<std::mutex> callbackLock{ m_decodeState->callbackMutex };
+        std::lock_guard<std::mutex> lock{ m_decodeState->mutex };
+        m_decodeState->callback = nullptr;
+    }
+
+    if (m_cache != nullptr)
+    {
+        m_cache->Remove(this);
+    }
+}
+
+void Bitmap2D::SetCompletionCallback(std::function<void()> callback)
+{
+    {
+        std::lock_guard<std::mutex> lock{ m_decodeState->mutex };
+        if (!m_decodeState->isComplete)
+        {
+            m_decodeState->callback = std::move(callback);
+            return;
+        }
+    }
+
+    // Decoding is already complete.
+    if (callback)
+    {
+        callback();
+    }
+}
+
+D2D_SIZE_U Bitmap2D::GetPixelSize() const
+{
+    if (!m_levels.empty())
+    {
+        return m_levels.front().size;
+    }
+
+    // Decoding may be complete without the levels having been moved in yet.
+    std::lock_guard<std::mutex> lock{ m_decodeState->mutex };
+    if (!m_decodeState->isComplete || m_decodeState->levels.empty())
+    {
+        return D2D_SIZE_U{};
+    }
+    return m_decodeState->levels.front().size;
+}
+
+bool Bitmap2D::IsReady()
+{
+    if (!m_levels.empty())
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{ m_decodeState->mutex };
+        if (!m_decodeState->isComplete)
+        {
+            return false;
+        }
+        m_levels = std::move(m_decodeState->levels);
+    }
+
+    m_uploadedLevels.resize(m_levels.size());
+    return !m_levels.empty();
+}
+
+HRESULT Bitmap2D::GetDecodeError() const
+{
+    std::lock_guard<std::mutex> lock{ m_decodeState->mutex };
+    return m_decodeState->hr;
+}
+
+std::vector<Bitmap2D::Level> Bitmap2D::Decode(wchar_t const* path, bool useMemoryMapping)
+{
+    ComPtr<IWICImagingFactory> wicFactory;
+    HR(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&wicFactory)));
+
+    // Create the decoder, either directly from the file or from a view of
+    // the whole file, which lets the OS page it in without extra copies.
+    UniqueHandle mapping;
+    std::unique_ptr<void const, BOOL(WINAPI*)(LPCVOID)> view{ nullptr, &UnmapViewOfFile };
+    ComPtr<IWICStream> stream;
+    ComPtr<IWICBitmapDecoder> decoder;
+
+    if (useMemoryMapping)
+    {
+        HANDLE fileHandle = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+        {
+            ThrowLastError();
+        }
+        UniqueHandle file{ fileHandle };
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file.Get(), &fileSize))
+        {
+            ThrowLastError();
+        }
+        if (fileSize.QuadPart == 0 || fileSize.QuadPart > MAXDWORD)
+        {
+            throw WinException{ WINCODEC_ERR_BADIMAGE };
+        }
+
+        mapping.Reset(CreateFileMappingW(file.Get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+        if (mapping.Get() == nullptr)
+        {
+            ThrowLastError();
+        }
+
+        view.reset(MapViewOfFile(mapping.Get(), FILE_MAP_READ, 0, 0, 0));
+        if (view == nullptr)
+        {
+            ThrowLastError();
+        }
+
+        HR(wicFactory->CreateStream(&stream));
+        HR(stream->InitializeFromMemory(
+            static_cast<BYTE*>(const_cast<void*>(view.get())),
+            static_cast<DWORD>(fileSize.QuadPart)
+        ));
+        HR(wicFactory->CreateDecoderFromStream(stream.Get(), nullptr, WICDecodeMetadataCacheOnDemand, &decoder));
+    }
+    else
+    {
+        HR(wicFactory->CreateDecoderFromFilename(path, nullptr, GENERIC_READ, WICDecodeMetadataCacheOnDemand, &decoder));
+    }
+
+    ComPtr<IWICBitmapFrameDecode> frame;
+    HR(decoder->GetFrame(0, &frame));
+
+    // Convert to the premultiplied format Direct2D uses.
+    ComPtr<IWICFormatConverter> converter;
+    HR(wicFactory->CreateFormatConverter(&converter));
+    HR(converter->Initialize(
+        frame.Get(),
+        GUID_WICPixelFormat32bppPBGRA,
+        WICBitmapDitherTypeNone,
+        nullptr,
+        0,
+        WICBitmapPaletteTypeMedianCut
+    ));
+
+    Level level;
+    HR(converter->GetSize(&level.size.width, &level.size.height));
+    if (level.size.width == 0 || level.size.height == 0)
+    {
+        throw WinException{ WINCODEC_ERR_BADIMAGE };
+    }
+    if (static_cast<uint64_t>(level.size.width) * level.size.height > SIZE_MAX / sizeof(uint32_t))
+    {
+        throw WinException{ E_OUTOFMEMORY };
+    }
+
+    level.pixels.resize(static_cast<size_t>(level.size.width) * level.size.height);
+    HR(converter->CopyPixels(
+        nullptr,
+        level.size.width * sizeof(uint32_t),
+        static_cast<UINT>(level.pixels.size() * sizeof(uint32_t)),
+        reinterpret_cast<BYTE*>(level.pixels.data())
+    ));
+
+    // Generate the downscaled levels.
+    std::vector<Level> levels;
+    levels.push_back(std::move(level));
+
+    while (levels.back().size.width > 1 || levels.back().size.height > 1)
+    {
+        levels.push_back(Downsample(levels.back()));
+    }
+
+    return levels;
+}
+
+Bitmap2D::Level Bitmap2D::Downsample(Level const& source)
+{
+    // Average each 2x2 block of premultiplied pixels. For an odd size, the
+    // last row or column is averaged with itself.
+    Level level;
+    level.size.width = std::max(source.size.width / 2, 1u);
+    level.size.height = std::max(source.size.height / 2, 1u);
+    level.pixels.resize(static_cast<size_t>(level.size.width) * level.size.height);
+
+    uint32_t const maxX = source.size.width - 1;
+    uint32_t const maxY = source.size.height - 1;
+
+    for (uint32_t y = 0; y < level.size.height; y++)
+    {
+        uint32_t const* row0 = &source.pixels[static_cast<size_t>(std::min(y * 2, maxY)) * source.size.width];
+        uint32_t const* row1 = &source.pixels[static_cast<size_t>(std::min(y * 2 + 1, maxY)) * source.size.width];
+        uint32_t* target = &level.pixels[static_cast<size_t>(y) * level.size.width];
+
+        for (uint32_t x = 0; x < level.size.width; x++)
+        {
+            uint32_t const x0 = std::min(x * 2, maxX);
+            uint32_t const x1 = std::min(x * 2 + 1, maxX);
+            uint32_t const p[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+
+            uint32_t result = 0;
+            for (uint32_t shift = 0; shift < 32; shift += 8)
+            {
+                uint32_t sum = 2; // round to nearest
+                for (uint32_t pixel : p)
+                {
+                    sum += (pixel >> shift) & 0xFF;
+                }
+                result |= (sum / 4) << shift;
+            }
+            target[x] = result;
+        }
+    }
+
+    return level;
+}
+
+void Bitmap2D::Draw(ID2D1DeviceContext6* context, D2D_RECT_F const& destinationRect, float opacity)
+{
+    if (!IsReady())
+    {
+        return;
+    }
+
+    // Get the destination size in pixels, including the transform's scale.
+    D2D1_MATRIX_3X2_F transform;
+    context->GetTransform(&transform);
+    float dpiX, dpiY;
+    context->GetDpi(&dpiX, &dpiY);
+
+    float const scale = sqrtf(fabsf(transform._11 * transform._22 - transform._12 * transform._21)) * dpiX / 96.0f;
+    float const width = fabsf(destinationRect.right - destinationRect.left) * scale;
+    float const height = fabsf(destinationRect.bottom - destinationRect.top) * scale;
+
+    // Use the smallest level that is at least as large as the destination,
+    // so the level is downscaled by less than half. Skip levels too large
+    // for the device.
+    UINT32 const maxSize = context->GetMaximumBitmapSize();
+    size_t index = 0;
+    while (index + 1 < m_levels.size() &&
+        ((m_levels[index + 1].size.width >= width && m_levels[index + 1].size.height >= height) ||
+        m_levels[index].size.width > maxSize || m_levels[index].size.height > maxSize))
+    {
+        index++;
+    }
+
+    // In scRGB, an sRGB format makes the GPU linearize the pixels. Levels
+    // are released by Reset when the color space changes.
+    auto& level = m_levels[index];
+    auto& bitmap = m_uploadedLevels[index];
+    if (bitmap == nullptr)
+    {
+        HR(context->CreateBitmap(
+            level.size,
+            level.pixels.data(),
+            level.size.width * sizeof(uint32_t),
+            D2D1::BitmapProperties1(
+                D2D1_BITMAP_OPTIONS_NONE,
+                D2D1::PixelFormat(
+                    IsScRgbContext(context) ? DXGI_FORMAT_B8G8R8A8_UNORM_SRGB : DXGI_FORMAT_B8G8R8A8_UNORM,
+                    D2D1_ALPHA_MODE_PREMULTIPLIED
+                    )
+                ),
+            &bitmap
+            ));
+    }
+
+    context->DrawBitmap(bitmap.Get(), destinationRect, opacity, D2D1_INTERPOLATION_MODE_LINEAR, nullptr, nullptr);
+
+    if (m_cache != nullptr)
+    {
+        m_lastDrawnFrame = m_cache->GetFrameNumber();
+    }
+}
+
+void Bitmap2D::ReleaseUploadedLevels() noexcept
+{
+    for (auto& bitmap : m_uploadedLevels)
+    {
+        bitmap.Reset();
+    }
+}
+
+uint64_t Bitmap2D::GetUploadedBytes() const noexcept
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < m_uploadedLevels.size(); i++)
+    {
+        if (m_uploadedLevels[i] != nullptr)
+        {
+            total += static_cast<uint64_t>(m_levels[i].size.width) * m_levels[i].size.height * sizeof(uint32_t);
+        }
+    }
+    return total;
+}
+
+void Bitmap2D::Initialize(ID2D1DeviceContext6* /*device*/)
+{
+    m_isInitialized = true;
+}
+
+void Bitmap2D::Reset() noexcept
+{
+    ReleaseUploadedLevels();
+    m_isInitialized = false;
+}
+
+#pragma endregion // Resources
+
+#pragma region Text
+
+bool TextLayoutCache::KeyView::operator==(KeyView const& other) const noexcept
+{
+    return textLength == other.textLength &&
+        textFormat == other.textFormat &&
+        maxWidth == other.maxWidth &&
+        fontSize == other.fontSize &&
+        wmemcmp(text, other.text, textLength) == 0;
+}
+
+size_t TextLayoutCache::KeyHash::operator()(KeyView const& key) const noexcept
+{
+    // FNV-1a hash of the text and the other key fields.
+    uint64_t hash = 14695981039346656037ull;
+    auto combine = [&hash](uint64_t value) noexcept
+    {
+        hash = (hash ^ value) * 1099511628211ull;
+    };
+
+    for (uint32_t i = 0; i < key.textLength; i++)
+    {
+        combine(key.text[i]);
+    }
+
+    uint32_t maxWidthBits, fontSizeBits;
+    memcpy(&maxWidthBits, &key.maxWidth, sizeof(maxWidthBits));
+    memcpy(&fontSizeBits, &key.fontSize, sizeof(fontSizeBits));
+
+    combine(reinterpret_cast<uintptr_t>(key.textFormat));
+    combine(maxWidthBits);
+    combine(fontSizeBits);
+
+    return static_cast<size_t>(hash);
+}
+
+size_t TextLayoutCache::EstimateSize(uint32_t textLength) noexcept
+{
+    // Rough estimate of the memory used by a layout: a fixed overhead plus
+    // per-character cluster, glyph, and string data.
+    constexpr size_t layoutOverhead = 1024;
+    constexpr size_t bytesPerCharacter = 96;
+    return sizeof(Entry) + layoutOverhead + textLength * bytesPerCharacter;
+}
+
+TextLayoutCache::TextLayoutCache(size_t budgetBytes) :
+    m_budget(budgetBytes),
+    m_asyncState{ std::make_shared<AsyncState>() }
+{
+}
+
+TextLayoutCache::~TextLayoutCache()
+{
+    // Pending layouts may still complete, but must not call back.
+    std::lock_guard<std::mutex> lock{ m_asyncState->mutex };
+    m_asyncState->callback = nullptr;
+}
+
+CachedTextLayout TextLayoutCache::Get(
+    IDWriteFactory7* factory,
+    wchar_t const* text,
+    uint32_t textLength,
+    IDWriteTextFormat* textFormat,
+    float maxWidth,
+    float fontSize
+)
+{
+    // Return the existing entry if there is one, making it most recent.
+    auto it = m_map.find(KeyView{ text, textLength, textFormat, maxWidth, fontSize });
+    if (it != m_map.end())
+    {
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return it->second->value;
+    }
+
+    CachedTextLayout value = CreateLayout(factory, text, textLength, textFormat, maxWidth, fontSize);
+    Insert(std::wstring(text, textLength), textFormat, maxWidth, fontSize, value);
+    return value;
+}
+
+bool TextLayoutCache::TryGet(
+    IDWriteFactory7* factory,
+    wchar_t const* text,
+    uint32_t textLength,
+    IDWriteTextFormat* textFormat,
+    float maxWidth,
+    float fontSize,
+    _Out_ CachedTextLayout* result
+)
+{
+    KeyView key{ text, textLength, textFormat, maxWidth, fontSize };
+
+    auto it = m_map.find(key);
+    if (it != m_map.end())
+    {
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        *result = it->second->value;
+        return true;
+    }
+
+    *result = CachedTextLayout{};
+
+    if (m_pending.find(key) != m_pending.end())
+    {
+        return false;
+    }
+
+    auto request = std::make_shared<PendingLayout>();
+    request->text.assign(text, textLength);
+    request->textFormat = textFormat;
+    request->maxWidth = maxWidth;
+    request->fontSize = fontSize;
+    request->value = CachedTextLayout{};
+    request->hr = S_OK;
+
+    m_pending.emplace(request->GetKey(), request);
+
+    ComPtr<IDWriteFactory7> factoryRef{ factory };
+    std::shared_ptr<AsyncState> state = m_asyncState;
+
+    try
+    {
+        WorkerPool::GetDefault().Submit([factoryRef, request, state]() noexcept
+        {
+            try
+            {
+                request->value = CreateLayout(
+                    factoryRef.Get(),
+                    request->text.c_str(),
+                    static_cast<uint32_t>(request->text.size()),
+                    request->textFormat.Get(),
+                    request->maxWidth,
+                    request->fontSize
+                );
+            }
+            catch (WinException& e)
+            {
+                request->hr = e.GetError();
+            }
+            catch (std::bad_alloc&)
+            {
+                request->hr = E_OUTOFMEMORY;
+            }
+
+            std::function<void()> callback;
+            {
+                std::lock_guard<std::mutex> lock{ state->mutex };
+                state->completed.push_back(request);
+                callback = state->callback;
+            }
+
+            if (callback)
+            {
+                callback();
+            }
+        });
+    }
+    catch (...)
+    {
+        m_pending.erase(request->GetKey());
+        throw;
+    }
+
+    return false;
+}
+
+size_t TextLayoutCache::ProcessCompletedLayouts()
+{
+    std::vector<std::shared_ptr<PendingLayout>> completed;
+    {
+        std::lock_guard<std::mutex> lock{ m_asyncState->mutex };
+        completed.swap(m_asyncState->completed);
+    }
+
+    // Every request is processed before a failure is reported, so that the
+    // others are added and none of them stay pending.
+    size_t count = 0;
+    HRESULT firstError = S_OK;
+    for (auto& request : completed)
+    {
+        m_pending.erase(request->GetKey());
+
+        if (FAILED(request->hr))
+        {
+            if (SUCCEEDED(firstError))
+            {
+                firstError = request->hr;
+            }
+        }
+        else if (m_map.find(request->GetKey()) == m_map.end())
+        {
+            Insert(std::move(request->text), request->textFormat.Get(), request->maxWidth, request->fontSize, request->value);
+            count++;
+        }
+    }
+
+    // Failures are reported as synchronous Get would report them.
+    HR(firstError);
+    return count;
+}
+
+void TextLayoutCache::SetCompletionCallback(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock{ m_asyncState->mutex };
+    m_asyncState->callback = std::move(callback);
+}
+
+CachedTextLayout TextLayoutCache::CreateLayout(
+    IDWriteFactory7* factory,
+    wchar_t const* text,
+    uint32_t textLength,
+    IDWriteTextFormat* textFormat,
+    float maxWidth,
+    float fontSize
+)
+{
+    CachedTextLayout value;
+    HR(factory->CreateTextLayout(
+        text,
+        textLength,
+        textFormat,
+        maxWidth,
+        0,
+        &value.textLayout
+    ));
+
+    if (fontSize > 0)
+    {
+        HR(value.textLayout->SetFontSize(fontSize, DWRITE_TEXT_RANGE{ 0, textLength }));
+    }
+
+    HR(value.textLayout->GetMetrics(&value.metrics));
+    return value;
+}
+
+void TextLayoutCache::Insert(std::wstring text, IDWriteTextFormat* textFormat, float maxWidth, float fontSize, CachedTextLayout const& value)
+{
+    size_t const size = EstimateSize(static_cast<uint32_t>(text.size()));
+
+    m_entries.push_front(Entry{
+        std::move(text),
+        textFormat,
+        maxWidth,
+        fontSize,
+        value,
+        size
+    });
+
+    try
+    {
+        m_map.emplace(m_entries.front().GetKey(), m_entries.begin());
+    }
+    catch (...)
+    {
+        m_entries.pop_front();
+        throw;
+    }
+
+    m_memoryUsage += m_entries.front().size;
+    EvictToBudget();
+}
+
+void TextLayoutCache::SetBudget(size_t budgetBytes) noexcept
+{
+    m_budget = budgetBytes;
+    EvictToBudget();
+}
+
+void TextLayoutCache::EvictToBudget() noexcept
+{
+    // Evict least recently used entries, but always keep the newest.
+    while (m_memoryUsage > m_budget && m_entries.size() > 1)
+    {
+        Entry const& entry = m_entries.back();
+        m_map.erase(entry.GetKey());
+        m_memoryUsage -= entry.size;
+        m_entries.pop_back();
+    }
+}
+
+void TextLayoutCache::Clear() noexcept
+{
+    m_map.clear();
+    m_entries.clear();
+    m_memoryUsage = 0;
+}
+
+//
+// GlyphRunBatch::Recorder - text renderer that adds the glyph runs and
+// decorations of a text layout to a GlyphRunBatch.
+//
+class GlyphRunBatch::Recorder : public ComObjectBaseT<IDWriteTextRenderer>
+{
+public:
+    Recorder(GlyphRunBatch* batch, IDWriteFactory7* factory, float dpi) noexcept :
+        m_batch{ batch },
+        m_factory{ factory },
+        m_pixelsPerDip{ dpi / 96.0f }
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, _COM_Outptr_ void** ppvObject) override
+    {
+        if (riid == __uuidof(IDWritePixelSnapping))
+        {
+            *ppvObject = static_cast<IDWritePixelSnapping*>(this);
+            AddRef();
+            return S_OK;
+        }
+        return ComObjectBaseT::QueryInterface(riid, ppvObject);
+    }
+
+    // IDWritePixelSnapping methods. Runs are captured in DIPs, with baselines
+    // snapped to device pixels at the DPI they're drawn at.
+    HRESULT STDMETHODCALLTYPE IsPixelSnappingDisabled(void*, _Out_ BOOL* isDisabled) override
+    {
+        *isDisabled = FALSE;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetCurrentTransform(void*, _Out_ DWRITE_MATRIX* transform) override
+    {
+        *transform = DWRITE_MATRIX{ 1, 0, 0, 1, 0, 0 };
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetPixelsPerDip(void*, _Out_ FLOAT* pixelsPerDip) override
+    {
+        *pixelsPerDip = m_pixelsPerDip;
+        return S_OK;
+    }
+
+    // IDWriteTextRenderer methods.
+    HRESULT STDMETHODCALLTYPE DrawGlyphRun(
+        void*,
+        FLOAT baselineOriginX,
+        FLOAT baselineOriginY,
+        DWRITE_MEASURING_MODE measuringMode,
+        _In_ DWRITE_GLYPH_RUN const* glyphRun,
+        _In_ DWRITE_GLYPH_RUN_DESCRIPTION const* glyphRunDescription,
+        IUnknown*
+    ) override
+    {
+        try
+        {
+            D2D_POINT_2F const baselineOrigin{ baselineOriginX, baselineOriginY };
+
+            // Translate the run into color layers, if it contains color glyphs.
+            ComPtr<IDWriteColorGlyphRunEnumerator1> colorLayers;
+            HRESULT hr = m_factory->TranslateColorGlyphRun(
+                baselineOrigin,
+                glyphRun,
+                glyphRunDescription,
+                SupportedImageFormats,
+                measuringMode,
+                nullptr,
+                0,
+                &colorLayers
+            );
+
+            if (hr == DWRITE_E_NOCOLOR)
+            {
+                m_batch->AddGlyphRun(*glyphRun, baselineOrigin, measuringMode, DWRITE_GLYPH_IMAGE_FORMATS_TRUETYPE, nullptr, false);
+                return S_OK;
+            }
+            HR(hr);
+
+            for (;;)
+            {
+                BOOL hasRun;
+                HR(colorLayers->MoveNext(&hasRun));
+                if (!hasRun)
+                {
+                    break;
+                }
+
+                DWRITE_COLOR_GLYPH_RUN1 const* colorRun;
+                HR(colorLayers->GetCurrentRun(&colorRun));
+
+                // A palette index of 0xFFFF means the layer uses the text color.
+                D2D_COLOR_F const color{ colorRun->runColor.r, colorRun->runColor.g, colorRun->runColor.b, colorRun->runColor.a };
+                m_batch->AddGlyphRun(
+                    colorRun->glyphRun,
+                    D2D_POINT_2F{ colorRun->baselineOriginX, colorRun->baselineOriginY },
+                    colorRun->measuringMode,
+                    colorRun->glyphImageFormat,
+                    colorRun->paletteIndex == 0xFFFF ? nullptr : &color,
+                    true
+                );
+            }
+
+            return S_OK;
+        }
+        catch (WinException& e)
+        {
+            return e.GetError();
+        }
+        catch (std::bad_alloc&)
+        {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawUnderline(
+        void*,
+        FLOAT baselineOriginX,
+        FLOAT baselineOriginY,
+        _In_ DWRITE_UNDERLINE const* underline,
+        IUnknown*
+    ) override
+    {
+        return AddDecoration(baselineOriginX, baselineOriginY, underline->width, underline->offset, underline->thickness);
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawStrikethrough(
+        void*,
+        FLOAT baselineOriginX,
+        FLOAT baselineOriginY,
+        _In_ DWRITE_STRIKETHROUGH const* strikethrough,
+        IUnknown*
+    ) override
+    {
+        return AddDecoration(baselineOriginX, baselineOriginY, strikethrough->width, strikethrough->offset, strikethrough->thickness);
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawInlineObject(
+        void* clientDrawingContext,
+        FLOAT originX,
+        FLOAT originY,
+        IDWriteInlineObject* inlineObject,
+        BOOL isSideways,
+        BOOL isRightToLeft,
+        IUnknown* clientDrawingEffect
+    ) override
+    {
+        // Let the inline object draw itself using this renderer.
+        return inlineObject->Draw(clientDrawingContext, this, originX, originY, isSideways, isRightToLeft, clientDrawingEffect);
+    }
+
+    // The same image formats that DrawTextLayout supports with
+    // D2D1_DRAW_TEXT_OPTIONS_ENABLE_COLOR_FONT.
+    static constexpr DWRITE_GLYPH_IMAGE_FORMATS SupportedImageFormats = static_cast<DWRITE_GLYPH_IMAGE_FORMATS>(
+        DWRITE_GLYPH_IMAGE_FORMATS_TRUETYPE |
+        DWRITE_GLYPH_IMAGE_FORMATS_CFF |
+        DWRITE_GLYPH_IMAGE_FORMATS_COLR |
+        DWRITE_GLYPH_IMAGE_FORMATS_SVG |
+        DWRITE_GLYPH_IMAGE_FORMATS_PNG |
+        DWRITE_GLYPH_IMAGE_FORMATS_JPEG |
+        DWRITE_GLYPH_IMAGE_FORMATS_TIFF |
+        DWRITE_GLYPH_IMAGE_FORMATS_PREMULTIPLIED_B8G8R8A8
+        );
+
+private:
+    HRESULT AddDecoration(float x, float y, float width, float offset, float thickness) noexcept
+    {
+        try
+        {
+            m_batch->m_decorations.push_back(D2D_RECT_F{ x, y + offset, x + width, y + offset + thickness });
+            m_batch->m_areBatchesValid = false;
+            return S_OK;
+        }
+        catch (std::bad_alloc&)
+        {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    GlyphRunBatch* m_batch;
+    IDWriteFactory7* m_factory;
+    float m_pixelsPerDip;
+};
+
+void GlyphRunBatch::AddTextLayout(IDWriteFactory7* factory, IDWriteTextLayout* textLayout, D2D_POINT_2F origin, float dpi)
+{
+    ComPtr<Recorder> recorder{ new Recorder{ this, factory, dpi } };
+    HR(textLayout->Draw(nullptr, recorder.Get(), origin.x, origin.y));
+}
+
+void GlyphRunBatch::AddGlyphRun(
+    DWRITE_GLYPH_RUN const& glyphRun,
+    D2D_POINT_2F baselineOrigin,
+    DWRITE_MEASURING_MODE measuringMode,
+    DWRITE_GLYPH_IMAGE_FORMATS imageFormat,
+    D2D_COLOR_F const* color,
+    bool isColorLayer
+)
+{
+    uint32_t const glyphCount = glyphRun.glyphCount;
+
+    GlyphRun run;
+    run.fontFace = glyphRun.fontFace;
+    run.fontEmSize = glyphRun.fontEmSize;
+    run.glyphIndices.assign(glyphRun.glyphIndices, glyphRun.glyphIndices + glyphCount);
+
+    if (glyphRun.glyphAdvances != nullptr)
+    {
+        run.glyphAdvances.assign(glyphRun.glyphAdvances, glyphRun.glyphAdvances + glyphCount);
+    }
+    else
+    {
+        // Use the font's design advances.
+        DWRITE_FONT_METRICS fontMetrics;
+        glyphRun.fontFace->GetMetrics(&fontMetrics);
+
+        std::vector<DWRITE_GLYPH_METRICS> glyphMetrics(glyphCount);
+        HR(glyphRun.fontFace->GetDesignGlyphMetrics(glyphRun.glyphIndices, glyphCount, glyphMetrics.data(), glyphRun.isSideways));
+
+        float const scale = glyphRun.fontEmSize / fontMetrics.designUnitsPerEm;
+        run.glyphAdvances.reserve(glyphCount);
+        for (auto& metrics : glyphMetrics)
+        {
+            run.glyphAdvances.push_back((glyphRun.isSideways ? metrics.advanceHeight : metrics.advanceWidth) * scale);
+        }
+    }
+
+    if (glyphRun.glyphOffsets != nullptr)
+    {
+        run.glyphOffsets.assign(glyphRun.glyphOffsets, glyphRun.glyphOffsets + glyphCount);
+    }
+    else
+    {
+        run.glyphOffsets.resize(glyphCount, DWRITE_GLYPH_OFFSET{});
+    }
+
+    run.isSideways = glyphRun.isSideways;
+    run.bidiLevel = glyphRun.bidiLevel;
+    run.baselineOrigin = baselineOrigin;
+    run.measuringMode = measuringMode;
+    run.imageFormat = imageFormat;
+    run.color = color != nullptr ? *color : D2D_COLOR_F{};
+    run.useTextBrush = color == nullptr;
+    run.isColorLayer = isColorLayer;
+
+    m_runs.push_back(std::move(run));
+    m_areBatchesValid = false;
+}
+
+DWRITE_GLYPH_RUN GlyphRunBatch::GlyphRun::GetGlyphRun() const noexcept
+{
+    return DWRITE_GLYPH_RUN{
+        fontFace.Get(),
+        fontEmSize,
+        static_cast<UINT32>(glyphIndices.size()),
+        glyphIndices.data(),
+        glyphAdvances.data(),
+        glyphOffsets.data(),
+        isSideways,
+        bidiLevel
+    };
+}
+
+bool GlyphRunBatch::GlyphRun::IsMergeable() const noexcept
+{
+    // Only horizontal left-to-right outline runs are merged, because merged
+    // glyphs are positioned using offsets from the first run's origin.
+    return !isSideways && (bidiLevel & 1) == 0 &&
+        (imageFormat == DWRITE_GLYPH_IMAGE_FORMATS_TRUETYPE ||
+         imageFormat == DWRITE_GLYPH_IMAGE_FORMATS_CFF ||
+         imageFormat == DWRITE_GLYPH_IMAGE_FORMATS_COLR);
+}
+
+bool GlyphRunBatch::GlyphRun::CanMergeWith(GlyphRun const& other) const noexcept
+{
+    return IsMergeable() && other.IsMergeable() &&
+        fontFace == other.fontFace &&
+        fontEmSize == other.fontEmSize &&
+        measuringMode == other.measuringMode &&
+        useTextBrush == other.useTextBrush &&
+        (useTextBrush || memcmp(&color, &other.color, sizeof(color)) == 0);
+}
+
+void GlyphRunBatch::GlyphRun::Append(GlyphRun const& other)
+{
+    // The first time, convert this run's advances to offsets.
+    if (!isMerged)
+    {
+        float penX = 0;
+        for (size_t i = 0; i < glyphIndices.size(); i++)
+        {
+            glyphOffsets[i].advanceOffset += penX;
+            penX += glyphAdvances[i];
+            glyphAdvances[i] = 0;
+        }
+        isMerged = true;
+    }
+
+    // Append the other run's glyphs, positioned relative to this run's origin.
+    float penX = other.baselineOrigin.x - baselineOrigin.x;
+    float const deltaY = baselineOrigin.y - other.baselineOrigin.y;
+
+    for (size_t i = 0; i < other.glyphIndices.size(); i++)
+    {
+        glyphIndices.push_back(other.glyphIndices[i]);
+        glyphAdvances.push_back(0);
+        glyphOffsets.push_back(DWRITE_GLYPH_OFFSET{
+            penX + other.glyphOffsets[i].advanceOffset,
+            deltaY + other.glyphOffsets[i].ascenderOffset
+        });
+        penX += other.glyphAdvances[i];
+    }
+}
+
+void GlyphRunBatch::BuildBatches()
+{
+    m_batches.clear();
+
+    // Plain runs are merged by font regardless of order, since glyphs from
+    // different layouts don't overlap.
+    for (auto& run : m_runs)
+    {
+        if (!run.isColorLayer && run.IsMergeable())
+        {
+            auto it = std::find_if(m_batches.begin(), m_batches.end(), [&run](GlyphRun const& batch) { return batch.CanMergeWith(run); });
+            if (it != m_batches.end())
+            {
+                it->Append(run);
+            }
+            else
+            {
+                m_batches.push_back(run);
+            }
+        }
+    }
+
+    // Color layers, including those drawn with the text brush, must be drawn
+    // in order, so each one is only merged with the immediately preceding
+    // batch.
+    size_t const firstOrderedBatch = m_batches.size();
+    for (auto& run : m_runs)
+    {
+        if (run.isColorLayer || !run.IsMergeable())
+        {
+            if (m_batches.size() > firstOrderedBatch && m_batches.back().CanMergeWith(run))
+            {
+                m_batches.back().Append(run);
+            }
+            else
+            {
+                m_batches.push_back(run);
+            }
+        }
+    }
+
+    m_areBatchesValid = true;
+}
+
+void GlyphRunBatch::Clear() noexcept
+{
+    m_runs.clear();
+    m_batches.clear();
+    m_decorations.clear();
+    m_areBatchesValid = false;
+}
+
+void GlyphRunBatch::Initialize(ID2D1DeviceContext6* device)
+{
+    HR(device->CreateSolidColorBrush(D2D_COLOR_F{ 0, 0, 0, 1.0f }, m_layerBrush.ReleaseAndGetAddressOf()));
+}
+
+void GlyphRunBatch::Draw(ID2D1DeviceContext6* context, ID2D1Brush* textBrush)
+{
+    if (!m_areBatchesValid)
+    {
+        BuildBatches();
+    }
+
+    // Color layers are in sRGB, like brush colors.
+    bool const isScRgb = IsScRgbContext(context);
+
+    for (auto& batch : m_batches)
+    {
+        DWRITE_GLYPH_RUN const glyphRun = batch.GetGlyphRun();
+
+        switch (batch.imageFormat)
+        {
+        case DWRITE_GLYPH_IMAGE_FORMATS_PNG:
+        case DWRITE_GLYPH_IMAGE_FORMATS_JPEG:
+        case DWRITE_GLYPH_IMAGE_FORMATS_TIFF:
+        case DWRITE_GLYPH_IMAGE_FORMATS_PREMULTIPLIED_B8G8R8A8:
+            context->DrawColorBitmapGlyphRun(batch.imageFormat, batch.baselineOrigin, &glyphRun, batch.measuringMode);
+            break;
+
+        case DWRITE_GLYPH_IMAGE_FORMATS_SVG:
+            context->DrawSvgGlyphRun(batch.baselineOrigin, &glyphRun, textBrush, nullptr, 0, batch.measuringMode);
+            break;
+
+        default:
+            if (batch.useTextBrush)
+            {
+                context->DrawGlyphRun(batch.baselineOrigin, &glyphRun, textBrush, batch.measuringMode);
+            }
+            else
+            {
+                m_layerBrush->SetColor(isScRgb ? SrgbToScRgb(batch.color) : batch.color);
+                context->DrawGlyphRun(batch.baselineOrigin, &glyphRun, m_layerBrush.Get(), batch.measuringMode);
+            }
+            break;
+        }
+    }
+
+    for (auto& rect : m_decorations)
+    {
+        context->FillRectangle(rect, textBrush);
+    }
+}
+
+bool TextFormatCache::Key::operator==(Key const& other) const noexcept
+{
+    return fontSize == other.fontSize &&
+        wordWrapping == other.wordWrapping &&
+        fontWeight == other.fontWeight &&
+        fontStyle == other.fontStyle &&
+        fontStretch == other.fontStretch &&
+        familyName == other.familyName &&
+        localeName == other.localeName;
+}
+
+size_t TextFormatCache::KeyHash::operator()(Key const& key) const noexcept
+{
+    // FNV-1a hash of the names and the other key fields.
+    uint64_t hash = 14695981039346656037ull;
+    auto combine = [&hash](uint64_t value) noexcept
+    {
+        hash = (hash ^ value) * 1099511628211ull;
+    };
+
+    for (wchar_t ch : key.familyName)
+    {
+        combine(ch);
+    }
+
+    for (wchar_t ch : key.localeName)
+    {
+        combine(ch);
+    }
+
+    uint32_t fontSizeBits;
+    memcpy(&fontSizeBits, &key.fontSize, sizeof(fontSizeBits));
+
+    combine(fontSizeBits);
+    combine(key.wordWrapping);
+    combine(key.fontWeight);
+    combine(key.fontStyle);
+    combine(key.fontStretch);
+
+    return static_cast<size_t>(hash);
+}
+
+ComPtr<IDWriteTextFormat> TextFormatCache::Get(
+    wchar_t const* familyName,
+    float fontSize,
+    DWRITE_WORD_WRAPPING wordWrapping,
+    DWRITE_FONT_WEIGHT fontWeight,
+    DWRITE_FONT_STYLE fontStyle,
+    DWRITE_FONT_STRETCH fontStretch,
+    wchar_t const* localeName
+)
+{
+    Key key{ familyName, localeName, fontSize, wordWrapping, fontWeight, fontStyle, fontStretch };
+
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        auto it = m_formats.find(key);
+        if (it != m_formats.end())
+        {
+            return it->second;
+        }
+    }
+
+    // Create the format outside the lock, since the first format may wait
+    // for the system font collection. If another thread created the same
+    // format meanwhile, use that one.
+    ComPtr<IDWriteTextFormat> textFormat;
+    HR(m_factory->CreateTextFormat(
+        familyName,
+        nullptr,
+        fontWeight,
+        fontStyle,
+        fontStretch,
+        fontSize,
+        localeName,
+        &textFormat
+    ));
+    HR(textFormat->SetWordWrapping(wordWrapping));
+
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    return m_formats.emplace(std::move(key), std::move(textFormat)).first->second;
+}
+
+void TextFormatCache::Clear() noexcept
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    m_formats.clear();
+}
+
+void WarmUpFonts(IDWriteFactory7* factory, FontWarmupOptions const& options)
+{
+    // Getting the system font set enumerates the installed fonts, which is
+    // most of the cost of the first CreateTextFormat.
+    ComPtr<IDWriteFontSet1> systemFontSet;
+    HR(factory->GetSystemFontSet(FALSE, &systemFontSet));
+
+    // Build a font set of the configured families. The base interface is
+    // used because IDWriteFontSet1 hides the family name overloads.
+    ComPtr<IDWriteFontSetBuilder2> builder;
+    HR(factory->CreateFontSetBuilder(&builder));
+
+    IDWriteFontSet* fonts = systemFontSet.Get();
+    for (auto const& familyName : options.familyNames)
+    {
+        ComPtr<IDWriteFontSet> matchingFonts;
+        HR(fonts->GetMatchingFonts(
+            familyName.c_str(),
+            DWRITE_FONT_WEIGHT_NORMAL,
+            DWRITE_FONT_STRETCH_NORMAL,
+            DWRITE_FONT_STYLE_NORMAL,
+            &matchingFonts
+        ));
+        HR(builder->AddFontSet(matchingFonts.Get()));
+    }
+
+    // Create a font face for each font in the set, which opens and maps the
+    // font files.
+    ComPtr<IDWriteFontSet> familyFonts;
+    HR(builder->CreateFontSet(&familyFonts));
+
+    uint32_t const fontCount = familyFonts->GetFontCount();
+    for (uint32_t i = 0; i < fontCount; i++)
+    {
+        ComPtr<IDWriteFontFaceReference> fontFaceReference;
+        ComPtr<IDWriteFontFace3> fontFace;
+        HR(familyFonts->GetFontFaceReference(i, &fontFaceReference));
+        HR(fontFaceReference->CreateFontFace(&fontFace));
+    }
+
+    // Lay out the sample text with each family, which resolves the system
+    // fallback fonts for the characters the family doesn't have.
+    auto const textLength = static_cast<uint32_t>(options.sampleText.size());
+    for (auto const& familyName : options.familyNames)
+    {
+        ComPtr<IDWriteTextFormat> textFormat;
+        HR(factory->CreateTextFormat(
+            familyName.c_str(),
+            nullptr,
+            DWRITE_FONT_WEIGHT_NORMAL,
+            DWRITE_FONT_STYLE_NORMAL,
+            DWRITE_FONT_STRETCH_NORMAL,
+            12.0f,
+            options.localeName.c_str(),
+            &textFormat
+        ));
+
+        ComPtr<IDWriteTextLayout> textLayout;
+        HR(factory->CreateTextLayout(options.sampleText.c_str(), textLength, textFormat.Get(), 0, 0, &textLayout));
+
+        DWRITE_TEXT_METRICS metrics;
+        HR(textLayout->GetMetrics(&metrics));
+    }
+}
+
+#pragma endregion // Text
+
+#pragma region Instrumentation
+
+char const* GetFramePhaseName(FramePhase phase) noexcept
+{
+    switch (phase)
+    {
+    case FramePhase::EnsureInitialized: return "EnsureInitialized";
+    case FramePhase::RenderContent:     return "RenderContent";
+    case FramePhase::EndDraw:           return "EndDraw";
+    case FramePhase::Present:           return "Present";
+    default:                            return "Unknown";
+    }
+}
+
+void FrameTimingLog::Add(FrameTiming const& timing) noexcept
+{
+    uint64_t const count = m_count.load(std::memory_order_relaxed);
+    Slot& slot = m_slots[count % Capacity];
+
+    // Mark the slot as being written, then write it.
+    uint64_t const sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.timing = timing;
+
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    m_count.store(count + 1, std::memory_order_release);
+}
+
+uint32_t FrameTimingLog::GetRecent(FrameTiming* timings, uint32_t maxCount) const noexcept
+{
+    uint64_t const count = m_count.load(std::memory_order_acquire);
+    uint64_t const first = count - std::min<uint64_t>(std::min<uint64_t>(count, Capacity), maxCount);
+
+    uint32_t copied = 0;
+    for (uint64_t i = first; i < count; i++)
+    {
+        Slot const& slot = m_slots[i % Capacity];
+
+        // The Nth write to a slot leaves its sequence number equal to 2N.
+        // Skip the entry if it is being written or has been overwritten.
+        uint64_t const expected = (i / Capacity + 1) * 2;
+        if (slot.sequence.load(std::memory_order_acquire) != expected)
+        {
+            continue;
+        }
+
+        FrameTiming timing = slot.timing;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (slot.sequence.load(std::memory_order_relaxed) == expected)
+        {
+            timings[copied++] = timing;
+        }
+    }
+
+    return copied;
+}
+
+void FrameTimingLog::WriteCsv(wchar_t const* fileName) const
+{
+    std::vector<FrameTiming> timings(Capacity);
+    timings.resize(GetRecent(timings.data(), Capacity));
+
+    FILE* file = nullptr;
+    errno_t const err = _wfopen_s(&file, fileName, L"w");
+    if (err != 0 || file == nullptr)
+    {
+        ThrowErrno(err);
+    }
+
+    fprintf(file, "frame");
+    for (uint32_t phase = 0; phase < FramePhaseCount; phase++)
+    {
+        fprintf(file, ",%sMs", GetFramePhaseName(static_cast<FramePhase>(phase)));
+    }
+    fprintf(file, ",gpuMs,presentToDisplayMs,missedVsyncs\n");
+
+    for (auto& timing : timings)
+    {
+        fprintf(file, "%llu", static_cast<unsigned long long>(timing.frameNumber));
+        for (float ms : timing.cpuMs)
+        {
+            fprintf(file, ",%.3f", ms);
+        }
+        fprintf(file, ",%.3f,%.3f,%u\n", timing.gpuMs, timing.presentToDisplayMs, timing.missedVsyncs);
+    }
+
+    fclose(file);
+}
+
+int64_t FrameProfiler::GetQpcTime() noexcept
+{
+    LARGE_INTEGER time;
+    QueryPerformanceCounter(&time);
+    return time.QuadPart;
+}
+
+float FrameProfiler::QpcToMs(int64_t qpcDelta) noexcept
+{
+    static double const msPerTick = []() noexcept
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return 1000.0 / frequency.QuadPart;
+    }();
+
+    return static_cast<float>(qpcDelta * msPerTick);
+}
+
+void FrameProfiler::BeginFrame() noexcept
+{
+    m_current = {};
+    m_current.frameNumber = m_frameCount;
+    m_current.gpuMs = -1.0f;
+    m_current.presentToDisplayMs = -1.0f;
+    m_current.startQpc = GetQpcTime();
+    m_phaseStartQpc = m_current.startQpc;
+    m_isGpuWorkActive = false;
+
+    // If the next pending slot is still in use, publish what we have for it
+    // so its queries can be reused.
+    PendingFrame& pending = m_pending[m_nextPending];
+    if (pending.isActive)
+    {
+        Publish(pending);
+    }
+}
+
+void FrameProfiler::BeginGpuWork(ID3D11DeviceContext* d3dContext)
+{
+    GpuQueries& queries = m_queries[m_nextPending];
+    if (queries.disjoint == nullptr)
+    {
+        ComPtr<ID3D11Device> d3dDevice;
+        d3dContext->GetDevice(&d3dDevice);
+
+        CD3D11_QUERY_DESC disjointDesc(D3D11_QUERY_TIMESTAMP_DISJOINT);
+        CD3D11_QUERY_DESC timestampDesc(D3D11_QUERY_TIMESTAMP);
+        HR(d3dDevice->CreateQuery(&disjointDesc, &queries.disjoint));
+        HR(d3dDevice->CreateQuery(&timestampDesc, &queries.begin));
+        HR(d3dDevice->CreateQuery(&timestampDesc, &queries.end));
+    }
+
+    d3dContext->Begin(queries.disjoint.Get());
+    d3dContext->End(queries.begin.Get());
+    m_isGpuWorkActive = true;
+}
+
+void FrameProfiler::EndPhase(FramePhase phase) noexcept
+{
+    int64_t const now = GetQpcTime();
+    m_current.cpuMs[static_cast<uint32_t>(phase)] = QpcToMs(now - m_phaseStartQpc);
+    m_phaseStartQpc = now;
+}
+
+void FrameProfiler::EndFrame(ID3D11DeviceContext* d3dContext, IDXGISwapChain1* swapChain)
+{
+    PendingFrame& pending = m_pending[m_nextPending];
+    pending = {};
+    pending.timing = m_current;
+    pending.presentQpc = m_phaseStartQpc;
+    pending.isActive = true;
+
+    if (m_isGpuWorkActive)
+    {
+        GpuQueries& queries = m_queries[m_nextPending];
+        d3dContext->End(queries.end.Get());
+        d3dContext->End(queries.disjoint.Get());
+        pending.isGpuPending = true;
+        m_isGpuWorkActive = false;
+    }
+
+    if (FAILED(swapChain->GetLastPresentCount(&pending.presentCount)))
+    {
+        pending.presentCount = 0;
+    }
+
+    m_frameCount++;
+    m_nextPending = (m_nextPending + 1) % MaxPendingFrames;
+
+    UpdatePresentStatistics(swapChain);
+
+    for (uint32_t index = 0; index < MaxPendingFrames; index++)
+    {
+        if (m_pending[index].isActive)
+        {
+            UpdateGpuTime(d3dContext, index);
+            m_pending[index].age++;
+        }
+    }
+
+    // Publish pending frames in order, oldest first, as soon as all their
+    // measurements are available or they are too old to wait for.
+    for (uint32_t i = 0; i < MaxPendingFrames; i++)
+    {
+        uint32_t const index = (m_nextPending + i) % MaxPendingFrames;
+        PendingFrame& frame = m_pending[index];
+        if (!frame.isActive)
+        {
+            continue;
+        }
+
+        bool const isComplete = !frame.isGpuPending && frame.timing.presentToDisplayMs >= 0;
+        if (!isComplete && frame.age < MaxPendingFrames - 1)
+        {
+            break;
+        }
+
+        Publish(frame);
+    }
+}
+
+void FrameProfiler::UpdatePresentStatistics(IDXGISwapChain1* swapChain) noexcept
+{
+    // Frame statistics are only available for flip-model swap chains.
+    DXGI_FRAME_STATISTICS stats;
+    if (FAILED(swapChain->GetFrameStatistics(&stats)))
+    {
+        return;
+    }
+
+    for (auto& frame : m_pending)
+    {
+        if (!frame.isActive || frame.presentCount != stats.PresentCount)
+        {
+            continue;
+        }
+
+        // If the most recent vsync is the one at which this frame was
+        // displayed, then SyncQPCTime is the display time.
+        if (frame.timing.presentToDisplayMs < 0 &&
+            stats.SyncRefreshCount == stats.PresentRefreshCount &&
+            stats.SyncQPCTime.QuadPart >= frame.presentQpc)
+        {
+            frame.timing.presentToDisplayMs = QpcToMs(stats.SyncQPCTime.QuadPart - frame.presentQpc);
+        }
+
+        // Any vsyncs beyond one per present were missed.
+        if (m_hasLastStats && stats.PresentCount > m_lastStats.PresentCount)
+        {
+            UINT const presents = stats.PresentCount - m_lastStats.PresentCount;
+            UINT const refreshes = stats.PresentRefreshCount - m_lastStats.PresentRefreshCount;
+            frame.timing.missedVsyncs = refreshes > presents ? refreshes - presents : 0;
+        }
+    }
+
+    if (!m_hasLastStats || stats.PresentCount != m_lastStats.PresentCount)
+    {
+        m_lastStats = stats;
+        m_hasLastStats = true;
+    }
+}
+
+void FrameProfiler::UpdateGpuTime(ID3D11DeviceContext* d3dContext, uint32_t index) noexcept
+{
+    PendingFrame& frame = m_pending[index];
+    if (!frame.isGpuPending)
+    {
+        return;
+    }
+
+    GpuQueries& queries = m_queries[index];
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+    if (d3dContext->GetData(queries.disjoint.Get(), &disjoint, sizeof(disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+    {
+        return;
+    }
+
+    UINT64 begin, end;
+    if (!disjoint.Disjoint &&
+        d3dContext->GetData(queries.begin.Get(), &begin, sizeof(begin), D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK &&
+        d3dContext->GetData(queries.end.Get(), &end, sizeof(end), D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK)
+    {
+        frame.timing.gpuMs = static_cast<float>((end - begin) * 1000.0 / disjoint.Frequency);
+    }
+
+    frame.isGpuPending = false;
+}
+
+void FrameProfiler::Publish(PendingFrame& frame) noexcept
+{
+    m_log.Add(frame.timing);
+    frame.isActive = false;
+}
+
+void FrameProfiler::Reset() noexcept
+{
+    for (auto& frame : m_pending)
+    {
+        if (frame.isActive)
+        {
+            frame.isGpuPending = false;
+            Publish(frame);
+        }
+    }
+
+    for (auto& queries : m_queries)
+    {
+        queries = {};
+    }
+
+    m_isGpuWorkActive = false;
+    m_hasLastStats = false;
+}
+
+namespace
+{
+    // Returns the QPC time at which the process was created, so the startup
+    // timeline includes loader and CRT initialization. The creation time is
+    // a system time, so it is converted using the current system and QPC
+    // times. Returns the current QPC time if the creation time isn't known.
+    int64_t GetProcessStartQpcTime() noexcept
+    {
+        int64_t const now = FrameProfiler::GetQpcTime();
+
+        FILETIME creationTime, exitTime, kernelTime, userTime;
+        if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+        {
+            return now;
+        }
+
+        FILETIME systemTime;
+        GetSystemTimePreciseAsFileTime(&systemTime);
+
+        ULARGE_INTEGER creation, current;
+        creation.LowPart = creationTime.dwLowDateTime;
+        creation.HighPart = creationTime.dwHighDateTime;
+        current.LowPart = systemTime.dwLowDateTime;
+        current.HighPart = systemTime.dwHighDateTime;
+        if (current.QuadPart <= creation.QuadPart)
+        {
+            return now;
+        }
+
+        // File times are in 100 ns units.
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        double const elapsedTicks = (current.QuadPart - creation.QuadPart) * (frequency.QuadPart / 1e7);
+        return now - static_cast<int64_t>(elapsedTicks);
+    }
+}
+
+std::atomic<int64_t> StartupTimeline::m_times[StartupMarkCount];
+
+char const* GetStartupMarkName(StartupMark mark) noexcept
+{
+    switch (mark)
+    {
+    case StartupMark::ProcessStart:         return "ProcessStart";
+    case StartupMark::WindowCreated:        return "WindowCreated";
+    case StartupMark::DeviceCreated:        return "DeviceCreated";
+    case StartupMark::FirstFramePresented:  return "FirstFramePresented";
+    case StartupMark::ContentReady:         return "ContentReady";
+    default:                                return "Unknown";
+    }
+}
+
+bool StartupTimeline::Mark(StartupMark mark) noexcept
+{
+    int64_t const time = mark == StartupMark::ProcessStart ?
+        GetProcessStartQpcTime() :
+        FrameProfiler::GetQpcTime();
+
+    int64_t expected = 0;
+    if (!m_times[static_cast<uint32_t>(mark)].compare_exchange_strong(expected, time))
+    {
+        return false;
+    }
+
+    char message[80];
+    sprintf_s(message, "Startup: %s at %.1f ms\n", GetStartupMarkName(mark), GetElapsedMs(mark));
+    OutputDebugStringA(message);
+    return true;
+}
+
+float StartupTimeline::GetElapsedMs(StartupMark mark) noexcept
+{
+    int64_t const startTime = m_times[static_cast<uint32_t>(StartupMark::ProcessStart)].load();
+    int64_t const time = m_times[static_cast<uint32_t>(mark)].load();
+
+    if (startTime == 0 || time == 0)
+    {
+        return -1.0f;
+    }
+    return FrameProfiler::QpcToMs(time - startTime);
+}
+
+#pragma endregion // Instrumentation
+
+#pragma region Capture
+
+namespace
+{
+    constexpr uint32_t CaptureMagic = 0x43463244; // "D2FC"
+    constexpr uint32_t CaptureVersion = 1;
+    constexpr uint32_t NoResource = UINT32_MAX;
+
+    [[noreturn]] void ThrowInvalidCapture()
+    {
+        throw WinException{ HRESULT_FROM_WIN32(ERROR_INVALID_DATA) };
+    }
+
+    template<typename T>
+    void Append(std::vector<uint8_t>& bytes, T const& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+        auto p = reinterpret_cast<uint8_t const*>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    template<typename T>
+    void AppendArray(std::vector<uint8_t>& bytes, T const* values, uint32_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+        auto p = reinterpret_cast<uint8_t const*>(values);
+        bytes.insert(bytes.end(), p, p + sizeof(T) * count);
+    }
+
+    void AppendTiming(std::vector<uint8_t>& bytes, FrameTiming const& timing)
+    {
+        Append(bytes, timing.frameNumber);
+        Append(bytes, timing.startQpc);
+        AppendArray(bytes, timing.cpuMs, FramePhaseCount);
+        Append(bytes, timing.gpuMs);
+        Append(bytes, timing.presentToDisplayMs);
+        Append(bytes, timing.missedVsyncs);
+    }
+
+    // Returns the size of a pixel in the formats a capture supports, or zero.
+    uint32_t GetBytesPerPixel(DXGI_FORMAT format) noexcept
+    {
+        switch (format)
+        {
+        case DXGI_FORMAT_A8_UNORM:
+            return 1;
+
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        case DXGI_FORMAT_B8G8R8X8_UNORM:
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+        case DXGI_FORMAT_R10G10B10A2_UNORM:
+            return 4;
+
+        case DXGI_FORMAT_R16G16B16A16_FLOAT:
+            return 8;
+
+        case DXGI_FORMAT_R32G32B32A32_FLOAT:
+            return 16;
+
+        default:
+            return 0;
+        }
+    }
+}
+
+//
+// FrameCapture::Reader - reads values from a section of a capture, and
+// throws ERROR_INVALID_DATA instead of reading past its end.
+//
+class FrameCapture::Reader
+{
+public:
+    Reader(uint8_t const* data, size_t size) noexcept : m_next{ data }, m_end{ data + size }
+    {
+    }
+
+    bool IsAtEnd() const noexcept
+    {
+        return m_next == m_end;
+    }
+
+    template<typename T>
+    T Read()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+        T value;
+        memcpy(&value, Skip(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    template<typename T>
+    void ReadArray(std::vector<T>& values, uint32_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+        uint8_t const* p = Skip(static_cast<size_t>(count) * sizeof(T));
+        values.resize(count);
+        if (count != 0)
+        {
+            memcpy(values.data(), p, static_cast<size_t>(count) * sizeof(T));
+        }
+    }
+
+    // Returns a pointer to the value, or nullptr if it was not written.
+    template<typename T>
+    T const* ReadOptional(_Out_ T* value)
+    {
+        if (Read<uint8_t>() == 0)
+        {
+            return nullptr;
+        }
+
+        *value = Read<T>();
+        return value;
+    }
+
+    template<typename T>
+    T const* ReadOptionalArray(std::vector<T>& values, uint32_t count)
+    {
+        if (Read<uint8_t>() == 0)
+        {
+            return nullptr;
+        }
+
+        ReadArray(values, count);
+        return values.data();
+    }
+
+    D2D1_BRUSH_PROPERTIES ReadBrushProperties()
+    {
+        D2D1_BRUSH_PROPERTIES properties;
+        properties.opacity = Read<float>();
+        properties.transform = Read<D2D1_MATRIX_3X2_F>();
+        return properties;
+    }
+
+    FrameTiming ReadTiming()
+    {
+        FrameTiming timing;
+        timing.frameNumber = Read<uint64_t>();
+        timing.startQpc = Read<int64_t>();
+        for (float& ms : timing.cpuMs)
+        {
+            ms = Read<float>();
+        }
+        timing.gpuMs = Read<float>();
+        timing.presentToDisplayMs = Read<float>();
+        timing.missedVsyncs = Read<uint32_t>();
+        return timing;
+    }
+
+    // Returns a pointer to the next size bytes and skips them.
+    uint8_t const* Skip(size_t size)
+    {
+        if (size > static_cast<size_t>(m_end - m_next))
+        {
+            ThrowInvalidCapture();
+        }
+
+        uint8_t const* p = m_next;
+        m_next += size;
+        return p;
+    }
+
+private:
+    uint8_t const* m_next;
+    uint8_t const* const m_end;
+};
+
+//
+// FrameCapture::GeometryWriter - writes the figures of a simplified geometry
+// to a resource definition.
+//
+class FrameCapture::GeometryWriter : public ComObjectBaseT<ID2D1SimplifiedGeometrySink>
+{
+public:
+    enum class Op : uint8_t
+    {
+        SetFillMode,
+        SetSegmentFlags,
+        BeginFigure,
+        AddLines,
+        AddBeziers,
+        EndFigure,
+        End
+    };
+
+    explicit GeometryWriter(std::vector<uint8_t>& bytes) noexcept : m_bytes{ bytes }
+    {
+    }
+
+    // Returns the first error from a method that can't return one.
+    HRESULT GetResult() const noexcept
+    {
+        return m_hr;
+    }
+
+    // ID2D1SimplifiedGeometrySink methods.
+    void STDMETHODCALLTYPE SetFillMode(D2D1_FILL_MODE fillMode) override
+    {
+        Write([&] { Append(m_bytes, Op::SetFillMode); Append(m_bytes, fillMode); });
+    }
+
+    void STDMETHODCALLTYPE SetSegmentFlags(D2D1_PATH_SEGMENT vertexFlags) override
+    {
+        Write([&] { Append(m_bytes, Op::SetSegmentFlags); Append(m_bytes, vertexFlags); });
+    }
+
+    void STDMETHODCALLTYPE BeginFigure(D2D1_POINT_2F startPoint, D2D1_FIGURE_BEGIN figureBegin) override
+    {
+        Write([&] { Append(m_bytes, Op::BeginFigure); Append(m_bytes, startPoint); Append(m_bytes, figureBegin); });
+    }
+
+    void STDMETHODCALLTYPE AddLines(_In_reads_(pointsCount) D2D1_POINT_2F const* points, UINT32 pointsCount) override
+    {
+        Write([&] { Append(m_bytes, Op::AddLines); Append(m_bytes, pointsCount); AppendArray(m_bytes, points, pointsCount); });
+    }
+
+    void STDMETHODCALLTYPE AddBeziers(_In_reads_(beziersCount) D2D1_BEZIER_SEGMENT const* beziers, UINT32 beziersCount) override
+    {
+        Write([&] { Append(m_bytes, Op::AddBeziers); Append(m_bytes, beziersCount); AppendArray(m_bytes, beziers, beziersCount); });
+    }
+
+    void STDMETHODCALLTYPE EndFigure(D2D1_FIGURE_END figureEnd) override
+    {
+        Write([&] { Append(m_bytes, Op::EndFigure); Append(m_bytes, figureEnd); });
+    }
+
+    HRESULT STDMETHODCALLTYPE Close() override
+    {
+        Write([&] { Append(m_bytes, Op::End); });
+        return m_hr;
+    }
+
+private:
+    template<typename F>
+    void Write(F&& write) noexcept
+    {
+        if (FAILED(m_hr))
+        {
+            return;
+        }
+
+        try
+        {
+            write();
+        }
+        catch (std::bad_alloc&)
+        {
+            m_hr = E_OUTOFMEMORY;
+        }
+    }
+
+    std::vector<uint8_t>& m_bytes;
+    HRESULT m_hr = S_OK;
+};
+
+//
+// FrameCapture::Writer - command sink that serializes the commands of a
+// command list. Writers for nested command lists share the resource
+// definitions, which are written before the first command that uses them.
+//
+class FrameCapture::Writer : public ComObjectBaseT<ID2D1CommandSink3>
+{
+public:
+    // State shared by the writers of one capture.
+    struct State
+    {
+        ID2D1DeviceContext6* context;
+        DXGI_FORMAT targetFormat;
+        D2D_RECT_F targetBounds;
+        std::vector<uint8_t> resources;
+        uint32_t resourceCount = 0;
+        uint32_t skippedCommandCount = 0;
+
+        // Index of each object that has been defined, or NoResource if it
+        // can't be captured.
+        std::unordered_map<IUnknown*, uint32_t> indices;
+    };
+
+    explicit Writer(State& state) noexcept : m_state{ state }
+    {
+    }
+
+    std::vector<uint8_t> const& GetCommands() const noexcept
+    {
+        return m_commands;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, _COM_Outptr_ void** ppvObject) override
+    {
+        if (riid == __uuidof(ID2D1CommandSink) || riid == __uuidof(ID2D1CommandSink1) || riid == __uuidof(ID2D1CommandSink2))
+        {
+            *ppvObject = static_cast<ID2D1CommandSink3*>(this);
+            AddRef();
+            return S_OK;
+        }
+        return ComObjectBaseT::QueryInterface(riid, ppvObject);
+    }
+
+    // ID2D1CommandSink methods.
+    HRESULT STDMETHODCALLTYPE BeginDraw() override
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE EndDraw() override
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetAntialiasMode(D2D1_ANTIALIAS_MODE antialiasMode) override
+    {
+        return Record([&] { Write(Command::SetAntialiasMode); Write(antialiasMode); });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetTags(D2D1_TAG tag1, D2D1_TAG tag2) override
+    {
+        return Record([&] { Write(Command::SetTags); Write(tag1); Write(tag2); });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetTextAntialiasMode(D2D1_TEXT_ANTIALIAS_MODE textAntialiasMode) override
+    {
+        return Record([&] { Write(Command::SetTextAntialiasMode); Write(textAntialiasMode); });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetTextRenderingParams(_In_opt_ IDWriteRenderingParams* textRenderingParams) override
+    {
+        return Record([&]
+        {
+            uint32_t const paramsIndex = DefineRenderingParams(textRenderingParams);
+            Write(Command::SetTextRenderingParams);
+            Write(paramsIndex);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetTransform(_In_ D2D1_MATRIX_3X2_F const* transform) override
+    {
+        return Record([&] { Write(Command::SetTransform); Write(*transform); });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetPrimitiveBlend(D2D1_PRIMITIVE_BLEND primitiveBlend) override
+    {
+        return Record([&] { Write(Command::SetPrimitiveBlend); Write(primitiveBlend); });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetUnitMode(D2D1_UNIT_MODE unitMode) override
+    {
+        return Record([&] { Write(Command::SetUnitMode); Write(unitMode); });
+    }
+
+    HRESULT STDMETHODCALLTYPE Clear(_In_opt_ D2D1_COLOR_F const* color) override
+    {
+        return Record([&]
+        {
+            Write(Command::Clear);
+            WriteOptional(color);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawGlyphRun(
+        D2D1_POINT_2F baselineOrigin,
+        _In_ DWRITE_GLYPH_RUN const* glyphRun,
+        _In_opt_ DWRITE_GLYPH_RUN_DESCRIPTION const*,
+        _In_ ID2D1Brush* foregroundBrush,
+        DWRITE_MEASURING_MODE measuringMode
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const fontFaceIndex = DefineFontFace(glyphRun->fontFace);
+            uint32_t const brushIndex = DefineBrush(foregroundBrush);
+            if (fontFaceIndex == NoResource || brushIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawGlyphRun);
+            Write(baselineOrigin);
+            Write(measuringMode);
+            Write(brushIndex);
+            Write(fontFaceIndex);
+            Write(glyphRun->fontEmSize);
+            Write(glyphRun->glyphCount);
+            Write(glyphRun->isSideways);
+            Write(glyphRun->bidiLevel);
+            WriteOptionalArray(glyphRun->glyphIndices, glyphRun->glyphCount);
+            WriteOptionalArray(glyphRun->glyphAdvances, glyphRun->glyphCount);
+            WriteOptionalArray(glyphRun->glyphOffsets, glyphRun->glyphCount);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawLine(
+        D2D1_POINT_2F point0,
+        D2D1_POINT_2F point1,
+        _In_ ID2D1Brush* brush,
+        FLOAT strokeWidth,
+        _In_opt_ ID2D1StrokeStyle* strokeStyle
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const brushIndex = DefineBrush(brush);
+            if (brushIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawLine);
+            Write(point0);
+            Write(point1);
+            Write(brushIndex);
+            Write(strokeWidth);
+            Write(DefineStrokeStyle(strokeStyle));
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawGeometry(
+        _In_ ID2D1Geometry* geometry,
+        _In_ ID2D1Brush* brush,
+        FLOAT strokeWidth,
+        _In_opt_ ID2D1StrokeStyle* strokeStyle
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const geometryIndex = DefineGeometry(geometry);
+            uint32_t const brushIndex = DefineBrush(brush);
+            if (brushIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawGeometry);
+            Write(geometryIndex);
+            Write(brushIndex);
+            Write(strokeWidth);
+            Write(DefineStrokeStyle(strokeStyle));
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawRectangle(
+        _In_ D2D1_RECT_F const* rect,
+        _In_ ID2D1Brush* brush,
+        FLOAT strokeWidth,
+        _In_opt_ ID2D1StrokeStyle* strokeStyle
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const brushIndex = DefineBrush(brush);
+            if (brushIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawRectangle);
+            Write(*rect);
+            Write(brushIndex);
+            Write(strokeWidth);
+            Write(DefineStrokeStyle(strokeStyle));
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawBitmap(
+        _In_ ID2D1Bitmap* bitmap,
+        _In_opt_ D2D1_RECT_F const* destinationRectangle,
+        FLOAT opacity,
+        D2D1_INTERPOLATION_MODE interpolationMode,
+        _In_opt_ D2D1_RECT_F const* sourceRectangle,
+        _In_opt_ D2D1_MATRIX_4X4_F const* perspectiveTransform
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const bitmapIndex = DefineBitmap(bitmap);
+            if (bitmapIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawBitmap);
+            Write(bitmapIndex);
+            WriteOptional(destinationRectangle);
+            Write(opacity);
+            Write(interpolationMode);
+            WriteOptional(sourceRectangle);
+            WriteOptional(perspectiveTransform);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawImage(
+        _In_ ID2D1Image* image,
+        _In_opt_ D2D1_POINT_2F const* targetOffset,
+        _In_opt_ D2D1_RECT_F const* imageRectangle,
+        D2D1_INTERPOLATION_MODE interpolationMode,
+        D2D1_COMPOSITE_MODE compositeMode
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const imageIndex = DefineImage(image);
+            if (imageIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawImage);
+            Write(imageIndex);
+            WriteOptional(targetOffset);
+            WriteOptional(imageRectangle);
+            Write(interpolationMode);
+            Write(compositeMode);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawGdiMetafile(_In_ ID2D1GdiMetafile*, _In_opt_ D2D1_POINT_2F const*) override
+    {
+        return Record([&] { Skip(); });
+    }
+
+    HRESULT STDMETHODCALLTYPE FillMesh(_In_ ID2D1Mesh*, _In_ ID2D1Brush*) override
+    {
+        return Record([&] { Skip(); });
+    }
+
+    HRESULT STDMETHODCALLTYPE FillOpacityMask(
+        _In_ ID2D1Bitmap* opacityMask,
+        _In_ ID2D1Brush* brush,
+        _In_opt_ D2D1_RECT_F const* destinationRectangle,
+        _In_opt_ D2D1_RECT_F const* sourceRectangle
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const bitmapIndex = DefineBitmap(opacityMask);
+            uint32_t const brushIndex = DefineBrush(brush);
+            if (bitmapIndex == NoResource || brushIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::FillOpacityMask);
+            Write(bitmapIndex);
+            Write(brushIndex);
+            WriteOptional(destinationRectangle);
+            WriteOptional(sourceRectangle);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE FillGeometry(
+        _In_ ID2D1Geometry* geometry,
+        _In_ ID2D1Brush* brush,
+        _In_opt_ ID2D1Brush* opacityBrush
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const geometryIndex = DefineGeometry(geometry);
+            uint32_t const brushIndex = DefineBrush(brush);
+            uint32_t const opacityBrushIndex = DefineBrush(opacityBrush);
+            if (brushIndex == NoResource || (opacityBrush != nullptr && opacityBrushIndex == NoResource))
+            {
+                return Skip();
+            }
+
+            Write(Command::FillGeometry);
+            Write(geometryIndex);
+            Write(brushIndex);
+            Write(opacityBrushIndex);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE FillRectangle(_In_ D2D1_RECT_F const* rect, _In_ ID2D1Brush* brush) override
+    {
+        return Record([&]
+        {
+            uint32_t const brushIndex = DefineBrush(brush);
+            if (brushIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::FillRectangle);
+            Write(*rect);
+            Write(brushIndex);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE PushAxisAlignedClip(_In_ D2D1_RECT_F const* clipRect, D2D1_ANTIALIAS_MODE antialiasMode) override
+    {
+        return Record([&] { Write(Command::PushAxisAlignedClip); Write(*clipRect); Write(antialiasMode); });
+    }
+
+    HRESULT STDMETHODCALLTYPE PushLayer(_In_ D2D1_LAYER_PARAMETERS1 const* layerParameters1, _In_opt_ ID2D1Layer*) override
+    {
+        return Record([&]
+        {
+            // The layer must be pushed even if its opacity brush can't be
+            // captured, so the pops still match.
+            uint32_t const maskIndex = DefineGeometry(layerParameters1->geometricMask);
+            uint32_t const opacityBrushIndex = DefineBrush(layerParameters1->opacityBrush);
+            if (layerParameters1->opacityBrush != nullptr && opacityBrushIndex == NoResource)
+            {
+                m_state.skippedCommandCount++;
+            }
+
+            Write(Command::PushLayer);
+            Write(layerParameters1->contentBounds);
+            Write(maskIndex);
+            Write(layerParameters1->maskAntialiasMode);
+            Write(layerParameters1->maskTransform);
+            Write(layerParameters1->opacity);
+            Write(opacityBrushIndex);
+            Write(layerParameters1->layerOptions);
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE PopAxisAlignedClip() override
+    {
+        return Record([&] { Write(Command::PopAxisAlignedClip); });
+    }
+
+    HRESULT STDMETHODCALLTYPE PopLayer() override
+    {
+        return Record([&] { Write(Command::PopLayer); });
+    }
+
+    // ID2D1CommandSink1 methods.
+    HRESULT STDMETHODCALLTYPE SetPrimitiveBlend1(D2D1_PRIMITIVE_BLEND primitiveBlend) override
+    {
+        return SetPrimitiveBlend(primitiveBlend);
+    }
+
+    // ID2D1CommandSink2 methods.
+    HRESULT STDMETHODCALLTYPE DrawInk(_In_ ID2D1Ink*, _In_ ID2D1Brush*, _In_opt_ ID2D1InkStyle*) override
+    {
+        return Record([&] { Skip(); });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawGradientMesh(_In_ ID2D1GradientMesh*) override
+    {
+        return Record([&] { Skip(); });
+    }
+
+    HRESULT STDMETHODCALLTYPE DrawGdiMetafile(_In_ ID2D1GdiMetafile*, _In_opt_ D2D1_RECT_F const*, _In_opt_ D2D1_RECT_F const*) override
+    {
+        return Record([&] { Skip(); });
+    }
+
+    // ID2D1CommandSink3 methods.
+    HRESULT STDMETHODCALLTYPE DrawSpriteBatch(
+        _In_ ID2D1SpriteBatch* spriteBatch,
+        UINT32 startIndex,
+        UINT32 spriteCount,
+        _In_ ID2D1Bitmap* bitmap,
+        D2D1_BITMAP_INTERPOLATION_MODE interpolationMode,
+        D2D1_SPRITE_OPTIONS spriteOptions
+    ) override
+    {
+        return Record([&]
+        {
+            uint32_t const spriteBatchIndex = DefineSpriteBatch(spriteBatch);
+            uint32_t const bitmapIndex = DefineBitmap(bitmap);
+            if (bitmapIndex == NoResource)
+            {
+                return Skip();
+            }
+
+            Write(Command::DrawSpriteBatch);
+            Write(spriteBatchIndex);
+            Write(startIndex);
+            Write(spriteCount);
+            Write(bitmapIndex);
+            Write(interpolationMode);
+            Write(spriteOptions);
+        });
+    }
+
+private:
+    template<typename F>
+    static HRESULT Record(F&& record) noexcept
+    {
+        try
+        {
+            record();
+            return S_OK;
+        }
+        catch (WinException& e)
+        {
+            return e.GetError();
+        }
+        catch (std::bad_alloc&)
+        {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    void Skip() noexcept
+    {
+        m_state.skippedCommandCount++;
+    }
+
+    template<typename T>
+    void Write(T const& value)
+    {
+        Append(m_commands, value);
+    }
+
+    template<typename T>
+    void WriteOptional(T const* value)
+    {
+        Write<uint8_t>(value != nullptr);
+        if (value != nullptr)
+        {
+            Write(*value);
+        }
+    }
+
+    template<typename T>
+    void WriteOptionalArray(T const* values, uint32_t count)
+    {
+        Write<uint8_t>(values != nullptr);
+        if (values != nullptr)
+        {
+            AppendArray(m_commands, values, count);
+        }
+    }
+
+    // Returns the index of the object, writing its definition the first
+    // time. The define function writes the definition and returns false if
+    // the object can't be captured. The definition is written after those
+    // of any resources it refers to.
+    template<typename F>
+    uint32_t Define(IUnknown* object, F&& define)
+    {
+        if (object == nullptr)
+        {
+            return NoResource;
+        }
+
+        auto it = m_state.indices.find(object);
+        if (it != m_state.indices.end())
+        {
+            return it->second;
+        }
+
+        std::vector<uint8_t> definition;
+        uint32_t index = NoResource;
+        if (define(definition))
+        {
+            m_state.resources.insert(m_state.resources.end(), definition.begin(), definition.end());
+            index = m_state.resourceCount++;
+        }
+
+        m_state.indices.emplace(object, index);
+        return index;
+    }
+
+    uint32_t DefineBitmap(ID2D1Bitmap* bitmap)
+    {
+        return Define(bitmap, [&](std::vector<uint8_t>& definition)
+        {
+            Append(definition, ResourceKind::Bitmap);
+            return AppendPixels(bitmap, definition);
+        });
+    }
+
+    uint32_t DefineImage(ID2D1Image* image)
+    {
+        ComPtr<ID2D1Bitmap> bitmap;
+        if (SUCCEEDED(image->QueryInterface(IID_PPV_ARGS(&bitmap))))
+        {
+            return DefineBitmap(bitmap.Get());
+        }
+
+        return Define(image, [&](std::vector<uint8_t>& definition)
+        {
+            ComPtr<ID2D1CommandList> commandList;
+            if (SUCCEEDED(image->QueryInterface(IID_PPV_ARGS(&commandList))))
+            {
+                ComPtr<Writer> writer{ new Writer{ m_state } };
+                HR(commandList->Stream(writer.Get()));
+
+                auto const& commands = writer->GetCommands();
+                Append(definition, ResourceKind::CommandList);
+                Append(definition, static_cast<uint32_t>(commands.size()));
+                definition.insert(definition.end(), commands.begin(), commands.end());
+                return true;
+            }
+
+            return AppendRasterizedImage(image, definition);
+        });
+    }
+
+    uint32_t DefineBrush(ID2D1Brush* brush)
+    {
+        return Define(brush, [&](std::vector<uint8_t>& definition)
+        {
+            ComPtr<ID2D1SolidColorBrush> solidColorBrush;
+            ComPtr<ID2D1BitmapBrush1> bitmapBrush;
+            ComPtr<ID2D1LinearGradientBrush> linearBrush;
+            ComPtr<ID2D1RadialGradientBrush> radialBrush;
+
+            if (SUCCEEDED(brush->QueryInterface(IID_PPV_ARGS(&solidColorBrush))))
+            {
+                Append(definition, ResourceKind::SolidColorBrush);
+                Append(definition, solidColorBrush->GetColor());
+            }
+            else if (SUCCEEDED(brush->QueryInterface(IID_PPV_ARGS(&bitmapBrush))))
+            {
+                ComPtr<ID2D1Bitmap> bitmap;
+                bitmapBrush->GetBitmap(&bitmap);
+                uint32_t const bitmapIndex = DefineBitmap(bitmap.Get());
+                if (bitmap != nullptr && bitmapIndex == NoResource)
+                {
+                    return false;
+                }
+
+                Append(definition, ResourceKind::BitmapBrush);
+                Append(definition, bitmapIndex);
+                Append(definition, bitmapBrush->GetExtendModeX());
+                Append(definition, bitmapBrush->GetExtendModeY());
+                Append(definition, bitmapBrush->GetInterpolationMode1());
+            }
+            else if (SUCCEEDED(brush->QueryInterface(IID_PPV_ARGS(&linearBrush))))
+            {
+                ComPtr<ID2D1GradientStopCollection> stops;
+                linearBrush->GetGradientStopCollection(&stops);
+
+                Append(definition, ResourceKind::LinearGradientBrush);
+                Append(definition, linearBrush->GetStartPoint());
+                Append(definition, linearBrush->GetEndPoint());
+                AppendGradientStops(stops.Get(), definition);
+            }
+            else if (SUCCEEDED(brush->QueryInterface(IID_PPV_ARGS(&radialBrush))))
+            {
+                ComPtr<ID2D1GradientStopCollection> stops;
+                radialBrush->GetGradientStopCollection(&stops);
+
+                Append(definition, ResourceKind::RadialGradientBrush);
+                Append(definition, radialBrush->GetCenter());
+                Append(definition, radialBrush->GetGradientOriginOffset());
+                Append(definition, radialBrush->GetRadiusX());
+                Append(definition, radialBrush->GetRadiusY());
+                AppendGradientStops(stops.Get(), definition);
+            }
+            else
+            {
+                // Image brushes would need their image rasterized with the
+                // brush's source rectangle and extend modes.
+                return false;
+            }
+
+            D2D1_MATRIX_3X2_F transform;
+            brush->GetTransform(&transform);
+            Append(definition, brush->GetOpacity());
+            Append(definition, transform);
+            return true;
+        });
+    }
+
+    uint32_t DefineGeometry(ID2D1Geometry* geometry)
+    {
+        return Define(geometry, [&](std::vector<uint8_t>& definition)
+        {
+            // Arcs and quadratic curves are converted to Bezier curves.
+            Append(definition, ResourceKind::Geometry);
+            ComPtr<GeometryWriter> writer{ new GeometryWriter{ definition } };
+            HR(geometry->Simplify(D2D1_GEOMETRY_SIMPLIFICATION_OPTION_CUBICS_AND_LINES, nullptr, writer.Get()));
+            HR(writer->GetResult());
+            return true;
+        });
+    }
+
+    uint32_t DefineStrokeStyle(ID2D1StrokeStyle* strokeStyle)
+    {
+        return Define(strokeStyle, [&](std::vector<uint8_t>& definition)
+        {
+            ComPtr<ID2D1StrokeStyle1> strokeStyle1;
+            D2D1_STROKE_TRANSFORM_TYPE transformType = D2D1_STROKE_TRANSFORM_TYPE_NORMAL;
+            if (SUCCEEDED(strokeStyle->QueryInterface(IID_PPV_ARGS(&strokeStyle1))))
+            {
+                transformType = strokeStyle1->GetStrokeTransformType();
+            }
+
+            D2D1_STROKE_STYLE_PROPERTIES1 const properties = {
+                strokeStyle->GetStartCap(),
+                strokeStyle->GetEndCap(),
+                strokeStyle->GetDashCap(),
+                strokeStyle->GetLineJoin(),
+                strokeStyle->GetMiterLimit(),
+                strokeStyle->GetDashStyle(),
+                strokeStyle->GetDashOffset(),
+                transformType
+            };
+
+            // Only custom dash styles have an array of dashes.
+            std::vector<float> dashes;
+            if (properties.dashStyle == D2D1_DASH_STYLE_CUSTOM)
+            {
+                dashes.resize(strokeStyle->GetDashesCount());
+                strokeStyle->GetDashes(dashes.data(), static_cast<UINT32>(dashes.size()));
+            }
+
+            Append(definition, ResourceKind::StrokeStyle);
+            Append(definition, properties);
+            Append(definition, static_cast<uint32_t>(dashes.size()));
+            AppendArray(definition, dashes.data(), static_cast<uint32_t>(dashes.size()));
+            return true;
+        });
+    }
+
+    uint32_t DefineFontFace(IDWriteFontFace* fontFace)
+    {
+        return Define(fontFace, [&](std::vector<uint8_t>& definition)
+        {
+            // Only fonts loaded from a single local file can be referenced
+            // by path.
+            UINT32 fileCount = 0;
+            HR(fontFace->GetFiles(&fileCount, nullptr));
+            if (fileCount != 1)
+            {
+                return false;
+            }
+
+            ComPtr<IDWriteFontFile> fontFile;
+            HR(fontFace->GetFiles(&fileCount, &fontFile));
+
+            ComPtr<IDWriteFontFileLoader> loader;
+            ComPtr<IDWriteLocalFontFileLoader> localLoader;
+            HR(fontFile->GetLoader(&loader));
+            if (FAILED(loader.As(&localLoader)))
+            {
+                return false;
+            }
+
+            void const* key;
+            UINT32 keySize;
+            UINT32 pathLength;
+            HR(fontFile->GetReferenceKey(&key, &keySize));
+            HR(localLoader->GetFilePathLengthFromKey(key, keySize, &pathLength));
+
+            std::vector<wchar_t> path(pathLength + 1);
+            HR(localLoader->GetFilePathFromKey(key, keySize, path.data(), pathLength + 1));
+
+            // Variable fonts are recreated with the same axis values.
+            std::vector<DWRITE_FONT_AXIS_VALUE> axisValues;
+            ComPtr<IDWriteFontFace5> fontFace5;
+            if (SUCCEEDED(fontFace->QueryInterface(IID_PPV_ARGS(&fontFace5))))
+            {
+                axisValues.resize(fontFace5->GetFontAxisValueCount());
+                HR(fontFace5->GetFontAxisValues(axisValues.data(), static_cast<UINT32>(axisValues.size())));
+            }
+
+            Append(definition, ResourceKind::FontFace);
+            Append(definition, fontFace->GetIndex());
+            Append(definition, fontFace->GetSimulations());
+            Append(definition, pathLength);
+            AppendArray(definition, path.data(), pathLength);
+            Append(definition, static_cast<uint32_t>(axisValues.size()));
+            AppendArray(definition, axisValues.data(), static_cast<uint32_t>(axisValues.size()));
+            return true;
+        });
+    }
+
+    uint32_t DefineRenderingParams(IDWriteRenderingParams* params)
+    {
+        return Define(params, [&](std::vector<uint8_t>& definition)
+        {
+            Append(definition, ResourceKind::RenderingParams);
+            Append(definition, params->GetGamma());
+            Append(definition, params->GetEnhancedContrast());
+            Append(definition, params->GetClearTypeLevel());
+            Append(definition, params->GetPixelGeometry());
+            Append(definition, params->GetRenderingMode());
+            return true;
+        });
+    }
+
+    uint32_t DefineSpriteBatch(ID2D1SpriteBatch* spriteBatch)
+    {
+        return Define(spriteBatch, [&](std::vector<uint8_t>& definition)
+        {
+            // Capture every sprite, since draws may use different ranges.
+            uint32_t const count = spriteBatch->GetSpriteCount();
+            std::vector<D2D1_RECT_F> destinationRectangles(count);
+            std::vector<D2D1_RECT_U> sourceRectangles(count);
+            std::vector<D2D1_COLOR_F> colors(count);
+            std::vector<D2D1_MATRIX_3X2_F> transforms(count);
+            if (count != 0)
+            {
+                HR(spriteBatch->GetSprites(0, count, destinationRectangles.data(), sourceRectangles.data(), colors.data(), transforms.data()));
+            }
+
+            Append(definition, ResourceKind::SpriteBatch);
+            Append(definition, count);
+            AppendArray(definition, destinationRectangles.data(), count);
+            AppendArray(definition, sourceRectangles.data(), count);
+            AppendArray(definition, colors.data(), count);
+            AppendArray(definition, transforms.data(), count);
+            return true;
+        });
+    }
+
+    // Reads back the pixels of a bitmap. Returns false if the bitmap can't
+    // be read back, e.g., because its format is block-compressed.
+    bool AppendPixels(ID2D1Bitmap* bitmap, std::vector<uint8_t>& definition)
+    {
+        D2D1_SIZE_U const size = bitmap->GetPixelSize();
+        D2D1_PIXEL_FORMAT const format = bitmap->GetPixelFormat();
+        uint32_t const rowSize = size.width * GetBytesPerPixel(format.format);
+        if (rowSize == 0 || size.height == 0)
+        {
+            return false;
+        }
+
+        float dpiX, dpiY;
+        bitmap->GetDpi(&dpiX, &dpiY);
+
+        ComPtr<ID2D1Bitmap1> readbackBitmap;
+        HRESULT hr = m_state.context->CreateBitmap(
+            size,
+            nullptr,
+            0,
+            D2D1::BitmapProperties1(D2D1_BITMAP_OPTIONS_CPU_READ | D2D1_BITMAP_OPTIONS_CANNOT_DRAW, format, dpiX, dpiY),
+            &readbackBitmap
+        );
+        if (SUCCEEDED(hr))
+        {
+            hr = readbackBitmap->CopyFromBitmap(nullptr, bitmap, nullptr);
+        }
+        if (FAILED(hr))
+        {
+            return false;
+        }
+
+        Append(definition, size);
+        Append(definition, format);
+        Append(definition, dpiX);
+        Append(definition, dpiY);
+
+        // Reserve the space first, so nothing throws while mapped.
+        size_t const offset = definition.size();
+        definition.resize(offset + static_cast<size_t>(rowSize) * size.height);
+
+        D2D1_MAPPED_RECT mapped;
+        HR(readbackBitmap->Map(D2D1_MAP_OPTIONS_READ, &mapped));
+        for (uint32_t y = 0; y < size.height; y++)
+        {
+            memcpy(&definition[offset + static_cast<size_t>(rowSize) * y], mapped.bits + static_cast<size_t>(mapped.pitch) * y, rowSize);
+        }
+        HR(readbackBitmap->Unmap());
+        return true;
+    }
+
+    // Renders an image, such as an effect, to a bitmap at the target's DPI
+    // and reads it back. Only the part inside the target bounds is kept,
+    // since effects such as floods have infinite bounds.
+    bool AppendRasterizedImage(ID2D1Image* image, std::vector<uint8_t>& definition)
+    {
+        auto context = m_state.context;
+
+        D2D_RECT_F bounds;
+        if (FAILED(context->GetImageLocalBounds(image, &bounds)))
+        {
+            return false;
+        }
+        bounds.left = std::max(bounds.left, m_state.targetBounds.left);
+        bounds.top = std::max(bounds.top, m_state.targetBounds.top);
+        bounds.right = std::min(bounds.right, m_state.targetBounds.right);
+        bounds.bottom = std::min(bounds.bottom, m_state.targetBounds.bottom);
+        if (bounds.right <= bounds.left || bounds.bottom <= bounds.top)
+        {
+            return false;
+        }
+
+        float dpiX, dpiY;
+        context->GetDpi(&dpiX, &dpiY);
+        D2D1_SIZE_U const pixelSize = {
+            static_cast<uint32_t>(ceilf((bounds.right - bounds.left) * dpiX / 96.0f)),
+            static_cast<uint32_t>(ceilf((bounds.bottom - bounds.top) * dpiY / 96.0f))
+        };
+
+        ComPtr<ID2D1Bitmap1> bitmap;
+        HR(context->CreateBitmap(
+            pixelSize,
+            nullptr,
+            0,
+            D2D1::BitmapProperties1(
+                D2D1_BITMAP_OPTIONS_TARGET,
+                D2D1::PixelFormat(m_state.targetFormat, D2D1_ALPHA_MODE_PREMULTIPLIED),
+                dpiX,
+                dpiY
+            ),
+            &bitmap
+        ));
+
+        context->SetTarget(bitmap.Get());
+        context->BeginDraw();
+        context->Clear(D2D1_COLOR_F{});
+        context->DrawImage(image, D2D_POINT_2F{ -bounds.left, -bounds.top });
+
+        // Drawing fails if the image belongs to another device context,
+        // e.g., an effect created by a region context.
+        if (FAILED(context->EndDraw()))
+        {
+            return false;
+        }
+
+        Append(definition, ResourceKind::RasterizedImage);
+        Append(definition, D2D_POINT_2F{ bounds.left, bounds.top });
+        return AppendPixels(bitmap.Get(), definition);
+    }
+
+    static void AppendGradientStops(ID2D1GradientStopCollection* stopCollection, std::vector<uint8_t>& definition)
+    {
+        std::vector<D2D1_GRADIENT_STOP> stops(stopCollection->GetGradientStopCount());
+        stopCollection->GetGradientStops(stops.data(), static_cast<UINT32>(stops.size()));
+
+        Append(definition, stopCollection->GetColorInterpolationGamma());
+        Append(definition, stopCollection->GetExtendMode());
+        Append(definition, static_cast<uint32_t>(stops.size()));
+        AppendArray(definition, stops.data(), static_cast<uint32_t>(stops.size()));
+    }
+
+    State& m_state;
+    std::vector<uint8_t> m_commands;
+};
+
+void FrameCapture::Save(
+    wchar_t const* path,
+    ID2D1DeviceContext6* context,
+    ID2D1CommandList* commandList,
+    FrameCaptureInfo const& info
+)
+{
+    Writer::State state;
+    state.context = context;
+    state.targetFormat = info.bufferPrecision == D2D1_BUFFER_PRECISION_16BPC_FLOAT ? DXGI_FORMAT_R16G16B16A16_FLOAT : DXGI_FORMAT_B8G8R8A8_UNORM;
+    state.targetBounds = D2D_RECT_F{ 0, 0, info.pixelWidth * 96.0f / info.dpi, info.pixelHeight * 96.0f / info.dpi };
+
+    // Stream the commands. Reading back bitmaps and rasterizing images
+    // changes the context's target, and images are rasterized without a
+    // transform, so both are restored afterward.
+    ComPtr<ID2D1Image> target;
+    D2D1_MATRIX_3X2_F transform;
+    context->GetTarget(&target);
+    context->GetTransform(&transform);
+    context->SetTransform(D2D1::Matrix3x2F::Identity());
+
+    ComPtr<Writer> writer{ new Writer{ state } };
+    HRESULT const hr = commandList->Stream(writer.Get());
+
+    context->SetTarget(target.Get());
+    context->SetTransform(transform);
+    HR(hr);
+
+    LARGE_INTEGER qpcFrequency;
+    QueryPerformanceFrequency(&qpcFrequency);
+
+    std::vector<uint8_t> header;
+    Append(header, CaptureMagic);
+    Append(header, CaptureVersion);
+    Append(header, info.pixelWidth);
+    Append(header, info.pixelHeight);
+    Append(header, info.dpi);
+    Append(header, info.bufferPrecision);
+    Append(header, info.resourceCount);
+    Append(header, state.skippedCommandCount);
+    Append(header, qpcFrequency.QuadPart);
+    AppendTiming(header, info.timing);
+    Append(header, static_cast<uint32_t>(info.recentTimings.size()));
+    for (auto const& timing : info.recentTimings)
+    {
+        AppendTiming(header, timing);
+    }
+    Append(header, static_cast<uint32_t>(state.resources.size()));
+
+    // The header is followed by the resource definitions, and then the
+    // size of the commands and the commands.
+    auto const& commands = writer->GetCommands();
+    auto const commandSize = static_cast<uint32_t>(commands.size());
+
+    FILE* file = nullptr;
+    errno_t const err = _wfopen_s(&file, path, L"wb");
+    if (err != 0 || file == nullptr)
+    {
+        ThrowErrno(err);
+    }
+
+    bool const isWritten =
+        fwrite(header.data(), 1, header.size(), file) == header.size() &&
+        fwrite(state.resources.data(), 1, state.resources.size(), file) == state.resources.size() &&
+        fwrite(&commandSize, sizeof(commandSize), 1, file) == 1 &&
+        fwrite(commands.data(), 1, commands.size(), file) == commands.size();
+
+    if (fclose(file) != 0 || !isWritten)
+    {
+        throw WinException{ HRESULT_FROM_WIN32(ERROR_WRITE_FAULT) };
+    }
+}
+
+void FrameCapture::Load(wchar_t const* path)
+{
+    FILE* file = nullptr;
+    errno_t const err = _wfopen_s(&file, path, L"rb");
+    if (err != 0 || file == nullptr)
+    {
+        ThrowErrno(err);
+    }
+
+    std::vector<uint8_t> data;
+    bool isRead = _fseeki64(file, 0, SEEK_END) == 0;
+    int64_t const fileSize = isRead ? _ftelli64(file) : -1;
+    if (fileSize >= 0 && _fseeki64(file, 0, SEEK_SET) == 0)
+    {
+        data.resize(static_cast<size_t>(fileSize));
+        isRead = fread(data.data(), 1, data.size(), file) == data.size();
+    }
+    else
+    {
+        isRead = false;
+    }
+    fclose(file);
+
+    if (!isRead)
+    {
+        throw WinException{ HRESULT_FROM_WIN32(ERROR_READ_FAULT) };
+    }
+
+    Reader reader{ data.data(), data.size() };
+    if (reader.Read<uint32_t>() != CaptureMagic || reader.Read<uint32_t>() != CaptureVersion)
+    {
+        ThrowInvalidCapture();
+    }
+
+    FrameCaptureInfo info;
+    info.pixelWidth = reader.Read<uint32_t>();
+    info.pixelHeight = reader.Read<uint32_t>();
+    info.dpi = reader.Read<float>();
+    info.bufferPrecision = reader.Read<D2D1_BUFFER_PRECISION>();
+    info.resourceCount = reader.Read<uint32_t>();
+    info.skippedCommandCount = reader.Read<uint32_t>();
+    info.qpcFrequency = reader.Read<int64_t>();
+    info.timing = reader.ReadTiming();
+
+    uint32_t const timingCount = reader.Read<uint32_t>();
+    for (uint32_t i = 0; i < timingCount; i++)
+    {
+        info.recentTimings.push_back(reader.ReadTiming());
+    }
+
+    if (info.pixelWidth == 0 || info.pixelHeight == 0 || !(info.dpi > 0))
+    {
+        ThrowInvalidCapture();
+    }
+
+    uint32_t const resourceSize = reader.Read<uint32_t>();
+    uint8_t const* resources = reader.Skip(resourceSize);
+    uint32_t const commandSize = reader.Read<uint32_t>();
+    uint8_t const* commands = reader.Skip(commandSize);
+    if (!reader.IsAtEnd())
+    {
+        ThrowInvalidCapture();
+    }
+
+    // The resources of a previous capture are no longer valid.
+    Reset();
+
+    m_resourceOffset = resources - data.data();
+    m_resourceSize = resourceSize;
+    m_commandOffset = commands - data.data();
+    m_commandSize = commandSize;
+    m_data = std::move(data);
+    m_info = std::move(info);
+}
+
+void FrameCapture::Replay(ID2D1DeviceContext6* context)
+{
+    ResetState(context);
+
+    Reader reader{ m_data.data() + m_commandOffset, m_commandSize };
+    ReplayCommands(context, reader);
+}
+
+void FrameCapture::Initialize(ID2D1DeviceContext6* context)
+{
+    // Geometries and stroke styles are created by the factory.
+    ComPtr<ID2D1Factory> factory;
+    ComPtr<ID2D1Factory7> factory7;
+    context->GetFactory(&factory);
+    HR(factory.As(&factory7));
+
+    m_resources.clear();
+
+    Reader reader{ m_data.data() + m_resourceOffset, m_resourceSize };
+    while (!reader.IsAtEnd())
+    {
+        CreateResource(context, factory7.Get(), reader);
+    }
+
+    m_isInitialized = true;
+}
+
+void FrameCapture::Reset() noexcept
+{
+    m_resources.clear();
+    m_isInitialized = false;
+}
+
+void FrameCapture::ResetState(ID2D1DeviceContext6* context) noexcept
+{
+    context->SetTransform(D2D1::Matrix3x2F::Identity());
+    context->SetAntialiasMode(D2D1_ANTIALIAS_MODE_PER_PRIMITIVE);
+    context->SetTextAntialiasMode(D2D1_TEXT_ANTIALIAS_MODE_DEFAULT);
+    context->SetTextRenderingParams(nullptr);
+    context->SetPrimitiveBlend(D2D1_PRIMITIVE_BLEND_SOURCE_OVER);
+    context->SetUnitMode(D2D1_UNIT_MODE_DIPS);
+    context->SetTags(0, 0);
+}
+
+void FrameCapture::CreateResource(ID2D1DeviceContext6* context, ID2D1Factory7* factory, Reader& reader)
+{
+    Resource resource = { reader.Read<ResourceKind>(), nullptr, D2D_POINT_2F{} };
+
+    // Reads a gradient stop collection of a gradient brush.
+    auto readGradientStops = [&]()
+    {
+        auto const gamma = reader.Read<D2D1_GAMMA>();
+        auto const extendMode = reader.Read<D2D1_EXTEND_MODE>();
+
+        std::vector<D2D1_GRADIENT_STOP> stops;
+        reader.ReadArray(stops, reader.Read<uint32_t>());
+
+        // The render target method, which the device context's overloads hide.
+        ID2D1RenderTarget* renderTarget = context;
+        ComPtr<ID2D1GradientStopCollection> stopCollection;
+        HR(renderTarget->CreateGradientStopCollection(stops.data(), static_cast<UINT32>(stops.size()), gamma, extendMode, &stopCollection));
+        return stopCollection;
+    };
+
+    switch (resource.kind)
+    {
+    case ResourceKind::RasterizedImage:
+        resource.origin = reader.Read<D2D_POINT_2F>();
+        // The rest is the same as a bitmap.
+        //fallthrough
+
+    case ResourceKind::Bitmap:
+    {
+        auto const size = reader.Read<D2D1_SIZE_U>();
+        auto const format = reader.Read<D2D1_PIXEL_FORMAT>();
+        float const dpiX = reader.Read<float>();
+        float const dpiY = reader.Read<float>();
+
+        uint32_t const rowSize = size.width * GetBytesPerPixel(format.format);
+        if (rowSize == 0 || size.height == 0)
+        {
+            ThrowInvalidCapture();
+        }
+
+        uint8_t const* pixels = reader.Skip(static_cast<size_t>(rowSize) * size.height);
+
+        ComPtr<ID2D1Bitmap1> bitmap;
+        HR(context->CreateBitmap(size, pixels, rowSize, D2D1::BitmapProperties1(D2D1_BITMAP_OPTIONS_NONE, format, dpiX, dpiY), &bitmap));
+        resource.object = static_cast<ID2D1Bitmap1*>(bitmap.Get());
+        break;
+    }
+
+    case ResourceKind::CommandList:
+    {
+        uint32_t const size = reader.Read<uint32_t>();
+        Reader commands{ reader.Skip(size), size };
+
+        // Record the nested commands into a command list, starting from the
+        // default state as the capture did.
+        ComPtr<ID2D1CommandList> commandList;
+        HR(context->CreateCommandList(&commandList));
+
+        ComPtr<ID2D1Image> target;
+        context->GetTarget(&target);
+        context->SetTarget(commandList.Get());
+        context->BeginDraw();
+        ResetState(context);
+
+        try
+        {
+            ReplayCommands(context, commands);
+        }
+        catch (...)
+        {
+            context->EndDraw();
+            context->SetTarget(target.Get());
+            throw;
+        }
+
+        HRESULT const hr = context->EndDraw();
+        context->SetTarget(target.Get());
+        HR(hr);
+        HR(commandList->Close());
+
+        resource.object = static_cast<ID2D1CommandList*>(commandList.Get());
+        break;
+    }
+
+    case ResourceKind::SolidColorBrush:
+    {
+        auto const color = reader.Read<D2D1_COLOR_F>();
+        auto const brushProperties = reader.ReadBrushProperties();
+
+        ComPtr<ID2D1SolidColorBrush> brush;
+        HR(context->CreateSolidColorBrush(color, brushProperties, &brush));
+        resource.object = static_cast<ID2D1Brush*>(brush.Get());
+        break;
+    }
+
+    case ResourceKind::BitmapBrush:
+    {
+        auto const bitmap = GetOptionalResource<ID2D1Bitmap1>(reader.Read<uint32_t>(), ResourceKind::Bitmap);
+        D2D1_BITMAP_BRUSH_PROPERTIES1 bitmapBrushProperties;
+        bitmapBrushProperties.extendModeX = reader.Read<D2D1_EXTEND_MODE>();
+        bitmapBrushProperties.extendModeY = reader.Read<D2D1_EXTEND_MODE>();
+        bitmapBrushProperties.interpolationMode = reader.Read<D2D1_INTERPOLATION_MODE>();
+        auto const brushProperties = reader.ReadBrushProperties();
+
+        ComPtr<ID2D1BitmapBrush1> brush;
+        HR(context->CreateBitmapBrush(bitmap, &bitmapBrushProperties, &brushProperties, &brush));
+        resource.object = static_cast<ID2D1Brush*>(brush.Get());
+        break;
+    }
+
+    case ResourceKind::LinearGradientBrush:
+    {
+        D2D1_LINEAR_GRADIENT_BRUSH_PROPERTIES linearProperties;
+        linearProperties.startPoint = reader.Read<D2D1_POINT_2F>();
+        linearProperties.endPoint = reader.Read<D2D1_POINT_2F>();
+        auto const stopCollection = readGradientStops();
+        auto const brushProperties = reader.ReadBrushProperties();
+
+        ComPtr<ID2D1LinearGradientBrush> brush;
+        HR(context->CreateLinearGradientBrush(linearProperties, brushProperties, stopCollection.Get(), &brush));
+        resource.object = static_cast<ID2D1Brush*>(brush.Get());
+        break;
+    }
+
+    case ResourceKind::RadialGradientBrush:
+    {
+        D2D1_RADIAL_GRADIENT_BRUSH_PROPERTIES radialProperties;
+        radialProperties.center = reader.Read<D2D1_POINT_2F>();
+        radialProperties.gradientOriginOffset = reader.Read<D2D1_POINT_2F>();
+        radialProperties.radiusX = reader.Read<float>();
+        radialProperties.radiusY = reader.Read<float>();
+        auto const stopCollection = readGradientStops();
+        auto const brushProperties = reader.ReadBrushProperties();
+
+        ComPtr<ID2D1RadialGradientBrush> brush;
+        HR(context->CreateRadialGradientBrush(radialProperties, brushProperties, stopCollection.Get(), &brush));
+        resource.object = static_cast<ID2D1Brush*>(brush.Get());
+        break;
+    }
+
+    case ResourceKind::Geometry:
+    {
+        ComPtr<ID2D1PathGeometry1> geometry;
+        ComPtr<ID2D1GeometrySink> sink;
+        HR(factory->CreatePathGeometry(&geometry));
+        HR(geometry->Open(&sink));
+
+        std::vector<D2D1_POINT_2F> points;
+        std::vector<D2D1_BEZIER_SEGMENT> beziers;
+
+        for (bool isDone = false; !isDone; )
+        {
+            switch (reader.Read<GeometryWriter::Op>())
+            {
+            case GeometryWriter::Op::SetFillMode:
+                sink->SetFillMode(reader.Read<D2D1_FILL_MODE>());
+                break;
+
+            case GeometryWriter::Op::SetSegmentFlags:
+                sink->SetSegmentFlags(reader.Read<D2D1_PATH_SEGMENT>());
+                break;
+
+            case GeometryWriter::Op::BeginFigure:
+            {
+                auto const startPoint = reader.Read<D2D1_POINT_2F>();
+                sink->BeginFigure(startPoint, reader.Read<D2D1_FIGURE_BEGIN>());
+                break;
+            }
+
+            case GeometryWriter::Op::AddLines:
+                reader.ReadArray(points, reader.Read<uint32_t>());
+                sink->AddLines(points.data(), static_cast<UINT32>(points.size()));
+                break;
+
+            case GeometryWriter::Op::AddBeziers:
+                reader.ReadArray(beziers, reader.Read<uint32_t>());
+                sink->AddBeziers(beziers.data(), static_cast<UINT32>(beziers.size()));
+                break;
+
+            case GeometryWriter::Op::EndFigure:
+                sink->EndFigure(reader.Read<D2D1_FIGURE_END>());
+                break;
+
+            case GeometryWriter::Op::End:
+                isDone = true;
+                break;
+
+            default:
+                ThrowInvalidCapture();
+            }
+        }
+
+        HR(sink->Close());
+        resource.object = static_cast<ID2D1Geometry*>(geometry.Get());
+        break;
+    }
+
+    case ResourceKind::StrokeStyle:
+    {
+        auto const properties = reader.Read<D2D1_STROKE_STYLE_PROPERTIES1>();
+        std::vector<float> dashes;
+        reader.ReadArray(dashes, reader.Read<uint32_t>());
+
+        ComPtr<ID2D1StrokeStyle1> strokeStyle;
+        HR(factory->CreateStrokeStyle(properties, dashes.data(), static_cast<UINT32>(dashes.size()), &strokeStyle));
+        resource.object = static_cast<ID2D1StrokeStyle*>(strokeStyle.Get());
+        break;
+    }
+
+    case ResourceKind::FontFace:
+    {
+        auto const faceIndex = reader.Read<UINT32>();
+        auto const simulations = reader.Read<DWRITE_FONT_SIMULATIONS>();
+
+        std::vector<wchar_t> path;
+        reader.ReadArray(path, reader.Read<uint32_t>());
+        path.push_back(L'\0');
+
+        std::vector<DWRITE_FONT_AXIS_VALUE> axisValues;
+        reader.ReadArray(axisValues, reader.Read<uint32_t>());
+
+        ComPtr<IDWriteFontFile> fontFile;
+        ComPtr<IDWriteFontFaceReference1> fontFaceReference;
+        ComPtr<IDWriteFontFace5> fontFace;
+        HR(m_factory->CreateFontFileReference(path.data(), nullptr, &fontFile));
+        HR(m_factory->CreateFontFaceReference(
+            fontFile.Get(),
+            faceIndex,
+            simulations,
+            axisValues.data(),
+            static_cast<UINT32>(axisValues.size()),
+            &fontFaceReference
+        ));
+        HR(fontFaceReference->CreateFontFace(&fontFace));
+        resource.object = static_cast<IDWriteFontFace*>(fontFace.Get());
+        break;
+    }
+
+    case ResourceKind::RenderingParams:
+    {
+        float const gamma = reader.Read<float>();
+        float const enhancedContrast = reader.Read<float>();
+        float const clearTypeLevel = reader.Read<float>();
+        auto const pixelGeometry = reader.Read<DWRITE_PIXEL_GEOMETRY>();
+        auto const renderingMode = reader.Read<DWRITE_RENDERING_MODE>();
+
+        // The original factory method, which later overloads hide.
+        IDWriteFactory* dwriteFactory = m_factory.Get();
+        ComPtr<IDWriteRenderingParams> params;
+        HR(dwriteFactory->CreateCustomRenderingParams(gamma, enhancedContrast, clearTypeLevel, pixelGeometry, renderingMode, &params));
+        resource.object = static_cast<IDWriteRenderingParams*>(params.Get());
+        break;
+    }
+
+    case ResourceKind::SpriteBatch:
+    {
+        uint32_t const count = reader.Read<uint32_t>();
+        std::vector<D2D1_RECT_F> destinationRectangles;
+        std::vector<D2D1_RECT_U> sourceRectangles;
+        std::vector<D2D1_COLOR_F> colors;
+        std::vector<D2D1_MATRIX_3X2_F> transforms;
+        reader.ReadArray(destinationRectangles, count);
+        reader.ReadArray(sourceRectangles, count);
+        reader.ReadArray(colors, count);
+        reader.ReadArray(transforms, count);
+
+        ComPtr<ID2D1SpriteBatch> spriteBatch;
+        HR(context->CreateSpriteBatch(&spriteBatch));
+        if (count != 0)
+        {
+            HR(spriteBatch->AddSprites(count, destinationRectangles.data(), sourceRectangles.data(), colors.data(), transforms.data()));
+        }
+        resource.object = static_cast<ID2D1SpriteBatch*>(spriteBatch.Get());
+        break;
+    }
+
+    default:
+        ThrowInvalidCapture();
+    }
+
+    m_resources.push_back(std::move(resource));
+}
+
+void FrameCapture::ReplayCommands(ID2D1DeviceContext6* context, Reader& reader)
+{
+    while (!reader.IsAtEnd())
+    {
+        switch (reader.Read<Command>())
+        {
+        case Command::SetAntialiasMode:
+            context->SetAntialiasMode(reader.Read<D2D1_ANTIALIAS_MODE>());
+            break;
+
+        case Command::SetTags:
+        {
+            auto const tag1 = reader.Read<D2D1_TAG>();
+            context->SetTags(tag1, reader.Read<D2D1_TAG>());
+            break;
+        }
+
+        case Command::SetTextAntialiasMode:
+            context->SetTextAntialiasMode(reader.Read<D2D1_TEXT_ANTIALIAS_MODE>());
+            break;
+
+        case Command::SetTextRenderingParams:
+            context->SetTextRenderingParams(GetOptionalResource<IDWriteRenderingParams>(reader.Read<uint32_t>(), ResourceKind::RenderingParams));
+            break;
+
+        case Command::SetTransform:
+            context->SetTransform(reader.Read<D2D1_MATRIX_3X2_F>());
+            break;
+
+        case Command::SetPrimitiveBlend:
+            context->SetPrimitiveBlend(reader.Read<D2D1_PRIMITIVE_BLEND>());
+            break;
+
+        case Command::SetUnitMode:
+            context->SetUnitMode(reader.Read<D2D1_UNIT_MODE>());
+            break;
+
+        case Command::Clear:
+        {
+            D2D1_COLOR_F color;
+            context->Clear(reader.ReadOptional(&color));
+            break;
+        }
+
+        case Command::DrawGlyphRun:
+        {
+            auto const baselineOrigin = reader.Read<D2D1_POINT_2F>();
+            auto const measuringMode = reader.Read<DWRITE_MEASURING_MODE>();
+            auto const brush = GetBrush(reader.Read<uint32_t>());
+
+            DWRITE_GLYPH_RUN glyphRun;
+            glyphRun.fontFace = GetResource<IDWriteFontFace>(reader.Read<uint32_t>(), ResourceKind::FontFace);
+            glyphRun.fontEmSize = reader.Read<float>();
+            glyphRun.glyphCount = reader.Read<UINT32>();
+            glyphRun.isSideways = reader.Read<BOOL>();
+            glyphRun.bidiLevel = reader.Read<UINT32>();
+            glyphRun.glyphIndices = reader.ReadOptionalArray(m_glyphIndices, glyphRun.glyphCount);
+            glyphRun.glyphAdvances = reader.ReadOptionalArray(m_glyphAdvances, glyphRun.glyphCount);
+            glyphRun.glyphOffsets = reader.ReadOptionalArray(m_glyphOffsets, glyphRun.glyphCount);
+
+            context->DrawGlyphRun(baselineOrigin, &glyphRun, nullptr, brush, measuringMode);
+            break;
+        }
+
+        case Command::DrawLine:
+        {
+            auto const point0 = reader.Read<D2D1_POINT_2F>();
+            auto const point1 = reader.Read<D2D1_POINT_2F>();
+            auto const brush = GetBrush(reader.Read<uint32_t>());
+            float const strokeWidth = reader.Read<float>();
+            auto const strokeStyle = GetOptionalResource<ID2D1StrokeStyle>(reader.Read<uint32_t>(), ResourceKind::StrokeStyle);
+
+            context->DrawLine(point0, point1, brush, strokeWidth, strokeStyle);
+            break;
+        }
+
+        case Command::DrawGeometry:
+        {
+            auto const geometry = GetResource<ID2D1Geometry>(reader.Read<uint32_t>(), ResourceKind::Geometry);
+            auto const brush = GetBrush(reader.Read<uint32_t>());
+            float const strokeWidth = reader.Read<float>();
+            auto const strokeStyle = GetOptionalResource<ID2D1StrokeStyle>(reader.Read<uint32_t>(), ResourceKind::StrokeStyle);
+
+            context->DrawGeometry(geometry, brush, strokeWidth, strokeStyle);
+            break;
+        }
+
+        case Command::DrawRectangle:
+        {
+            auto const rect = reader.Read<D2D1_RECT_F>();
+            auto const brush = GetBrush(reader.Read<uint32_t>());
+            float const strokeWidth = reader.Read<float>();
+            auto const strokeStyle = GetOptionalResource<ID2D1StrokeStyle>(reader.Read<uint32_t>(), ResourceKind::StrokeStyle);
+
+            context->DrawRectangle(rect, brush, strokeWidth, strokeStyle);
+            break;
+        }
+
+        case Command::DrawBitmap:
+        {
+            auto const bitmap = GetBitmap(reader.Read<uint32_t>());
+            D2D1_RECT_F destinationRectangle;
+            auto const destination = reader.ReadOptional(&destinationRectangle);
+            float const opacity = reader.Read<float>();
+            auto const interpolationMode = reader.Read<D2D1_INTERPOLATION_MODE>();
+            D2D1_RECT_F sourceRectangle;
+            auto const source = reader.ReadOptional(&sourceRectangle);
+            D2D1_MATRIX_4X4_F perspectiveTransform;
+            auto const perspective = reader.ReadOptional(&perspectiveTransform);
+
+            context->DrawBitmap(bitmap, destination, opacity, interpolationMode, source, perspective);
+            break;
+        }
+
+        case Command::DrawImage:
+        {
+            D2D_POINT_2F origin;
+            auto const image = GetImage(reader.Read<uint32_t>(), &origin);
+            D2D_POINT_2F targetOffset = {};
+            reader.ReadOptional(&targetOffset);
+            D2D_RECT_F imageRectangle;
+            bool const hasImageRectangle = reader.ReadOptional(&imageRectangle) != nullptr;
+            auto const interpolationMode = reader.Read<D2D1_INTERPOLATION_MODE>();
+            auto const compositeMode = reader.Read<D2D1_COMPOSITE_MODE>();
+
+            // The bitmap of a rasterized image starts at its origin in image
+            // space. The image rectangle, if any, is what's mapped to the
+            // target offset.
+            if (hasImageRectangle)
+            {
+                imageRectangle.left -= origin.x;
+                imageRectangle.top -= origin.y;
+                imageRectangle.right -= origin.x;
+                imageRectangle.bottom -= origin.y;
+            }
+            else
+            {
+                targetOffset.x += origin.x;
+                targetOffset.y += origin.y;
+            }
+
+            context->DrawImage(image, &targetOffset, hasImageRectangle ? &imageRectangle : nullptr, interpolationMode, compositeMode);
+            break;
+        }
+
+        case Command::FillOpacityMask:
+        {
+            auto const opacityMask = GetBitmap(reader.Read<uint32_t>());
+            auto const brush = GetBrush(reader.Read<uint32_t>());
+            D2D1_RECT_F destinationRectangle;
+            auto const destination = reader.ReadOptional(&destinationRectangle);
+            D2D1_RECT_F sourceRectangle;
+            auto const source = reader.ReadOptional(&sourceRectangle);
+
+            context->FillOpacityMask(opacityMask, brush, destination, source);
+            break;
+        }
+
+        case Command::FillGeometry:
+        {
+            auto const geometry = GetResource<ID2D1Geometry>(reader.Read<uint32_t>(), ResourceKind::Geometry);
+            auto const brush = GetBrush(reader.Read<uint32_t>());
+            auto const opacityBrush = GetOptionalBrush(reader.Read<uint32_t>());
+
+            context->FillGeometry(geometry, brush, opacityBrush);
+            break;
+        }
+
+        case Command::FillRectangle:
+        {
+            auto const rect = reader.Read<D2D1_RECT_F>();
+            context->FillRectangle(rect, GetBrush(reader.Read<uint32_t>()));
+            break;
+        }
+
+        case Command::PushAxisAlignedClip:
+        {
+            auto const clipRect = reader.Read<D2D1_RECT_F>();
+            context->PushAxisAlignedClip(clipRect, reader.Read<D2D1_ANTIALIAS_MODE>());
+            break;
+        }
+
+        case Command::PushLayer:
+        {
+            D2D1_LAYER_PARAMETERS1 layerParameters;
+            layerParameters.contentBounds = reader.Read<D2D1_RECT_F>();
+            layerParameters.geometricMask = GetOptionalResource<ID2D1Geometry>(reader.Read<uint32_t>(), ResourceKind::Geometry);
+            layerParameters.maskAntialiasMode = reader.Read<D2D1_ANTIALIAS_MODE>();
+            layerParameters.maskTransform = reader.Read<D2D1_MATRIX_3X2_F>();
+            layerParameters.opacity = reader.Read<float>();
+            layerParameters.opacityBrush = GetOptionalBrush(reader.Read<uint32_t>());
+            layerParameters.layerOptions = reader.Read<D2D1_LAYER_OPTIONS1>();
+
+            context->PushLayer(layerParameters, nullptr);
+            break;
+        }
+
+        case Command::PopAxisAlignedClip:
+            context->PopAxisAlignedClip();
+            break;
+
+        case Command::PopLayer:
+            context->PopLayer();
+            break;
+
+        case Command::DrawSpriteBatch:
+        {
+            auto const spriteBatch = GetResource<ID2D1SpriteBatch>(reader.Read<uint32_t>(), ResourceKind::SpriteBatch);
+            uint32_t const startIndex = reader.Read<uint32_t>();
+            uint32_t const spriteCount = reader.Read<uint32_t>();
+            auto const bitmap = GetBitmap(reader.Read<uint32_t>());
+            auto const interpolationMode = reader.Read<D2D1_BITMAP_INTERPOLATION_MODE>();
+            auto const spriteOptions = reader.Read<D2D1_SPRITE_OPTIONS>();
+
+            context->DrawSpriteBatch(spriteBatch, startIndex, spriteCount, bitmap, interpolationMode, spriteOptions);
+            break;
+        }
+
+        default:
+            ThrowInvalidCapture();
+        }
+    }
+}
+
+template<typename T>
+T* FrameCapture::GetResource(uint32_t index, ResourceKind kind) const
+{
+    if (index >= m_resources.size() || m_resources[index].kind != kind)
+    {
+        ThrowInvalidCapture();
+    }
+    return static_cast<T*>(m_resources[index].object.Get());
+}
+
+template<typename T>
+T* FrameCapture::GetOptionalResource(uint32_t index, ResourceKind kind) const
+{
+    return index != NoResource ? GetResource<T>(index, kind) : nullptr;
+}
+
+ID2D1Brush* FrameCapture::GetBrush(uint32_t index) const
+{
+    if (index < m_resources.size())
+    {
+        switch (m_resources[index].kind)
+        {
+        case ResourceKind::SolidColorBrush:
+        case ResourceKind::BitmapBrush:
+        case ResourceKind::LinearGradientBrush:
+        case ResourceKind::RadialGradientBrush:
+            return static_cast<ID2D1Brush*>(m_resources[index].object.Get());
+
+        default:
+            break;
+        }
+    }
+    ThrowInvalidCapture();
+}
+
+ID2D1Brush* FrameCapture::GetOptionalBrush(uint32_t index) const
+{
+    return index != NoResource ? GetBrush(index) : nullptr;
+}
+
+ID2D1Image* FrameCapture::GetImage(uint32_t index, _Out_ D2D_POINT_2F* origin) const
+{
+    if (index < m_resources.size())
+    {
+        auto const& resource = m_resources[index];
+        *origin = resource.origin;
+
+        switch (resource.kind)
+        {
+        case ResourceKind::Bitmap:
+        case ResourceKind::RasterizedImage:
+            return static_cast<ID2D1Bitmap1*>(resource.object.Get());
+
+        case ResourceKind::CommandList:
+            return static_cast<ID2D1CommandList*>(resource.object.Get());
+
+        default:
+            break;
+        }
+    }
+    ThrowInvalidCapture();
+}
+
+ID2D1Bitmap1* FrameCapture::GetBitmap(uint32_t index) const
+{
+    return GetResource<ID2D1Bitmap1>(index, ResourceKind::Bitmap);
+}
+
+#pragma endregion // Capture
+
+#pragma region DXDevice
+
+DXDevice::DXDevice(DXDeviceOptions const& options) :
+    m_options{ options },
+    m_d2dFactory{ CreateD2DFactory(options.multithreaded) },
+    m_dwriteFactory{ CreateDWriteFactory() },
+    m_textFormatCache{ m_dwriteFactory.Get() }
+{
+    if (options.multithreaded)
+    {
+        HR(m_d2dFactory.As(&m_d2dMultithread));
+    }
+}
+
+ComPtr<ID2D1Factory7> DXDevice::CreateD2DFactory(bool multithreaded)
+{
+    ComPtr<ID2D1Factory7> ptr;
+    HR(D2D1CreateFactory(
+        multithreaded ? D2D1_FACTORY_TYPE_MULTI_THREADED : D2D1_FACTORY_TYPE_SINGLE_THREADED,
+        ptr.GetAddressOf()
+        ));
+    return ptr;
+}
+
+ComPtr<IDWriteFactory7> DXDevice::CreateDWriteFactory()
+{
+    ComPtr<IDWriteFactory7> ptr;
+    HR(DWriteCreateFactory(
+        DWRITE_FACTORY_TYPE_SHARED,
+        __uuidof(IDWriteFactory7),
+        reinterpret_cast<IUnknown**>(ptr.GetAddressOf())
+    ));
+    return ptr;
+}
+
+void DXDevice::Reset() noexcept
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+
+    m_d3dContext.Reset();
+    m_dxgiDevice.Reset();
+    m_d2dDevice.Reset();
+}
+
+bool DXDevice::ResetIfGeneration(uint32_t generation) noexcept
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+
+    if (m_d2dDevice == nullptr || m_generation.load(std::memory_order_relaxed) != generation)
+    {
+        return false;
+    }
+
+    m_d3dContext.Reset();
+    m_dxgiDevice.Reset();
+    m_d2dDevice.Reset();
+    return true;
+}
+
+void DXDevice::EnsureInitialized()
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    EnsureInitializedLocked();
+}
+
+DXAdapterInfo DXDevice::GetAdapterInfo() const
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    return m_adapterInfo;
+}
+
+bool DXDevice::GetAdapterLuidForWindow(HWND hwnd, _Out_ LUID* luid)
+{
+    *luid = {};
+
+    HMONITOR monitor = MonitorFromWindow(hwnd, MONITOR_DEFAULTTONEAREST);
+
+    ComPtr<IDXGIFactory1> dxgiFactory;
+    HR(CreateDXGIFactory1(IID_PPV_ARGS(&dxgiFactory)));
+
+    // Find the adapter with an output on the window's monitor.
+    ComPtr<IDXGIAdapter1> adapter;
+    for (UINT i = 0; dxgiFactory->EnumAdapters1(i, adapter.ReleaseAndGetAddressOf()) != DXGI_ERROR_NOT_FOUND; i++)
+    {
+        ComPtr<IDXGIOutput> output;
+        for (UINT j = 0; adapter->EnumOutputs(j, output.ReleaseAndGetAddressOf()) != DXGI_ERROR_NOT_FOUND; j++)
+        {
+            DXGI_OUTPUT_DESC outputDesc;
+            HR(output->GetDesc(&outputDesc));
+
+            if (outputDesc.Monitor == monitor)
+            {
+                DXGI_ADAPTER_DESC1 adapterDesc;
+                HR(adapter->GetDesc1(&adapterDesc));
+                *luid = adapterDesc.AdapterLuid;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+ComPtr<IDXGIAdapter1> DXDevice::SelectAdapter() const
+{
+    ComPtr<IDXGIAdapter1> adapter;
+
+    switch (m_options.adapterPreference)
+    {
+    case AdapterPreference::HighPerformance:
+    case AdapterPreference::MinimumPower:
+        {
+            // IDXGIFactory6 requires Windows 10 1803. On older systems,
+            // use the default adapter.
+            ComPtr<IDXGIFactory6> dxgiFactory;
+            if (FAILED(CreateDXGIFactory2(0, IID_PPV_ARGS(&dxgiFactory))))
+            {
+                break;
+            }
+
+            auto preference = m_options.adapterPreference == AdapterPreference::HighPerformance ?
+                DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE :
+                DXGI_GPU_PREFERENCE_MINIMUM_POWER;
+
+            // Take the first hardware adapter in order of preference.
+            for (UINT i = 0; SUCCEEDED(dxgiFactory->EnumAdapterByGpuPreference(
+                i, preference, IID_PPV_ARGS(adapter.ReleaseAndGetAddressOf()))); i++)
+            {
+                DXGI_ADAPTER_DESC1 desc;
+                HR(adapter->GetDesc1(&desc));
+                if ((desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) == 0)
+                {
+                    return adapter;
+                }
+            }
+            adapter.Reset();
+        }
+        break;
+
+    case AdapterPreference::Luid:
+        {
+            // The adapter may have been removed since the LUID was obtained.
+            ComPtr<IDXGIFactory4> dxgiFactory;
+            if (SUCCEEDED(CreateDXGIFactory2(0, IID_PPV_ARGS(&dxgiFactory))) &&
+                FAILED(dxgiFactory->EnumAdapterByLuid(m_options.adapterLuid, IID_PPV_ARGS(&adapter))))
+            {
+                OutputDebugStringW(L"DXDevice: adapter LUID not found; using the default adapter.\n");
+                adapter.Reset();
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return adapter;
+}
+
+void DXDevice::BeginInitialize()
+{
+    {
+        std::lock_guard<std::mutex> lock{ m_initializingMutex };
+        if (m_isInitializing.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        m_isInitializing.store(true, std::memory_order_release);
+    }
+
+    // The thread holds a reference, so the device outlives it.
+    ComPtr<DXDevice> self{ this };
+    try
+    {
+        std::thread([self]() noexcept { self->InitializeInBackground(); }).detach();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock{ m_initializingMutex };
+        m_isInitializing.store(false, std::memory_order_release);
+        throw;
+    }
+}
+
+void DXDevice::BeginFontWarmup(FontWarmupOptions options)
+{
+    // The thread holds a reference, so the DirectWrite factory outlives it.
+    ComPtr<DXDevice> self{ this };
+    std::thread([self, options = std::move(options)]() noexcept
+    {
+        try
+        {
+            WarmUpFonts(self->GetDWriteFactory(), options);
+        }
+        catch (WinException& e)
+        {
+            wchar_t message[80];
+            swprintf_s(message, L"DXDevice: font warmup failed (0x%08X).\n", static_cast<uint32_t>(e.GetError()));
+            OutputDebugStringW(message);
+        }
+        catch (std::bad_alloc&)
+        {
+        }
+    }).detach();
+}
+
+void DXDevice::InitializeInBackground() noexcept
+{
+    // If this fails, the first window to paint tries again and reports the
+    // error on its own thread.
+    try
+    {
+        EnsureInitialized();
+    }
+    catch (WinException& e)
+    {
+        wchar_t message[80];
+        swprintf_s(message, L"DXDevice: background initialization failed (0x%08X).\n", static_cast<uint32_t>(e.GetError()));
+        OutputDebugStringW(message);
+    }
+    catch (std::bad_alloc&)
+    {
+    }
+
+    std::vector<HWND> windows;
+    {
+        std::lock_guard<std::mutex> lock{ m_initializingMutex };
+        m_isInitializing.store(false, std::memory_order_release);
+        windows.swap(m_windowsToRepaint);
+    }
+
+    for (HWND hwnd : windows)
+    {
+        RedrawWindow(hwnd, nullptr, nullptr, RDW_INTERNALPAINT);
+    }
+}
+
+bool DXDevice::RepaintWhenInitialized(HWND hwnd)
+{
+    std::lock_guard<std::mutex> lock{ m_initializingMutex };
+    if (!m_isInitializing.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+
+    if (std::find(m_windowsToRepaint.begin(), m_windowsToRepaint.end(), hwnd) == m_windowsToRepaint.end())
+    {
+        m_windowsToRepaint.push_back(hwnd);
+    }
+    return true;
+}
+
+DXDeviceObjects DXDevice::Acquire()
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    EnsureInitializedLocked();
+
+    DXDeviceObjects objects;
+    objects.d3dContext = m_d3dContext;
+    objects.dxgiDevice = m_dxgiDevice;
+    objects.d2dDevice = m_d2dDevice;
+    objects.generation = m_generation.load(std::memory_order_relaxed);
+    return objects;
+}
+
+void DXDevice::EnsureInitializedLocked()
+{
+    if (IsInitialized())
+    {
+        return;
+    }
+
+    // Create the D3D device on the preferred adapter. If an adapter is
+    // specified, the driver type must be unknown.
+    bool isWarpPreferred = m_options.adapterPreference == AdapterPreference::Warp;
+    ComPtr<IDXGIAdapter1> adapter = SelectAdapter();
+    ComPtr<ID3D11Device> d3dDevice;
+    ComPtr<ID3D11DeviceContext> d3dContext;
+    HRESULT hr = D3D11CreateDevice(
+        adapter.Get(),
+        adapter != nullptr ? D3D_DRIVER_TYPE_UNKNOWN : isWarpPreferred ? D3D_DRIVER_TYPE_WARP : D3D_DRIVER_TYPE_HARDWARE,
+        nullptr, // leave as null if hardware is used
+        D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+        nullptr, // levels
+        0,
+        D3D11_SDK_VERSION,
+        &d3dDevice,
+        nullptr,
+        &d3dContext
+        );
+
+    // Fall back to WARP if there is no usable hardware device, e.g., in a
+    // VM or remote session without a GPU, or while the driver is updating.
+    DXAdapterInfo adapterInfo;
+    if (FAILED(hr) && m_options.allowWarpFallback && !isWarpPreferred)
+    {
+        wchar_t message[80];
+        swprintf_s(message, L"DXDevice: hardware device creation failed (0x%08X); using WARP.\n", static_cast<uint32_t>(hr));
+        OutputDebugStringW(message);
+
+        adapterInfo.isFallback = true;
+        adapterInfo.fallbackReason = hr;
+
+        hr = D3D11CreateDevice(
+            nullptr,
+            D3D_DRIVER_TYPE_WARP,
+            nullptr,
+            D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+            nullptr, // levels
+            0,
+            D3D11_SDK_VERSION,
+            &d3dDevice,
+            nullptr,
+            &d3dContext
+            );
+    }
+    HR(hr);
+
+    // If the device is shared across threads, serialize access to the
+    // immediate context. Direct2D also takes this lock internally.
+    if (m_options.multithreaded)
+    {
+        ComPtr<ID3D11Multithread> multithread;
+        HR(d3dContext.As(&multithread));
+        multithread->SetMultithreadProtected(TRUE);
+    }
+
+    // Get the D3D device as a DXGI device.
+    ComPtr<IDXGIDevice> dxgiDevice;
+    HR(d3dDevice->QueryInterface(dxgiDevice.GetAddressOf()));
+
+    // Record which adapter the device was actually created on.
+    ComPtr<IDXGIAdapter> dxgiAdapter;
+    HR(dxgiDevice->GetAdapter(&dxgiAdapter));
+    ComPtr<IDXGIAdapter1> dxgiAdapter1;
+    HR(dxgiAdapter.As(&dxgiAdapter1));
+    DXGI_ADAPTER_DESC1 adapterDesc;
+    HR(dxgiAdapter1->GetDesc1(&adapterDesc));
+
+    adapterInfo.description = adapterDesc.Description;
+    adapterInfo.luid = adapterDesc.AdapterLuid;
+    adapterInfo.vendorId = adapterDesc.VendorId;
+    adapterInfo.deviceId = adapterDesc.DeviceId;
+    adapterInfo.dedicatedVideoMemory = adapterDesc.DedicatedVideoMemory;
+    adapterInfo.isWarp = (adapterDesc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) != 0;
+
+    OutputDebugStringW((L"DXDevice: created device on " + adapterInfo.description + L"\n").c_str());
+
+    // Create the D2D device.
+    ComPtr<ID2D1Device6> d2dDevice;
+    HR(m_d2dFactory->CreateDevice(dxgiDevice.Get(), d2dDevice.GetAddressOf()));
+
+    // Initialize members.
+    m_d3dContext = std::move(d3dContext);
+    m_dxgiDevice = std::move(dxgiDevice);
+    m_d2dDevice = std::move(d2dDevice);
+    m_adapterInfo = std::move(adapterInfo);
+    m_generation.fetch_add(1, std::memory_order_release);
+
+    StartupTimeline::Mark(StartupMark::DeviceCreated);
+}
+
+#pragma endregion // DXDevice
+
+#pragma region DXWindowContext
+
+uint32_t DXWindowContext::m_forceDpi = 0;
+constexpr D2D_RECT_F DXWindowContext::OverlayRect;
+constexpr DWORD DXWindowContext::OcclusionPollMs;
+constexpr uint32_t DXWindowContext::VelocityWindowMs;
+constexpr float DXWindowContext::MaxPredictionMs;
+
+DXWindowContext::DXWindowContext(DXDevice* device, HWND hwnd, SwapChainOptions const& options) noexcept :
+    DXWindowContext{ device, options }
+{
+    AttachWindow(hwnd);
+}
+
+DXWindowContext::DXWindowContext(DXDevice* device, SwapChainOptions const& options) noexcept :
+    m_device{ device },
+    m_options{ options }
+{
+}
+
+void DXWindowContext::AttachWindow(HWND hwnd) noexcept
+{
+    m_hwnd = hwnd;
+    m_pixelSize = GetWindowSize(hwnd);
+    m_dpi = m_forceDpi ? m_forceDpi : GetDpiForWindow(hwnd);
+
+    SetWindowLongPtr(hwnd, GWLP_USERDATA, reinterpret_cast<UINT_PTR>(this));
+
+    // Wake the UI thread when asynchronously created text layouts are ready.
+    m_textLayoutCache.SetCompletionCallback([hwnd]() noexcept
+    {
+        RedrawWindow(hwnd, nullptr, nullptr, RDW_INTERNALPAINT);
+    });
+}
+
+D2D_SIZE_U DXWindowContext::GetWindowSize(HWND hwnd) noexcept
+{
+    RECT clientRect;
+    GetClientRect(hwnd, &clientRect);
+    return D2D_SIZE_U
+    {
+        std::max<uint32_t>(1, clientRect.right - clientRect.left),
+        std::max<uint32_t>(1, clientRect.bottom - clientRect.top)
+    };
+}
+
+void DXWindowContext::OnResize(HWND hwnd) noexcept
+{
+    auto context = GetThis(hwnd);
+    if (context != nullptr)
+    {
+        try
+        {
+            context->OnResizeInternal();
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+    }
+}
+
+void DXWindowContext::OnResizeInternal()
+{
+    // A minimized window has no client area, so keep the swap chain as it
+    // is and stop rendering until the window is restored.
+    if (IsIconic(m_hwnd))
+    {
+        m_isOccluded = true;
+        return;
+    }
+
+    // The next Present reports whether the restored window is covered.
+    if (m_isOccluded)
+    {
+        m_isOccluded = false;
+        m_isFullyDirty = true;
+    }
+
+    D2D_SIZE_U newSize = GetWindowSize(m_hwnd);
+    if (newSize.width != m_pixelSize.width || newSize.height != m_pixelSize.height)
+    {
+        m_pixelSize = newSize;
+
+        // Defer resizing the swap chain buffers until the next frame, so a
+        // storm of WM_SIZE messages results in at most one ResizeBuffers call.
+        m_isResizePending = true;
+        m_isFullyDirty = true;
+
+        // Call virtual method, so derived class can update its layout.
+        OnSizeChanged();
+    }
+}
+
+void DXWindowContext::OnDpiChanged(HWND hwnd, WPARAM wParam, LPARAM lParam) noexcept
+{
+    auto context = GetThis(hwnd);
+    if (context != nullptr)
+    {
+        try
+        {
+            // The horizontal DPI is in LOWORD(wParam).
+            // The vertical DPI is in HIWORD(wParam) but always equals the horizontal DPI.
+            // LPARAM points to a RECT with the new window bounds.
+            context->OnDpiChangedInternal(
+                m_forceDpi ? m_forceDpi : LOWORD(wParam),
+                *reinterpret_cast<RECT*>(lParam)
+            );
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+    }
+}
+
+void DXWindowContext::OnDpiChangedInternal(uint32_t newDpi, RECT newRect)
+{
+    if (newDpi != m_dpi)
+    {
+        // Save the new DPI.
+        m_dpi = newDpi;
+
+        // If the D2D context exists, set its DPI.
+        auto d2dContext = GetD2dContext();
+        if (d2dContext != nullptr)
+        {
+            d2dContext->SetDpi(static_cast<float>(newDpi), static_cast<float>(newDpi));
+        }
+
+        // Let DPI-dependent resources reset themselves. During background
+        // recovery, a worker is initializing them, so this waits until it
+        // is done.
+        if (m_recoveryState != nullptr)
+        {
+            m_recoveryState->isDpiChanged = true;
+        }
+        else
+        {
+            m_resourceList.OnDpiChanged();
+        }
+
+        // The window has probably moved to another monitor.
+        m_isColorCheckPending = m_options.advancedColor;
+
+        // Dirty rectangles are in pixels, so redraw everything at the new DPI.
+        m_isFullyDirty = true;
+
+        // Call virtual method, so derived class can update its layout.
+        OnDpiChanged();
+    }
+
+    // Set the new window bounds.
+    SetWindowPos(
+        m_hwnd,
+        nullptr,
+        newRect.left,
+        newRect.top,
+        newRect.right - newRect.left,
+        newRect.bottom - newRect.top,
+        SWP_NOZORDER | SWP_NOACTIVATE
+        );
+}
+
+void DXWindowContext::OnMove(HWND hwnd) noexcept
+{
+    auto context = GetThis(hwnd);
+    if (context != nullptr)
+    {
+        context->OnMoveInternal();
+    }
+}
+
+void DXWindowContext::OnMoveInternal() noexcept
+{
+    if (m_options.advancedColor && MonitorFromWindow(m_hwnd, MONITOR_DEFAULTTONEAREST) != m_monitor)
+    {
+        m_isColorCheckPending = true;
+        RequestFrame();
+    }
+}
+
+void DXWindowContext::OnDisplayChange(HWND hwnd) noexcept
+{
+    auto context = GetThis(hwnd);
+    if (context != nullptr)
+    {
+        context->OnDisplayChangeInternal();
+    }
+}
+
+void DXWindowContext::OnDisplayChangeInternal() noexcept
+{
+    // HDR may have been turned on or off for the monitor.
+    if (m_options.advancedColor)
+    {
+        m_isColorCheckPending = true;
+        RequestFrame();
+    }
+}
+
+void DXWindowContext::OnPaint(HWND hwnd) noexcept
+{
+    auto context = GetThis(hwnd);
+    if (context != nullptr)
+    {
+        try
+        {
+            context->OnPaintInternal();
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+    }
+    else
+    {
+        DefWindowProc(hwnd, WM_PAINT, 0, 0);
+    }
+}
+
+void DXWindowContext::OnPaintInternal()
+{
+    PAINTSTRUCT ps;
+    BeginPaint(m_hwnd, &ps);
+
+    // Include the region invalidated by the system, if any.
+    AddDirtyRect(ps.rcPaint);
+
+    // In continuous mode, the message loop renders the next frame.
+    // Part of an occluded window may have become visible, so let
+    // the next Present check again.
+    if (m_renderMode == RenderMode::OnDemand)
+    {
+        Paint();
+    }
+    else if (m_isOccluded && !IsIconic(m_hwnd))
+    {
+        m_isOccluded = false;
+        m_isFullyDirty = true;
+    }
+
+    EndPaint(m_hwnd, &ps);
+}
+
+bool DXWindowContext::QueueInput(UINT message, WPARAM wParam, LPARAM lParam)
+{
+    InputEvent event = {};
+    event.time = static_cast<uint32_t>(GetMessageTime());
+
+    switch (message)
+    {
+    case WM_KEYDOWN:
+    case WM_SYSKEYDOWN:
+    case WM_KEYUP:
+    case WM_SYSKEYUP:
+    case WM_CHAR:
+        event.type = message == WM_CHAR ? InputEventType::Char :
+            message == WM_KEYDOWN || message == WM_SYSKEYDOWN ? InputEventType::KeyDown :
+            InputEventType::KeyUp;
+        event.key = static_cast<uint32_t>(wParam);
+        event.flags = HIWORD(lParam);
+        m_inputQueue.push_back(event);
+        RequestFrame();
+
+        // Let DefWindowProc handle system keys, e.g., Alt+F4 and menus.
+        return message != WM_SYSKEYDOWN && message != WM_SYSKEYUP;
+
+    case WM_MOUSEMOVE:
+        event.type = InputEventType::MouseMove;
+        m_lastMovePoint = POINT{ GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+        m_lastMoveTime = event.time;
+        m_hasMouseMoved = true;
+        break;
+
+    case WM_POINTERUPDATE:
+        // The history must be retrieved while the message is processed.
+        // DefWindowProc still generates mouse messages for the pointer.
+        if (m_isInputStateEnabled)
+        {
+            AppendPointerHistory(GET_POINTERID_WPARAM(wParam));
+        }
+        return false;
+
+    case WM_LBUTTONDOWN:
+    case WM_LBUTTONDBLCLK:
+        event.type = InputEventType::MouseDown;
+        event.key = VK_LBUTTON;
+        break;
+    case WM_RBUTTONDOWN:
+    case WM_RBUTTONDBLCLK:
+        event.type = InputEventType::MouseDown;
+        event.key = VK_RBUTTON;
+        break;
+    case WM_MBUTTONDOWN:
+    case WM_MBUTTONDBLCLK:
+        event.type = InputEventType::MouseDown;
+        event.key = VK_MBUTTON;
+        break;
+    case WM_XBUTTONDOWN:
+    case WM_XBUTTONDBLCLK:
+        event.type = InputEventType::MouseDown;
+        event.key = GET_XBUTTON_WPARAM(wParam) == XBUTTON1 ? VK_XBUTTON1 : VK_XBUTTON2;
+        break;
+
+    case WM_LBUTTONUP:
+        event.type = InputEventType::MouseUp;
+        event.key = VK_LBUTTON;
+        break;
+    case WM_RBUTTONUP:
+        event.type = InputEventType::MouseUp;
+        event.key = VK_RBUTTON;
+        break;
+    case WM_MBUTTONUP:
+        event.type = InputEventType::MouseUp;
+        event.key = VK_MBUTTON;
+        break;
+    case WM_XBUTTONUP:
+        event.type = InputEventType::MouseUp;
+        event.key = GET_XBUTTON_WPARAM(wParam) == XBUTTON1 ? VK_XBUTTON1 : VK_XBUTTON2;
+        break;
+
+    case WM_MOUSEWHEEL:
+    case WM_MOUSEHWHEEL:
+        event.type = message == WM_MOUSEWHEEL ? InputEventType::MouseWheel : InputEventType::MouseHWheel;
+        event.wheelDelta = GET_WHEEL_DELTA_WPARAM(wParam);
+        break;
+
+    default:
+        return false;
+    }
+
+    // Mouse positions are in client pixels, except for the wheel messages,
+    // which use screen coordinates.
+    POINT point{ GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+    if (message == WM_MOUSEWHEEL || message == WM_MOUSEHWHEEL)
+    {
+        ScreenToClient(m_hwnd, &point);
+    }
+    event.flags = GET_KEYSTATE_WPARAM(wParam);
+
+    float const dipsPerPixel = 96.0f / m_dpi;
+    event.position = D2D_POINT_2F{ point.x * dipsPerPixel, point.y * dipsPerPixel };
+
+    // Coalesce consecutive mouse moves, whose intermediate positions are
+    // retrieved from the mouse history when needed.
+    if (event.type == InputEventType::MouseMove &&
+        !m_inputQueue.empty() &&
+        m_inputQueue.back().type == InputEventType::MouseMove)
+    {
+        m_inputQueue.back() = event;
+        return true;
+    }
+
+    m_inputQueue.push_back(event);
+    RequestFrame();
+    return true;
+}
+
+void DXWindowContext::UpdateInputState()
+{
+    auto& state = m_inputState;
+    state.wheelDelta = 0;
+    state.hWheelDelta = 0;
+    state.history.clear();
+
+    for (auto const& event : m_processedInput)
+    {
+        switch (event.type)
+        {
+        case InputEventType::KeyDown:
+        case InputEventType::KeyUp:
+        case InputEventType::Char:
+            continue;
+        case InputEventType::MouseWheel:
+            state.wheelDelta += event.wheelDelta;
+            break;
+        case InputEventType::MouseHWheel:
+            state.hWheelDelta += event.wheelDelta;
+            break;
+        default:
+            break;
+        }
+
+        state.position = event.position;
+        state.mouseFlags = event.flags;
+    }
+
+    // Pen and touch history is gathered per message; otherwise, get the
+    // mouse history that ends at the last move.
+    if (!m_pointerHistory.empty())
+    {
+        std::swap(state.history, m_pointerHistory);
+        m_pointerHistory.clear();
+    }
+    else if (m_hasMouseMoved)
+    {
+        AppendMouseHistory();
+    }
+    m_hasMouseMoved = false;
+
+    state.predictedPosition = state.position;
+    if (m_isPredictionEnabled)
+    {
+        PredictInputPosition();
+    }
+}
+
+void DXWindowContext::AppendMouseHistory()
+{
+    float const dipsPerPixel = 96.0f / m_dpi;
+
+    // The query is the last move in screen coordinates, truncated to 16
+    // bits, as the mouse history stores them.
+    POINT point = m_lastMovePoint;
+    ClientToScreen(m_hwnd, &point);
+
+    MOUSEMOVEPOINT query = {};
+    query.x = point.x & 0xFFFF;
+    query.y = point.y & 0xFFFF;
+    query.time = m_lastMoveTime;
+
+    MOUSEMOVEPOINT points[64];
+    int count = GetMouseMovePointsEx(sizeof(MOUSEMOVEPOINT), &query, points, ARRAYSIZE(points), GMMP_USE_DISPLAY_POINTS);
+
+    // Points are returned newest first. Keep those since the last frame,
+    // or just the last move if the history isn't available.
+    int newCount = 0;
+    while (newCount < count && static_cast<int32_t>(points[newCount].time - m_lastHistoryTime) > 0)
+    {
+        newCount++;
+    }
+
+    if (newCount == 0)
+    {
+        m_inputState.history.push_back(InputPoint{ m_inputState.position, m_lastMoveTime });
+    }
+
+    for (int i = newCount - 1; i >= 0; i--)
+    {
+        // Coordinates on monitors left of or above the primary are negative.
+        POINT historyPoint{
+            points[i].x > 32767 ? points[i].x - 65536 : points[i].x,
+            points[i].y > 32767 ? points[i].y - 65536 : points[i].y
+        };
+        ScreenToClient(m_hwnd, &historyPoint);
+
+        m_inputState.history.push_back(InputPoint{
+            D2D_POINT_2F{ historyPoint.x * dipsPerPixel, historyPoint.y * dipsPerPixel },
+            points[i].time
+        });
+    }
+
+    m_lastHistoryTime = m_lastMoveTime;
+}
+
+void DXWindowContext::AppendPointerHistory(uint32_t pointerId)
+{
+    UINT32 count = 0;
+    if (!GetPointerInfoHistory(pointerId, &count, nullptr) || count == 0)
+    {
+        return;
+    }
+
+    m_pointerInfos.resize(count);
+    if (!GetPointerInfoHistory(pointerId, &count, m_pointerInfos.data()))
+    {
+        return;
+    }
+
+    // Entries are newest first, and times may be zero if the device
+    // doesn't provide them.
+    float const dipsPerPixel = 96.0f / m_dpi;
+    uint32_t const messageTime = static_cast<uint32_t>(GetMessageTime());
+
+    for (UINT32 i = count; i-- > 0;)
+    {
+        POINT point = m_pointerInfos[i].ptPixelLocation;
+        ScreenToClient(m_hwnd, &point);
+
+        m_pointerHistory.push_back(InputPoint{
+            D2D_POINT_2F{ point.x * dipsPerPixel, point.y * dipsPerPixel },
+            m_pointerInfos[i].dwTime != 0 ? m_pointerInfos[i].dwTime : messageTime
+        });
+    }
+}
+
+void DXWindowContext::PredictInputPosition() noexcept
+{
+    auto& state = m_inputState;
+    if (state.history.size() < 2)
+    {
+        return;
+    }
+
+    // Get the velocity over the most recent points.
+    auto const& last = state.history.back();
+    size_t first = state.history.size() - 1;
+    while (first > 0 && last.time - state.history[first - 1].time <= VelocityWindowMs)
+    {
+        first--;
+    }
+
+    auto const& start = state.history[first];
+    uint32_t const elapsedMs = last.time - start.time;
+    if (elapsedMs == 0)
+    {
+        return;
+    }
+
+    // Extrapolate from the last point to the next vsync, which is when the
+    // frame can be displayed at the earliest.
+    float const ageMs = static_cast<float>(GetTickCount() - last.time);
+    float const horizonMs = std::min(ageMs + GetTimeToNextVBlankMs(), MaxPredictionMs);
+
+    float const scale = horizonMs / elapsedMs;
+    state.predictedPosition = D2D_POINT_2F{
+        last.position.x + (last.position.x - start.position.x) * scale,
+        last.position.y + (last.position.y - start.position.y) * scale
+    };
+}
+
+float DXWindowContext::GetTimeToNextVBlankMs() noexcept
+{
+    DWM_TIMING_INFO timingInfo = {};
+    timingInfo.cbSize = sizeof(timingInfo);
+    if (FAILED(DwmGetCompositionTimingInfo(nullptr, &timingInfo)) || timingInfo.qpcRefreshPeriod == 0)
+    {
+        return 0;
+    }
+
+    int64_t const now = FrameProfiler::GetQpcTime();
+    int64_t const period = static_cast<int64_t>(timingInfo.qpcRefreshPeriod);
+    int64_t const lastVBlank = static_cast<int64_t>(timingInfo.qpcVBlank);
+    int64_t const sinceVBlank = ((now - lastVBlank) % period + period) % period;
+
+    return FrameProfiler::QpcToMs(period - sinceVBlank);
+}
+
+void DXWindowContext::Paint()
+{
+    // Process the input received since the last frame, e.g., so the frame
+    // reflects all the mouse moves in one update.
+    if (!m_inputQueue.empty() || m_isInputStateEnabled)
+    {
+        std::swap(m_inputQueue, m_processedInput);
+        if (m_isInputStateEnabled)
+        {
+            UpdateInputState();
+        }
+        if (!m_processedInput.empty())
+        {
+            ProcessInput(m_processedInput);
+        }
+        m_processedInput.clear();
+    }
+
+    // If the device is still being created in the background, don't block
+    // the UI thread; the window is repainted when the device is ready.
+    if (m_d2dContext == nullptr && m_device->RepaintWhenInitialized(m_hwnd))
+    {
+        return;
+    }
+
+    try
+    {
+        if (m_recoveryState != nullptr)
+        {
+            // Leave the last frame on screen until the worker is done.
+            if (!m_recoveryState->isComplete.load(std::memory_order_acquire))
+            {
+                return;
+            }
+            EndBackgroundRecovery();
+        }
+
+        PaintInternal();
+    }
+    catch (DeviceLostException&)
+    {
+        if (m_recoveryMode == DeviceRecoveryMode::Background && m_device->IsMultithreaded())
+        {
+            BeginBackgroundRecovery();
+            return;
+        }
+
+        ResetDevice();
+        PaintInternal();
+    }
+}
+
+void DXWindowContext::BeginBackgroundRecovery()
+{
+    // Release the device-dependent resources, but keep the swap chain so
+    // its last frame stays on screen. A window can't have two flip-model
+    // swap chains, so the new one is created on the UI thread after the
+    // worker finishes.
+    ResetDeviceResources();
+    m_profiler.Reset();
+
+    auto state = std::make_shared<RecoveryState>();
+    state->completedEvent.Reset(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (state->completedEvent.Get() == nullptr)
+    {
+        ThrowLastError();
+    }
+
+    // The state holds a reference to this object so it stays alive until
+    // the worker is done with the resource list, and is released on the UI
+    // thread. The worker initializes a copy of the list so resources can
+    // still be added on the UI thread.
+    state->owner = this;
+    ComPtr<DXDevice> device{ m_device };
+    ResourceList2D resources = m_resourceList;
+    float dpi = static_cast<float>(m_dpi);
+    D2D1_BUFFER_PRECISION bufferPrecision = GetBufferPrecision();
+    HWND hwnd = m_hwnd;
+
+    std::thread([device, resources, dpi, bufferPrecision, hwnd, state]() mutable noexcept
+    {
+        try
+        {
+            auto objects = device->Acquire();
+            resources.InitializeAllInParallel(objects.d2dDevice.Get(), dpi, bufferPrecision);
+        }
+        catch (...)
+        {
+            state->error = std::current_exception();
+        }
+
+        // Wake the UI thread to present the first frame on the new device.
+        state->isComplete.store(true, std::memory_order_release);
+        SetEvent(state->completedEvent.Get());
+        InvalidateRect(hwnd, nullptr, FALSE);
+    }).detach();
+
+    m_recoveryState = std::move(state);
+}
+
+void DXWindowContext::EndBackgroundRecovery()
+{
+    // The window still holds a reference, so releasing the owner reference
+    // at the end of this method doesn't delete this object.
+    auto state = std::move(m_recoveryState);
+    auto owner = std::move(state->owner);
+
+    // Now replace the old swap chain. The next EnsureInitialized creates a
+    // new one and finds the resources already initialized, except those
+    // reset by a DPI change during recovery.
+    ResetWindow();
+    m_resourceList.Invalidate();
+    if (state->isDpiChanged)
+    {
+        m_resourceList.OnDpiChanged();
+    }
+
+    // If the device was lost again, this is handled as usual by Paint.
+    if (state->error != nullptr)
+    {
+        std::rethrow_exception(state->error);
+    }
+}
+
+void DXWindowContext::OnNcDestroyInternal() noexcept
+{
+    // Wait for background recovery, so the window context isn't destroyed
+    // while the worker uses its resources, and release the reference the
+    // recovery holds.
+    if (m_recoveryState != nullptr)
+    {
+        WaitForSingleObject(m_recoveryState->completedEvent.Get(), INFINITE);
+        auto owner = std::move(m_recoveryState->owner);
+        m_recoveryState = nullptr;
+    }
+}
+
+void DXWindowContext::PaintInternal()
+{
+    // A captured frame is timed even if frame timing isn't enabled.
+    bool const isCapturing = !m_capturePath.empty();
+    bool const isTimed = m_isFrameTimingEnabled || isCapturing;
+
+    if (isTimed)
+    {
+        m_profiler.BeginFrame();
+    }
+
+    // Ensure device-dependent resources are initialized.
+    EnsureInitialized();
+
+    // Don't render while the window isn't visible.
+    if (m_isOccluded && CheckStillOccluded())
+    {
+        return;
+    }
+
+    // Add text layouts completed by worker threads to the cache.
+    if (m_textLayoutCache.ProcessCompletedLayouts() != 0)
+    {
+        OnTextLayoutsReady();
+    }
+
+    // Let the derived class update content and the dirty region.
+    OnBeginFrame();
+
+    // The overlay changes every frame.
+    if (m_isOverlayVisible)
+    {
+        AddDirtyRect(DipsToPixels(OverlayRect));
+    }
+
+    // Without partial presentation, every frame redraws the whole window.
+    bool isPartial = m_isPartialPresentation && !m_isFullyDirty && !isCapturing;
+
+    if (isPartial && m_dirtyRects.empty() && !m_hasScrollRect)
+    {
+        // Nothing has changed. In continuous mode, still present a frame to
+        // keep the frame latency waitable signaled. The back buffer of a
+        // flip-sequential swap chain already matches the previous frame, so
+        // presenting a single unchanged pixel is enough.
+        if (m_renderMode == RenderMode::Continuous)
+        {
+            RECT unchangedRect = { 0, 0, 1, 1 };
+            DXGI_PRESENT_PARAMETERS params = { 1, &unchangedRect, nullptr, nullptr };
+            Present(&params);
+            m_lastFrameTime = GetTickCount64();
+        }
+        m_frameArena.Reset();
+        return;
+    }
+
+    if (isTimed)
+    {
+        m_profiler.EndPhase(FramePhase::EnsureInitialized);
+        m_profiler.BeginGpuWork(m_d3dContext.Get());
+    }
+
+    // In parallel render mode, record the regions before drawing.
+    bool const isParallel = m_parallelRegionCount != 0 && m_device->IsMultithreaded();
+    if (m_parallelRegionCount != 0)
+    {
+        m_renderRegions.clear();
+        GetRenderRegions(m_parallelRegionCount, m_renderRegions);
+        if (isParallel)
+        {
+            RecordRegions();
+        }
+    }
+
+    // Begin drawing. A captured frame is recorded into a command list, and
+    // then drawn to the back buffer. The transform is set again so that the
+    // command list records it.
+    auto context = GetD2dContext();
+    ComPtr<ID2D1CommandList> captureList;
+    ComPtr<ID2D1Image> captureTarget;
+    D2D1_MATRIX_3X2_F captureTransform;
+
+    // Restores the back buffer as the target if drawing throws while the
+    // target is the command list, so later frames don't draw into it.
+    struct TargetRestorer
+    {
+        ID2D1DeviceContext6* context;
+        ID2D1Image* target;
+
+        ~TargetRestorer()
+        {
+            if (target != nullptr)
+            {
+                context->SetTarget(target);
+            }
+        }
+    };
+    TargetRestorer targetRestorer{ context, nullptr };
+
+    if (isCapturing)
+    {
+        HR(context->CreateCommandList(&captureList));
+        context->GetTarget(&captureTarget);
+        context->SetTarget(captureList.Get());
+        targetRestorer.target = captureTarget.Get();
+        context->GetTransform(&captureTransform);
+    }
+
+    context->BeginDraw();
+
+    if (isCapturing)
+    {
+        context->SetTransform(captureTransform);
+    }
+
+    if (isPartial)
+    {
+        // Clip to the bounding rectangle of the dirty region.
+        RECT bounds = m_dirtyRects.empty() ? RECT{} : m_dirtyRects.front();
+        for (auto& rect : m_dirtyRects)
+        {
+            UnionRect(&bounds, &bounds, &rect);
+        }
+
+        float const dipsPerPixel = 96.0f / m_dpi;
+        D2D1_MATRIX_3X2_F transform;
+        context->GetTransform(&transform);
+        context->SetTransform(D2D1::Matrix3x2F::Identity());
+        context->PushAxisAlignedClip(
+            D2D_RECT_F{
+                bounds.left * dipsPerPixel,
+                bounds.top * dipsPerPixel,
+                bounds.right * dipsPerPixel,
+                bounds.bottom * dipsPerPixel
+            },
+            D2D1_ANTIALIAS_MODE_ALIASED
+        );
+        context->SetTransform(transform);
+    }
+
+    // Call derived class method to render the window content.
+    if (isParallel)
+    {
+        DrawRegions(context);
+    }
+    else if (m_parallelRegionCount != 0)
+    {
+        for (uint32_t i = 0; i < m_renderRegions.size(); i++)
+        {
+            context->PushAxisAlignedClip(m_renderRegions[i], D2D1_ANTIALIAS_MODE_ALIASED);
+            RenderRegion(context, i, m_renderRegions[i]);
+            context->PopAxisAlignedClip();
+        }
+    }
+    else
+    {
+        RenderContent();
+    }
+
+    if (m_isOverlayVisible)
+    {
+        DrawFrameTimingOverlay();
+    }
+
+    if (isPartial)
+    {
+        context->PopAxisAlignedClip();
+    }
+
+    if (isCapturing)
+    {
+        HRESULT const hr = context->EndDraw();
+        context->SetTarget(captureTarget.Get());
+        targetRestorer.target = nullptr;
+        HR(hr);
+        HR(captureList->Close());
+
+        context->SetTransform(D2D1::Matrix3x2F::Identity());
+        context->BeginDraw();
+        context->Clear(D2D1_COLOR_F{});
+        context->DrawImage(captureList.Get());
+        context->SetTransform(captureTransform);
+    }
+
+    if (isTimed)
+    {
+        m_profiler.EndPhase(FramePhase::RenderContent);
+    }
+
+    // End drawing and present.
+    HR(context->EndDraw());
+
+    if (isTimed)
+    {
+        m_profiler.EndPhase(FramePhase::EndDraw);
+    }
+
+    if (isPartial)
+    {
+        DXGI_PRESENT_PARAMETERS params = {};
+        params.DirtyRectsCount = static_cast<UINT>(m_dirtyRects.size());
+        params.pDirtyRects = m_dirtyRects.data();
+        if (m_hasScrollRect)
+        {
+            params.pScrollRect = &m_scrollRect;
+            params.pScrollOffset = &m_scrollOffset;
+        }
+        Present(&params);
+    }
+    else
+    {
+        Present(nullptr);
+    }
+
+    if (isTimed)
+    {
+        m_profiler.EndPhase(FramePhase::Present);
+        m_profiler.EndFrame(m_d3dContext.Get(), m_swapChain.Get());
+    }
+
+    if (isCapturing)
+    {
+        SaveCapture(captureList.Get(), m_profiler.GetCurrentFrame());
+
+        // Don't keep GPU queries of the captured frame pending if frame
+        // timing isn't enabled.
+        if (!m_isFrameTimingEnabled)
+        {
+            m_profiler.Reset();
+        }
+    }
+
+    if (!m_hasPresented)
+    {
+        m_hasPresented = true;
+        StartupTimeline::Mark(StartupMark::FirstFramePresented);
+    }
+
+    ClearDirtyRects();
+    m_frameArena.Reset();
+    m_lastFrameTime = GetTickCount64();
+}
+
+void DXWindowContext::SaveCapture(ID2D1CommandList* commandList, FrameTiming const& timing) noexcept
+{
+    std::wstring const path = std::move(m_capturePath);
+    m_capturePath.clear();
+
+    try
+    {
+        FrameCaptureInfo info;
+        info.pixelWidth = GetPixelWidth();
+        info.pixelHeight = GetPixelHeight();
+        info.dpi = m_dpi;
+        info.bufferPrecision = GetBufferPrecision();
+        info.resourceCount = static_cast<uint32_t>(m_resourceList.GetCount());
+        info.timing = timing;
+        info.recentTimings.resize(FrameTimingLog::Capacity);
+        info.recentTimings.resize(GetFrameTimingLog().GetRecent(info.recentTimings.data(), FrameTimingLog::Capacity));
+
+        FrameCapture::Save(path.c_str(), GetD2dContext(), commandList, info);
+    }
+    catch (WinException& e)
+    {
+        wchar_t message[80];
+        swprintf_s(message, L"DXWindowContext: frame capture failed (0x%08X).\n", static_cast<uint32_t>(e.GetError()));
+        OutputDebugStringW(message);
+    }
+    catch (std::bad_alloc&)
+    {
+    }
+}
+
+void DXWindowContext::GetRenderRegions(uint32_t regionCount, std::vector<D2D_RECT_F>& regions)
+{
+    float const dipsPerPixel = 96.0f / m_dpi;
+    float const width = GetWidthDips();
+    uint32_t const height = GetPixelHeight();
+
+    for (uint32_t i = 0; i < regionCount; i++)
+    {
+        regions.push_back(D2D_RECT_F{
+            0,
+            (height * i / regionCount) * dipsPerPixel,
+            width,
+            (height * (i + 1) / regionCount) * dipsPerPixel
+        });
+    }
+}
+
+void DXWindowContext::RecordRegions()
+{
+    uint32_t const regionCount = static_cast<uint32_t>(m_renderRegions.size());
+
+    // Create the region contexts from the window's device on first use.
+    if (m_regionContexts.size() < regionCount)
+    {
+        ComPtr<ID2D1Device> device;
+        m_d2dContext->GetDevice(&device);
+
+        ComPtr<ID2D1Device6> device6;
+        HR(device.As(&device6));
+
+        while (m_regionContexts.size() < regionCount)
+        {
+            ComPtr<ID2D1DeviceContext6> regionContext;
+            HR(device6->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &regionContext));
+            m_regionContexts.push_back(std::move(regionContext));
+        }
+    }
+    m_regionLists.resize(regionCount);
+
+    // Recording takes the factory lock only for some calls, e.g., to create
+    // resources, so most of the work runs concurrently.
+    float const dpi = static_cast<float>(m_dpi);
+    WorkerPool::GetDefault().ParallelFor(regionCount, [this, dpi](uint32_t index)
+    {
+        auto regionContext = m_regionContexts[index].Get();
+        regionContext->SetDpi(dpi, dpi);
+        SetBufferPrecision(regionContext);
+
+        ComPtr<ID2D1CommandList> commandList;
+        HR(regionContext->CreateCommandList(&commandList));
+
+        regionContext->SetTarget(commandList.Get());
+        regionContext->BeginDraw();
+        regionContext->PushAxisAlignedClip(m_renderRegions[index], D2D1_ANTIALIAS_MODE_ALIASED);
+
+        // End drawing even if RenderRegion throws, so the context can be
+        // used for the next frame.
+        try
+        {
+            RenderRegion(regionContext, index, m_renderRegions[index]);
+        }
+        catch (...)
+        {
+            regionContext->PopAxisAlignedClip();
+            regionContext->EndDraw();
+            regionContext->SetTarget(nullptr);
+            throw;
+        }
+
+        regionContext->PopAxisAlignedClip();
+        HRESULT hr = regionContext->EndDraw();
+        regionContext->SetTarget(nullptr);
+        HR(hr);
+
+        HR(commandList->Close());
+        m_regionLists[index] = std::move(commandList);
+    });
+}
+
+void DXWindowContext::DrawRegions(ID2D1DeviceContext6* context)
+{
+    // Each frame records new command lists, so release them once drawn.
+    for (auto& commandList : m_regionLists)
+    {
+        context->DrawImage(commandList.Get());
+        commandList.Reset();
+    }
+}
+
+bool DXWindowContext::CheckStillOccluded()
+{
+    if (!IsIconic(m_hwnd))
+    {
+        // Ask DXGI whether a frame would be visible, without presenting it.
+        HRESULT const hr = m_swapChain->Present(0, DXGI_PRESENT_TEST);
+        HR(hr);
+
+        if (hr != DXGI_STATUS_OCCLUDED)
+        {
+            // Render a single frame of the current content.
+            m_isOccluded = false;
+            m_isFullyDirty = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void DXWindowContext::EnableFrameTiming(bool enable) noexcept
+{
+    if (!enable)
+    {
+        m_profiler.Reset();
+        m_isOverlayVisible = false;
+    }
+    m_isFrameTimingEnabled = enable;
+}
+
+void DXWindowContext::ShowFrameTimingOverlay(bool show)
+{
+    if (show)
+    {
+        if (!m_areOverlayResourcesAdded)
+        {
+            m_resourceList.Add(&m_overlayTextBrush);
+            m_resourceList.Add(&m_overlayBackgroundBrush);
+            m_areOverlayResourcesAdded = true;
+        }
+        EnableFrameTiming(true);
+    }
+
+    m_isOverlayVisible = show;
+    Invalidate(OverlayRect);
+}
+
+void DXWindowContext::DrawFrameTimingOverlay()
+{
+    if (m_overlayTextFormat == nullptr)
+    {
+        HR(GetDWriteFactory()->CreateTextFormat(
+            L"Consolas",
+            nullptr,
+            DWRITE_FONT_WEIGHT_NORMAL,
+            DWRITE_FONT_STYLE_NORMAL,
+            DWRITE_FONT_STRETCH_NORMAL,
+            12.0f,
+            L"en-us",
+            &m_overlayTextFormat
+        ));
+        HR(m_overlayTextFormat->SetWordWrapping(DWRITE_WORD_WRAPPING_NO_WRAP));
+        HR(m_overlayTextFormat->SetParagraphAlignment(DWRITE_PARAGRAPH_ALIGNMENT_CENTER));
+    }
+
+    // Summarize the most recent published frames.
+    constexpr uint32_t maxFrames = 60;
+    FrameTiming timings[maxFrames];
+    uint32_t const frameCount = GetFrameTimingLog().GetRecent(timings, maxFrames);
+
+    float cpuTotal = 0, cpuMax = 0, gpuTotal = 0, latencyTotal = 0;
+    uint32_t gpuCount = 0, latencyCount = 0, missedVsyncs = 0;
+    for (uint32_t i = 0; i < frameCount; i++)
+    {
+        float const cpuMs = timings[i].GetTotalCpuMs();
+        cpuTotal += cpuMs;
+        cpuMax = std::max(cpuMax, cpuMs);
+
+        if (timings[i].gpuMs >= 0)
+        {
+            gpuTotal += timings[i].gpuMs;
+            gpuCount++;
+        }
+
+        if (timings[i].presentToDisplayMs >= 0)
+        {
+            latencyTotal += timings[i].presentToDisplayMs;
+            latencyCount++;
+        }
+
+        missedVsyncs += timings[i].missedVsyncs;
+    }
+
+    wchar_t text[128];
+    int const textLength = swprintf_s(
+        text,
+        L" CPU %.2f ms (max %.2f)  GPU %.2f ms  Display %.1f ms  Missed %u",
+        frameCount ? cpuTotal / frameCount : 0.0f,
+        cpuMax,
+        gpuCount ? gpuTotal / gpuCount : 0.0f,
+        latencyCount ? latencyTotal / latencyCount : 0.0f,
+        missedVsyncs
+    );
+
+    // Draw in DIPs, ignoring any transform set by the derived class.
+    auto context = GetD2dContext();
+    D2D1_MATRIX_3X2_F transform;
+    context->GetTransform(&transform);
+    context->SetTransform(D2D1::Matrix3x2F::Identity());
+
+    context->FillRectangle(OverlayRect, m_overlayBackgroundBrush.Get());
+    context->DrawText(
+        text,
+        static_cast<UINT32>(std::max(textLength, 0)),
+        m_overlayTextFormat.Get(),
+        OverlayRect,
+        m_overlayTextBrush.Get()
+    );
+
+    context->SetTransform(transform);
+}
+
+void DXWindowContext::Present(DXGI_PRESENT_PARAMETERS const* params)
+{
+    // Continuous frames are paced by vertical sync unless tearing is
+    // enabled, in which case they are paced by the frame latency waitable.
+    UINT syncInterval = 0;
+    UINT flags = 0;
+    if (m_renderMode == RenderMode::Continuous)
+    {
+        if (m_isTearingSupported)
+        {
+            flags = DXGI_PRESENT_ALLOW_TEARING;
+        }
+        else
+        {
+            syncInterval = 1;
+        }
+    }
+
+    // Present is made outside the device API lock so that a window waiting
+    // for vertical sync doesn't stall Direct2D work on other threads. The
+    // immediate context it flushes is protected by the D3D multithread lock.
+    HRESULT const hr = params != nullptr ?
+        m_swapChain->Present1(syncInterval, flags, params) :
+        m_swapChain->Present(syncInterval, flags);
+    HR(hr);
+
+    // The frame isn't visible, so stop rendering until it would be.
+    if (hr == DXGI_STATUS_OCCLUDED)
+    {
+        m_isOccluded = true;
+    }
+}
+
+RECT DXWindowContext::DipsToPixels(D2D_RECT_F const& rect) const noexcept
+{
+    float const pixelsPerDip = m_dpi / 96.0f;
+    auto toPixels = [](float value, uint32_t limit) noexcept
+    {
+        return static_cast<LONG>(std::min(std::max(value, 0.0f), static_cast<float>(limit)));
+    };
+
+    return RECT{
+        toPixels(floorf(rect.left * pixelsPerDip), m_pixelSize.width),
+        toPixels(floorf(rect.top * pixelsPerDip), m_pixelSize.height),
+        toPixels(ceilf(rect.right * pixelsPerDip), m_pixelSize.width),
+        toPixels(ceilf(rect.bottom * pixelsPerDip), m_pixelSize.height)
+    };
+}
+
+void DXWindowContext::AddDirtyRect(RECT const& rect)
+{
+    if (m_isFullyDirty || IsRectEmpty(&rect))
+    {
+        return;
+    }
+
+    // Clamp to the client area.
+    RECT clientRect = { 0, 0, static_cast<LONG>(m_pixelSize.width), static_cast<LONG>(m_pixelSize.height) };
+    RECT dirtyRect;
+    if (IntersectRect(&dirtyRect, &rect, &clientRect))
+    {
+        m_dirtyRects.push_back(dirtyRect);
+    }
+}
+
+void DXWindowContext::ClearDirtyRects() noexcept
+{
+    m_dirtyRects.clear();
+    m_hasScrollRect = false;
+    m_isFullyDirty = false;
+}
+
+void DXWindowContext::Invalidate(D2D_RECT_F const& rect)
+{
+    if (!m_isPartialPresentation)
+    {
+        m_isFullyDirty = true;
+    }
+    AddDirtyRect(DipsToPixels(rect));
+    RequestFrame();
+}
+
+void DXWindowContext::InvalidateAll()
+{
+    m_isFullyDirty = true;
+    RequestFrame();
+}
+
+void DXWindowContext::CaptureNextFrame(std::wstring path)
+{
+    m_capturePath = std::move(path);
+    InvalidateAll();
+}
+
+void DXWindowContext::Scroll(D2D_RECT_F const& rect, D2D_POINT_2F offset)
+{
+    RECT scrollRect = DipsToPixels(rect);
+    float const pixelsPerDip = m_dpi / 96.0f;
+    POINT scrollOffset = {
+        static_cast<LONG>(roundf(offset.x * pixelsPerDip)),
+        static_cast<LONG>(roundf(offset.y * pixelsPerDip))
+    };
+
+    // Only one scroll rectangle can be presented per frame. In any other
+    // case, just redraw the whole rectangle.
+    LONG const width = scrollRect.right - scrollRect.left;
+    LONG const height = scrollRect.bottom - scrollRect.top;
+    if (!m_isPartialPresentation || m_isFullyDirty || m_hasScrollRect ||
+        abs(scrollOffset.x) >= width || abs(scrollOffset.y) >= height)
+    {
+        Invalidate(rect);
+        return;
+    }
+
+    m_scrollRect = scrollRect;
+    m_scrollOffset = scrollOffset;
+    m_hasScrollRect = true;
+
+    // Mark the exposed areas, whose source is outside the scroll rectangle.
+    if (scrollOffset.y > 0)
+    {
+        AddDirtyRect(RECT{ scrollRect.left, scrollRect.top, scrollRect.right, scrollRect.top + scrollOffset.y });
+    }
+    else if (scrollOffset.y < 0)
+    {
+        AddDirtyRect(RECT{ scrollRect.left, scrollRect.bottom + scrollOffset.y, scrollRect.right, scrollRect.bottom });
+    }
+
+    if (scrollOffset.x > 0)
+    {
+        AddDirtyRect(RECT{ scrollRect.left, scrollRect.top, scrollRect.left + scrollOffset.x, scrollRect.bottom });
+    }
+    else if (scrollOffset.x < 0)
+    {
+        AddDirtyRect(RECT{ scrollRect.right + scrollOffset.x, scrollRect.top, scrollRect.right, scrollRect.bottom });
+    }
+
+    RequestFrame();
+}
+
+void DXWindowContext::RequestFrame() noexcept
+{
+    // In continuous mode, the message loop renders the next frame anyway.
+    // Otherwise, request a WM_PAINT without adding to the update region.
+    if (m_renderMode == RenderMode::OnDemand)
+    {
+        RedrawWindow(m_hwnd, nullptr, nullptr, RDW_INTERNALPAINT);
+    }
+}
+
+int DXWindowContext::RunMessageLoop()
+{
+    MSG msg = {};
+
+    for (;;)
+    {
+        if (m_renderMode == RenderMode::OnDemand)
+        {
+            // No WM_PAINT is sent when a covered window becomes visible
+            // again, so while it is occluded, check periodically and redraw
+            // it once it is visible. The check is made by Paint. A minimized
+            // window is repainted when it is restored.
+            if (m_isOccluded && m_recoveryState == nullptr && IsWindow(m_hwnd) && !IsIconic(m_hwnd))
+            {
+                DWORD waitResult = MsgWaitForMultipleObjectsEx(0, nullptr, OcclusionPollMs, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+                if (waitResult == WAIT_FAILED)
+                {
+                    ThrowLastError();
+                }
+                if (waitResult == WAIT_TIMEOUT)
+                {
+                    Paint();
+                }
+                else if (!DispatchPendingMessages(msg))
+                {
+                    return static_cast<int>(msg.wParam);
+                }
+                continue;
+            }
+
+            // Block until a message arrives. Frames are rendered in
+            // response to WM_PAINT.
+            BOOL result = GetMessage(&msg, nullptr, 0, 0);
+            if (result == 0)
+            {
+                break;
+            }
+            if (result == -1)
+            {
+                ThrowLastError();
+            }
+
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+            continue;
+        }
+
+        // Dispatch all pending messages without blocking.
+        if (!DispatchPendingMessages(msg))
+        {
+            return static_cast<int>(msg.wParam);
+        }
+
+        // A message handler may have changed the mode or destroyed the window.
+        if (m_renderMode != RenderMode::Continuous)
+        {
+            continue;
+        }
+        if (!IsWindow(m_hwnd))
+        {
+            WaitMessage();
+            continue;
+        }
+
+        // Until the device is created in the background, there is nothing
+        // to render. The window is repainted when the device is ready.
+        if (m_d2dContext == nullptr && m_device->IsInitializing())
+        {
+            WaitMessage();
+            continue;
+        }
+
+        // While the window is occluded, check periodically whether it is
+        // visible again instead of rendering. The check is made by Paint.
+        if (m_isOccluded && m_recoveryState == nullptr)
+        {
+            DWORD waitResult = MsgWaitForMultipleObjectsEx(0, nullptr, OcclusionPollMs, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+            if (waitResult == WAIT_FAILED)
+            {
+                ThrowLastError();
+            }
+            if (waitResult == WAIT_TIMEOUT)
+            {
+                Paint();
+            }
+            continue;
+        }
+
+        // Without recent input, wait until the next throttled frame is due,
+        // waking up for messages in the meantime.
+        if (IsIdle())
+        {
+            uint64_t const now = GetTickCount64();
+            uint64_t const frameTime = m_lastFrameTime + static_cast<uint64_t>(1000 / m_idleFrameRate);
+            if (now < frameTime)
+            {
+                DWORD waitResult = MsgWaitForMultipleObjectsEx(0, nullptr, static_cast<DWORD>(frameTime - now), QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+                if (waitResult == WAIT_FAILED)
+                {
+                    ThrowLastError();
+                }
+                continue;
+            }
+        }
+
+        // Wait until the swap chain can accept a new frame, but wake up
+        // early to process any messages that arrive in the meantime. While
+        // the device is being recovered, wait for the worker instead.
+        HANDLE waitable = m_recoveryState != nullptr ?
+            m_recoveryState->completedEvent.Get() :
+            GetFrameLatencyWaitableObject();
+        if (waitable != nullptr)
+        {
+            DWORD waitResult = MsgWaitForMultipleObjectsEx(
+                1,
+                &waitable,
+                INFINITE,
+                QS_ALLINPUT,
+                MWMO_INPUTAVAILABLE
+            );
+
+            if (waitResult == WAIT_FAILED)
+            {
+                ThrowLastError();
+            }
+            if (waitResult != WAIT_OBJECT_0)
+            {
+                continue;
+            }
+
+            // Gather the input that arrived while waiting, so the frame
+            // uses the latest input instead of leaving it for the next one.
+            if (!DispatchPendingMessages(msg))
+            {
+                return static_cast<int>(msg.wParam);
+            }
+            if (m_renderMode != RenderMode::Continuous || !IsWindow(m_hwnd))
+            {
+                continue;
+            }
+        }
+
+        Paint();
+    }
+
+    return static_cast<int>(msg.wParam);
+}
+
+bool DXWindowContext::DispatchPendingMessages(MSG& msg)
+{
+    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+    {
+        if (msg.message == WM_QUIT)
+        {
+            return false;
+        }
+
+        if (IsInputMessage(msg.message))
+        {
+            m_lastInputTime = GetTickCount64();
+        }
+
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+
+    return true;
+}
+
+bool DXWindowContext::IsIdle() const noexcept
+{
+    return m_idleFrameRate > 0 &&
+        m_renderMode == RenderMode::Continuous &&
+        GetTickCount64() - m_lastInputTime >= m_idleTimeoutMs;
+}
+
+bool DXWindowContext::IsInputMessage(UINT message) noexcept
+{
+    return (message >= WM_KEYFIRST && message <= WM_KEYLAST) ||
+        (message >= WM_MOUSEFIRST && message <= WM_MOUSELAST) ||
+        (message >= WM_NCMOUSEMOVE && message <= WM_NCXBUTTONDBLCLK) ||
+        (message >= WM_POINTERUPDATE && message <= WM_POINTERWHEEL) ||
+        message == WM_TOUCH;
+}
+
+void DXWindowContext::ResetWindow() noexcept
+{
+    m_profiler.Reset();
+    m_d2dContext.Reset();
+    m_regionContexts.clear();
+    m_regionLists.clear();
+    m_dcompVisual.Reset();
+    m_dcompTarget.Reset();
+    m_dcompDevice.Reset();
+    m_frameLatencyWaitable.Reset();
+    m_swapChain.Reset();
+    m_swapChainFlags = 0;
+    m_isTearingSupported = false;
+    m_isPartialPresentation = false;
+    m_d3dContext.Reset();
+}
+
+void DXWindowContext::ResetDevice() noexcept
+{
+    // Reset the swap chain.
+    ResetWindow();
+
+    ResetDeviceResources();
+}
+
+void DXWindowContext::ResetDeviceResources() noexcept
+{
+    // Reset device-dependent resources.
+    m_resourceList.ResetAll();
+
+    // Reset the device if it hasn't already been reset and reinitialized
+    // by another window context.
+    m_device->ResetIfGeneration(m_deviceGeneration);
+}
+
+void DXWindowContext::EnsureInitialized()
+{
+    // If the D2D context is already initialized, then just make sure the
+    // swap chain is the right size and all D2D resources are initialized.
+    if (m_d2dContext != nullptr)
+    {
+        // If another window found the device lost and recreated it, then
+        // this window's swap chain and resources belong to the old device.
+        if (m_deviceGeneration != m_device->GetGeneration())
+        {
+            throw DeviceLostException{ DXGI_ERROR_DEVICE_REMOVED };
+        }
+
+        if (m_isColorCheckPending)
+        {
+            UpdateColorMode();
+        }
+        if (m_isResizePending)
+        {
+            ResizeSwapChain();
+        }
+        m_resourceList.EnsureInitialized(m_d2dContext.Get());
+        return;
+    }
+
+    // Ensure the device is initialized, and remember the device objects
+    // and generation. Holding our own references means another thread
+    // can't release the objects while this window is using them.
+    auto deviceObjects = m_device->Acquire();
+    auto dxgiDevice = deviceObjects.dxgiDevice.Get();
+
+    // Get the DXGI factory.
+    ComPtr<IDXGIAdapter> dxgiAdapter;
+    HR(dxgiDevice->GetAdapter(&dxgiAdapter));
+
+    ComPtr<IDXGIFactory2> dxgiFactory;
+    HR(dxgiAdapter->GetParent(IID_PPV_ARGS(&dxgiFactory)));
+
+    // Choose the swap chain format for the window's monitor. A legacy swap
+    // chain is always sRGB; a flip-model swap chain sets its color space
+    // when it is created.
+    m_isAdvancedColor = ShouldUseAdvancedColor();
+    m_isColorCheckPending = false;
+    m_colorSpace = DXGI_COLOR_SPACE_RGB_FULL_G22_NONE_P709;
+
+    // Create a DXGI swap chain for the window.
+    ComPtr<IDXGISwapChain1> dxgiSwapChain;
+    {
+        DXDevice::ApiLock lock{ *m_device };
+        dxgiSwapChain = m_options.flipModel || m_options.composition || m_options.advancedColor ?
+            CreateFlipSwapChain(dxgiFactory.Get(), dxgiDevice) :
+            CreateLegacySwapChain(dxgiFactory.Get(), dxgiDevice);
+    }
+
+    // Create the D2D context.
+    auto d2dDevice = deviceObjects.d2dDevice.Get();
+    ComPtr<ID2D1DeviceContext6> d2dContext;
+    HR(d2dDevice->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &d2dContext));
+
+    // Set the DPI, and the buffer precision for the color space.
+    d2dContext->SetDpi(static_cast<float>(m_dpi), static_cast<float>(m_dpi));
+    SetBufferPrecision(d2dContext.Get());
+
+    // Set the swap chain's back buffer as the target.
+    SetTargetFromSwapChain(d2dContext.Get(), dxgiSwapChain.Get(), GetTargetAlphaMode());
+
+    // Initialize device-dependent resources.
+    m_resourceList.Invalidate();
+    m_resourceList.EnsureInitialized(d2dContext.Get());
+
+    // Update members.
+    m_deviceGeneration = deviceObjects.generation;
+    m_d3dContext = std::move(deviceObjects.d3dContext);
+    m_swapChain = std::move(dxgiSwapChain);
+    m_d2dContext = std::move(d2dContext);
+    m_isResizePending = false;
+    m_isFullyDirty = true;
+}
+
+void DXWindowContext::ResizeSwapChain()
+{
+    DXDevice::ApiLock lock{ *m_device };
+
+    // Release the target bitmap, which holds a reference to the back buffer.
+    m_d2dContext->SetTarget(nullptr);
+
+    // Resize the buffers, preserving the buffer count. The format changes
+    // if the window moved to a monitor with different color support.
+    HR(m_swapChain->ResizeBuffers(
+        0,
+        GetPixelWidth(),
+        GetPixelHeight(),
+        m_options.flipModel || m_options.composition || m_options.advancedColor ?
+            GetSwapChainFormat() :
+            DXGI_FORMAT_UNKNOWN,
+        m_swapChainFlags
+    ));
+    SetSwapChainColorSpace(m_swapChain.Get());
+    SetBufferPrecision(m_d2dContext.Get());
+
+    // Rebind the new back buffer.
+    SetTargetFromSwapChain(m_d2dContext.Get(), m_swapChain.Get(), GetTargetAlphaMode());
+
+    // The contents of the resized buffers are undefined.
+    m_isResizePending = false;
+    m_isFullyDirty = true;
+}
+
+void DXWindowContext::UpdateColorMode()
+{
+    m_isColorCheckPending = false;
+
+    bool isAdvancedColor = ShouldUseAdvancedColor();
+    if (isAdvancedColor == m_isAdvancedColor)
+    {
+        return;
+    }
+
+    // Change the swap chain format and color space when it is next resized,
+    // and recreate the resources, whose colors depend on the color space.
+    // The resize happens before the resources are initialized again.
+    m_isAdvancedColor = isAdvancedColor;
+    m_resourceList.ResetAll();
+    m_isResizePending = true;
+}
+
+bool DXWindowContext::ShouldUseAdvancedColor()
+{
+    m_monitor = MonitorFromWindow(m_hwnd, MONITOR_DEFAULTTONEAREST);
+    return m_options.advancedColor && IsAdvancedColorMonitor(m_monitor);
+}
+
+bool DXWindowContext::IsAdvancedColorMonitor(HMONITOR monitor)
+{
+    // Use a new factory, since the outputs of a factory created before a
+    // display change are out of date.
+    ComPtr<IDXGIFactory1> dxgiFactory;
+    HR(CreateDXGIFactory1(IID_PPV_ARGS(&dxgiFactory)));
+
+    ComPtr<IDXGIAdapter1> adapter;
+    for (UINT i = 0; dxgiFactory->EnumAdapters1(i, adapter.ReleaseAndGetAddressOf()) != DXGI_ERROR_NOT_FOUND; i++)
+    {
+        ComPtr<IDXGIOutput> output;
+        for (UINT j = 0; adapter->EnumOutputs(j, output.ReleaseAndGetAddressOf()) != DXGI_ERROR_NOT_FOUND; j++)
+        {
+            // IDXGIOutput6 requires Windows 10 1703.
+            ComPtr<IDXGIOutput6> output6;
+            DXGI_OUTPUT_DESC1 outputDesc;
+            if (FAILED(output.As(&output6)) || FAILED(output6->GetDesc1(&outputDesc)))
+            {
+                return false;
+            }
+
+            if (outputDesc.Monitor == monitor)
+            {
+                return outputDesc.ColorSpace == DXGI_COLOR_SPACE_RGB_FULL_G2084_NONE_P2020 ||
+                    outputDesc.BitsPerColor > 8;
+            }
+        }
+    }
+
+    return false;
+}
+
+void DXWindowContext::SetSwapChainColorSpace(IDXGISwapChain1* dxgiSwapChain)
+{
+    // FP16 buffers are linear scRGB, and 8-bit buffers are sRGB.
+    ComPtr<IDXGISwapChain3> dxgiSwapChain3;
+    if (FAILED(dxgiSwapChain->QueryInterface(IID_PPV_ARGS(&dxgiSwapChain3))))
+    {
+        return;
+    }
+
+    DXGI_COLOR_SPACE_TYPE colorSpace = m_isAdvancedColor ?
+        DXGI_COLOR_SPACE_RGB_FULL_G10_NONE_P709 :
+        DXGI_COLOR_SPACE_RGB_FULL_G22_NONE_P709;
+
+    UINT support = 0;
+    if (SUCCEEDED(dxgiSwapChain3->CheckColorSpaceSupport(colorSpace, &support)) &&
+        (support & DXGI_SWAP_CHAIN_COLOR_SPACE_SUPPORT_FLAG_PRESENT) != 0)
+    {
+        HR(dxgiSwapChain3->SetColorSpace1(colorSpace));
+        m_colorSpace = colorSpace;
+    }
+    else
+    {
+        // The swap chain keeps the default color space for its format.
+        m_colorSpace = GetSwapChainFormat() == DXGI_FORMAT_R16G16B16A16_FLOAT ?
+            DXGI_COLOR_SPACE_RGB_FULL_G10_NONE_P709 :
+            DXGI_COLOR_SPACE_RGB_FULL_G22_NONE_P709;
+    }
+}
+
+void DXWindowContext::SetBufferPrecision(ID2D1DeviceContext6* d2dContext) const noexcept
+{
+    // FP16 intermediate buffers avoid banding in layers and effects, and
+    // mark the context as scRGB for IsScRgbContext, so they are used only
+    // if the swap chain is in the scRGB color space.
+    D2D1_RENDERING_CONTROLS controls;
+    d2dContext->GetRenderingControls(&controls);
+    controls.bufferPrecision = GetBufferPrecision();
+    d2dContext->SetRenderingControls(controls);
+}
+
+void DXWindowContext::CreateCompositionTarget(IDXGIDevice* dxgiDevice, IDXGISwapChain1* dxgiSwapChain)
+{
+    // Create a visual tree with a single visual whose content is the swap
+    // chain, and make it the content of the window.
+    ComPtr<IDCompositionDevice> dcompDevice;
+    HR(DCompositionCreateDevice(dxgiDevice, IID_PPV_ARGS(&dcompDevice)));
+
+    ComPtr<IDCompositionTarget> dcompTarget;
+    HR(dcompDevice->CreateTargetForHwnd(m_hwnd, TRUE, &dcompTarget));
+
+    ComPtr<IDCompositionVisual> dcompVisual;
+    HR(dcompDevice->CreateVisual(&dcompVisual));
+    HR(dcompVisual->SetContent(dxgiSwapChain));
+    HR(dcompTarget->SetRoot(dcompVisual.Get()));
+    HR(dcompDevice->Commit());
+
+    m_dcompDevice = std::move(dcompDevice);
+    m_dcompTarget = std::move(dcompTarget);
+    m_dcompVisual = std::move(dcompVisual);
+}
+
+void DXWindowContext::SetTargetFromSwapChain(ID2D1DeviceContext6* d2dContext, IDXGISwapChain1* dxgiSwapChain, D2D1_ALPHA_MODE alphaMode)
+{
+    // Get the DXGI surface for the swap chain.
+    ComPtr<IDXGISurface> dxgiSurface;
+    HR(dxgiSwapChain->GetBuffer(0, IID_PPV_ARGS(&dxgiSurface)));
+
+    // Create a D2D bitmap from the swap chain surface, and set it as the target.
+    ComPtr<ID2D1Bitmap1> d2dBitmap;
+    HR(d2dContext->CreateBitmapFromDxgiSurface(
+        dxgiSurface.Get(),
+        D2D1::BitmapProperties1(
+            D2D1_BITMAP_OPTIONS_TARGET | D2D1_BITMAP_OPTIONS_CANNOT_DRAW,
+            D2D1::PixelFormat(DXGI_FORMAT_UNKNOWN, alphaMode) // use the buffer format
+        ),
+        &d2dBitmap
+    ));
+
+    d2dContext->SetTarget(d2dBitmap.Get());
+}
+
+ComPtr<IDXGISwapChain1> DXWindowContext::CreateLegacySwapChain(IDXGIFactory2* dxgiFactory, IDXGIDevice* dxgiDevice)
+{
+    DXGI_SWAP_CHAIN_DESC scDesc = {};
+    scDesc.BufferDesc.Width = GetPixelWidth();
+    scDesc.BufferDesc.Height = GetPixelHeight();
+    scDesc.BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    scDesc.SampleDesc.Count = 1;
+    scDesc.BufferUsage = DXGI_USAGE_BACK_BUFFER | DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    scDesc.BufferCount = 1;
+    scDesc.OutputWindow = m_hwnd;
+    scDesc.Windowed = true;
+    scDesc.SwapEffect = DXGI_SWAP_EFFECT_DISCARD;
+
+    ComPtr<IDXGISwapChain> dxgiSwapChain;
+    HR(dxgiFactory->CreateSwapChain(
+        dxgiDevice,
+        &scDesc,
+        dxgiSwapChain.GetAddressOf()
+    ));
+
+    ComPtr<IDXGISwapChain1> dxgiSwapChain1;
+    HR(dxgiSwapChain.As(&dxgiSwapChain1));
+
+    m_swapChainFlags = scDesc.Flags;
+    return dxgiSwapChain1;
+}
+
+ComPtr<IDXGISwapChain1> DXWindowContext::CreateFlipSwapChain(IDXGIFactory2* dxgiFactory, IDXGIDevice* dxgiDevice)
+{
+    DXGI_SWAP_CHAIN_DESC1 scDesc = {};
+    scDesc.Width = GetPixelWidth();
+    scDesc.Height = GetPixelHeight();
+    scDesc.Format = GetSwapChainFormat();
+    scDesc.SampleDesc.Count = 1;
+    scDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    scDesc.BufferCount = std::min<uint32_t>(std::max<uint32_t>(m_options.bufferCount, 2), 3);
+    scDesc.Scaling = DXGI_SCALING_STRETCH;
+    scDesc.SwapEffect = m_options.partialPresentation ? DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL : DXGI_SWAP_EFFECT_FLIP_DISCARD;
+    scDesc.AlphaMode = m_options.composition ? DXGI_ALPHA_MODE_PREMULTIPLIED : DXGI_ALPHA_MODE_IGNORE;
+    scDesc.Flags = DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT;
+
+    // Tearing requires both the swap chain flag and system support.
+    bool isTearingSupported = false;
+    if (m_options.allowTearing && !m_options.composition)
+    {
+        ComPtr<IDXGIFactory5> dxgiFactory5;
+        BOOL allowTearing = FALSE;
+        if (SUCCEEDED(dxgiFactory->QueryInterface(IID_PPV_ARGS(&dxgiFactory5))) &&
+            SUCCEEDED(dxgiFactory5->CheckFeatureSupport(DXGI_FEATURE_PRESENT_ALLOW_TEARING, &allowTearing, sizeof(allowTearing))) &&
+            allowTearing)
+        {
+            scDesc.Flags |= DXGI_SWAP_CHAIN_FLAG_ALLOW_TEARING;
+            isTearingSupported = true;
+        }
+    }
+
+    ComPtr<IDXGISwapChain1> dxgiSwapChain;
+    if (m_options.composition)
+    {
+        HR(dxgiFactory->CreateSwapChainForComposition(
+            dxgiDevice,
+            &scDesc,
+            nullptr, // don't restrict output
+            &dxgiSwapChain
+        ));
+
+        CreateCompositionTarget(dxgiDevice, dxgiSwapChain.Get());
+    }
+    else
+    {
+        HR(dxgiFactory->CreateSwapChainForHwnd(
+            dxgiDevice,
+            m_hwnd,
+            &scDesc,
+            nullptr, // no full-screen description
+            nullptr, // don't restrict output
+            &dxgiSwapChain
+        ));
+    }
+
+    SetSwapChainColorSpace(dxgiSwapChain.Get());
+
+    // Limit the number of queued frames, and get the waitable object that
+    // is signaled when the swap chain can accept another frame.
+    ComPtr<IDXGISwapChain2> dxgiSwapChain2;
+    HR(dxgiSwapChain.As(&dxgiSwapChain2));
+    HR(dxgiSwapChain2->SetMaximumFrameLatency(std::max<uint32_t>(m_options.maxFrameLatency, 1)));
+
+    m_frameLatencyWaitable.Reset(dxgiSwapChain2->GetFrameLatencyWaitableObject());
+    m_swapChainFlags = scDesc.Flags;
+    m_isTearingSupported = isTearingSupported;
+    m_isPartialPresentation = m_options.partialPresentation;
+    return dxgiSwapChain;
+}
+
+#pragma endregion // DXWindowContext
+
+#pragma region DXHeadlessContext
+
+constexpr uint32_t DXHeadlessContext::StagingBitmapCount;
+
+ComPtr<IWICImagingFactory> DXHeadlessContext::CreateWicFactory()
+{
+    ComPtr<IWICImagingFactory> ptr;
+    HR(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&ptr)));
+    return ptr;
+}
+
+DXHeadlessContext::DXHeadlessContext(DXDevice* device, uint32_t pixelWidth, uint32_t pixelHeight, uint32_t dpi) :
+    m_device{ device },
+    m_pixelSize{ pixelWidth, pixelHeight },
+    m_dpi{ dpi },
+    m_wicFactory{ CreateWicFactory() },
+    m_exportState{ std::make_shared<ExportState>() }
+{
+}
+
+DXHeadlessContext::~DXHeadlessContext()
+{
+    WaitForEncodes();
+}
+
+void DXHeadlessContext::ResetTargets() noexcept
+{
+    m_pendingFrames.clear();
+    for (auto& stagedFrame : m_stagedFrames)
+    {
+        stagedFrame.bitmap.Reset();
+        stagedFrame.path.clear();
+    }
+    m_targetBitmap.Reset();
+}
+
+void DXHeadlessContext::ResetDevice() noexcept
+{
+    ResetTargets();
     m_d2dContext.Reset();
-    m_swapChain.Reset();
+    m_d3dContext.Reset();
+
+    m_resourceList.ResetAll();
+    m_device->ResetIfGeneration(m_deviceGeneration);
+}
+
+void DXHeadlessContext::EnsureInitialized()
+{
+    if (m_d2dContext != nullptr)
+    {
+        // Another context may have found the device lost and recreated it.
+        if (m_deviceGeneration != m_device->GetGeneration())
+        {
+            throw DeviceLostException{ DXGI_ERROR_DEVICE_REMOVED };
+        }
+    }
+    else
+    {
+        auto deviceObjects = m_device->Acquire();
+
+        ComPtr<ID2D1DeviceContext6> d2dContext;
+        HR(deviceObjects.d2dDevice->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &d2dContext));
+        d2dContext->SetDpi(static_cast<float>(m_dpi), static_cast<float>(m_dpi));
+
+        m_resourceList.Invalidate();
+
+        m_deviceGeneration = deviceObjects.generation;
+        m_d3dContext = std::move(deviceObjects.d3dContext);
+        m_d2dContext = std::move(d2dContext);
+    }
+
+    if (m_targetBitmap == nullptr)
+    {
+        CreateTargets();
+    }
+
+    m_resourceList.EnsureInitialized(m_d2dContext.Get());
+}
+
+void DXHeadlessContext::CreateTargets()
+{
+    auto dpi = static_cast<float>(m_dpi);
+    auto pixelFormat = D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED);
+
+    ComPtr<ID2D1Bitmap1> targetBitmap;
+    HR(m_d2dContext->CreateBitmap(
+        m_pixelSize,
+        nullptr,
+        0,
+        D2D1::BitmapProperties1(D2D1_BITMAP_OPTIONS_TARGET, pixelFormat, dpi, dpi),
+        &targetBitmap
+    ));
+
+    // Staging bitmaps are only copied to by the GPU and mapped by the CPU.
+    ComPtr<ID2D1Bitmap1> stagingBitmaps[StagingBitmapCount];
+    for (auto& stagingBitmap : stagingBitmaps)
+    {
+        HR(m_d2dContext->CreateBitmap(
+            m_pixelSize,
+            nullptr,
+            0,
+            D2D1::BitmapProperties1(D2D1_BITMAP_OPTIONS_CPU_READ | D2D1_BITMAP_OPTIONS_CANNOT_DRAW, pixelFormat, dpi, dpi),
+            &stagingBitmap
+        ));
+    }
+
+    m_d2dContext->SetTarget(targetBitmap.Get());
+
+    m_targetBitmap = std::move(targetBitmap);
+    for (uint32_t i = 0; i < StagingBitmapCount; i++)
+    {
+        m_stagedFrames[i].bitmap = std::move(stagingBitmaps[i]);
+    }
+    m_nextStagedFrame = 0;
+}
+
+void DXHeadlessContext::Resize(uint32_t pixelWidth, uint32_t pixelHeight)
+{
+    if (pixelWidth == m_pixelSize.width && pixelHeight == m_pixelSize.height)
+    {
+        return;
+    }
+
+    // Read back the frames staged at the old size before releasing them.
+    try
+    {
+        while (!m_pendingFrames.empty())
+        {
+            ReadBackOldestFrame();
+        }
+    }
+    catch (DeviceLostException&)
+    {
+        ResetDevice();
+        throw;
+    }
+
+    if (m_d2dContext != nullptr)
+    {
+        m_d2dContext->SetTarget(nullptr);
+    }
+    ResetTargets();
+
+    m_pixelSize = D2D_SIZE_U{ pixelWidth, pixelHeight };
+}
+
+void DXHeadlessContext::ExportFrame(std::wstring path)
+{
+    try
+    {
+        ExportFrameInternal(std::move(path));
+    }
+    catch (DeviceLostException&)
+    {
+        ResetDevice();
+        throw;
+    }
+}
+
+void DXHeadlessContext::ExportFrameInternal(std::wstring path)
+{
+    EnsureInitialized();
+
+    // Add any asynchronously created text layouts to the cache.
+    m_textLayoutCache.ProcessCompletedLayouts();
+
+    m_d2dContext->BeginDraw();
+    m_d2dContext->Clear(D2D1_COLOR_F{});
+    RenderContent();
+    HR(m_d2dContext->EndDraw());
+
+    // Queue a copy to the next staging bitmap. At most one less than the
+    // number of staging bitmaps is pending, so this one is free.
+    uint32_t index = m_nextStagedFrame;
+    StagedFrame& stagedFrame = m_stagedFrames[index];
+    HR(stagedFrame.bitmap->CopyFromBitmap(nullptr, m_targetBitmap.Get(), nullptr));
+    stagedFrame.path = std::move(path);
+
+    m_pendingFrames.push_back(index);
+    m_nextStagedFrame = (index + 1) % StagingBitmapCount;
+
+    // Read back the previous frame, which the GPU has most likely
+    // finished, while the GPU works on this one.
+    m_d3dContext->Flush();
+
+    while (m_pendingFrames.size() >= StagingBitmapCount)
+    {
+        ReadBackOldestFrame();
+    }
+}
+
+void DXHeadlessContext::ReadBackOldestFrame()
+{
+    StagedFrame& stagedFrame = m_stagedFrames[m_pendingFrames.front()];
+    D2D_SIZE_U size = stagedFrame.bitmap->GetPixelSize();
+    uint32_t stride = size.width * 4;
+
+    // Copy the pixels out, so the staging bitmap can be reused while the
+    // image is encoded.
+    std::vector<uint8_t> pixels(static_cast<size_t>(stride) * size.height);
+
+    D2D1_MAPPED_RECT mappedRect;
+    HR(stagedFrame.bitmap->Map(D2D1_MAP_OPTIONS_READ, &mappedRect));
+
+    for (uint32_t y = 0; y < size.height; y++)
+    {
+        memcpy(&pixels[static_cast<size_t>(y) * stride], mappedRect.bits + static_cast<size_t>(y) * mappedRect.pitch, stride);
+    }
+
+    HR(stagedFrame.bitmap->Unmap());
+
+    std::wstring path = std::move(stagedFrame.path);
+    m_pendingFrames.pop_front();
+
+    // Encode the image on a worker thread.
+    ComPtr<IWICImagingFactory> wicFactory = m_wicFactory;
+    std::shared_ptr<ExportState> state = m_exportState;
+    uint32_t dpi = m_dpi;
+
+    {
+        std::lock_guard<std::mutex> lock{ state->mutex };
+        state->pendingCount++;
+    }
+
+    try
+    {
+        WorkerPool::GetDefault().Submit([wicFactory, state, path, size, stride, pixels = std::move(pixels), dpi]() mutable noexcept
+        {
+            HRESULT hr = S_OK;
+
+            HRESULT hrInit = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+            try
+            {
+                EncodePng(wicFactory.Get(), path.c_str(), size, stride, pixels, dpi);
+            }
+            catch (WinException& e)
+            {
+                hr = e.GetError();
+            }
+            catch (std::bad_alloc&)
+            {
+                hr = E_OUTOFMEMORY;
+            }
+            if (SUCCEEDED(hrInit))
+            {
+                CoUninitialize();
+            }
+
+            std::lock_guard<std::mutex> lock{ state->mutex };
+            if (FAILED(hr) && SUCCEEDED(state->hr))
+            {
+                state->hr = hr;
+            }
+            state->pendingCount--;
+            state->completed.notify_all();
+        });
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock{ state->mutex };
+        state->pendingCount--;
+        throw;
+    }
+}
+
+void DXHeadlessContext::EncodePng(
+    IWICImagingFactory* wicFactory,
+    wchar_t const* path,
+    D2D_SIZE_U size,
+    uint32_t stride,
+    std::vector<uint8_t>& pixels,
+    uint32_t dpi
+    )
+{
+    // Wrap the premultiplied pixels. The frame encoder converts them to the
+    // straight alpha format it supports.
+    ComPtr<IWICBitmap> wicBitmap;
+    HR(wicFactory->CreateBitmapFromMemory(
+        size.width,
+        size.height,
+        GUID_WICPixelFormat32bppPBGRA,
+        stride,
+        static_cast<UINT>(pixels.size()),
+        pixels.data(),
+        &wicBitmap
+    ));
+    HR(wicBitmap->SetResolution(dpi, dpi));
+
+    ComPtr<IWICStream> stream;
+    HR(wicFactory->CreateStream(&stream));
+    HR(stream->InitializeFromFilename(path, GENERIC_WRITE));
+
+    ComPtr<IWICBitmapEncoder> encoder;
+    HR(wicFactory->CreateEncoder(GUID_ContainerFormatPng, nullptr, &encoder));
+    HR(encoder->Initialize(stream.Get(), WICBitmapEncoderNoCache));
+
+    ComPtr<IWICBitmapFrameEncode> frame;
+    HR(encoder->CreateNewFrame(&frame, nullptr));
+    HR(frame->Initialize(nullptr));
+    HR(frame->WriteSource(wicBitmap.Get(), nullptr));
+    HR(frame->Commit());
+    HR(encoder->Commit());
+}
+
+void DXHeadlessContext::Flush()
+{
+    try
+    {
+        FlushInternal();
+    }
+    catch (DeviceLostException&)
+    {
+        ResetDevice();
+        throw;
+    }
+}
+
+void DXHeadlessContext::FlushInternal()
+{
+    while (!m_pendingFrames.empty())
+    {
+        ReadBackOldestFrame();
+    }
+
+    WaitForEncodes();
+
+    // Report the first error since the last Flush.
+    HRESULT hr;
+    {
+        std::lock_guard<std::mutex> lock{ m_exportState->mutex };
+        hr = m_exportState->hr;
+        m_exportState->hr = S_OK;
+    }
+    HR(hr);
+}
+
+void DXHeadlessContext::WaitForEncodes() noexcept
+{
+    std::unique_lock<std::mutex> lock{ m_exportState->mutex };
+    m_exportState->completed.wait(lock, [this]() { return m_exportState->pendingCount == 0; });
+}
+
+#pragma endregion // DXHeadlessContext
+
+#pragma region Scene
+
+void SceneNode::AddChild(std::unique_ptr<SceneNode> child)
+{
+    child->m_parent = this;
+    child->SetScene(m_scene);
+    m_children.push_back(std::move(child));
+
+    InvalidateCaches();
+    m_children.back()->InvalidateArea();
+}
+
+std::unique_ptr<SceneNode> SceneNode::RemoveChild(SceneNode* child)
+{
+    auto it = std::find_if(m_children.begin(), m_children.end(),
+        [child](std::unique_ptr<SceneNode> const& p) { return p.get() == child; });
+
+    if (it == m_children.end())
+    {
+        return nullptr;
+    }
+
+    child->InvalidateArea();
+    InvalidateCaches();
+
+    std::unique_ptr<SceneNode> result = std::move(*it);
+    m_children.erase(it);
+
+    result->m_parent = nullptr;
+    result->SetScene(nullptr);
+    return result;
+}
+
+void SceneNode::SetTransform(D2D_MATRIX_3X2_F const& transform)
+{
+    InvalidateArea();
+    m_transform = transform;
+    InvalidateArea();
+
+    // The transform is applied outside this node's own cache.
+    if (m_parent != nullptr)
+    {
+        m_parent->InvalidateCaches();
+    }
+}
+
+void SceneNode::SetClip(D2D_RECT_F const& clip)
+{
+    InvalidateArea();
+    m_clip = clip;
+    m_hasClip = true;
+    InvalidateArea();
+
+    // The clip is applied outside this node's own cache.
+    if (m_parent != nullptr)
+    {
+        m_parent->InvalidateCaches();
+    }
+}
+
+void SceneNode::ClearClip()
+{
+    if (m_hasClip)
+    {
+        m_hasClip = false;
+        InvalidateArea();
+
+        if (m_parent != nullptr)
+        {
+            m_parent->InvalidateCaches();
+        }
+    }
+}
+
+void SceneNode::SetBounds(D2D_RECT_F const& bounds)
+{
+    InvalidateArea();
+    m_bounds = bounds;
+    InvalidateArea();
+    InvalidateCaches();
+}
+
+void SceneNode::SetVisible(bool isVisible)
+{
+    if (isVisible != m_isVisible)
+    {
+        // Invalidate while visible, so the area is not empty.
+        if (!isVisible)
+        {
+            InvalidateArea();
+        }
+
+        m_isVisible = isVisible;
+
+        if (isVisible)
+        {
+            InvalidateArea();
+        }
+
+        if (m_parent != nullptr)
+        {
+            m_parent->InvalidateCaches();
+        }
+    }
+}
+
+void SceneNode::SetCacheMode(SceneCacheMode mode)
+{
+    if (mode != m_cacheMode)
+    {
+        m_cacheMode = mode;
+        m_cache.Reset();
+        InvalidateCaches();
+        InvalidateArea();
+    }
+}
+
+void SceneNode::InvalidateContent()
+{
+    InvalidateCaches();
+    InvalidateArea();
+}
+
+D2D_RECT_F SceneNode::GetSubtreeBounds() const noexcept
+{
+    if (!m_isVisible)
+    {
+        return D2D_RECT_F{};
+    }
+
+    D2D_RECT_F bounds = m_bounds;
+    for (auto const& child : m_children)
+    {
+        bounds = UnionRect(bounds, child->GetSubtreeBounds());
+    }
+
+    if (m_hasClip)
+    {
+        bounds.left = std::max(bounds.left, m_clip.left);
+        bounds.top = std::max(bounds.top, m_clip.top);
+        bounds.right = std::min(bounds.right, m_clip.right);
+        bounds.bottom = std::min(bounds.bottom, m_clip.bottom);
+    }
+
+    if (bounds.right <= bounds.left || bounds.bottom <= bounds.top)
+    {
+        return D2D_RECT_F{};
+    }
+
+    return TransformRect(bounds, m_transform);
+}
+
+D2D_MATRIX_3X2_F SceneNode::GetWorldTransform() const noexcept
+{
+    D2D1::Matrix3x2F transform = *D2D1::Matrix3x2F::ReinterpretBaseType(&m_transform);
+    for (SceneNode* p = m_parent; p != nullptr; p = p->m_parent)
+    {
+        transform = transform * *D2D1::Matrix3x2F::ReinterpretBaseType(&p->m_transform);
+    }
+    return transform;
+}
+
+void SceneNode::SetScene(Scene* scene) noexcept
+{
+    m_scene = scene;
+    for (auto const& child : m_children)
+    {
+        child->SetScene(scene);
+    }
+}
+
+void SceneNode::InvalidateCaches() noexcept
+{
+    for (SceneNode* p = this; p != nullptr; p = p->m_parent)
+    {
+        p->m_isCacheValid = false;
+    }
+}
+
+void SceneNode::InvalidateArea()
+{
+    if (m_scene == nullptr)
+    {
+        return;
+    }
+
+    // Subtree bounds are in the parent's space, so apply the transforms of
+    // the ancestors. Ancestor clips are ignored, which only overestimates.
+    D2D_RECT_F bounds = GetSubtreeBounds();
+    if (m_parent != nullptr)
+    {
+        bounds = TransformRect(bounds, m_parent->GetWorldTransform());
+    }
+
+    if (bounds.right > bounds.left && bounds.bottom > bounds.top)
+    {
+        m_scene->InvalidateRect(bounds);
+    }
+}
+
+D2D_RECT_F SceneNode::TransformRect(D2D_RECT_F const& rect, D2D_MATRIX_3X2_F const& transform) noexcept
+{
+    auto const& matrix = *D2D1::Matrix3x2F::ReinterpretBaseType(&transform);
+    D2D_POINT_2F const corners[] =
+    {
+        matrix.TransformPoint(D2D_POINT_2F{ rect.left, rect.top }),
+        matrix.TransformPoint(D2D_POINT_2F{ rect.right, rect.top }),
+        matrix.TransformPoint(D2D_POINT_2F{ rect.left, rect.bottom }),
+        matrix.TransformPoint(D2D_POINT_2F{ rect.right, rect.bottom })
+    };
+
+    D2D_RECT_F result = { corners[0].x, corners[0].y, corners[0].x, corners[0].y };
+    for (auto const& point : corners)
+    {
+        result.left = std::min(result.left, point.x);
+        result.top = std::min(result.top, point.y);
+        result.right = std::max(result.right, point.x);
+        result.bottom = std::max(result.bottom, point.y);
+    }
+    return result;
+}
+
+D2D_RECT_F SceneNode::UnionRect(D2D_RECT_F const& a, D2D_RECT_F const& b) noexcept
+{
+    // Empty rectangles don't contribute to the union.
+    if (b.right <= b.left || b.bottom <= b.top)
+    {
+        return a;
+    }
+    if (a.right <= a.left || a.bottom <= a.top)
+    {
+        return b;
+    }
+
+    return D2D_RECT_F
+    {
+        std::min(a.left, b.left),
+        std::min(a.top, b.top),
+        std::max(a.right, b.right),
+        std::max(a.bottom, b.bottom)
+    };
+}
+
+Scene::Scene(DXWindowContext* window) noexcept : m_window{ window }
+{
+    m_root.m_scene = this;
+}
+
+void Scene::Initialize(ID2D1DeviceContext6* device)
+{
+    // Caches are recorded using a separate context, so recording doesn't
+    // disturb the window's context, which is between BeginDraw and EndDraw.
+    ComPtr<ID2D1Device> d2dDevice;
+    device->GetDevice(&d2dDevice);
+
+    ComPtr<ID2D1DeviceContext> recordContext;
+    HR(d2dDevice->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &recordContext));
+    HR(recordContext.As(&m_recordContext));
+
+    // Existing caches belong to the old device, if any.
+    ResetCaches(m_root);
+}
+
+void Scene::Reset() noexcept
+{
+    m_recordContext.Reset();
+    ResetCaches(m_root);
+}
+
+void Scene::ResetCaches(SceneNode& node) noexcept
+{
+    node.m_cache.Reset();
+    node.m_isCacheValid = false;
+
+    for (auto const& child : node.m_children)
+    {
+        ResetCaches(*child);
+    }
+}
+
+void Scene::InvalidateRect(D2D_RECT_F const& rect)
+{
+    if (m_window != nullptr)
+    {
+        m_window->Invalidate(rect);
+    }
+}
+
+void Scene::Render(ID2D1DeviceContext6* context)
+{
+    float dpiX, dpiY;
+    context->GetDpi(&dpiX, &dpiY);
+
+    // Record the caches of changed nodes first. Descendants are recorded
+    // before their ancestors, so an ancestor's cache replays theirs.
+    UpdateCaches(m_root, dpiX);
+
+    RenderNode(context, m_root);
+}
+
+void Scene::UpdateCaches(SceneNode& node, float dpi)
+{
+    if (!node.m_isVisible)
+    {
+        return;
+    }
+
+    for (auto const& child : node.m_children)
+    {
+        UpdateCaches(*child, dpi);
+    }
+
+    if (node.m_cacheMode != SceneCacheMode::None && !node.m_isCacheValid)
+    {
+        RecordCache(node, dpi);
+    }
+}
+
+void Scene::RecordCache(SceneNode& node, float dpi)
+{
+    auto context = m_recordContext.Get();
+    context->SetDpi(dpi, dpi);
+
+    ComPtr<ID2D1Image> cache;
+    if (node.m_cacheMode == SceneCacheMode::CommandList)
+    {
+        ComPtr<ID2D1CommandList> commandList;
+        HR(context->CreateCommandList(&commandList));
+
+        context->SetTarget(commandList.Get());
+        context->BeginDraw();
+        context->SetTransform(D2D1::Matrix3x2F::Identity());
+        RenderSubtree(context, node);
+        HRESULT hr = context->EndDraw();
+        context->SetTarget(nullptr);
+        HR(hr);
+
+        HR(commandList->Close());
+        cache = std::move(commandList);
+    }
+    else
+    {
+        D2D_RECT_F const& bounds = node.m_bounds;
+        D2D_SIZE_U pixelSize =
+        {
+            static_cast<uint32_t>(std::max(1.0f, ceilf((bounds.right - bounds.left) * dpi / 96.0f))),
+            static_cast<uint32_t>(std::max(1.0f, ceilf((bounds.bottom - bounds.top) * dpi / 96.0f)))
+        };
+
+        ComPtr<ID2D1Bitmap1> bitmap;
+        HR(context->CreateBitmap(
+            pixelSize,
+            nullptr,
+            0,
+            D2D1::BitmapProperties1(
+                D2D1_BITMAP_OPTIONS_TARGET,
+                D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED),
+                dpi,
+                dpi
+                ),
+            &bitmap
+            ));
+
+        // The bitmap's origin is the top-left corner of the node's bounds.
+        context->SetTarget(bitmap.Get());
+        context->BeginDraw();
+        context->Clear(D2D_COLOR_F{ 0, 0, 0, 0 });
+        context->SetTransform(D2D1::Matrix3x2F::Translation(-bounds.left, -bounds.top));
+        RenderSubtree(context, node);
+        HRESULT hr = context->EndDraw();
+        context->SetTarget(nullptr);
+        HR(hr);
+
+        cache = std::move(bitmap);
+    }
+
+    node.m_cache = std::move(cache);
+    node.m_isCacheValid = true;
+}
+
+void Scene::RenderNode(ID2D1DeviceContext6* context, SceneNode& node)
+{
+    if (!node.m_isVisible)
+    {
+        return;
+    }
+
+    D2D1::Matrix3x2F parentTransform;
+    context->GetTransform(&parentTransform);
+    context->SetTransform(*D2D1::Matrix3x2F::ReinterpretBaseType(&node.m_transform) * parentTransform);
+
+    if (node.m_hasClip)
+    {
+        context->PushAxisAlignedClip(node.m_clip, D2D1_ANTIALIAS_MODE_PER_PRIMITIVE);
+    }
+
+    if (node.m_cache != nullptr && node.m_isCacheValid)
+    {
+        if (node.m_cacheMode == SceneCacheMode::Bitmap)
+        {
+            ComPtr<ID2D1Bitmap1> bitmap;
+            HR(node.m_cache.As(&bitmap));
+            context->DrawBitmap(bitmap.Get(), &node.m_bounds, 1.0f, D2D1_INTERPOLATION_MODE_LINEAR, nullptr, nullptr);
+        }
+        else
+        {
+            context->DrawImage(node.m_cache.Get());
+        }
+    }
+    else
+    {
+        RenderSubtree(context, node);
+    }
+
+    if (node.m_hasClip)
+    {
+        context->PopAxisAlignedClip();
+    }
+
+    context->SetTransform(parentTransform);
 }
 
-void DXWindowContext::ResetDevice() noexcept
+void Scene::RenderSubtree(ID2D1DeviceContext6* context, SceneNode& node)
 {
-    // Reset the swap chain.
-    ResetWindow();
+    node.RenderContent(context);
 
-    // Reset device-dependent resources.
-    m_resourceList.ResetAll();
+    for (auto const& child : node.m_children)
+    {
+        RenderNode(context, *child);
+    }
+}
 
-    // Reset the device if it hasn't already been reset and reinitialized
-    // by another window context.
-    if (m_deviceGeneration == m_device->GetGeneration())
+#pragma endregion // Scene
+
+#pragma region Controls
+
+constexpr uint32_t TextListView::HeightScale;
+constexpr size_t TextListView::BlockSize;
+constexpr double TextListView::PrefetchMargin;
+constexpr float TextListView::ScrollTimeConstantMs;
+
+TextListView::TextListView(DXDevice* device, HWND hwnd, IDWriteTextFormat* textFormat, SwapChainOptions const& options) :
+    DXWindowContext{ device, hwnd, options },
+    m_textFormat{ textFormat }
+{
+    AddResource(&m_textBrush);
+
+    auto dwriteFactory = GetDWriteFactory();
+
+    if (m_textFormat == nullptr)
+    {
+        m_textFormat = device->GetTextFormatCache().Get(L"Consolas", 12.0f, DWRITE_WORD_WRAPPING_NO_WRAP);
+    }
+    else if (m_textFormat->GetWordWrapping() != DWRITE_WORD_WRAPPING_NO_WRAP)
+    {
+        // The format may be shared, e.g., by a TextFormatCache, so it isn't
+        // changed here.
+        throw WinException{ E_INVALIDARG };
+    }
+
+    // Estimate line heights using the height of a typical line.
+    ComPtr<IDWriteTextLayout> textLayout;
+    HR(dwriteFactory->CreateTextLayout(L"X", 1, m_textFormat.Get(), 0, 0, &textLayout));
+
+    DWRITE_TEXT_METRICS metrics;
+    HR(textLayout->GetMetrics(&metrics));
+    m_estimatedHeight = static_cast<uint16_t>(std::min(ceilf(metrics.height * HeightScale), 65535.0f));
+}
+
+void TextListView::AppendLine(wchar_t const* text, uint32_t textLength)
+{
+    bool const wasAtEnd = IsAtEnd();
+
+    m_text.append(text, textLength);
+    m_lineEnds.push_back(static_cast<uint32_t>(m_text.size()));
+    m_lineHeights.push_back(m_estimatedHeight);
+    m_isLineMeasured.push_back(false);
+
+    size_t const lineIndex = m_lineEnds.size() - 1;
+    if (lineIndex % BlockSize == 0)
+    {
+        m_blockHeights.push_back(0);
+        m_blockOffsets.push_back(0);
+    }
+    m_blockHeights.back() += m_estimatedHeight;
+
+    // Redraw if the new line may be visible, and keep following the end.
+    double const lineTop = static_cast<double>(GetLineTop(lineIndex)) / HeightScale;
+    if (lineTop < m_scrollOffset + GetHeightDips())
+    {
+        m_areVisibleLinesValid = false;
+        InvalidateAll();
+    }
+
+    if (wasAtEnd)
     {
-        m_device->Reset();
+        ScrollToEnd();
     }
 }
 
-void DXWindowContext::EnsureInitialized()
+void TextListView::Clear()
 {
-    // If the D2D context is already initialized, then just make sure all
-    // D2D resources are initialized.
-    if (m_d2dContext != nullptr)
+    m_text.clear();
+    m_lineEnds.clear();
+    m_lineHeights.clear();
+    m_isLineMeasured.clear();
+    m_blockHeights.clear();
+    m_blockOffsets.clear();
+    m_validBlockCount = 0;
+    m_visibleLines.clear();
+    m_areVisibleLinesValid = false;
+
+    m_scrollOffset = m_scrollTarget = m_drawnOffset = 0;
+    InvalidateAll();
+}
+
+wchar_t const* TextListView::GetLineText(size_t lineIndex) const noexcept
+{
+    return m_text.data() + (lineIndex == 0 ? 0 : m_lineEnds[lineIndex - 1]);
+}
+
+uint32_t TextListView::GetLineLength(size_t lineIndex) const noexcept
+{
+    return m_lineEnds[lineIndex] - (lineIndex == 0 ? 0 : m_lineEnds[lineIndex - 1]);
+}
+
+void TextListView::SetLineHeight(size_t lineIndex, uint16_t height) noexcept
+{
+    size_t const block = lineIndex / BlockSize;
+    m_blockHeights[block] = m_blockHeights[block] - m_lineHeights[lineIndex] + height;
+    m_lineHeights[lineIndex] = height;
+
+    // Offsets of the following blocks must be recomputed.
+    m_validBlockCount = std::min(m_validBlockCount, block + 1);
+}
+
+void TextListView::EnsureBlockOffsets() const noexcept
+{
+    size_t const blockCount = m_blockHeights.size();
+    if (m_validBlockCount == 0 && blockCount != 0)
     {
-        m_resourceList.EnsureInitialized(m_d2dContext.Get());
+        m_blockOffsets[0] = 0;
+        m_validBlockCount = 1;
+    }
+
+    for (size_t i = m_validBlockCount; i < blockCount; i++)
+    {
+        m_blockOffsets[i] = m_blockOffsets[i - 1] + m_blockHeights[i - 1];
+    }
+    m_validBlockCount = blockCount;
+}
+
+uint64_t TextListView::GetLineTop(size_t lineIndex) const noexcept
+{
+    EnsureBlockOffsets();
+
+    size_t const block = lineIndex / BlockSize;
+    if (block >= m_blockOffsets.size())
+    {
+        return m_blockOffsets.empty() ? 0 : m_blockOffsets.back() + m_blockHeights.back();
+    }
+
+    uint64_t top = m_blockOffsets[block];
+    for (size_t i = block * BlockSize; i < lineIndex; i++)
+    {
+        top += m_lineHeights[i];
+    }
+    return top;
+}
+
+size_t TextListView::FindLine(uint64_t y) const noexcept
+{
+    if (m_lineEnds.empty())
+    {
+        return 0;
+    }
+
+    EnsureBlockOffsets();
+
+    // Find the last block that starts at or above y.
+    auto it = std::upper_bound(m_blockOffsets.begin(), m_blockOffsets.end(), y);
+    size_t const block = (it == m_blockOffsets.begin()) ? 0 : static_cast<size_t>(it - m_blockOffsets.begin()) - 1;
+
+    // Find the line within the block.
+    uint64_t top = m_blockOffsets[block];
+    size_t const end = std::min(m_lineEnds.size(), (block + 1) * BlockSize);
+    for (size_t i = block * BlockSize; i < end; i++)
+    {
+        top += m_lineHeights[i];
+        if (top > y)
+        {
+            return i;
+        }
+    }
+    return end - 1;
+}
+
+double TextListView::GetContentHeight() const noexcept
+{
+    return static_cast<double>(GetLineTop(m_lineEnds.size())) / HeightScale;
+}
+
+double TextListView::GetMaxScrollOffset() const noexcept
+{
+    return std::max(0.0, GetContentHeight() - GetHeightDips());
+}
+
+bool TextListView::IsAtEnd() const noexcept
+{
+    return m_scrollTarget >= GetMaxScrollOffset() - 0.5;
+}
+
+void TextListView::ScrollBy(double delta)
+{
+    ScrollTo(m_scrollTarget + delta);
+}
+
+void TextListView::ScrollTo(double offset)
+{
+    double const target = std::min(std::max(offset, 0.0), GetMaxScrollOffset());
+    if (target != m_scrollTarget)
+    {
+        m_scrollTarget = target;
+        RequestFrame();
+    }
+}
+
+void TextListView::ScrollToLine(size_t lineIndex)
+{
+    if (lineIndex < m_lineEnds.size())
+    {
+        ScrollTo(static_cast<double>(GetLineTop(lineIndex)) / HeightScale);
+    }
+}
+
+void TextListView::ScrollToEnd()
+{
+    ScrollTo(GetMaxScrollOffset());
+}
+
+void TextListView::OnSizeChanged()
+{
+    // The visible range changed, and the end may have moved.
+    m_areVisibleLinesValid = false;
+    m_scrollTarget = std::min(m_scrollTarget, GetMaxScrollOffset());
+    m_scrollOffset = std::min(m_scrollOffset, GetMaxScrollOffset());
+}
+
+void TextListView::AnimateScroll()
+{
+    if (m_scrollOffset == m_scrollTarget)
+    {
+        m_lastAnimationTime = 0;
         return;
     }
 
-    // Ensure the device is initialized, and remember the device generation.
-    m_device->EnsureInitialized();
-    m_deviceGeneration = m_device->GetGeneration();
+    // Move a fraction of the remaining distance, based on the time since
+    // the last frame. Assume a typical frame time after a pause.
+    int64_t const now = FrameProfiler::GetQpcTime();
+    float elapsedMs = m_lastAnimationTime != 0 ? FrameProfiler::QpcToMs(now - m_lastAnimationTime) : 16.0f;
+    elapsedMs = std::min(elapsedMs, 100.0f);
+    m_lastAnimationTime = now;
 
-    // Get the DXGI factory.
-    auto dxgiDevice = m_device->GetDxgiDevice();
-    ComPtr<IDXGIAdapter> dxgiAdapter;
-    HR(dxgiDevice->GetAdapter(&dxgiAdapter));
+    double const fraction = 1.0 - exp(-elapsedMs / ScrollTimeConstantMs);
+    m_scrollOffset += (m_scrollTarget - m_scrollOffset) * fraction;
 
-    ComPtr<IDXGIFactory> dxgiFactory;
-    HR(dxgiAdapter->GetParent(IID_PPV_ARGS(&dxgiFactory)));
+    // Stop when within a quarter pixel of the target.
+    double const dipsPerPixel = 96.0 / GetDpi();
+    if (fabs(m_scrollTarget - m_scrollOffset) < dipsPerPixel / 4)
+    {
+        m_scrollOffset = m_scrollTarget;
+    }
+    else
+    {
+        RequestFrame();
+    }
+}
 
-    // Create a DXGI swap chain for the window.
-    DXGI_SWAP_CHAIN_DESC scDesc = {};
-    scDesc.BufferDesc.Width = GetPixelWidth();
-    scDesc.BufferDesc.Height = GetPixelHeight();
-    scDesc.BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    scDesc.SampleDesc.Count = 1;
-    scDesc.BufferUsage = DXGI_USAGE_BACK_BUFFER | DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    scDesc.BufferCount = 1;
-    scDesc.OutputWindow = m_hwnd;
-    scDesc.Windowed = true;
-    scDesc.SwapEffect = DXGI_SWAP_EFFECT_DISCARD;
+void TextListView::UpdateVisibleLines()
+{
+    // Move the previous lines to the frame arena, so that neither vector
+    // allocates from the heap once m_visibleLines has enough capacity.
+    FrameVector<VisibleLine> oldLines{
+        std::make_move_iterator(m_visibleLines.begin()),
+        std::make_move_iterator(m_visibleLines.end()),
+        ArenaAllocator<VisibleLine>{ GetFrameArena() }
+    };
+    m_visibleLines.clear();
 
-    ComPtr<IDXGISwapChain> dxgiSwapChain;
-    HR(dxgiFactory->CreateSwapChain(
-        dxgiDevice,
-        &scDesc,
-        dxgiSwapChain.GetAddressOf()
-    ));
+    if (m_lineEnds.empty())
+    {
+        return;
+    }
 
-    CD3D11_TEXTURE2D_DESC desc(
-        DXGI_FORMAT_B8G8R8A8_UNORM,
-        GetPixelWidth(),
-        GetPixelHeight(),
-        1, // arraySize 
-        1, // mipLevels
-        D3D11_BIND_RENDER_TARGET // bindFlags
-    );
+    double const viewHeight = GetHeightDips();
+    double const margin = viewHeight * PrefetchMargin;
+    uint64_t const top = static_cast<uint64_t>(std::max(0.0, m_drawnOffset - margin) * HeightScale);
+    uint64_t const bottom = static_cast<uint64_t>((m_drawnOffset + viewHeight + margin) * HeightScale);
 
-    // Get the DXGI surface for the swap chain.
-    ComPtr<IDXGISurface> dxgiSurface;
-    HR(dxgiSwapChain->GetBuffer(0, IID_PPV_ARGS(&dxgiSurface)));
+    auto dwriteFactory = GetDWriteFactory();
+    auto& layoutCache = GetTextLayoutCache();
 
-    // Create the D2D context.
-    auto d2dDevice = m_device->GetD2dDevice();
-    ComPtr<ID2D1DeviceContext6> d2dContext;
-    HR(d2dDevice->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &d2dContext));
+    size_t const firstLine = FindLine(top);
+    uint64_t lineTop = GetLineTop(firstLine);
+    uint64_t viewTop = static_cast<uint64_t>(m_drawnOffset * HeightScale);
+    bool haveHeightsChanged = false;
+    size_t oldIndex = 0;
 
-    // Set the DPI.
-    d2dContext->SetDpi(static_cast<float>(m_dpi), static_cast<float>(m_dpi));
+    for (size_t i = firstLine; i < m_lineEnds.size() && lineTop < bottom; i++)
+    {
+        VisibleLine line{ i, 0, nullptr };
 
-    // Create a D2D bitmap from the swap chain surface, and set it as the target.
-    ComPtr<ID2D1Bitmap1> d2dBitmap;
-    HR(d2dContext->CreateBitmapFromDxgiSurface(
-        dxgiSurface.Get(),
-        D2D1::BitmapProperties1(
-            D2D1_BITMAP_OPTIONS_TARGET | D2D1_BITMAP_OPTIONS_CANNOT_DRAW,
-            D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_IGNORE)
-        ),
-        &d2dBitmap
-    ));
+        // Reuse the layout from the previous range, if any.
+        while (oldIndex < oldLines.size() && oldLines[oldIndex].lineIndex < i)
+        {
+            oldIndex++;
+        }
+        if (oldIndex < oldLines.size() && oldLines[oldIndex].lineIndex == i)
+        {
+            line.textLayout = std::move(oldLines[oldIndex].textLayout);
+        }
+        else
+        {
+            auto layout = layoutCache.Get(dwriteFactory, GetLineText(i), GetLineLength(i), m_textFormat.Get(), 0);
+            line.textLayout = std::move(layout.textLayout);
 
-    d2dContext->SetTarget(d2dBitmap.Get());
+            // Replace the estimated height with the measured height.
+            if (!m_isLineMeasured[i])
+            {
+                m_isLineMeasured[i] = true;
 
-    // Initialize device-dependent resources.
-    m_resourceList.EnsureInitialized(d2dContext.Get());
+                uint16_t height = static_cast<uint16_t>(std::min(ceilf(layout.metrics.height * HeightScale), 65535.0f));
+                int const delta = static_cast<int>(height) - m_lineHeights[i];
+                if (delta != 0)
+                {
+                    SetLineHeight(i, height);
+                    haveHeightsChanged = true;
 
-    // Update members.
-    m_swapChain = std::move(dxgiSwapChain);
-    m_d2dContext = std::move(d2dContext);
+                    // Keep the visible content in place if a line above it
+                    // changed height.
+                    if (lineTop < viewTop)
+                    {
+                        double const deltaDips = static_cast<double>(delta) / HeightScale;
+                        m_scrollOffset += deltaDips;
+                        m_scrollTarget += deltaDips;
+                        viewTop += delta;
+                    }
+                }
+            }
+        }
+
+        line.top = static_cast<double>(lineTop) / HeightScale;
+        lineTop += m_lineHeights[i];
+
+        m_visibleLines.push_back(std::move(line));
+    }
+
+    // If lines moved, redraw everything at the adjusted offset.
+    if (haveHeightsChanged)
+    {
+        m_drawnOffset = SnapToPixels(m_scrollOffset);
+        InvalidateAll();
+    }
+
+    m_areVisibleLinesValid = true;
 }
 
-#pragma endregion // DXWindowContext
+double TextListView::SnapToPixels(double offset) const noexcept
+{
+    double const pixelsPerDip = GetDpi() / 96.0;
+    return floor(offset * pixelsPerDip + 0.5) / pixelsPerDip;
+}
+
+void TextListView::OnBeginFrame()
+{
+    AnimateScroll();
+
+    // Only draw at whole-pixel offsets, so content scrolled by DXGI matches
+    // what would be drawn.
+    double const offset = SnapToPixels(m_scrollOffset);
+
+    if (offset != m_drawnOffset)
+    {
+        Scroll(
+            D2D_RECT_F{ 0, 0, GetWidthDips(), GetHeightDips() },
+            D2D_POINT_2F{ 0, static_cast<float>(m_drawnOffset - offset) }
+            );
+        m_drawnOffset = offset;
+        m_areVisibleLinesValid = false;
+    }
+
+    if (!m_areVisibleLinesValid)
+    {
+        UpdateVisibleLines();
+    }
+}
+
+void TextListView::RenderContent()
+{
+    auto context = GetD2dContext();
+
+    context->Clear(D2D1_COLOR_F{ 1.0f, 1.0f, 1.0f, 1.0f });
+
+    float const viewHeight = GetHeightDips();
+    for (auto const& line : m_visibleLines)
+    {
+        float const y = static_cast<float>(line.top - m_drawnOffset);
+        if (y >= viewHeight)
+        {
+            break;
+        }
+
+        float const height = static_cast<float>(m_lineHeights[line.lineIndex]) / HeightScale;
+        if (y + height > 0)
+        {
+            context->DrawTextLayout(
+                D2D_POINT_2F{ 4.0f, y },
+                line.textLayout.Get(),
+                m_textBrush.Get(),
+                D2D1_DRAW_TEXT_OPTIONS_ENABLE_COLOR_FONT
+                );
+        }
+    }
+}
+
+void TextListView::OnMouseWheel(HWND hwnd, WPARAM wParam) noexcept
+{
+    auto view = GetThis(hwnd);
+    if (view != nullptr)
+    {
+        try
+        {
+            view->OnMouseWheelInternal(GET_WHEEL_DELTA_WPARAM(wParam));
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+    }
+}
+
+void TextListView::OnMouseWheelInternal(int wheelDelta)
+{
+    UINT linesPerNotch = 3;
+    SystemParametersInfoW(SPI_GETWHEELSCROLLLINES, 0, &linesPerNotch, 0);
+
+    double const lineHeight = static_cast<double>(m_estimatedHeight) / HeightScale;
+    if (linesPerNotch == WHEEL_PAGESCROLL)
+    {
+        ScrollBy(-GetHeightDips() * wheelDelta / WHEEL_DELTA);
+    }
+    else
+    {
+        ScrollBy(-lineHeight * linesPerNotch * wheelDelta / WHEEL_DELTA);
+    }
+}
+
+void TextListView::OnKeyDown(HWND hwnd, WPARAM wParam) noexcept
+{
+    auto view = GetThis(hwnd);
+    if (view != nullptr)
+    {
+        try
+        {
+            view->OnKeyDownInternal(wParam);
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+    }
+}
+
+void TextListView::OnKeyDownInternal(WPARAM key)
+{
+    double const lineHeight = static_cast<double>(m_estimatedHeight) / HeightScale;
+    double const pageHeight = std::max(lineHeight, GetHeightDips() - lineHeight);
+
+    switch (key)
+    {
+    case VK_UP:
+        ScrollBy(-lineHeight);
+        break;
+    case VK_DOWN:
+        ScrollBy(lineHeight);
+        break;
+    case VK_PRIOR:
+        ScrollBy(-pageHeight);
+        break;
+    case VK_NEXT:
+        ScrollBy(pageHeight);
+        break;
+    case VK_HOME:
+        ScrollTo(0);
+        break;
+    case VK_END:
+        ScrollToEnd();
+        break;
+    }
+}
+
+#pragma endregion // Controls
@@ -5,31 +5,66 @@
 using Microsoft::WRL::ComPtr;
 
 //
-// Base class with trivial implementation of IUnknown methods.
+// Base class with trivial implementation of IUnknown methods, for a COM
+// object that implements the interface TInterface.
 //
-// QueryInterface only supports IUnknown, but that's OK if all that's needed
-// is reference-counting. A derived class can override QueryInterface if needed.
+// QueryInterface only supports IUnknown and TInterface, but that's OK if all
+// that's needed is reference-counting or an interface with no base other than
+// IUnknown. A derived class can override QueryInterface if needed.
 //
-class ComObjectBase : public IUnknown
+template<typename TInterface>
+class ComObjectBaseT : public TInterface
 {
 public:
-    ComObjectBase() noexcept {}
-    virtual ~ComObjectBase() {}
+    ComObjectBaseT() noexcept {}
+    virtual ~ComObjectBaseT() {}
 
-    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, _COM_Outptr_ void** ppvObject) override;
-    ULONG STDMETHODCALLTYPE AddRef() final override;
-    ULONG STDMETHODCALLTYPE Release() final override;
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, _COM_Outptr_ void** ppvObject) override
+    {
+        if (riid == __uuidof(IUnknown) || riid == __uuidof(TInterface))
+        {
+            *ppvObject = static_cast<TInterface*>(this);
+            AddRef();
+            return S_OK;
+        }
+        else
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() final override
+    {
+        return m_refCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    ULONG STDMETHODCALLTYPE Release() final override
+    {
+        uint32_t newCount = m_refCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
+
+        if (newCount == 0)
+        {
+            delete this;
+        }
+
+        return newCount;
+    }
 
     // Disallow copy, move, and assignment.
-    ComObjectBase(ComObjectBase const&) = delete;
-    ComObjectBase(ComObjectBase&&) = delete;
-    void operator=(ComObjectBase const&) = delete;
-    void operator=(ComObjectBase&&) = delete;
+    ComObjectBaseT(ComObjectBaseT const&) = delete;
+    ComObjectBaseT(ComObjectBaseT&&) = delete;
+    void operator=(ComObjectBaseT const&) = delete;
+    void operator=(ComObjectBaseT&&) = delete;
 
 private:
-    uint32_t m_refCount = 0;
+    // The reference count is atomic so that references can be held and
+    // released by worker threads, e.g., during background device recovery.
+    std::atomic<uint32_t> m_refCount{ 0 };
 };
 
+using ComObjectBase = ComObjectBaseT<IUnknown>;
+
 //
 // Error handling helpers.
 //
@@ -58,12 +93,72 @@ public:
     using WinException::WinException;
 };
 
+//
+// UniqueHandle - owns a Win32 handle that is closed using CloseHandle.
+//
+class UniqueHandle
+{
+public:
+    UniqueHandle() noexcept {}
+
+    explicit UniqueHandle(HANDLE handle) noexcept : m_handle(handle)
+    {
+    }
+
+    ~UniqueHandle()
+    {
+        Reset();
+    }
+
+    HANDLE Get() const noexcept
+    {
+        return m_handle;
+    }
+
+    void Reset(HANDLE newHandle = nullptr) noexcept
+    {
+        if (m_handle != nullptr)
+        {
+            CloseHandle(m_handle);
+        }
+        m_handle = newHandle;
+    }
+
+    // Disallow copy, move, and assignment.
+    UniqueHandle(UniqueHandle const&) = delete;
+    UniqueHandle(UniqueHandle&&) = delete;
+    void operator=(UniqueHandle const&) = delete;
+    void operator=(UniqueHandle&&) = delete;
+
+private:
+    HANDLE m_handle = nullptr;
+};
+
 inline void ThrowLastError()
 {
     DWORD err = GetLastError();
     throw WinException{ HRESULT_FROM_WIN32(err) };
 }
 
+// Throws for an errno value returned by a CRT function such as _wfopen_s,
+// which doesn't set the last Win32 error.
+inline void ThrowErrno(errno_t err)
+{
+    HRESULT hr;
+    switch (err)
+    {
+    case ENOENT: hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND); break;
+    case EACCES: hr = HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED); break;
+    case EEXIST: hr = HRESULT_FROM_WIN32(ERROR_FILE_EXISTS); break;
+    case EMFILE: hr = HRESULT_FROM_WIN32(ERROR_TOO_MANY_OPEN_FILES); break;
+    case ENOSPC: hr = HRESULT_FROM_WIN32(ERROR_DISK_FULL); break;
+    case ENOMEM: hr = E_OUTOFMEMORY; break;
+    case EINVAL: hr = E_INVALIDARG; break;
+    default:     hr = E_FAIL; break;
+    }
+    throw WinException{ hr };
+}
+
 inline void HR(HRESULT hr)
 {
     if (FAILED(hr))
@@ -74,6 +169,203 @@ inline void HR(HRESULT hr)
 
 #pragma endregion // Helpers
 
+#pragma region Threading
+
+//
+// WorkerPool - fixed set of threads with a work-stealing scheduler. Each
+// thread has its own queue. Work submitted by a worker goes to its own
+// queue, and other work is spread across the queues. A thread whose queue
+// is empty steals from the others, so work within a queue runs in FIFO
+// order, but work in different queues runs in any order. Work items must
+// not throw.
+//
+class WorkerPool
+{
+public:
+    // A thread count of zero means one less than the number of cores, so
+    // the UI thread keeps a core to itself.
+    explicit WorkerPool(uint32_t threadCount = 0);
+
+    // Discards work that hasn't started and waits for running work.
+    ~WorkerPool();
+
+    void Submit(std::function<void()> work);
+
+    // Calls work(i) for each i in [0, count) on the workers and the calling
+    // thread, and returns when all the calls have returned. Indices are
+    // claimed one at a time, so uneven work is balanced. If a call throws,
+    // the remaining indices are skipped and the first exception is rethrown.
+    void ParallelFor(uint32_t count, std::function<void(uint32_t)> const& work);
+
+    uint32_t GetThreadCount() const noexcept
+    {
+        return static_cast<uint32_t>(m_threads.size());
+    }
+
+    // Returns a pool shared by the whole process.
+    static WorkerPool& GetDefault();
+
+    // Disallow copy, move, and assignment.
+    WorkerPool(WorkerPool const&) = delete;
+    WorkerPool(WorkerPool&&) = delete;
+    void operator=(WorkerPool const&) = delete;
+    void operator=(WorkerPool&&) = delete;
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> items;
+    };
+
+    void Stop() noexcept;
+    void ThreadProc(uint32_t queueIndex) noexcept;
+
+    // Takes work from the front of the thread's own queue, or steals from
+    // the back of another queue.
+    bool TryTake(uint32_t queueIndex, std::function<void()>& work);
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::atomic<uint32_t> m_nextQueue{ 0 };
+
+    // Idle threads wait for the number of queued items to be nonzero. The
+    // count is incremented with the mutex held, so wakeups aren't lost, and
+    // before the item is queued, so it never underflows. It may briefly
+    // exceed the number of items in the queues.
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::atomic<size_t> m_queuedCount{ 0 };
+    std::atomic<bool> m_isStopping{ false };
+    std::vector<std::thread> m_threads;
+};
+
+#pragma endregion // Threading
+
+#pragma region Memory
+
+//
+// FrameArena - linear allocator for transient data that is freed all at
+// once by Reset, e.g., at the end of a frame. If a frame needs more than
+// the current block, more blocks are added, and the next Reset replaces
+// them with one block large enough for the whole frame, so steady-state
+// frames make no heap allocations. Not thread-safe.
+//
+class FrameArena
+{
+public:
+    static constexpr size_t DefaultBlockSize = 64 * 1024;
+
+    explicit FrameArena(size_t initialSize = DefaultBlockSize);
+
+    // Returns uninitialized memory with the specified alignment, which must
+    // be a power of two.
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    template<typename T>
+    T* AllocateArray(size_t count)
+    {
+        if (count > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length{};
+        }
+        return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // Returns memory to the arena if it is the most recent allocation, e.g.,
+    // when a vector grows. Otherwise, does nothing.
+    void Free(void* p, size_t size) noexcept;
+
+    // Frees all allocations. Destructors are not called.
+    void Reset() noexcept;
+
+    // Bytes allocated since the last Reset, including alignment padding.
+    size_t GetBytesUsed() const noexcept
+    {
+        return m_previousBlocksUsed + m_offset;
+    }
+
+    // Largest number of bytes used between two calls to Reset.
+    size_t GetHighWaterMark() const noexcept
+    {
+        return std::max(m_highWaterMark, GetBytesUsed());
+    }
+
+    size_t GetCapacity() const noexcept;
+
+    // Disallow copy, move, and assignment.
+    FrameArena(FrameArena const&) = delete;
+    FrameArena(FrameArena&&) = delete;
+    void operator=(FrameArena const&) = delete;
+    void operator=(FrameArena&&) = delete;
+
+private:
+    struct Block
+    {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    size_t m_offset = 0;
+    size_t m_previousBlocksUsed = 0;
+    size_t m_highWaterMark = 0;
+};
+
+//
+// ArenaAllocator - STL-compatible allocator that allocates from a
+// FrameArena. Containers using it must not outlive the next Reset.
+//
+template<typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(FrameArena& arena) noexcept : m_arena{ &arena }
+    {
+    }
+
+    template<typename U>
+    ArenaAllocator(ArenaAllocator<U> const& other) noexcept : m_arena{ other.GetArena() }
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        return m_arena->AllocateArray<T>(count);
+    }
+
+    void deallocate(T* p, size_t count) noexcept
+    {
+        m_arena->Free(p, count * sizeof(T));
+    }
+
+    FrameArena* GetArena() const noexcept
+    {
+        return m_arena;
+    }
+
+    template<typename U>
+    bool operator==(ArenaAllocator<U> const& other) const noexcept
+    {
+        return m_arena == other.GetArena();
+    }
+
+    template<typename U>
+    bool operator!=(ArenaAllocator<U> const& other) const noexcept
+    {
+        return m_arena != other.GetArena();
+    }
+
+private:
+    FrameArena* m_arena;
+};
+
+template<typename T>
+using FrameVector = std::vector<T, ArenaAllocator<T>>;
+
+#pragma endregion // Memory
+
 #pragma region Resources
 
 //
@@ -90,6 +382,12 @@ public:
     virtual bool IsInitialized() const noexcept = 0;
     virtual void Reset() noexcept = 0;
 
+    // Called when the DPI of the device context changes. A resource whose
+    // content depends on the DPI can reset itself so it is reinitialized.
+    virtual void OnDpiChanged() noexcept
+    {
+    }
+
     // Disallow copy, move, and assignment.
     IResource2D(IResource2D const&) = delete;
     IResource2D(IResource2D&&) = delete;
@@ -133,8 +431,41 @@ protected:
     ComPtr<T> m_ptr;
 };
 
+//
+// IImageSource2D - interface for a resource that provides an image, e.g.,
+// as the input of an Effect2D. The version changes whenever the content
+// changes, so a consumer can tell whether its cached result is stale.
+//
+class IImageSource2D
+{
+public:
+    // Returns the image for use with the specified context, or null if the
+    // resource isn't initialized.
+    virtual ID2D1Image* GetImage(ID2D1DeviceContext6* context) = 0;
+    virtual uint64_t GetImageVersion() const noexcept = 0;
+
+protected:
+    ~IImageSource2D() = default;
+};
+
+//
+// Converts an sRGB color to linear scRGB. Colors drawn to an scRGB context
+// must be converted, since Direct2D doesn't color-manage them.
+//
+D2D_COLOR_F SrgbToScRgb(D2D_COLOR_F const& color) noexcept;
+
+//
+// Returns true if the context renders in linear scRGB. DXWindowContext sets
+// FP16 buffer precision on its context exactly when its swap chain is in the
+// scRGB color space, and contexts derived from it copy the rendering
+// controls, so the precision carries the color space to them. Other code
+// must not set FP16 precision on a context that doesn't render scRGB.
+//
+bool IsScRgbContext(ID2D1DeviceContext* context) noexcept;
+
 //
 // SolidColorBrush - Implementation of IResource2D for solid color brush.
+// The color is in sRGB and is converted if the context renders in scRGB.
 //
 class SolidColorBrush : public Resource2DBase<ID2D1SolidColorBrush>
 {
@@ -162,200 +493,2931 @@ public:
 
 private:
     D2D_COLOR_F m_color;
+    bool m_isScRgb = false;
 };
 
 //
-// ResourceList2D - non-owning collection of Direct2D device-dependent
-// resources. Adding resources to a resource list ensures that they are
-// initialized before use and reset when necessary (e.g., on device lost).
+// PathGeometry - Implementation of IResource2D for a path geometry whose
+// figures are specified by a callback. The callback is invoked each time
+// the geometry is initialized, and must not close the sink.
 //
-class ResourceList2D
+class PathGeometry : public Resource2DBase<ID2D1PathGeometry1>
 {
 public:
-    void Add(IResource2D* p)
+    using Builder = std::function<void(ID2D1GeometrySink* sink)>;
+
+    PathGeometry() noexcept {}
+
+    explicit PathGeometry(Builder builder) : m_builder{ std::move(builder) }
     {
-        m_resources.push_back(p);
     }
 
-    void ResetAll() noexcept;
-    void EnsureInitialized(ID2D1DeviceContext6* device);
+    void Initialize(ID2D1DeviceContext6* device) override;
 
-private:
-    std::vector<IResource2D*> m_resources;
-};
+    // Replaces the callback. If the geometry is initialized, it is rebuilt
+    // immediately, and realizations of it are recreated on their next draw.
+    void SetBuilder(Builder builder);
 
-#pragma endregion // Resources
+private:
+    void Build();
 
-#pragma region DX_Context
+    Builder m_builder;
+    ComPtr<ID2D1Factory1> m_factory;
+};
 
 //
-// DXDevice - encapsulates a D3D device, which can be shared by
-// multiple window contexts.
+// GeometryRealization - Implementation of IResource2D for a filled or
+// stroked realization of a PathGeometry. Realizations are tessellated once
+// and then drawn without further CPU work.
 //
-class DXDevice : public ComObjectBase
+// The flattening tolerance depends on the DPI and on the scale of the world
+// transform, so realizations are cached per power-of-two scale bucket. The
+// cache is cleared when the DPI changes or the source geometry is recreated.
+// The source geometry must precede the realization in the resource list.
+//
+class GeometryRealization : public IResource2D
 {
 public:
-    bool IsInitialized() const noexcept
+    // Creates a filled realization.
+    explicit GeometryRealization(PathGeometry& geometry) noexcept : m_geometry{ geometry }
     {
-        return m_d2dDevice != nullptr;
     }
 
-    void Reset() noexcept;
-
-    void EnsureInitialized();
-
-    ID2D1Factory7* GetD2dFactory() const noexcept
+    // Creates a stroked realization.
+    GeometryRealization(PathGeometry& geometry, float strokeWidth, ID2D1StrokeStyle* strokeStyle = nullptr) noexcept :
+        m_geometry{ geometry },
+        m_isStroked{ true },
+        m_strokeWidth{ strokeWidth },
+        m_strokeStyle{ strokeStyle }
     {
-        return m_d2dFactory.Get();
     }
 
-    IDWriteFactory7* GetDWriteFactory() const noexcept
-    {
-        return m_dwriteFactory.Get();
-    }
+    // Draws the realization using the context's current transform, first
+    // creating a realization for the transform's scale bucket if needed.
+    void Draw(ID2D1DeviceContext6* context, ID2D1Brush* brush);
 
-    ID3D11DeviceContext* GetD3dContext() const noexcept
-    {
-        return m_d3dContext.Get();
-    }
+    // IResource2D methods. Initialize creates the realization for scale 1.
+    void Initialize(ID2D1DeviceContext6* device) override;
 
-    IDXGIDevice* GetDxgiDevice() const noexcept
+    bool IsInitialized() const noexcept override
     {
-        return m_dxgiDevice.Get();
+        return !m_realizations.empty();
     }
 
-    ID2D1Device6* GetD2dDevice() const noexcept
+    void Reset() noexcept override
     {
-        return m_d2dDevice.Get();
+        m_realizations.clear();
+        m_source = nullptr;
     }
 
-    uint32_t GetGeneration() const noexcept
+    void OnDpiChanged() noexcept override
     {
-        return m_generation;
+        Reset();
     }
 
 private:
-    static ComPtr<ID2D1Factory7> CreateD2DFactory();
-    static ComPtr<IDWriteFactory7> CreateDWriteFactory();
+    // A realization is created at scale 2^bucket.
+    static constexpr int MinScaleBucket = -4;
+    static constexpr int MaxScaleBucket = 8;
+    static constexpr size_t MaxCachedRealizations = 4;
 
-    const ComPtr<ID2D1Factory7> m_d2dFactory = CreateD2DFactory();
-    const ComPtr<IDWriteFactory7> m_dwriteFactory = CreateDWriteFactory();
+    static int GetScaleBucket(D2D_MATRIX_3X2_F const& transform) noexcept;
 
-    ComPtr<ID3D11DeviceContext> m_d3dContext;
-    ComPtr<IDXGIDevice> m_dxgiDevice;
-    ComPtr<ID2D1Device6> m_d2dDevice;
-    uint32_t m_generation = 0;
+    ID2D1GeometryRealization* GetRealization(ID2D1DeviceContext6* context, int bucket);
+
+    struct CachedRealization
+    {
+        int bucket;
+        ComPtr<ID2D1GeometryRealization> realization;
+    };
+
+    PathGeometry& m_geometry;
+    bool m_isStroked = false;
+    float m_strokeWidth = 1.0f;
+    ComPtr<ID2D1StrokeStyle> m_strokeStyle;
+
+    // The geometry and DPI the cached realizations were created from. The
+    // reference ensures a rebuilt geometry can't reuse the same address.
+    ComPtr<ID2D1PathGeometry1> m_source;
+    float m_dpi = 96.0f;
+
+    // Cached realizations, most recently used first.
+    std::vector<CachedRealization> m_realizations;
 };
 
 //
-// DXWindowContext - manages a swap chain and Direct2D device context
-// for a window.
+// AtlasBitmap - Implementation of IResource2D for a bitmap containing
+// sprite images. The pixels (32bpp premultiplied BGRA) are kept in system
+// memory so the bitmap can be recreated after the device is lost. The
+// default atlas is a single white pixel, for drawing solid sprites.
 //
-class DXWindowContext : public ComObjectBase
+class AtlasBitmap : public Resource2DBase<ID2D1Bitmap1>, public IImageSource2D
 {
 public:
-    DXWindowContext(DXDevice* device, HWND hwnd) noexcept;
+    AtlasBitmap() : m_size{ 1, 1 }, m_pixels(1, 0xFFFFFFFF)
+    {
+    }
 
-    void Paint();
+    AtlasBitmap(D2D_SIZE_U size, std::vector<uint32_t> pixels);
 
-    // Static methods for handling window messages.
-    static void OnResize(HWND hwnd) noexcept;
-    static void OnDpiChanged(HWND hwnd, WPARAM wParam, LPARAM lParam) noexcept;
-    static void OnPaint(HWND hwnd) noexcept;
+    void Initialize(ID2D1DeviceContext6* device) override;
 
-    static DXWindowContext* GetThis(HWND hwnd) noexcept
+    void Reset() noexcept override
     {
-        return reinterpret_cast<DXWindowContext*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
+        m_ptr = nullptr;
+        m_device = nullptr;
     }
 
-    static D2D_SIZE_U GetWindowSize(HWND hwnd) noexcept;
+    D2D_SIZE_U GetPixelSize() const noexcept
+    {
+        return m_size;
+    }
 
-    // Getters.
-    uint32_t GetPixelWidth() const noexcept
+    // Replaces all the pixels. If the bitmap exists, it is updated in place,
+    // or recreated on the same device if the size changed.
+    void SetPixels(D2D_SIZE_U size, std::vector<uint32_t> pixels);
+
+    // Copies pixels into the specified rectangle of the atlas, updating the
+    // bitmap in place if it exists. Pitch is in bytes.
+    void UpdatePixels(D2D_RECT_U const& rect, uint32_t const* pixels, uint32_t pitch);
+
+    // IImageSource2D methods.
+    ID2D1Image* GetImage(ID2D1DeviceContext6* context) override
     {
-        return m_pixelSize.width;
+        UNREFERENCED_PARAMETER(context);
+        return m_ptr.Get();
     }
 
-    uint32_t GetPixelHeight() const noexcept
+    uint64_t GetImageVersion() const noexcept override
     {
-        return m_pixelSize.height;
+        return m_version;
     }
 
-    float GetWidthDips() const noexcept
+private:
+    void CreateBitmap(ID2D1DeviceContext6* context);
+
+    // The device and color space the bitmap was created for, so SetPixels
+    // can recreate it on a context of its own.
+    ComPtr<ID2D1Device6> m_device;
+    bool m_isScRgb = false;
+    D2D_SIZE_U m_size;
+    std::vector<uint32_t> m_pixels;
+    uint64_t m_version = 1;
+};
+
+//
+// SpriteBatch - Implementation of IResource2D for an ID2D1SpriteBatch
+// that draws images from an AtlasBitmap. Sprite properties are kept in
+// system memory as separate arrays, and only sprites added or changed
+// since the last draw are uploaded. The atlas must precede the sprite
+// batch in the resource list.
+//
+class SpriteBatch : public Resource2DBase<ID2D1SpriteBatch>
+{
+public:
+    explicit SpriteBatch(AtlasBitmap& atlas) noexcept : m_atlas{ atlas }
     {
-        return GetPixelWidth() * (96.0f / m_dpi);
     }
 
-    float GetHeightDips() const noexcept
+    void Initialize(ID2D1DeviceContext6* device) override;
+
+    void Reset() noexcept override
     {
-        return GetPixelHeight() * (96.0f / m_dpi);
+        m_ptr = nullptr;
+        m_uploadedCount = 0;
+        m_dirtyBegin = m_dirtyEnd = 0;
     }
 
-    ID2D1Factory7* GetD2dFactory() const noexcept
+    uint32_t GetSpriteCount() const noexcept
     {
-        return m_device->GetD2dFactory();
+        return static_cast<uint32_t>(m_destinationRects.size());
     }
 
-    IDWriteFactory7* GetDWriteFactory() const noexcept
+    // Adds sprites and returns the index of the first one. The destination
+    // rectangles are required. Any other array may be null, in which case
+    // the sprites get the default value: the whole atlas, white, or the
+    // identity transform.
+    uint32_t AddSprites(
+        uint32_t count,
+        D2D_RECT_F const* destinationRects,
+        D2D_RECT_U const* sourceRects = nullptr,
+        D2D_COLOR_F const* colors = nullptr,
+        D2D_MATRIX_3X2_F const* transforms = nullptr
+        );
+
+    // Changes a range of sprites. Properties whose arrays are null are left
+    // unchanged.
+    void SetSprites(
+        uint32_t startIndex,
+        uint32_t count,
+        D2D_RECT_F const* destinationRects,
+        D2D_RECT_U const* sourceRects = nullptr,
+        D2D_COLOR_F const* colors = nullptr,
+        D2D_MATRIX_3X2_F const* transforms = nullptr
+        );
+
+    // Removes all sprites.
+    void Clear() noexcept;
+
+    D2D1_BITMAP_INTERPOLATION_MODE GetInterpolationMode() const noexcept
     {
-        return m_device->GetDWriteFactory();
+        return m_interpolationMode;
     }
 
-    ID2D1DeviceContext6* GetD2dContext() const noexcept
+    void SetInterpolationMode(D2D1_BITMAP_INTERPOLATION_MODE mode) noexcept
     {
-        return m_d2dContext.Get();
+        m_interpolationMode = mode;
     }
 
-    static void ForceDpi(uint16_t dpi) noexcept
+    // Uploads pending changes and draws all sprites. Sprite batches require
+    // aliased antialiasing, so the mode is set for the duration of the call.
+    void Draw(ID2D1DeviceContext6* context);
+
+private:
+    void Upload();
+
+    AtlasBitmap& m_atlas;
+    D2D1_BITMAP_INTERPOLATION_MODE m_interpolationMode = D2D1_BITMAP_INTERPOLATION_MODE_LINEAR;
+
+    // Sprite properties, one element per sprite.
+    std::vector<D2D_RECT_F> m_destinationRects;
+    std::vector<D2D_RECT_U> m_sourceRects;
+    std::vector<D2D_COLOR_F> m_colors;
+    std::vector<D2D_MATRIX_3X2_F> m_transforms;
+
+    // Sprites [0, m_uploadedCount) exist in the sprite batch, and sprites
+    // [m_dirtyBegin, m_dirtyEnd) among them have changed since.
+    uint32_t m_uploadedCount = 0;
+    uint32_t m_dirtyBegin = 0;
+    uint32_t m_dirtyEnd = 0;
+};
+
+//
+// Effect2D - Implementation of IResource2D for a Direct2D effect, e.g., a
+// blur, shadow, or color matrix. Property values and inputs are kept, so
+// the effect can be recreated after the device is lost. Inputs are image
+// sources, e.g., an AtlasBitmap or another Effect2D for an effect graph,
+// which must outlive the effect.
+//
+// If caching is enabled, Draw renders the output into a bitmap at the
+// context's DPI and draws the bitmap on later frames, until a property or
+// input changes. The cached output is drawn at the same size, so caching
+// suits effects drawn without a scale transform. Outputs with infinite
+// bounds, e.g., a flood, aren't cached. An effect used as the input of
+// another effect should not be cached itself, since it is rendered as part
+// of the other effect's graph.
+//
+// Drawing updates the cache, and an effect is recreated when it is used
+// with another context, so an effect must not be drawn from RenderRegion.
+//
+class Effect2D : public IResource2D, public IImageSource2D
+{
+public:
+    explicit Effect2D(REFCLSID effectId, bool isCached = true) noexcept :
+        m_effectId{ effectId },
+        m_isCached{ isCached }
     {
-        m_forceDpi = dpi;
     }
 
-protected:
+    void Initialize(ID2D1DeviceContext6* device) override;
 
-    // Derived class calls AddResource to ensure device-dependent objects
-    // are initialized and reinitialized as needed.
-    void AddResource(IResource2D* p)
+    bool IsInitialized() const noexcept override
     {
-        m_resourceList.Add(p);
+        return m_effect != nullptr;
     }
 
-    // Abstract method implemented by derived class to render a frame.
-    virtual void RenderContent() = 0;
+    void Reset() noexcept override;
 
-    virtual void OnSizeChanged()
+    // The cached output is in pixels, so it is rendered again.
+    void OnDpiChanged() noexcept override
     {
+        m_cacheBitmap = nullptr;
     }
 
-    virtual void OnDpiChanged()
+    // Sets a property, e.g., SetValue(D2D1_GAUSSIANBLUR_PROP_STANDARD_DEVIATION, 4.0f).
+    // Setting the current value again doesn't invalidate the cache.
+    template<typename T>
+    void SetValue(uint32_t index, T const& value)
+    {
+        SetValueBytes(index, &value, sizeof(T));
+    }
+
+    void SetValueBytes(uint32_t index, void const* data, uint32_t size);
+
+    // Sets an input, or removes it if source is null.
+    void SetInput(uint32_t index, IImageSource2D* source);
+
+    // Returns the output of the effect graph for the specified context,
+    // creating the effects on that context if needed.
+    ID2D1Image* GetImage(ID2D1DeviceContext6* context) override;
+
+    // Changes if a property or input of this effect or any effect it uses
+    // as input changes.
+    uint64_t GetImageVersion() const noexcept override;
+
+    // Draws the output at the specified offset, in DIPs. Uses the cached
+    // output if it is up to date; otherwise, renders it again.
+    void Draw(ID2D1DeviceContext6* context, D2D_POINT_2F offset = {});
+
+    ID2D1Effect* Get() const noexcept
+    {
+        return m_effect.Get();
+    }
+
+private:
+    void EnsureEffect(ID2D1DeviceContext6* context);
+    ID2D1DeviceContext6* GetCacheContext(ID2D1DeviceContext6* context);
+    bool UpdateCache(ID2D1DeviceContext6* context);
+
+    struct Property
+    {
+        uint32_t index;
+        std::vector<uint8_t> data;
+    };
+
+    // The version of the source when GetImageVersion last checked it.
+    struct Input
+    {
+        IImageSource2D* source;
+        ID2D1Image* appliedImage;
+        mutable uint64_t sourceVersion;
+    };
+
+    // The version is incremented when a property or input is set, or when
+    // GetImageVersion finds that the version of an input's source changed.
+    const CLSID m_effectId;
+    const bool m_isCached;
+    std::vector<Property> m_properties;
+    std::vector<Input> m_inputs;
+    mutable uint64_t m_version = 1;
+
+    // An effect belongs to the context that created it, so it is recreated
+    // if it is used with another context. A cached effect is used only
+    // with the cache context.
+    ComPtr<ID2D1Effect> m_effect;
+    ComPtr<ID2D1DeviceContext6> m_context;
+
+    // Cached output, its bounds in DIPs, and the version and DPI it was
+    // rendered at, or the version and DPI whose output couldn't be cached.
+    ComPtr<ID2D1DeviceContext6> m_cacheContext;
+    ComPtr<ID2D1Bitmap1> m_cacheBitmap;
+    D2D_RECT_F m_cacheBounds = {};
+    uint64_t m_cacheVersion = 0;
+    float m_cacheDpi = 0;
+    uint64_t m_uncacheableVersion = 0;
+    float m_uncacheableDpi = 0;
+};
+
+class Bitmap2D;
+class DXDevice;
+
+//
+// BitmapCache - limits the GPU memory used by Bitmap2D resources. Each
+// frame, Trim releases the uploaded levels of the least recently drawn
+// bitmaps if their total exceeds the budget, or if the process uses more
+// video memory than the OS budget reported by QueryVideoMemoryInfo.
+// Released levels are uploaded again from system memory when next drawn.
+//
+class BitmapCache
+{
+public:
+    static constexpr uint64_t DefaultBudget = 256 * 1024 * 1024;
+
+    explicit BitmapCache(uint64_t budgetBytes = DefaultBudget) noexcept : m_budget{ budgetBytes }
+    {
+    }
+
+    // Call once per frame, e.g., from OnBeginFrame.
+    void Trim(DXDevice* device);
+
+    uint64_t GetUploadedBytes() const noexcept;
+
+    // Disallow copy, move, and assignment.
+    BitmapCache(BitmapCache const&) = delete;
+    BitmapCache(BitmapCache&&) = delete;
+    void operator=(BitmapCache const&) = delete;
+    void operator=(BitmapCache&&) = delete;
+
+private:
+    friend class Bitmap2D;
+
+    void Add(Bitmap2D* bitmap);
+    void Remove(Bitmap2D* bitmap) noexcept;
+
+    uint64_t GetFrameNumber() const noexcept
+    {
+        return m_frameNumber;
+    }
+
+    const uint64_t m_budget;
+    uint64_t m_frameNumber = 1;
+    std::vector<Bitmap2D*> m_bitmaps;
+    std::vector<Bitmap2D*> m_evictionOrder;
+
+    ComPtr<IDXGIAdapter3> m_adapter;
+    uint32_t m_adapterGeneration = 0;
+};
+
+//
+// Bitmap2D - Implementation of IResource2D for an image file. The file is
+// decoded by WIC on the worker pool, optionally reading it through a file
+// mapping, and a pyramid of levels, each half the size of the previous, is
+// generated in system memory. Draw uploads and draws the smallest level
+// that covers the destination at the current DPI and scale, and does
+// nothing until decoding completes. After a device loss, levels are
+// uploaded again from the system memory copies without decoding.
+//
+class Bitmap2D : public IResource2D
+{
+public:
+    explicit Bitmap2D(std::wstring path, BitmapCache* cache = nullptr, bool useMemoryMapping = false);
+    ~Bitmap2D();
+
+    // Returns true if the image has been decoded. Returns false while
+    // decoding is in progress or if it failed.
+    bool IsReady();
+
+    // Returns the error that decoding failed with, or S_OK.
+    HRESULT GetDecodeError() const;
+
+    // Sets a function that is called on a worker thread when decoding is
+    // complete, e.g., to redraw the window. It isn't called after the
+    // Bitmap2D is destroyed, and the destructor waits for it if it is
+    // running.
+    void SetCompletionCallback(std::function<void()> callback);
+
+    // Size of the full-resolution image in pixels, or zero if decoding
+    // isn't complete or failed.
+    D2D_SIZE_U GetPixelSize() const;
+
+    // Draws the image scaled to the destination rectangle, in DIPs.
+    void Draw(ID2D1DeviceContext6* context, D2D_RECT_F const& destinationRect, float opacity = 1.0f);
+
+    // Releases the uploaded levels, keeping the system memory copies.
+    void ReleaseUploadedLevels() noexcept;
+
+    uint64_t GetUploadedBytes() const noexcept;
+
+    uint64_t GetLastDrawnFrame() const noexcept
+    {
+        return m_lastDrawnFrame;
+    }
+
+    // IResource2D methods. Levels are uploaded on demand by Draw, so
+    // Initialize does no work.
+    void Initialize(ID2D1DeviceContext6* device) override;
+
+    bool IsInitialized() const noexcept override
+    {
+        return m_isInitialized;
+    }
+
+    void Reset() noexcept override;
+
+    // Releases the uploaded levels, since a different level may be needed
+    // at the new DPI.
+    void OnDpiChanged() noexcept override
+    {
+        ReleaseUploadedLevels();
+    }
+
+private:
+    struct Level
+    {
+        D2D_SIZE_U size;
+        std::vector<uint32_t> pixels;
+    };
+
+    // Decoding state, shared with the worker thread. The callback mutex is
+    // held while the callback runs.
+    struct DecodeState
+    {
+        std::mutex mutex;
+        std::mutex callbackMutex;
+        bool isComplete = false;
+        std::atomic<bool> isCanceled{ false };
+        HRESULT hr = S_OK;
+        std::vector<Level> levels;
+        std::function<void()> callback;
+    };
+
+    static std::vector<Level> Decode(wchar_t const* path, bool useMemoryMapping);
+    static Level Downsample(Level const& source);
+
+    BitmapCache* const m_cache;
+    std::shared_ptr<DecodeState> m_decodeState;
+    std::vector<Level> m_levels;
+    std::vector<ComPtr<ID2D1Bitmap1>> m_uploadedLevels;
+    uint64_t m_lastDrawnFrame = 0;
+    bool m_isInitialized = false;
+};
+
+//
+// ResourceList2D - non-owning collection of Direct2D device-dependent
+// resources. Adding resources to a resource list ensures that they are
+// initialized before use and reset when necessary (e.g., on device lost).
+//
+// The list only checks its resources after something could have changed:
+// a resource was added, the resources were reset, or Invalidate was called.
+// In the steady state, EnsureInitialized is O(1).
+//
+class ResourceList2D
+{
+public:
+    void Add(IResource2D* p)
+    {
+        m_resources.push_back(p);
+        m_isDirty = true;
+    }
+
+    // Causes the next EnsureInitialized call to check every resource. Call
+    // this if a resource in the list was reset individually, or when the
+    // resources must be initialized for a new device context.
+    void Invalidate() noexcept
+    {
+        m_isDirty = true;
+    }
+
+    void ResetAll() noexcept;
+
+    size_t GetCount() const noexcept
+    {
+        return m_resources.size();
+    }
+
+    // Notifies every resource that the DPI changed. Resources that reset
+    // themselves are reinitialized by the next EnsureInitialized call.
+    void OnDpiChanged() noexcept;
+
+    void EnsureInitialized(ID2D1DeviceContext6* device)
+    {
+        if (m_isDirty)
+        {
+            InitializeAll(device);
+        }
+    }
+
+    // Initializes every uninitialized resource using a pool of threads, each
+    // with its own device context created from the specified device. The
+    // device must have been created by a multithreaded D2D factory, and no
+    // other thread may use the resources until this method returns. The
+    // buffer precision, if known, is set on each context, so resources see
+    // the same color space as on the target's context.
+    void InitializeAllInParallel(
+        ID2D1Device6* device,
+        float dpi,
+        D2D1_BUFFER_PRECISION bufferPrecision = D2D1_BUFFER_PRECISION_UNKNOWN
+        );
+
+private:
+    void InitializeAll(ID2D1DeviceContext6* device);
+
+    std::vector<IResource2D*> m_resources;
+    bool m_isDirty = false;
+};
+
+#pragma endregion // Resources
+
+#pragma region Text
+
+//
+// CachedTextLayout - a text layout and its metrics, as returned by
+// TextLayoutCache. The layout may be shared, so it must not be modified.
+//
+struct CachedTextLayout
+{
+    ComPtr<IDWriteTextLayout> textLayout;
+    DWRITE_TEXT_METRICS metrics;
+};
+
+//
+// TextLayoutCache - least-recently-used cache of text layouts keyed by
+// string, text format, maximum width, and font size. The cache evicts
+// layouts when their estimated memory exceeds the budget.
+//
+class TextLayoutCache
+{
+public:
+    static constexpr size_t DefaultBudget = 4 * 1024 * 1024;
+
+    explicit TextLayoutCache(size_t budgetBytes = DefaultBudget);
+    ~TextLayoutCache();
+
+    // Returns the layout for the specified key, creating it if necessary.
+    // A fontSize of zero means the text format's font size.
+    CachedTextLayout Get(
+        IDWriteFactory7* factory,
+        wchar_t const* text,
+        uint32_t textLength,
+        IDWriteTextFormat* textFormat,
+        float maxWidth,
+        float fontSize = 0
+    );
+
+    // Returns true and gets the layout if it is in the cache. Otherwise,
+    // starts creating the layout on the worker pool, if not already
+    // started, and returns false. The factory must be thread-safe, e.g., a
+    // shared DirectWrite factory, and the text format must not be changed
+    // while layouts are pending.
+    bool TryGet(
+        IDWriteFactory7* factory,
+        wchar_t const* text,
+        uint32_t textLength,
+        IDWriteTextFormat* textFormat,
+        float maxWidth,
+        float fontSize,
+        _Out_ CachedTextLayout* result
+    );
+
+    // Adds layouts completed by worker threads to the cache. Must be called
+    // on the thread that uses the cache. Returns the number added. If any
+    // layout failed, throws its error after adding the others.
+    size_t ProcessCompletedLayouts();
+
+    // Sets a function that is called on a worker thread after a layout is
+    // completed, e.g., to wake the UI thread to call ProcessCompletedLayouts.
+    void SetCompletionCallback(std::function<void()> callback);
+
+    // Number of layouts requested by TryGet that haven't been added yet.
+    size_t GetPendingCount() const noexcept
+    {
+        return m_pending.size();
+    }
+
+    size_t GetBudget() const noexcept
+    {
+        return m_budget;
+    }
+
+    void SetBudget(size_t budgetBytes) noexcept;
+
+    // Estimated memory used by cached layouts, in bytes.
+    size_t GetMemoryUsage() const noexcept
+    {
+        return m_memoryUsage;
+    }
+
+    size_t GetCount() const noexcept
+    {
+        return m_entries.size();
+    }
+
+    void Clear() noexcept;
+
+private:
+    // Key that refers to a string it does not own. Keys in the map refer
+    // to the string owned by the corresponding entry.
+    struct KeyView
+    {
+        wchar_t const* text;
+        uint32_t textLength;
+        IDWriteTextFormat* textFormat;
+        float maxWidth;
+        float fontSize;
+
+        bool operator==(KeyView const& other) const noexcept;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(KeyView const& key) const noexcept;
+    };
+
+    struct Entry
+    {
+        std::wstring text;
+        ComPtr<IDWriteTextFormat> textFormat;
+        float maxWidth;
+        float fontSize;
+        CachedTextLayout value;
+        size_t size;
+
+        KeyView GetKey() const noexcept
+        {
+            return KeyView{ text.c_str(), static_cast<uint32_t>(text.size()), textFormat.Get(), maxWidth, fontSize };
+        }
+    };
+
+    using EntryList = std::list<Entry>;
+
+    // A layout being created by a worker thread.
+    struct PendingLayout
+    {
+        std::wstring text;
+        ComPtr<IDWriteTextFormat> textFormat;
+        float maxWidth;
+        float fontSize;
+        CachedTextLayout value;
+        HRESULT hr;
+
+        KeyView GetKey() const noexcept
+        {
+            return KeyView{ text.c_str(), static_cast<uint32_t>(text.size()), textFormat.Get(), maxWidth, fontSize };
+        }
+    };
+
+    // State shared with worker threads, which may outlive the cache.
+    struct AsyncState
+    {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<PendingLayout>> completed;
+        std::function<void()> callback;
+    };
+
+    static size_t EstimateSize(uint32_t textLength) noexcept;
+    void EvictToBudget() noexcept;
+
+    static CachedTextLayout CreateLayout(
+        IDWriteFactory7* factory,
+        wchar_t const* text,
+        uint32_t textLength,
+        IDWriteTextFormat* textFormat,
+        float maxWidth,
+        float fontSize
+    );
+
+    void Insert(std::wstring text, IDWriteTextFormat* textFormat, float maxWidth, float fontSize, CachedTextLayout const& value);
+
+    // Entries in most-recently-used order.
+    EntryList m_entries;
+    std::unordered_map<KeyView, EntryList::iterator, KeyHash> m_map;
+    size_t m_budget;
+    size_t m_memoryUsage = 0;
+
+    // Layouts requested by TryGet, keyed by strings they own.
+    std::unordered_map<KeyView, std::shared_ptr<PendingLayout>, KeyHash> m_pending;
+    std::shared_ptr<AsyncState> m_asyncState;
+};
+
+//
+// GlyphRunBatch - captures the glyph runs of text layouts once, so they can
+// be drawn in later frames without going through DrawTextLayout.
+//
+// Monochrome left-to-right runs that share a font face, font size, and
+// measuring mode are merged into a single DrawGlyphRun call, regardless of
+// which layout they came from. Color glyphs such as emoji are translated into
+// color layers using TranslateColorGlyphRun at capture time, and are drawn
+// in order. Drawing effects set on the layouts are ignored.
+//
+// GlyphRunBatch is a resource because it owns a brush for color layers. It
+// must be added to the window context's resource list.
+//
+class GlyphRunBatch : public IResource2D
+{
+public:
+    GlyphRunBatch() noexcept {}
+
+    // Captures the glyph runs of a layout drawn at the specified origin.
+    // Baselines are snapped to device pixels at the specified DPI, so the
+    // layouts must be captured again if the DPI changes.
+    void AddTextLayout(IDWriteFactory7* factory, IDWriteTextLayout* textLayout, D2D_POINT_2F origin, float dpi);
+
+    void Clear() noexcept;
+
+    bool IsEmpty() const noexcept
+    {
+        return m_runs.empty() && m_decorations.empty();
+    }
+
+    // Draws the captured text. Monochrome text uses the specified brush.
+    void Draw(ID2D1DeviceContext6* context, ID2D1Brush* textBrush);
+
+    // IResource2D methods.
+    void Initialize(ID2D1DeviceContext6* device) override;
+
+    bool IsInitialized() const noexcept override
+    {
+        return m_layerBrush != nullptr;
+    }
+
+    void Reset() noexcept override
+    {
+        m_layerBrush = nullptr;
+    }
+
+private:
+    class Recorder;
+
+    struct GlyphRun
+    {
+        ComPtr<IDWriteFontFace> fontFace;
+        float fontEmSize;
+        std::vector<UINT16> glyphIndices;
+        std::vector<float> glyphAdvances;
+        std::vector<DWRITE_GLYPH_OFFSET> glyphOffsets;
+        BOOL isSideways;
+        UINT32 bidiLevel;
+        D2D_POINT_2F baselineOrigin;
+        DWRITE_MEASURING_MODE measuringMode;
+        DWRITE_GLYPH_IMAGE_FORMATS imageFormat;
+        D2D_COLOR_F color;
+        bool useTextBrush;
+
+        // True if the run is a layer from TranslateColorGlyphRun, which must
+        // be drawn in order with the other layers of its glyphs.
+        bool isColorLayer;
+        bool isMerged = false;
+
+        DWRITE_GLYPH_RUN GetGlyphRun() const noexcept;
+        bool IsMergeable() const noexcept;
+        bool CanMergeWith(GlyphRun const& other) const noexcept;
+        void Append(GlyphRun const& other);
+    };
+
+    void AddGlyphRun(
+        DWRITE_GLYPH_RUN const& glyphRun,
+        D2D_POINT_2F baselineOrigin,
+        DWRITE_MEASURING_MODE measuringMode,
+        DWRITE_GLYPH_IMAGE_FORMATS imageFormat,
+        D2D_COLOR_F const* color,
+        bool isColorLayer
+    );
+
+    void BuildBatches();
+
+    std::vector<GlyphRun> m_runs;
+    std::vector<GlyphRun> m_batches;
+    std::vector<D2D_RECT_F> m_decorations;
+    bool m_areBatchesValid = false;
+    ComPtr<ID2D1SolidColorBrush> m_layerBrush;
+};
+
+//
+// TextFormatCache - text formats keyed by their font and word wrapping
+// properties, so windows that use the same format share it instead of each
+// creating their own. Returned formats are shared, so they must not be
+// modified. Safe to call from any thread.
+//
+class TextFormatCache
+{
+public:
+    explicit TextFormatCache(IDWriteFactory7* factory) noexcept : m_factory{ factory }
+    {
+    }
+
+    TextFormatCache(TextFormatCache const&) = delete;
+    void operator=(TextFormatCache const&) = delete;
+
+    // Returns the text format with the specified properties, creating it
+    // the first time. The font is from the system font collection.
+    ComPtr<IDWriteTextFormat> Get(
+        wchar_t const* familyName,
+        float fontSize,
+        DWRITE_WORD_WRAPPING wordWrapping = DWRITE_WORD_WRAPPING_WRAP,
+        DWRITE_FONT_WEIGHT fontWeight = DWRITE_FONT_WEIGHT_NORMAL,
+        DWRITE_FONT_STYLE fontStyle = DWRITE_FONT_STYLE_NORMAL,
+        DWRITE_FONT_STRETCH fontStretch = DWRITE_FONT_STRETCH_NORMAL,
+        wchar_t const* localeName = L"en-us"
+    );
+
+    void Clear() noexcept;
+
+private:
+    struct Key
+    {
+        std::wstring familyName;
+        std::wstring localeName;
+        float fontSize;
+        DWRITE_WORD_WRAPPING wordWrapping;
+        DWRITE_FONT_WEIGHT fontWeight;
+        DWRITE_FONT_STYLE fontStyle;
+        DWRITE_FONT_STRETCH fontStretch;
+
+        bool operator==(Key const& other) const noexcept;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(Key const& key) const noexcept;
+    };
+
+    // Owned by the DXDevice that owns the cache.
+    IDWriteFactory7* const m_factory;
+
+    std::mutex m_mutex;
+    std::unordered_map<Key, ComPtr<IDWriteTextFormat>, KeyHash> m_formats;
+};
+
+//
+// FontWarmupOptions - specifies the fonts WarmUpFonts loads.
+//
+struct FontWarmupOptions
+{
+    // Font families the application creates text formats with.
+    std::vector<std::wstring> familyNames{ L"Segoe UI" };
+
+    // Text that is laid out with each family, so the fallback fonts for any
+    // characters the families don't have, such as emoji, are resolved.
+    std::wstring sampleText{ L"Hello World! \U0001F600" };
+
+    std::wstring localeName{ L"en-us" };
+};
+
+// Loads the system font set and the fonts of the specified families, and
+// lays out the sample text to resolve its fallback fonts. The first text
+// format and layout created afterward don't wait for font enumeration, file
+// mapping, or fallback resolution, which DirectWrite caches in the factory.
+// The factory must be a shared (thread-safe) DirectWrite factory.
+void WarmUpFonts(IDWriteFactory7* factory, FontWarmupOptions const& options);
+
+#pragma endregion // Text
+
+#pragma region Instrumentation
+
+//
+// FramePhase - CPU phases of a frame rendered by a DXWindowContext.
+//
+enum class FramePhase : uint32_t
+{
+    EnsureInitialized,
+    RenderContent,
+    EndDraw,
+    Present
+};
+
+constexpr uint32_t FramePhaseCount = 4;
+
+char const* GetFramePhaseName(FramePhase phase) noexcept;
+
+//
+// FrameTiming - timing information for one frame. Times are in milliseconds.
+// Negative values mean the measurement is not available.
+//
+struct FrameTiming
+{
+    uint64_t frameNumber;
+    int64_t startQpc;
+    float cpuMs[FramePhaseCount];
+    float gpuMs;
+    float presentToDisplayMs;
+
+    // Vertical syncs missed since the previous present. This is only
+    // meaningful when frames are rendered continuously.
+    uint32_t missedVsyncs;
+
+    float GetTotalCpuMs() const noexcept
+    {
+        float total = 0;
+        for (float ms : cpuMs)
+        {
+            total += ms;
+        }
+        return total;
+    }
+};
+
+//
+// FrameTimingLog - fixed-size ring buffer of recent frame timings. One thread
+// adds entries, and any thread can read them without taking a lock.
+//
+class FrameTimingLog
+{
+public:
+    static constexpr uint32_t Capacity = 256;
+
+    void Add(FrameTiming const& timing) noexcept;
+
+    // Copies up to maxCount of the most recent entries, oldest first.
+    // Returns the number of entries copied.
+    uint32_t GetRecent(FrameTiming* timings, uint32_t maxCount) const noexcept;
+
+    // Writes the recent entries to a CSV file.
+    void WriteCsv(wchar_t const* fileName) const;
+
+private:
+    // Each slot is protected by a sequence number, which is odd while the
+    // slot is being written.
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence{ 0 };
+        FrameTiming timing = {};
+    };
+
+    Slot m_slots[Capacity];
+    std::atomic<uint64_t> m_count{ 0 };
+};
+
+//
+// FrameProfiler - measures frames and adds the results to a FrameTimingLog.
+// CPU phases are measured with QueryPerformanceCounter and GPU time with D3D
+// timestamp queries. Frames are added to the log once their GPU time and DXGI
+// frame statistics are available, which is usually a few frames later.
+//
+class FrameProfiler
+{
+public:
+    void BeginFrame() noexcept;
+    void BeginGpuWork(ID3D11DeviceContext* d3dContext);
+    void EndPhase(FramePhase phase) noexcept;
+    void EndFrame(ID3D11DeviceContext* d3dContext, IDXGISwapChain1* swapChain);
+
+    // Frees device-dependent queries and discards unfinished measurements.
+    void Reset() noexcept;
+
+    FrameTimingLog const& GetLog() const noexcept
+    {
+        return m_log;
+    }
+
+    // Returns the timing of the frame being measured. Its GPU and display
+    // times aren't known until after EndFrame.
+    FrameTiming const& GetCurrentFrame() const noexcept
+    {
+        return m_current;
+    }
+
+    static int64_t GetQpcTime() noexcept;
+    static float QpcToMs(int64_t qpcDelta) noexcept;
+
+private:
+    static constexpr uint32_t MaxPendingFrames = 4;
+
+    struct PendingFrame
+    {
+        FrameTiming timing;
+        int64_t presentQpc;
+        UINT presentCount;
+        uint32_t age;
+        bool isActive;
+        bool isGpuPending;
+    };
+
+    struct GpuQueries
+    {
+        ComPtr<ID3D11Query> disjoint;
+        ComPtr<ID3D11Query> begin;
+        ComPtr<ID3D11Query> end;
+    };
+
+    void UpdatePresentStatistics(IDXGISwapChain1* swapChain) noexcept;
+    void UpdateGpuTime(ID3D11DeviceContext* d3dContext, uint32_t index) noexcept;
+    void Publish(PendingFrame& frame) noexcept;
+
+    FrameTimingLog m_log;
+    PendingFrame m_pending[MaxPendingFrames] = {};
+    GpuQueries m_queries[MaxPendingFrames];
+    uint32_t m_nextPending = 0;
+
+    FrameTiming m_current = {};
+    int64_t m_phaseStartQpc = 0;
+    bool m_isGpuWorkActive = false;
+    uint64_t m_frameCount = 0;
+
+    DXGI_FRAME_STATISTICS m_lastStats = {};
+    bool m_hasLastStats = false;
+};
+
+//
+// StartupMark - milestones recorded by StartupTimeline.
+//
+enum class StartupMark : uint32_t
+{
+    ProcessStart,
+    WindowCreated,
+    DeviceCreated,
+    FirstFramePresented,
+    ContentReady
+};
+
+constexpr uint32_t StartupMarkCount = 5;
+
+char const* GetStartupMarkName(StartupMark mark) noexcept;
+
+//
+// StartupTimeline - records the time of each startup milestone the first
+// time it is reached, and writes it to the debugger output relative to
+// ProcessStart. Safe to call from any thread.
+//
+// ProcessStart is recorded as the time the OS created the process, not the
+// time it is marked. It should still be marked at the entry point, before
+// the other milestones, which are reported relative to it.
+//
+class StartupTimeline
+{
+public:
+    // Records the mark if it hasn't been recorded. Returns true if this
+    // call recorded it.
+    static bool Mark(StartupMark mark) noexcept;
+
+    // Returns the time of the mark relative to ProcessStart, or a negative
+    // value if either mark hasn't been recorded.
+    static float GetElapsedMs(StartupMark mark) noexcept;
+
+private:
+    static std::atomic<int64_t> m_times[StartupMarkCount];
+};
+
+#pragma endregion // Instrumentation
+
+#pragma region Capture
+
+//
+// FrameCaptureInfo - the target and timings of a captured frame.
+//
+struct FrameCaptureInfo
+{
+    uint32_t pixelWidth = 0;
+    uint32_t pixelHeight = 0;
+    float dpi = 96.0f;
+    D2D1_BUFFER_PRECISION bufferPrecision = D2D1_BUFFER_PRECISION_8BPC_UNORM;
+
+    // Number of resources in the window context's resource list.
+    uint32_t resourceCount = 0;
+
+    // Number of commands left out of the capture because they use objects
+    // that can't be serialized, e.g., meshes, ink, or image brushes. Set by
+    // FrameCapture::Save.
+    uint32_t skippedCommandCount = 0;
+
+    // QueryPerformanceCounter frequency of the capturing machine, for the
+    // startQpc values of the timings. Set by FrameCapture::Save.
+    int64_t qpcFrequency = 0;
+
+    // The captured frame, whose GPU and display times aren't known yet when
+    // it is captured, and the frames before it, oldest first.
+    FrameTiming timing = {};
+    std::vector<FrameTiming> recentTimings;
+};
+
+//
+// FrameCapture - the drawing commands of one frame, recorded in a command
+// list and serialized with the resources they use: bitmap pixels, brushes,
+// geometries, stroke styles, font files, and nested command lists. Images
+// other than bitmaps and command lists, such as effects, are captured as a
+// bitmap of their output within the target bounds. Other device context
+// state, e.g., the antialias mode, is assumed to be the default when the
+// recording starts.
+//
+// FrameCapture is a resource because it creates the captured resources on
+// the device. After Load, it must be initialized before calling Replay.
+// Font files are referenced by path, so a capture is replayed on a machine
+// with the same fonts installed.
+//
+class FrameCapture : public IResource2D
+{
+public:
+    explicit FrameCapture(IDWriteFactory7* factory) noexcept : m_factory{ factory }
+    {
+    }
+
+    // Writes a capture of the command list, which must be closed, to a file.
+    // Bitmaps and effect outputs are read back using the device context,
+    // which must be on the same device and must not be drawing. Its target
+    // and transform are restored afterward.
+    static void Save(
+        wchar_t const* path,
+        ID2D1DeviceContext6* context,
+        ID2D1CommandList* commandList,
+        FrameCaptureInfo const& info
+    );
+
+    // Reads a capture file. Throws ERROR_INVALID_DATA if the file isn't a
+    // valid capture.
+    void Load(wchar_t const* path);
+
+    FrameCaptureInfo const& GetInfo() const noexcept
+    {
+        return m_info;
+    }
+
+    // Issues the captured commands. Call between BeginDraw and EndDraw on a
+    // context of the device the capture was initialized on, whose DPI
+    // matches the capture. The context state is reset to the defaults
+    // first, and is left as the commands set it.
+    void Replay(ID2D1DeviceContext6* context);
+
+    // IResource2D methods.
+    void Initialize(ID2D1DeviceContext6* context) override;
+
+    bool IsInitialized() const noexcept override
+    {
+        return m_isInitialized;
+    }
+
+    void Reset() noexcept override;
+
+private:
+    class Writer;
+    class GeometryWriter;
+    class Reader;
+
+    enum class ResourceKind : uint8_t
+    {
+        Bitmap,
+        RasterizedImage,
+        CommandList,
+        SolidColorBrush,
+        BitmapBrush,
+        LinearGradientBrush,
+        RadialGradientBrush,
+        Geometry,
+        StrokeStyle,
+        FontFace,
+        RenderingParams,
+        SpriteBatch
+    };
+
+    enum class Command : uint8_t
+    {
+        SetAntialiasMode,
+        SetTags,
+        SetTextAntialiasMode,
+        SetTextRenderingParams,
+        SetTransform,
+        SetPrimitiveBlend,
+        SetUnitMode,
+        Clear,
+        DrawGlyphRun,
+        DrawLine,
+        DrawGeometry,
+        DrawRectangle,
+        DrawBitmap,
+        DrawImage,
+        FillOpacityMask,
+        FillGeometry,
+        FillRectangle,
+        PushAxisAlignedClip,
+        PushLayer,
+        PopAxisAlignedClip,
+        PopLayer,
+        DrawSpriteBatch
+    };
+
+    // A resource created by Initialize. The object is the interface for its
+    // kind (e.g., ID2D1Brush for brushes, ID2D1Bitmap1 for images that are
+    // bitmaps), so it can be cast back without QueryInterface. Rasterized
+    // images are drawn offset by their origin.
+    struct Resource
+    {
+        ResourceKind kind;
+        ComPtr<IUnknown> object;
+        D2D_POINT_2F origin;
+    };
+
+    static void ResetState(ID2D1DeviceContext6* context) noexcept;
+
+    void CreateResource(ID2D1DeviceContext6* context, ID2D1Factory7* factory, Reader& reader);
+    void ReplayCommands(ID2D1DeviceContext6* context, Reader& reader);
+
+    template<typename T>
+    T* GetResource(uint32_t index, ResourceKind kind) const;
+    template<typename T>
+    T* GetOptionalResource(uint32_t index, ResourceKind kind) const;
+    ID2D1Brush* GetBrush(uint32_t index) const;
+    ID2D1Brush* GetOptionalBrush(uint32_t index) const;
+    ID2D1Image* GetImage(uint32_t index, _Out_ D2D_POINT_2F* origin) const;
+    ID2D1Bitmap1* GetBitmap(uint32_t index) const;
+
+    const ComPtr<IDWriteFactory7> m_factory;
+    FrameCaptureInfo m_info;
+
+    // Contents of the file, and the resource and command sections in it.
+    std::vector<uint8_t> m_data;
+    size_t m_resourceOffset = 0;
+    size_t m_resourceSize = 0;
+    size_t m_commandOffset = 0;
+    size_t m_commandSize = 0;
+
+    std::vector<Resource> m_resources;
+    bool m_isInitialized = false;
+
+    // Arrays copied out of the data, which isn't aligned.
+    std::vector<UINT16> m_glyphIndices;
+    std::vector<float> m_glyphAdvances;
+    std::vector<DWRITE_GLYPH_OFFSET> m_glyphOffsets;
+};
+
+#pragma endregion // Capture
+
+#pragma region DX_Context
+
+//
+// AdapterPreference - specifies which adapter a DXDevice creates its
+// D3D device on.
+//
+enum class AdapterPreference
+{
+    // Use the default adapter chosen by D3D11CreateDevice.
+    Default,
+
+    // Prefer the highest-performance GPU, e.g., the discrete GPU on a
+    // hybrid-GPU laptop.
+    HighPerformance,
+
+    // Prefer the lowest-power GPU, e.g., the integrated GPU.
+    MinimumPower,
+
+    // Use the adapter identified by DXDeviceOptions::adapterLuid, e.g., the
+    // one returned by DXDevice::GetAdapterLuidForWindow.
+    Luid,
+
+    // Use the WARP software rasterizer, e.g., to render on a server with
+    // no GPU.
+    Warp
+};
+
+//
+// DXDeviceOptions - specifies how a DXDevice creates its factories and
+// selects its adapter.
+//
+struct DXDeviceOptions
+{
+    AdapterPreference adapterPreference = AdapterPreference::Default;
+
+    // Adapter to use with AdapterPreference::Luid. If that adapter no longer
+    // exists, the default adapter is used.
+    LUID adapterLuid = {};
+
+    // If true and no hardware device can be created, fall back to the WARP
+    // software rasterizer.
+    bool allowWarpFallback = true;
+
+    // If true, the device can be shared by window contexts on different
+    // threads. This creates a multithreaded D2D factory and a multithread-
+    // protected D3D device. It is also required for background recovery
+    // (see DeviceRecoveryMode::Background).
+    bool multithreaded = false;
+};
+
+//
+// DXAdapterInfo - describes the adapter a DXDevice was created on.
+//
+struct DXAdapterInfo
+{
+    std::wstring description;
+    LUID luid = {};
+    uint32_t vendorId = 0;
+    uint32_t deviceId = 0;
+    uint64_t dedicatedVideoMemory = 0;
+
+    // True if the device uses the WARP software rasterizer.
+    bool isWarp = false;
+
+    // True if WARP is used because no hardware device could be created.
+    bool isFallback = false;
+
+    // HRESULT of the failed hardware device creation, if isFallback is true.
+    HRESULT fallbackReason = S_OK;
+};
+
+//
+// DXDeviceObjects - references to the objects of one generation of a
+// DXDevice. Holding these keeps the objects alive even if the device is
+// reset by another thread.
+//
+struct DXDeviceObjects
+{
+    ComPtr<ID3D11DeviceContext> d3dContext;
+    ComPtr<IDXGIDevice> dxgiDevice;
+    ComPtr<ID2D1Device6> d2dDevice;
+    uint32_t generation = 0;
+};
+
+//
+// DXDevice - encapsulates a D3D device, which can be shared by
+// multiple window contexts.
+//
+// In multithreaded mode, EnsureInitialized, Acquire, ResetIfGeneration, and
+// GetGeneration may be called from any thread. The other getters return
+// objects that may be released by another thread, so such callers should
+// use Acquire instead.
+//
+class DXDevice : public ComObjectBase
+{
+public:
+    explicit DXDevice(DXDeviceOptions const& options = {});
+
+    //
+    // ApiLock - holds the Direct2D factory lock in multithreaded mode, and
+    // does nothing otherwise. DXGI calls that change swap chain buffers, such
+    // as ResizeBuffers, must be made under this lock if the device is shared
+    // across threads, because Direct2D may hold targets on those buffers.
+    // Present doesn't need it: the D3D immediate context is multithread
+    // protected, and holding the lock across a vsync wait would stall every
+    // other thread using the device.
+    //
+    class ApiLock
+    {
+    public:
+        explicit ApiLock(DXDevice const& device) noexcept : m_multithread{ device.m_d2dMultithread.Get() }
+        {
+            if (m_multithread != nullptr)
+            {
+                m_multithread->Enter();
+            }
+        }
+
+        ~ApiLock()
+        {
+            if (m_multithread != nullptr)
+            {
+                m_multithread->Leave();
+            }
+        }
+
+        ApiLock(ApiLock const&) = delete;
+        void operator=(ApiLock const&) = delete;
+
+    private:
+        ID2D1Multithread* m_multithread;
+    };
+
+    bool IsMultithreaded() const noexcept
+    {
+        return m_options.multithreaded;
+    }
+
+    bool IsInitialized() const noexcept
+    {
+        return m_d2dDevice != nullptr;
+    }
+
+    void Reset() noexcept;
+
+    // Resets the device only if it is still the specified generation and
+    // hasn't already been reset. When several windows find the device lost,
+    // this ensures it is reset, and then recreated, only once. Returns true
+    // if this call reset the device.
+    bool ResetIfGeneration(uint32_t generation) noexcept;
+
+    void EnsureInitialized();
+
+    // Ensures the device is initialized and returns its current objects.
+    DXDeviceObjects Acquire();
+
+    // Starts creating the device objects on a background thread, so device
+    // creation overlaps other startup work such as creating windows. Window
+    // contexts that paint before the device is ready skip the paint and are
+    // repainted when it is. Unless the device is multithreaded, the D2D
+    // factory must not be used by other threads until IsInitializing
+    // returns false.
+    void BeginInitialize();
+
+    bool IsInitializing() const noexcept
+    {
+        return m_isInitializing.load(std::memory_order_acquire);
+    }
+
+    // Starts WarmUpFonts on a background thread, so font loading overlaps
+    // device and window creation rather than delaying the first text format
+    // or layout on the UI thread. Failures are only logged.
+    void BeginFontWarmup(FontWarmupOptions options = {});
+
+    // If background initialization is in progress, registers the window to
+    // be repainted when it completes and returns true. Otherwise, returns
+    // false.
+    bool RepaintWhenInitialized(HWND hwnd);
+
+    // Returns information about the adapter of the current device, or an
+    // empty description if the device is not initialized.
+    DXAdapterInfo GetAdapterInfo() const;
+
+    // Gets the LUID of the adapter that owns the monitor the window is on
+    // (or mostly on). Rendering on that adapter avoids cross-adapter copies
+    // on multi-GPU systems. Returns false if no adapter was found.
+    static bool GetAdapterLuidForWindow(HWND hwnd, _Out_ LUID* luid);
+
+    ID2D1Factory7* GetD2dFactory() const noexcept
+    {
+        return m_d2dFactory.Get();
+    }
+
+    IDWriteFactory7* GetDWriteFactory() const noexcept
+    {
+        return m_dwriteFactory.Get();
+    }
+
+    // Text formats shared by the windows that use this device.
+    TextFormatCache& GetTextFormatCache() noexcept
+    {
+        return m_textFormatCache;
+    }
+
+    ID3D11DeviceContext* GetD3dContext() const noexcept
+    {
+        return m_d3dContext.Get();
+    }
+
+    IDXGIDevice* GetDxgiDevice() const noexcept
+    {
+        return m_dxgiDevice.Get();
+    }
+
+    ID2D1Device6* GetD2dDevice() const noexcept
+    {
+        return m_d2dDevice.Get();
+    }
+
+    // Returns a number that is incremented each time the device objects
+    // are recreated.
+    uint32_t GetGeneration() const noexcept
+    {
+        return m_generation.load(std::memory_order_acquire);
+    }
+
+private:
+    static ComPtr<ID2D1Factory7> CreateD2DFactory(bool multithreaded);
+    static ComPtr<IDWriteFactory7> CreateDWriteFactory();
+
+    void EnsureInitializedLocked();
+    void InitializeInBackground() noexcept;
+    ComPtr<IDXGIAdapter1> SelectAdapter() const;
+
+    const DXDeviceOptions m_options;
+    const ComPtr<ID2D1Factory7> m_d2dFactory;
+    const ComPtr<IDWriteFactory7> m_dwriteFactory;
+    TextFormatCache m_textFormatCache;
+    ComPtr<ID2D1Multithread> m_d2dMultithread;
+
+    // Guards the device objects below.
+    mutable std::mutex m_mutex;
+
+    ComPtr<ID3D11DeviceContext> m_d3dContext;
+    ComPtr<IDXGIDevice> m_dxgiDevice;
+    ComPtr<ID2D1Device6> m_d2dDevice;
+    DXAdapterInfo m_adapterInfo;
+    std::atomic<uint32_t> m_generation{ 0 };
+
+    // Background initialization state, and windows waiting for it.
+    std::mutex m_initializingMutex;
+    std::atomic<bool> m_isInitializing{ false };
+    std::vector<HWND> m_windowsToRepaint;
+};
+
+//
+// SwapChainOptions - specifies how a DXWindowContext creates its swap chain.
+//
+struct SwapChainOptions
+{
+    // If true, use a flip-model swap chain with a frame latency waitable
+    // object. Otherwise, use a legacy bitblt-model swap chain.
+    bool flipModel = false;
+
+    // Number of buffers in a flip-model swap chain (2 or 3).
+    uint32_t bufferCount = 2;
+
+    // Maximum number of frames that can be queued for presentation by a
+    // flip-model swap chain. Lower values reduce input-to-photon latency.
+    uint32_t maxFrameLatency = 1;
+
+    // If true and the system supports it, a flip-model swap chain presents
+    // continuous frames without waiting for vertical sync.
+    bool allowTearing = false;
+
+    // If true, a flip-model swap chain uses FLIP_SEQUENTIAL so the previous
+    // frame is preserved. Each frame then redraws and presents only the
+    // rectangles marked dirty by Invalidate and Scroll.
+    bool partialPresentation = false;
+
+    // If true, present through DirectComposition using a flip-model swap
+    // chain with premultiplied alpha, so the window can be translucent.
+    // Implies flipModel. Tearing is not supported. The window should be
+    // created with WS_EX_NOREDIRECTIONBITMAP, and RenderContent should
+    // clear to a transparent or translucent (premultiplied) color.
+    bool composition = false;
+
+    // If true, use an R16G16B16A16_FLOAT swap chain in the linear scRGB
+    // color space while the window is on an HDR monitor or one with more
+    // than 8 bits per color, and switch back to 8-bit sRGB when it moves
+    // to another monitor. Implies flipModel. Colors passed directly to the
+    // context, e.g., to Clear, must then be converted by SrgbToScRgb.
+    bool advancedColor = false;
+};
+
+//
+// RenderMode - specifies when a DXWindowContext renders frames.
+//
+enum class RenderMode
+{
+    // Render only in response to WM_PAINT.
+    OnDemand,
+
+    // Render continuously from the message loop, paced by the display.
+    Continuous
+};
+
+//
+// DeviceRecoveryMode - specifies how a DXWindowContext recovers when the
+// device is lost.
+//
+enum class DeviceRecoveryMode
+{
+    // Recreate the device and all resources on the UI thread during the
+    // next paint.
+    Synchronous,
+
+    // Recreate the device and resources on worker threads, leaving the
+    // last frame on screen until recovery is complete. Resources in the
+    // resource list are initialized in parallel, so they must not be used
+    // by the derived class while IsRecoveringDevice returns true. Requires
+    // a multithreaded DXDevice; otherwise, recovery is synchronous.
+    Background
+};
+
+//
+// InputEvent - a mouse or keyboard message queued by DXWindow and passed
+// to ProcessInput at the start of the next frame.
+//
+enum class InputEventType : uint8_t
+{
+    MouseMove,
+    MouseDown,
+    MouseUp,
+    MouseWheel,
+    MouseHWheel,
+    KeyDown,
+    KeyUp,
+    Char
+};
+
+struct InputEvent
+{
+    InputEventType type;
+
+    // Virtual-key code for key events, VK_LBUTTON, VK_RBUTTON, VK_MBUTTON,
+    // VK_XBUTTON1, or VK_XBUTTON2 for mouse buttons, or the UTF-16 code unit
+    // for Char events.
+    uint32_t key;
+
+    // MK_* flags for mouse events, or the key flags in HIWORD(lParam), e.g.,
+    // KF_REPEAT, for key and Char events.
+    uint32_t flags;
+
+    // Wheel rotation in multiples of WHEEL_DELTA for wheel events.
+    int32_t wheelDelta;
+
+    // Mouse position in DIPs relative to the client area.
+    D2D_POINT_2F position;
+
+    // Message time from GetMessageTime, in milliseconds.
+    uint32_t time;
+};
+
+//
+// InputState - mouse input consolidated once per frame. See
+// DXWindowContext::EnableInputState.
+//
+struct InputPoint
+{
+    D2D_POINT_2F position;  // DIPs relative to the client area
+    uint32_t time;          // GetTickCount time, in milliseconds
+};
+
+struct InputState
+{
+    // Latest mouse position and MK_* flags.
+    D2D_POINT_2F position = {};
+    uint32_t mouseFlags = 0;
+
+    // Wheel rotation since the last frame, in multiples of WHEEL_DELTA.
+    int32_t wheelDelta = 0;
+    int32_t hWheelDelta = 0;
+
+    // Mouse or pointer positions since the last frame at the full input
+    // rate, oldest first, rather than one position per WM_MOUSEMOVE.
+    std::vector<InputPoint> history;
+
+    // Position extrapolated to the next vsync, if prediction is enabled;
+    // otherwise, the latest position.
+    D2D_POINT_2F predictedPosition = {};
+
+    bool HasMoved() const noexcept
+    {
+        return !history.empty();
+    }
+};
+
+template<typename Derived>
+class DXWindow;
+
+//
+// DXWindowContext - manages a swap chain and Direct2D device context
+// for a window.
+//
+class DXWindowContext : public ComObjectBase
+{
+public:
+    DXWindowContext(DXDevice* device, HWND hwnd, SwapChainOptions const& options = {}) noexcept;
+
+    // Processes queued input, if any, and renders a frame.
+    void Paint();
+
+    // Processes messages until WM_QUIT is received, rendering frames as
+    // specified by the current render mode. Returns the WM_QUIT exit code.
+    int RunMessageLoop();
+
+    RenderMode GetRenderMode() const noexcept
+    {
+        return m_renderMode;
+    }
+
+    void SetRenderMode(RenderMode mode) noexcept
+    {
+        m_renderMode = mode;
+    }
+
+    DeviceRecoveryMode GetDeviceRecoveryMode() const noexcept
+    {
+        return m_recoveryMode;
+    }
+
+    void SetDeviceRecoveryMode(DeviceRecoveryMode mode) noexcept
+    {
+        m_recoveryMode = mode;
+    }
+
+    // Returns true if the device is being recreated in the background.
+    bool IsRecoveringDevice() const noexcept
+    {
+        return m_recoveryState != nullptr;
+    }
+
+    // Returns true if the window is minimized or its content isn't visible,
+    // e.g., because it is covered or the session is locked. Rendering is
+    // suspended while the window is occluded, and the first frame after it
+    // becomes visible redraws the whole window.
+    bool IsOccluded() const noexcept
+    {
+        return m_isOccluded;
+    }
+
+    // Enables idle throttling in continuous mode. If no keyboard, mouse, or
+    // pointer input is received for idleTimeoutMs, frames are rendered at
+    // most idleFrameRate times per second, until the next input. A frame
+    // rate of zero disables throttling.
+    void SetIdleThrottling(float idleFrameRate, uint32_t idleTimeoutMs = 2000) noexcept
+    {
+        m_idleFrameRate = idleFrameRate;
+        m_idleTimeoutMs = idleTimeoutMs;
+        m_lastInputTime = GetTickCount64();
+    }
+
+    // Returns true if frames are being throttled because there is no input.
+    bool IsIdle() const noexcept;
+
+    // Enables the consolidated input state of a DXWindow. Mouse messages
+    // are coalesced, and at the start of each Paint, their full-rate history
+    // is retrieved from GetMouseMovePointsEx, or GetPointerInfoHistory for
+    // pen and touch. If prediction is enabled, the position is also
+    // extrapolated to the next vsync, for low-latency dragging.
+    void EnableInputState(bool enable, bool enablePrediction = false) noexcept
+    {
+        m_isInputStateEnabled = enable;
+        m_isPredictionEnabled = enable && enablePrediction;
+        m_lastHistoryTime = GetTickCount();
+    }
+
+    // Returns the input state for the current frame, e.g., for use by
+    // RenderContent.
+    InputState const& GetInputState() const noexcept
+    {
+        return m_inputState;
+    }
+
+    // Enables parallel rendering with the specified number of regions, or
+    // disables it if the count is zero. Each frame, the regions returned by
+    // GetRenderRegions are recorded into command lists by RenderRegion,
+    // in parallel on the default WorkerPool and the UI thread, and the
+    // lists are drawn in order on the window's context. RenderContent isn't
+    // called. Without a multithreaded DXDevice, the regions are rendered in
+    // turn on the window's context.
+    void SetParallelRendering(uint32_t regionCount) noexcept
+    {
+        m_parallelRegionCount = regionCount;
+    }
+
+    // Returns true if the swap chain is FP16 scRGB. See SwapChainOptions.
+    bool IsAdvancedColor() const noexcept
+    {
+        return m_isAdvancedColor;
+    }
+
+    // Marks a rectangle (in DIPs) as needing to be redrawn in the next frame.
+    // With partial presentation, RenderContent is clipped to the union of
+    // the dirty rectangles and only those rectangles are presented.
+    void Invalidate(D2D_RECT_F const& rect);
+
+    // Marks the whole window as needing to be redrawn in the next frame.
+    void InvalidateAll();
+
+    // Indicates that the content in the specified rectangle (in DIPs) has
+    // moved by the specified offset since the last frame. With partial
+    // presentation, the moved content is copied by DXGI and only the
+    // exposed area is marked dirty.
+    void Scroll(D2D_RECT_F const& rect, D2D_POINT_2F offset);
+
+    // Requests a frame without invalidating anything. In on-demand mode,
+    // this results in a WM_PAINT message.
+    void RequestFrame() noexcept;
+
+    // Enables or disables per-frame timing measurements.
+    void EnableFrameTiming(bool enable) noexcept;
+
+    // Shows or hides an overlay with recent frame timings. Showing the
+    // overlay also enables frame timing.
+    void ShowFrameTimingOverlay(bool show);
+
+    FrameTimingLog const& GetFrameTimingLog() const noexcept
+    {
+        return m_profiler.GetLog();
+    }
+
+    // Records the next frame into a command list and writes it, with the
+    // frame timings, to a file that FrameCapture can load and replay. The
+    // whole window is redrawn for the capture, and the frame is timed even
+    // if frame timing isn't enabled. Failures are only logged.
+    void CaptureNextFrame(std::wstring path);
+
+    // Static methods for handling window messages.
+    static void OnResize(HWND hwnd) noexcept;
+    static void OnDpiChanged(HWND hwnd, WPARAM wParam, LPARAM lParam) noexcept;
+    static void OnPaint(HWND hwnd) noexcept;
+
+    // Handlers for WM_MOVE and WM_DISPLAYCHANGE, which check whether the
+    // window's monitor supports advanced color.
+    static void OnMove(HWND hwnd) noexcept;
+    static void OnDisplayChange(HWND hwnd) noexcept;
+
+    static DXWindowContext* GetThis(HWND hwnd) noexcept
+    {
+        return reinterpret_cast<DXWindowContext*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
+    }
+
+    static D2D_SIZE_U GetWindowSize(HWND hwnd) noexcept;
+
+    // Getters.
+    uint32_t GetPixelWidth() const noexcept
+    {
+        return m_pixelSize.width;
+    }
+
+    uint32_t GetPixelHeight() const noexcept
+    {
+        return m_pixelSize.height;
+    }
+
+    uint32_t GetDpi() const noexcept
+    {
+        return m_dpi;
+    }
+
+    float GetWidthDips() const noexcept
+    {
+        return GetPixelWidth() * (96.0f / m_dpi);
+    }
+
+    float GetHeightDips() const noexcept
+    {
+        return GetPixelHeight() * (96.0f / m_dpi);
+    }
+
+    ID2D1Factory7* GetD2dFactory() const noexcept
+    {
+        return m_device->GetD2dFactory();
+    }
+
+    IDWriteFactory7* GetDWriteFactory() const noexcept
+    {
+        return m_device->GetDWriteFactory();
+    }
+
+    ID2D1DeviceContext6* GetD2dContext() const noexcept
+    {
+        return m_d2dContext.Get();
+    }
+
+    SwapChainOptions const& GetSwapChainOptions() const noexcept
+    {
+        return m_options;
+    }
+
+    DXDevice* GetDevice() const noexcept
+    {
+        return m_device.Get();
+    }
+
+    TextLayoutCache& GetTextLayoutCache() noexcept
+    {
+        return m_textLayoutCache;
+    }
+
+    // Returns an arena for transient data used while rendering a frame,
+    // e.g., with FrameVector. The arena is reset after each Present, so its
+    // memory must not be used after the frame.
+    FrameArena& GetFrameArena() noexcept
+    {
+        return m_frameArena;
+    }
+
+    // Returns a handle that is signaled when the swap chain is ready to
+    // accept a new frame, or nullptr if there is no flip-model swap chain.
+    // The caller can wait on the handle before rendering but must not close
+    // it. The handle is valid until the swap chain is recreated, so it
+    // should be retrieved again before each wait.
+    HANDLE GetFrameLatencyWaitableObject() const noexcept
+    {
+        return m_frameLatencyWaitable.Get();
+    }
+
+    static void ForceDpi(uint16_t dpi) noexcept
+    {
+        m_forceDpi = dpi;
+    }
+
+protected:
+
+    // Constructs a context with no window, for DXWindow, which attaches
+    // the window when it is created.
+    DXWindowContext(DXDevice* device, SwapChainOptions const& options) noexcept;
+
+    // Derived class calls AddResource to ensure device-dependent objects
+    // are initialized and reinitialized as needed.
+    void AddResource(IResource2D* p)
+    {
+        m_resourceList.Add(p);
+    }
+
+    // Abstract method implemented by derived class to render a frame.
+    virtual void RenderContent() = 0;
+
+    // Called at the start of each frame, before the dirty region is used.
+    // A derived class can advance animations here and call Invalidate or
+    // Scroll to update the current frame.
+    virtual void OnBeginFrame()
+    {
+    }
+
+    // Called at the start of a frame if layouts requested through
+    // TextLayoutCache::TryGet have been added to the cache. By default,
+    // this redraws the whole window.
+    virtual void OnTextLayoutsReady()
+    {
+        InvalidateAll();
+    }
+
+    virtual void OnSizeChanged()
+    {
+    }
+
+    virtual void OnDpiChanged()
+    {
+    }
+
+    // Returns the regions, in DIPs, to render in parallel. By default, the
+    // window is split into horizontal bands at pixel boundaries. A derived
+    // class can return overlapping regions, e.g., the whole window for each
+    // of several layers, which are drawn in order.
+    virtual void GetRenderRegions(uint32_t regionCount, std::vector<D2D_RECT_F>& regions);
+
+    // Renders one region in parallel render mode. May be called on a worker
+    // thread, with a context of the window's device whose target is a
+    // command list, clipped to the region. Regions render concurrently, so
+    // only resources that don't change while they are drawn can be used,
+    // e.g., brushes, bitmaps, and glyph run batches in the resource list.
+    // An Effect2D changes its cache or effect when drawn, so it must not be
+    // drawn here. State shared with the UI thread must not change until the
+    // frame is rendered.
+    virtual void RenderRegion(ID2D1DeviceContext6* context, uint32_t regionIndex, D2D_RECT_F const& bounds)
+    {
+        UNREFERENCED_PARAMETER(context);
+        UNREFERENCED_PARAMETER(regionIndex);
+        UNREFERENCED_PARAMETER(bounds);
+    }
+
+    // Called at the start of Paint, before any frame is rendered, with the
+    // mouse and keyboard input queued by DXWindow since the last call.
+    virtual void ProcessInput(std::vector<InputEvent> const& events)
+    {
+        UNREFERENCED_PARAMETER(events);
+    }
+
+private:
+    template<typename Derived>
+    friend class DXWindow;
+
+    void AttachWindow(HWND hwnd) noexcept;
+
+    // Internal message handlers.
+    void OnResizeInternal();
+    void OnDpiChangedInternal(uint32_t newDpi, RECT newRect);
+    void OnPaintInternal();
+    void OnMoveInternal() noexcept;
+    void OnDisplayChangeInternal() noexcept;
+    void OnNcDestroyInternal() noexcept;
+
+    // Adds a mouse or keyboard message to the input queue and returns true,
+    // or returns false for other messages.
+    bool QueueInput(UINT message, WPARAM wParam, LPARAM lParam);
+
+    // Dispatches messages until the queue is empty. Returns false if
+    // WM_QUIT was received.
+    bool DispatchPendingMessages(MSG& msg);
+
+    void UpdateInputState();
+    void AppendMouseHistory();
+    void AppendPointerHistory(uint32_t pointerId);
+    void PredictInputPosition() noexcept;
+    static float GetTimeToNextVBlankMs() noexcept;
+
+    // Prediction uses the velocity over a short window and is limited to a
+    // short horizon, since errors grow quickly with time.
+    static constexpr uint32_t VelocityWindowMs = 40;
+    static constexpr float MaxPredictionMs = 33.0f;
+
+    void ResetWindow() noexcept;
+    void ResetDevice() noexcept;
+    void ResetDeviceResources() noexcept;
+
+    void BeginBackgroundRecovery();
+    void EndBackgroundRecovery();
+
+    void EnsureInitialized();
+    void ResizeSwapChain();
+    void UpdateColorMode();
+    bool ShouldUseAdvancedColor();
+    static bool IsAdvancedColorMonitor(HMONITOR monitor);
+    void SetSwapChainColorSpace(IDXGISwapChain1* dxgiSwapChain);
+    void SetBufferPrecision(ID2D1DeviceContext6* d2dContext) const noexcept;
+
+    D2D1_BUFFER_PRECISION GetBufferPrecision() const noexcept
+    {
+        return m_colorSpace == DXGI_COLOR_SPACE_RGB_FULL_G10_NONE_P709 ?
+            D2D1_BUFFER_PRECISION_16BPC_FLOAT :
+            D2D1_BUFFER_PRECISION_8BPC_UNORM;
+    }
+
+    DXGI_FORMAT GetSwapChainFormat() const noexcept
+    {
+        return m_isAdvancedColor ? DXGI_FORMAT_R16G16B16A16_FLOAT : DXGI_FORMAT_B8G8R8A8_UNORM;
+    }
+
+    void PaintInternal();
+    void SaveCapture(ID2D1CommandList* commandList, FrameTiming const& timing) noexcept;
+    void RecordRegions();
+    void DrawRegions(ID2D1DeviceContext6* context);
+    void Present(DXGI_PRESENT_PARAMETERS const* params);
+    bool CheckStillOccluded();
+
+    static bool IsInputMessage(UINT message) noexcept;
+    static constexpr DWORD OcclusionPollMs = 250;
+
+    void DrawFrameTimingOverlay();
+    static constexpr D2D_RECT_F OverlayRect = { 0, 0, 440, 20 };
+
+    RECT DipsToPixels(D2D_RECT_F const& rect) const noexcept;
+    void AddDirtyRect(RECT const& rect);
+    void ClearDirtyRects() noexcept;
+
+    static void SetTargetFromSwapChain(ID2D1DeviceContext6* d2dContext, IDXGISwapChain1* dxgiSwapChain, D2D1_ALPHA_MODE alphaMode);
+
+    D2D1_ALPHA_MODE GetTargetAlphaMode() const noexcept
+    {
+        return m_options.composition ? D2D1_ALPHA_MODE_PREMULTIPLIED : D2D1_ALPHA_MODE_IGNORE;
+    }
+
+    void CreateCompositionTarget(IDXGIDevice* dxgiDevice, IDXGISwapChain1* dxgiSwapChain);
+
+    ComPtr<IDXGISwapChain1> CreateLegacySwapChain(IDXGIFactory2* dxgiFactory, IDXGIDevice* dxgiDevice);
+    ComPtr<IDXGISwapChain1> CreateFlipSwapChain(IDXGIFactory2* dxgiFactory, IDXGIDevice* dxgiDevice);
+
+    const ComPtr<DXDevice> m_device;
+    const SwapChainOptions m_options;
+    uint32_t m_deviceGeneration = 0;
+    ComPtr<ID3D11DeviceContext> m_d3dContext;
+
+    HWND m_hwnd = nullptr;
+    D2D_SIZE_U m_pixelSize = {};
+    uint32_t m_dpi = 96;
+    bool m_isResizePending = false;
+
+    static uint32_t m_forceDpi;
+
+    ComPtr<IDXGISwapChain1> m_swapChain;
+    UINT m_swapChainFlags = 0;
+    bool m_isTearingSupported = false;
+    bool m_isPartialPresentation = false;
+    RenderMode m_renderMode = RenderMode::OnDemand;
+    UniqueHandle m_frameLatencyWaitable;
+    ComPtr<ID2D1DeviceContext6> m_d2dContext;
+
+    // Advanced color state. The monitor is checked when the swap chain is
+    // created and after the window moves to another monitor. The color
+    // space is the one the swap chain actually uses, which decides the
+    // buffer precision and so whether colors are converted to scRGB.
+    bool m_isAdvancedColor = false;
+    DXGI_COLOR_SPACE_TYPE m_colorSpace = DXGI_COLOR_SPACE_RGB_FULL_G22_NONE_P709;
+    bool m_isColorCheckPending = false;
+    HMONITOR m_monitor = nullptr;
+
+    // DirectComposition objects, if SwapChainOptions::composition is set.
+    ComPtr<IDCompositionDevice> m_dcompDevice;
+    ComPtr<IDCompositionTarget> m_dcompTarget;
+    ComPtr<IDCompositionVisual> m_dcompVisual;
+
+    // Dirty region state, in pixels.
+    std::vector<RECT> m_dirtyRects;
+    RECT m_scrollRect = {};
+    POINT m_scrollOffset = {};
+    bool m_hasScrollRect = false;
+    bool m_isFullyDirty = true;
+
+    // Occlusion and idle throttling state. Times are from GetTickCount64.
+    bool m_isOccluded = false;
+    float m_idleFrameRate = 0;
+    uint32_t m_idleTimeoutMs = 2000;
+    uint64_t m_lastInputTime = 0;
+    uint64_t m_lastFrameTime = 0;
+
+    // Frame timing state.
+    bool m_hasPresented = false;
+    FrameProfiler m_profiler;
+    bool m_isFrameTimingEnabled = false;
+    bool m_isOverlayVisible = false;
+    bool m_areOverlayResourcesAdded = false;
+    ComPtr<IDWriteTextFormat> m_overlayTextFormat;
+    SolidColorBrush m_overlayTextBrush{ 1.0f, 1.0f, 0.0f };
+    SolidColorBrush m_overlayBackgroundBrush{ D2D_COLOR_F{ 0.0f, 0.0f, 0.0f, 0.75f } };
+
+    // Path of the pending frame capture, if any.
+    std::wstring m_capturePath;
+
+    // Background device recovery state, shared with the worker thread.
+    struct RecoveryState
+    {
+        UniqueHandle completedEvent;
+        std::atomic<bool> isComplete{ false };
+        std::exception_ptr error;
+
+        // Keeps the window context alive while the worker uses its
+        // resources. Only used on the UI thread, so the context is never
+        // released by the worker.
+        ComPtr<DXWindowContext> owner;
+
+        // Set if the DPI changed during recovery. DPI-dependent resources
+        // are reset when the worker is done with them.
+        bool isDpiChanged = false;
+    };
+    DeviceRecoveryMode m_recoveryMode = DeviceRecoveryMode::Synchronous;
+    std::shared_ptr<RecoveryState> m_recoveryState;
+
+    // Parallel rendering state. A device context is kept for each region,
+    // and the command lists are recorded each frame.
+    uint32_t m_parallelRegionCount = 0;
+    std::vector<D2D_RECT_F> m_renderRegions;
+    std::vector<ComPtr<ID2D1DeviceContext6>> m_regionContexts;
+    std::vector<ComPtr<ID2D1CommandList>> m_regionLists;
+
+    // Input queued since the last frame, and the input being processed.
+    std::vector<InputEvent> m_inputQueue;
+    std::vector<InputEvent> m_processedInput;
+
+    // Consolidated input state. The last mouse move, in client pixels, is
+    // the starting point for GetMouseMovePointsEx.
+    InputState m_inputState;
+    bool m_isInputStateEnabled = false;
+    bool m_isPredictionEnabled = false;
+    bool m_hasMouseMoved = false;
+    POINT m_lastMovePoint = {};
+    uint32_t m_lastMoveTime = 0;
+    uint32_t m_lastHistoryTime = 0;
+    std::vector<InputPoint> m_pointerHistory;
+    std::vector<POINTER_INFO> m_pointerInfos;
+
+    TextLayoutCache m_textLayoutCache;
+    FrameArena m_frameArena;
+
+    ResourceList2D m_resourceList;
+};
+
+//
+// DXWindow - base class for a window whose window procedure is generated
+// at compile time from the handlers the derived class defines:
+//
+//      static void InitializeWindowClass(WNDCLASSEXW& wcex);
+//      bool OnMessage(UINT message, WPARAM wParam, LPARAM lParam, LRESULT* result);
+//      void OnDestroy();
+//      void ProcessInput(std::vector<InputEvent> const& events) override;
+//
+// InitializeWindowClass can set the icons, cursor, or class name before
+// the class is registered, once per type. OnMessage is called first for
+// any message and returns true if it handled the message. If ProcessInput
+// is defined, mouse and keyboard messages are queued and a frame is
+// requested, so input is processed once per frame instead of per message.
+// Mouse messages are also queued if EnableInputState has been called.
+// Handlers that aren't defined cost nothing. Private handlers require
+// the derived class to befriend DXWindow<Derived>.
+//
+// The object is constructed before the window, which is created by
+// CreateHwnd and attached during WM_NCCREATE. The window holds a
+// reference to the object until WM_NCDESTROY.
+//
+template<typename Derived>
+class DXWindow : public DXWindowContext
+{
+public:
+    // Registers the window class on the first call for the type and creates
+    // the window with the default position and size.
+    HWND CreateHwnd(HINSTANCE hInstance, wchar_t const* title, DWORD style = WS_OVERLAPPEDWINDOW, DWORD exStyle = 0, HWND parent = nullptr)
+    {
+        ATOM classAtom = RegisterWindowClass(hInstance);
+
+        HWND hwnd = CreateWindowExW(
+            exStyle,
+            MAKEINTATOM(classAtom),
+            title,
+            style,
+            CW_USEDEFAULT, 0,
+            CW_USEDEFAULT, 0,
+            parent,
+            nullptr,
+            hInstance,
+            static_cast<Derived*>(this)
+            );
+
+        if (hwnd == nullptr)
+        {
+            ThrowLastError();
+        }
+
+        return hwnd;
+    }
+
+    HWND GetHwnd() const noexcept
+    {
+        return m_hwnd;
+    }
+
+protected:
+    DXWindow(DXDevice* device, SwapChainOptions const& options = {}) noexcept :
+        DXWindowContext{ device, options }
+    {
+    }
+
+    // Default handlers, hidden by the derived class's handlers.
+    static void InitializeWindowClass(WNDCLASSEXW& wcex) noexcept
+    {
+        UNREFERENCED_PARAMETER(wcex);
+    }
+
+    bool OnMessage(UINT message, WPARAM wParam, LPARAM lParam, LRESULT* result)
+    {
+        UNREFERENCED_PARAMETER(message);
+        UNREFERENCED_PARAMETER(wParam);
+        UNREFERENCED_PARAMETER(lParam);
+        UNREFERENCED_PARAMETER(result);
+        return false;
+    }
+
+    void OnDestroy()
     {
     }
 
 private:
+    // A handler is defined by the derived class if naming it through
+    // Derived yields a pointer to a member of Derived. These are functions
+    // rather than constants because Derived is incomplete until it is used.
+    static constexpr bool HasOnMessage() noexcept
+    {
+        return !std::is_same<decltype(&Derived::OnMessage), decltype(&DXWindow::OnMessage)>::value;
+    }
 
-    // Internal message handlers.
-    void OnResizeInternal();
-    void OnDpiChangedInternal(uint32_t newDpi, RECT newRect);
+    static constexpr bool HasOnDestroy() noexcept
+    {
+        return !std::is_same<decltype(&Derived::OnDestroy), decltype(&DXWindow::OnDestroy)>::value;
+    }
 
-    void ResetWindow() noexcept;
-    void ResetDevice() noexcept;
+    static constexpr bool HasProcessInput() noexcept
+    {
+        return !std::is_same<decltype(&Derived::ProcessInput), decltype(&DXWindowContext::ProcessInput)>::value;
+    }
+
+    static ATOM RegisterWindowClass(HINSTANCE hInstance)
+    {
+        // The class name is unique to the type unless the derived class
+        // sets one. If registration throws, the next call tries again.
+        static ATOM const classAtom = [hInstance]()
+        {
+            static char const typeTag = 0;
+            wchar_t className[32];
+            swprintf_s(className, L"DXWindow:%p", static_cast<void const*>(&typeTag));
+
+            WNDCLASSEXW wcex = {};
+            wcex.cbSize = sizeof(WNDCLASSEXW);
+            wcex.style = CS_HREDRAW | CS_VREDRAW;
+            wcex.lpfnWndProc = WindowProc;
+            wcex.hInstance = hInstance;
+            wcex.hCursor = LoadCursor(nullptr, IDC_ARROW);
+            wcex.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
+            wcex.lpszClassName = className;
+
+            Derived::InitializeWindowClass(wcex);
+
+            ATOM atom = RegisterClassExW(&wcex);
+            if (atom == 0)
+            {
+                ThrowLastError();
+            }
+            return atom;
+        }();
+
+        return classAtom;
+    }
+
+    static LRESULT CALLBACK WindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) noexcept
+    {
+        Derived* window;
+        if (message == WM_NCCREATE)
+        {
+            window = static_cast<Derived*>(reinterpret_cast<CREATESTRUCTW*>(lParam)->lpCreateParams);
+            window->AddRef();
+            window->AttachWindow(hwnd);
+        }
+        else
+        {
+            // Messages before WM_NCCREATE, e.g., WM_GETMINMAXINFO, have no window.
+            window = static_cast<Derived*>(GetThis(hwnd));
+            if (window == nullptr)
+            {
+                return DefWindowProc(hwnd, message, wParam, lParam);
+            }
+        }
+
+        try
+        {
+            return window->RouteMessage(hwnd, message, wParam, lParam);
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+    }
+
+    LRESULT RouteMessage(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+    {
+        auto derived = static_cast<Derived*>(this);
+
+        if (HasOnMessage())
+        {
+            LRESULT result = 0;
+            if (derived->OnMessage(message, wParam, lParam, &result))
+            {
+                return result;
+            }
+        }
+
+        switch (message)
+        {
+        case WM_PAINT:
+            OnPaintInternal();
+            return 0;
+
+        case WM_SIZE:
+            OnResizeInternal();
+            return 0;
+
+        case WM_DPICHANGED:
+            // LOWORD(wParam) is the new DPI, and lParam points to the new bounds.
+            OnDpiChangedInternal(m_forceDpi ? m_forceDpi : LOWORD(wParam), *reinterpret_cast<RECT*>(lParam));
+            return 0;
+
+        case WM_MOVE:
+            OnMoveInternal();
+            return 0;
+
+        case WM_DISPLAYCHANGE:
+            OnDisplayChangeInternal();
+            return 0;
+
+        case WM_DESTROY:
+            if (HasOnDestroy())
+            {
+                derived->OnDestroy();
+                return 0;
+            }
+            break;
+
+        case WM_NCDESTROY:
+        {
+            // Detach the window and release its reference, after which the
+            // object may have been deleted.
+            OnNcDestroyInternal();
+            SetWindowLongPtr(hwnd, GWLP_USERDATA, 0);
+            LRESULT result = DefWindowProc(hwnd, message, wParam, lParam);
+            Release();
+            return result;
+        }
+        }
+
+        if ((HasProcessInput() || m_isInputStateEnabled) && QueueInput(message, wParam, lParam))
+        {
+            return 0;
+        }
+
+        return DefWindowProc(hwnd, message, wParam, lParam);
+    }
+};
+
+//
+// DXHeadlessContext - renders frames to an offscreen bitmap, with no window
+// or swap chain, and exports them as PNG files. To render on a machine
+// without a GPU, use a DXDevice with AdapterPreference::Warp. Content built
+// as a Scene can be rendered by both a window and a headless context.
+//
+// Exports are pipelined: each frame is copied to one of a pool of staging
+// bitmaps, which is read back after the next frame has been submitted, and
+// the image is encoded on a worker thread. GPU rendering of one frame thus
+// overlaps the readback and encoding of the previous one. The caller must
+// initialize COM before constructing the context.
+//
+// If the device is lost, ExportFrame or Flush resets the device and throws
+// DeviceLostException. Frames exported since the last successful Flush may
+// not have been written, and can be exported again.
+//
+class DXHeadlessContext : public ComObjectBase
+{
+public:
+    DXHeadlessContext(DXDevice* device, uint32_t pixelWidth, uint32_t pixelHeight, uint32_t dpi = 96);
+
+    // Waits for queued encodes, but does not read back frames that are
+    // still on the GPU. Call Flush to make sure every frame is written.
+    ~DXHeadlessContext();
+
+    // Renders a frame and queues it to be written to the specified file.
+    void ExportFrame(std::wstring path);
+
+    // Waits until every exported frame has been written. Throws if any
+    // frame since the last Flush could not be written.
+    void Flush();
+
+    // Changes the size of subsequent frames.
+    void Resize(uint32_t pixelWidth, uint32_t pixelHeight);
+
+    // Getters.
+    uint32_t GetPixelWidth() const noexcept
+    {
+        return m_pixelSize.width;
+    }
+
+    uint32_t GetPixelHeight() const noexcept
+    {
+        return m_pixelSize.height;
+    }
+
+    uint32_t GetDpi() const noexcept
+    {
+        return m_dpi;
+    }
+
+    float GetWidthDips() const noexcept
+    {
+        return GetPixelWidth() * (96.0f / m_dpi);
+    }
+
+    float GetHeightDips() const noexcept
+    {
+        return GetPixelHeight() * (96.0f / m_dpi);
+    }
+
+    ID2D1Factory7* GetD2dFactory() const noexcept
+    {
+        return m_device->GetD2dFactory();
+    }
+
+    IDWriteFactory7* GetDWriteFactory() const noexcept
+    {
+        return m_device->GetDWriteFactory();
+    }
 
+    ID2D1DeviceContext6* GetD2dContext() const noexcept
+    {
+        return m_d2dContext.Get();
+    }
+
+    TextLayoutCache& GetTextLayoutCache() noexcept
+    {
+        return m_textLayoutCache;
+    }
+
+protected:
+
+    // Derived class calls AddResource to ensure device-dependent objects
+    // are initialized and reinitialized as needed.
+    void AddResource(IResource2D* p)
+    {
+        m_resourceList.Add(p);
+    }
+
+    // Abstract method implemented by derived class to render a frame. The
+    // target is cleared to transparent black before this is called.
+    virtual void RenderContent() = 0;
+
+private:
+    // Number of staging bitmaps, which is one more than the number of
+    // frames that may be waiting to be read back.
+    static constexpr uint32_t StagingBitmapCount = 2;
+
+    struct StagedFrame
+    {
+        ComPtr<ID2D1Bitmap1> bitmap;
+        std::wstring path;
+    };
+
+    // Encoding state, shared with the worker threads.
+    struct ExportState
+    {
+        std::mutex mutex;
+        std::condition_variable completed;
+        uint32_t pendingCount = 0;
+        HRESULT hr = S_OK;
+    };
+
+    static ComPtr<IWICImagingFactory> CreateWicFactory();
+
+    void ResetDevice() noexcept;
+    void ResetTargets() noexcept;
     void EnsureInitialized();
-    void PaintInternal();
+    void CreateTargets();
+    void ExportFrameInternal(std::wstring path);
+    void ReadBackOldestFrame();
+    void FlushInternal();
+    void WaitForEncodes() noexcept;
+
+    static void EncodePng(
+        IWICImagingFactory* wicFactory,
+        wchar_t const* path,
+        D2D_SIZE_U size,
+        uint32_t stride,
+        std::vector<uint8_t>& pixels,
+        uint32_t dpi
+    );
 
     const ComPtr<DXDevice> m_device;
     uint32_t m_deviceGeneration = 0;
+    ComPtr<ID3D11DeviceContext> m_d3dContext;
+    ComPtr<ID2D1DeviceContext6> m_d2dContext;
 
-    HWND m_hwnd = nullptr;
     D2D_SIZE_U m_pixelSize = {};
     uint32_t m_dpi = 96;
 
-    static uint32_t m_forceDpi;
+    // Target bitmap, pool of staging bitmaps, and indices of staged frames
+    // waiting to be read back, oldest first.
+    ComPtr<ID2D1Bitmap1> m_targetBitmap;
+    StagedFrame m_stagedFrames[StagingBitmapCount];
+    std::deque<uint32_t> m_pendingFrames;
+    uint32_t m_nextStagedFrame = 0;
 
-    ComPtr<IDXGISwapChain> m_swapChain;
-    ComPtr<ID2D1DeviceContext6> m_d2dContext;
+    const ComPtr<IWICImagingFactory> m_wicFactory;
+    std::shared_ptr<ExportState> m_exportState;
+
+    TextLayoutCache m_textLayoutCache;
 
     ResourceList2D m_resourceList;
 };
 
 #pragma endregion // DX_Context
+
+#pragma region Scene
+
+class Scene;
+
+//
+// SceneCacheMode - specifies how a SceneNode caches the rendering of its
+// content and descendants.
+//
+enum class SceneCacheMode
+{
+    // Render the subtree every frame.
+    None,
+
+    // Record the subtree into a command list, which is replayed until the
+    // subtree changes. Resolution-independent, so it suits subtrees drawn
+    // at varying scales.
+    CommandList,
+
+    // Render the subtree into a bitmap at the target DPI, which is drawn
+    // until the subtree changes. Cheapest to replay, but only sharp when the
+    // node is drawn without scaling. Content outside GetBounds is clipped.
+    Bitmap
+};
+
+//
+// SceneNode - node in a retained-mode scene. A node has a transform, an
+// optional clip, and content drawn by its virtual RenderContent method,
+// followed by its children. Nodes are owned by their parents.
+//
+// Changing a node marks the caches of it and its ancestors as invalid, and
+// invalidates the affected area of the window. A node's own transform and
+// clip are applied outside its cache, so changing them only re-records
+// the ancestors' caches, if any.
+//
+class SceneNode
+{
+public:
+    SceneNode() noexcept {}
+    virtual ~SceneNode() {}
+
+    // Creates a child node, which is drawn after existing children.
+    template<typename T, typename... Args>
+    T* AddChild(Args&&... args)
+    {
+        auto child = std::make_unique<T>(std::forward<Args>(args)...);
+        T* p = child.get();
+        AddChild(std::unique_ptr<SceneNode>{ std::move(child) });
+        return p;
+    }
+
+    void AddChild(std::unique_ptr<SceneNode> child);
+
+    // Removes the specified child node and returns ownership of it.
+    std::unique_ptr<SceneNode> RemoveChild(SceneNode* child);
+
+    SceneNode* GetParent() const noexcept
+    {
+        return m_parent;
+    }
+
+    std::vector<std::unique_ptr<SceneNode>> const& GetChildren() const noexcept
+    {
+        return m_children;
+    }
+
+    // Transform from this node's coordinate space to its parent's.
+    D2D_MATRIX_3X2_F const& GetTransform() const noexcept
+    {
+        return m_transform;
+    }
+
+    void SetTransform(D2D_MATRIX_3X2_F const& transform);
+
+    // Optional clip rectangle in the node's coordinate space. It is
+    // applied to the node's content and children.
+    bool HasClip() const noexcept
+    {
+        return m_hasClip;
+    }
+
+    D2D_RECT_F const& GetClip() const noexcept
+    {
+        return m_clip;
+    }
+
+    void SetClip(D2D_RECT_F const& clip);
+    void ClearClip();
+
+    // Bounds of the node's own content in its coordinate space. These are
+    // used to compute the area to invalidate and the size of a bitmap cache.
+    D2D_RECT_F const& GetBounds() const noexcept
+    {
+        return m_bounds;
+    }
+
+    void SetBounds(D2D_RECT_F const& bounds);
+
+    bool IsVisible() const noexcept
+    {
+        return m_isVisible;
+    }
+
+    void SetVisible(bool isVisible);
+
+    SceneCacheMode GetCacheMode() const noexcept
+    {
+        return m_cacheMode;
+    }
+
+    void SetCacheMode(SceneCacheMode mode);
+
+    // Must be called when what RenderContent draws has changed.
+    void InvalidateContent();
+
+    // Returns the bounds of this node and its descendants, clipped and
+    // transformed into the parent's coordinate space.
+    D2D_RECT_F GetSubtreeBounds() const noexcept;
+
+    // Returns the transform from this node's coordinate space to the
+    // scene's coordinate space.
+    D2D_MATRIX_3X2_F GetWorldTransform() const noexcept;
+
+    // Disallow copy, move, and assignment.
+    SceneNode(SceneNode const&) = delete;
+    SceneNode(SceneNode&&) = delete;
+    void operator=(SceneNode const&) = delete;
+    void operator=(SceneNode&&) = delete;
+
+protected:
+    // Draws the node's own content in its coordinate space, before its
+    // children. The context may be recording a cache, so the node must not
+    // change the context's target or assume it is the window's context.
+    virtual void RenderContent(ID2D1DeviceContext6* context)
+    {
+    }
+
+private:
+    friend class Scene;
+
+    void SetScene(Scene* scene) noexcept;
+    void InvalidateCaches() noexcept;
+    void InvalidateArea();
+
+    static D2D_RECT_F TransformRect(D2D_RECT_F const& rect, D2D_MATRIX_3X2_F const& transform) noexcept;
+    static D2D_RECT_F UnionRect(D2D_RECT_F const& a, D2D_RECT_F const& b) noexcept;
+
+    Scene* m_scene = nullptr;
+    SceneNode* m_parent = nullptr;
+    std::vector<std::unique_ptr<SceneNode>> m_children;
+
+    D2D_MATRIX_3X2_F m_transform = D2D1::Matrix3x2F::Identity();
+    D2D_RECT_F m_clip = {};
+    D2D_RECT_F m_bounds = {};
+    bool m_hasClip = false;
+    bool m_isVisible = true;
+
+    SceneCacheMode m_cacheMode = SceneCacheMode::None;
+    ComPtr<ID2D1Image> m_cache;
+    bool m_isCacheValid = false;
+};
+
+//
+// Scene - implementation of IResource2D for a tree of scene nodes. Add the
+// scene to the window's resource list and call Render from RenderContent
+// with the identity transform, so scene coordinates are window DIPs.
+//
+// Cached command lists and bitmaps are device-dependent resources, so they
+// are released by Reset (e.g., on device lost) and recreated on demand.
+//
+class Scene : public IResource2D
+{
+public:
+    // If a window is specified, changes to the scene invalidate the
+    // affected area of the window.
+    explicit Scene(DXWindowContext* window = nullptr) noexcept;
+
+    SceneNode& GetRoot() noexcept
+    {
+        return m_root;
+    }
+
+    void Render(ID2D1DeviceContext6* context);
+
+    // IResource2D methods. Initialize creates a device context used to
+    // record caches.
+    void Initialize(ID2D1DeviceContext6* device) override;
+
+    bool IsInitialized() const noexcept override
+    {
+        return m_recordContext != nullptr;
+    }
+
+    void Reset() noexcept override;
+
+    // Bitmap caches are created at the target DPI.
+    void OnDpiChanged() noexcept override
+    {
+        ResetCaches(m_root);
+    }
+
+private:
+    friend class SceneNode;
+
+    void InvalidateRect(D2D_RECT_F const& rect);
+
+    void UpdateCaches(SceneNode& node, float dpi);
+    void RecordCache(SceneNode& node, float dpi);
+    void RenderNode(ID2D1DeviceContext6* context, SceneNode& node);
+    void RenderSubtree(ID2D1DeviceContext6* context, SceneNode& node);
+    static void ResetCaches(SceneNode& node) noexcept;
+
+    DXWindowContext* m_window;
+    SceneNode m_root;
+    ComPtr<ID2D1DeviceContext6> m_recordContext;
+};
+
+#pragma endregion // Scene
+
+#pragma region Controls
+
+//
+// TextListView - window context that displays a scrollable list of
+// single-line text items, e.g., for tailing a log. The list is
+// virtualized: only the visible lines plus a prefetch margin have text
+// layouts, which come from the window's TextLayoutCache, so scrolling back
+// is cheap and memory is bounded by the cache budget.
+//
+// Line text is stored in a single buffer. Line heights are stored as 16-bit
+// fixed-point values with per-block prefix sums, and are estimated until a
+// line is first laid out.
+//
+class TextListView : public DXWindowContext
+{
+public:
+    // If textFormat is null, a default monospace format is used. Lines are
+    // never wrapped, so the format must use DWRITE_WORD_WRAPPING_NO_WRAP.
+    TextListView(DXDevice* device, HWND hwnd, IDWriteTextFormat* textFormat = nullptr, SwapChainOptions const& options = {});
+
+    // Adds a line to the end of the list. If the view was scrolled to the
+    // end, it scrolls to show the new line.
+    void AppendLine(wchar_t const* text, uint32_t textLength);
+
+    // Removes all lines.
+    void Clear();
+
+    size_t GetLineCount() const noexcept
+    {
+        return m_lineEnds.size();
+    }
+
+    // Scrolls smoothly by the specified distance, in DIPs.
+    void ScrollBy(double delta);
+
+    // Scrolls smoothly to the specified offset from the top, in DIPs.
+    void ScrollTo(double offset);
+
+    void ScrollToLine(size_t lineIndex);
+    void ScrollToEnd();
+
+    double GetScrollOffset() const noexcept
+    {
+        return m_scrollOffset;
+    }
+
+    // Returns the estimated total height of the content, in DIPs.
+    double GetContentHeight() const noexcept;
+
+    // Static methods for handling window messages.
+    static void OnMouseWheel(HWND hwnd, WPARAM wParam) noexcept;
+    static void OnKeyDown(HWND hwnd, WPARAM wParam) noexcept;
+
+protected:
+    void RenderContent() override;
+    void OnBeginFrame() override;
+    void OnSizeChanged() override;
+
+private:
+    // Line heights are in units of 1/HeightScale DIP.
+    static constexpr uint32_t HeightScale = 16;
+    static constexpr size_t BlockSize = 256;
+
+    // Fraction of the viewport height laid out above and below it.
+    static constexpr double PrefetchMargin = 0.5;
+
+    // Time constant of the smooth scrolling animation.
+    static constexpr float ScrollTimeConstantMs = 50.0f;
+
+    static TextListView* GetThis(HWND hwnd) noexcept
+    {
+        return static_cast<TextListView*>(DXWindowContext::GetThis(hwnd));
+    }
+
+    void OnMouseWheelInternal(int wheelDelta);
+    void OnKeyDownInternal(WPARAM key);
+
+    double GetMaxScrollOffset() const noexcept;
+    bool IsAtEnd() const noexcept;
+    void AnimateScroll();
+    double SnapToPixels(double offset) const noexcept;
+    void UpdateVisibleLines();
+
+    wchar_t const* GetLineText(size_t lineIndex) const noexcept;
+    uint32_t GetLineLength(size_t lineIndex) const noexcept;
+
+    // Height prefix sums, in fixed-point units.
+    void SetLineHeight(size_t lineIndex, uint16_t height) noexcept;
+    uint64_t GetLineTop(size_t lineIndex) const noexcept;
+    size_t FindLine(uint64_t y) const noexcept;
+    void EnsureBlockOffsets() const noexcept;
+
+    ComPtr<IDWriteTextFormat> m_textFormat;
+    SolidColorBrush m_textBrush;
+    uint16_t m_estimatedHeight = HeightScale;
+
+    // Line text, and the end offset of each line in m_text.
+    std::wstring m_text;
+    std::vector<uint32_t> m_lineEnds;
+
+    // Per-line heights, which lines have been measured, and per-block sums.
+    // m_blockOffsets is valid for the first m_validBlockCount blocks.
+    std::vector<uint16_t> m_lineHeights;
+    std::vector<bool> m_isLineMeasured;
+    std::vector<uint32_t> m_blockHeights;
+    mutable std::vector<uint64_t> m_blockOffsets;
+    mutable size_t m_validBlockCount = 0;
+
+    // Scroll state, in DIPs. m_drawnOffset is the pixel-aligned offset of
+    // the content currently in the back buffer.
+    double m_scrollOffset = 0;
+    double m_scrollTarget = 0;
+    double m_drawnOffset = 0;
+    int64_t m_lastAnimationTime = 0;
+
+    struct VisibleLine
+    {
+        size_t lineIndex;
+        double top;
+        ComPtr<IDWriteTextLayout> textLayout;
+    };
+
+    std::vector<VisibleLine> m_visibleLines;
+    bool m_areVisibleLinesValid = false;
+};
+
+#pragma endregion // Controls
@@ -8,187 +8,243 @@ int APIENTRY wWinMain(
     _In_ int nCmdShow
 )
 {
-    // Process command-line option to force 96 DPI.
+    StartupTimeline::Mark(StartupMark::ProcessStart);
+
+    // Process command-line options to force 96 DPI or use a translucent
+    // window presented through DirectComposition.
+    bool isTransparent = false;
     if (wcscmp(lpCmdLine, L"-96") == 0)
     {
         DXWindowContext::ForceDpi(96);
     }
+    else if (wcscmp(lpCmdLine, L"-transparent") == 0)
+    {
+        isTransparent = true;
+    }
 
-    // Create the device and the main window.
+    // Create the device objects and load the fonts in the background while
+    // the main window is created and its content is prepared.
     ComPtr<DXDevice> dxDevice{ new DXDevice{} };
-    auto windowContext = HelloWorldWindow::Create(dxDevice.Get(), hInstance, nCmdShow);
+    dxDevice->BeginFontWarmup();
+    dxDevice->BeginInitialize();
 
-    // Process messages until the main window is destroyed.
-    MSG msg;
-    while (GetMessage(&msg, nullptr, 0, 0))
-    {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-    }
+    auto windowContext = HelloWorldWindow::Create(dxDevice.Get(), hInstance, nCmdShow, isTransparent);
 
-    return (int) msg.wParam;
+    // Process messages until the main window is destroyed.
+    return windowContext->RunMessageLoop();
 }
 
-ComPtr<HelloWorldWindow> HelloWorldWindow::Create(DXDevice* device, HINSTANCE hInstance, int showCommand)
+ComPtr<HelloWorldWindow> HelloWorldWindow::Create(DXDevice* device, HINSTANCE hInstance, int showCommand, bool isTransparent)
 {
-    wchar_t const className[] = L"HelloWorldWindow";
-
-    // Register the window class on the first call.
-    static bool isClassRegistered = false;
-    if (!isClassRegistered)
-    {
-        WNDCLASSEXW wcex = {};
-
-        wcex.cbSize = sizeof(WNDCLASSEX);
-
-        wcex.style = CS_HREDRAW | CS_VREDRAW;
-        wcex.lpfnWndProc = WindowProc;
-        //wcex.cbClsExtra = 0;
-        //wcex.cbWndExtra = 0;
-        wcex.hInstance = hInstance;
-        wcex.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_HELLODESKTOP2D));
-        wcex.hCursor = LoadCursor(nullptr, IDC_ARROW);
-        wcex.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-        //wcex.lpszMenuName = nullptr;
-        wcex.lpszClassName = className;
-        wcex.hIconSm = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_SMALL));
-
-        ATOM classAtom = RegisterClassExW(&wcex);
-        if (classAtom == 0)
-        {
-            ThrowLastError();
-        }
-
-        isClassRegistered = true;
-    }
-
     // Get the window title.
     constexpr uint32_t maxTitle = 100;
     wchar_t appTitle[maxTitle];
     LoadStringW(hInstance, IDS_APP_TITLE, appTitle, maxTitle);
 
-    // Create the window.
-    HWND hwnd = CreateWindowW(
-        className,
+    // Create the window. A transparent window has no redirection bitmap,
+    // since its content is presented through DirectComposition.
+    ComPtr<HelloWorldWindow> windowContext{ new HelloWorldWindow{ device, isTransparent } };
+
+    HWND hwnd = windowContext->CreateHwnd(
+        hInstance,
         appTitle,
         WS_OVERLAPPEDWINDOW,
-        CW_USEDEFAULT, 0,
-        CW_USEDEFAULT, 0,
-        nullptr,
-        nullptr,
-        hInstance,
-        nullptr
+        isTransparent ? WS_EX_NOREDIRECTIONBITMAP : 0
     );
 
-    if (hwnd == nullptr)
-    {
-        ThrowLastError();
-    }
-
-    // Show the window, so it has a size when we create the window context.
-    ShowWindow(hwnd, showCommand);
+    StartupTimeline::Mark(StartupMark::WindowCreated);
 
-    ComPtr<HelloWorldWindow> windowContext{ new HelloWorldWindow{ device, hwnd } };
+    // Request the text layouts now that the window can be woken when they
+    // are ready. Placeholders are drawn until the layouts are ready.
+    windowContext->UpdateTextLines();
 
-    UpdateWindow(hwnd);
+    // Show the window. The first paint happens from the message loop rather
+    // than UpdateWindow, so it doesn't wait for the device on the startup path.
+    ShowWindow(hwnd, showCommand);
 
     return windowContext;
 }
 
-HelloWorldWindow::HelloWorldWindow(DXDevice* device, HWND hwnd) :
-    DXWindowContext{ device, hwnd }
+HelloWorldWindow::HelloWorldWindow(DXDevice* device, bool isTransparent) :
+    DXWindow{ device, GetSwapChainOptions(isTransparent) },
+    m_isTransparent{ isTransparent }
 {
-    // Add the text brush resource, so it will be initialized.
+    // Add the brush, batch, and effect resources, so they will be initialized.
     AddResource(&m_textBrush);
+    AddResource(&m_placeholderBrush);
+    AddResource(&m_textBatch);
+    AddResource(&m_cardBrush);
+    AddResource(&m_cardFlood);
+    AddResource(&m_cardCrop);
+    AddResource(&m_cardShadow);
 
-    // Create the text layout object.
-    auto dwriteFactory = GetDWriteFactory();
-
-    ComPtr<IDWriteTextFormat> textFormat;
-    HR(dwriteFactory->CreateTextFormat(
-        L"Segoe UI",
-        nullptr,
-        DWRITE_FONT_WEIGHT_NORMAL,
-        DWRITE_FONT_STYLE_NORMAL,
-        DWRITE_FONT_STRETCH_NORMAL,
-        10.0f,
-        L"en-us",
-        &textFormat
-    ));
-
-    HR(textFormat->SetWordWrapping(DWRITE_WORD_WRAPPING_NO_WRAP));
+    // Get the text format, which is shared with other windows on the device.
+    m_textFormat = device->GetTextFormatCache().Get(L"Segoe UI", 10.0f, DWRITE_WORD_WRAPPING_NO_WRAP);
 
+    // Set up the text lines, whose layouts are created on worker threads.
     constexpr uint32_t lineCount = 24;
-    m_textLines.reserve(lineCount);
+    m_textLines.resize(lineCount);
 
+    float textHeight = 0;
     for (uint32_t i = 0; i < lineCount; i++)
     {
-        TextLine textLine;
+        TextLine& textLine = m_textLines[i];
+        textLine.fontSize = 8.0f + i;
+        textLine.lineHeight = textLine.fontSize * 1.33f;
+        textHeight += textLine.lineHeight;
+    }
 
-        static wchar_t const text[] = L"Hello World! 😀";
-        constexpr uint32_t textLength = ARRAYSIZE(text) - 1;
+    // Size the card to fit the estimated text, and build its shadow from an
+    // opaque flood cropped to the card.
+    float const textWidth = m_textLines.back().fontSize * 7;
+    m_cardRect = D2D_RECT_F{ 4.0f, 4.0f, 16.0f + textWidth, 16.0f + textHeight };
 
-        HR(dwriteFactory->CreateTextLayout(
-            text,
-            textLength,
-            textFormat.Get(),
-            0,
-            0,
-            &textLine.textLayout
-        ));
+    m_cardCrop.SetInput(0, &m_cardFlood);
+    m_cardCrop.SetValue(D2D1_CROP_PROP_RECT, D2D1::Vector4F(m_cardRect.left, m_cardRect.top, m_cardRect.right, m_cardRect.bottom));
+    m_cardShadow.SetInput(0, &m_cardCrop);
+    m_cardShadow.SetValue(D2D1_SHADOW_PROP_BLUR_STANDARD_DEVIATION, 4.0f);
+    m_cardShadow.SetValue(D2D1_SHADOW_PROP_COLOR, D2D1::Vector4F(0, 0, 0, 0.3f));
+}
 
-        HR(textLine.textLayout->SetFontSize(8.0f + i, DWRITE_TEXT_RANGE{ 0, textLength }));
+SwapChainOptions HelloWorldWindow::GetSwapChainOptions(bool isTransparent) noexcept
+{
+    SwapChainOptions options;
+    options.composition = isTransparent;
+    return options;
+}
 
-        DWRITE_TEXT_METRICS textMetrics;
-        HR(textLine.textLayout->GetMetrics(&textMetrics));
+void HelloWorldWindow::InitializeWindowClass(WNDCLASSEXW& wcex) noexcept
+{
+    wcex.hIcon = LoadIcon(wcex.hInstance, MAKEINTRESOURCE(IDI_HELLODESKTOP2D));
+    wcex.hIconSm = LoadIcon(wcex.hInstance, MAKEINTRESOURCE(IDI_SMALL));
+    wcex.lpszClassName = L"HelloWorldWindow";
+}
+
+void HelloWorldWindow::OnDestroy()
+{
+    PostQuitMessage(0);
+}
 
-        textLine.lineHeight = textMetrics.height;
+void HelloWorldWindow::ProcessInput(std::vector<InputEvent> const& events)
+{
+    // F2 toggles the frame timing overlay, and F3 captures the next frame to
+    // a file that the benchmark can replay.
+    for (auto const& event : events)
+    {
+        if (event.type != InputEventType::KeyDown || (event.flags & KF_REPEAT) != 0)
+        {
+            continue;
+        }
 
-        m_textLines.push_back(std::move(textLine));
+        if (event.key == VK_F2)
+        {
+            m_isTimingOverlayVisible = !m_isTimingOverlayVisible;
+            ShowFrameTimingOverlay(m_isTimingOverlayVisible);
+        }
+        else if (event.key == VK_F3)
+        {
+            CaptureNextFrame(L"HelloDesktop2D.d2fc");
+        }
     }
 }
 
-LRESULT CALLBACK HelloWorldWindow::WindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+void HelloWorldWindow::UpdateTextLines()
 {
-    switch (message)
+    static wchar_t const text[] = L"Hello World! 😀";
+    constexpr uint32_t textLength = ARRAYSIZE(text) - 1;
+
+    auto dwriteFactory = GetDWriteFactory();
+    auto& layoutCache = GetTextLayoutCache();
+
+    bool areAllLinesReady = true;
+
+    for (auto& textLine : m_textLines)
+    {
+        if (textLine.textLayout != nullptr)
+        {
+            continue;
+        }
+
+        CachedTextLayout layout;
+        if (layoutCache.TryGet(dwriteFactory, text, textLength, m_textFormat.Get(), 0, textLine.fontSize, &layout))
+        {
+            textLine.textLayout = std::move(layout.textLayout);
+            textLine.lineHeight = layout.metrics.height;
+        }
+        else
+        {
+            areAllLinesReady = false;
+        }
+    }
+
+    if (areAllLinesReady && m_textBatch.IsEmpty())
     {
-    case WM_PAINT:
-        DXWindowContext::OnPaint(hwnd);
-        break;
-    case WM_SIZE:
-        DXWindowContext::OnResize(hwnd);
-        break;
-    case WM_DPICHANGED:
-        DXWindowContext::OnDpiChanged(hwnd, wParam, lParam);
-        break;
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        break;
-    default:
-        return DefWindowProc(hwnd, message, wParam, lParam);
+        // Capture the glyph runs of all the lines, so they can be drawn
+        // without re-walking the layouts each frame.
+        D2D_POINT_2F textPos{ 10.0f, 10.0f };
+
+        for (auto& textLine : m_textLines)
+        {
+            m_textBatch.AddTextLayout(dwriteFactory, textLine.textLayout.Get(), textPos, static_cast<float>(GetDpi()));
+            textPos.y += textLine.lineHeight;
+        }
+
+        StartupTimeline::Mark(StartupMark::ContentReady);
     }
-    return 0;
+}
+
+void HelloWorldWindow::OnTextLayoutsReady()
+{
+    UpdateTextLines();
+    InvalidateAll();
+}
+
+void HelloWorldWindow::OnDpiChanged()
+{
+    // The captured glyph runs are snapped to pixels at the old DPI.
+    m_textBatch.Clear();
+    UpdateTextLines();
 }
 
 void HelloWorldWindow::RenderContent()
 {
     auto context = GetD2dContext();
 
-    // Clear to white.
-    context->Clear(D2D1_COLOR_F{ 1.0f, 1.0f, 1.0f, 1.0f });
+    // Clear to white, or to translucent white (premultiplied) if the window
+    // is transparent.
+    context->Clear(m_isTransparent ?
+        D2D1_COLOR_F{ 0.75f, 0.75f, 0.75f, 0.75f } :
+        D2D1_COLOR_F{ 1.0f, 1.0f, 1.0f, 1.0f });
 
-    // Draw the text lines.
+    // Draw the card under the text, with its shadow offset down and right.
+    m_cardShadow.Draw(context, D2D_POINT_2F{ 1.0f, 2.0f });
+    context->FillRectangle(m_cardRect, m_cardBrush.Get());
+
+    if (!m_textBatch.IsEmpty())
+    {
+        // Draw the text lines.
+        m_textBatch.Draw(context, m_textBrush.Get());
+        return;
+    }
+
+    // Some layouts aren't ready yet, so draw the ones that are, and draw
+    // placeholders for the others.
     D2D_POINT_2F textPos{ 10.0f, 10.0f };
 
     for (auto& textLine : m_textLines)
     {
-        context->DrawTextLayout(
-            textPos,
-            textLine.textLayout.Get(),
-            m_textBrush.Get(),
-            D2D1_DRAW_TEXT_OPTIONS_ENABLE_COLOR_FONT
-        );
-
+        if (textLine.textLayout != nullptr)
+        {
+            context->DrawTextLayout(textPos, textLine.textLayout.Get(), m_textBrush.Get(), D2D1_DRAW_TEXT_OPTIONS_ENABLE_COLOR_FONT);
+        }
+        else
+        {
+            float const width = textLine.fontSize * 7;
+            context->FillRectangle(
+                D2D_RECT_F{ textPos.x, textPos.y + 2, textPos.x + width, textPos.y + textLine.lineHeight - 2 },
+                m_placeholderBrush.Get()
+            );
+        }
         textPos.y += textLine.lineHeight;
     }
 }
@@ -3,21 +3,48 @@
 #include "resource.h"
 #include "DXHelpers.h"
 
-class HelloWorldWindow : public DXWindowContext
+class HelloWorldWindow : public DXWindow<HelloWorldWindow>
 {
 public:
-    static ComPtr<HelloWorldWindow> Create(DXDevice* device, HINSTANCE hInstance, int showCommand);
+    static ComPtr<HelloWorldWindow> Create(DXDevice* device, HINSTANCE hInstance, int showCommand, bool isTransparent = false);
 
 private:
-    HelloWorldWindow(DXDevice* device, HWND hwnd);
-    static LRESULT CALLBACK WindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
+    friend class DXWindow<HelloWorldWindow>;
+
+    HelloWorldWindow(DXDevice* device, bool isTransparent);
+    static SwapChainOptions GetSwapChainOptions(bool isTransparent) noexcept;
+
+    // Handlers called by DXWindow.
+    static void InitializeWindowClass(WNDCLASSEXW& wcex) noexcept;
+    void OnDestroy();
+    void ProcessInput(std::vector<InputEvent> const& events) override;
+
     void RenderContent() override;
+    void OnTextLayoutsReady() override;
+    void OnDpiChanged() override;
+
+    void UpdateTextLines();
 
     SolidColorBrush m_textBrush;
+    SolidColorBrush m_placeholderBrush{ 0.9f, 0.9f, 0.9f };
+
+    // The text is drawn on a card with a drop shadow. The shadow of a
+    // cropped flood is cached, so it is rendered only when the card changes.
+    SolidColorBrush m_cardBrush{ 1.0f, 1.0f, 1.0f };
+    Effect2D m_cardFlood{ CLSID_D2D1Flood, false };
+    Effect2D m_cardCrop{ CLSID_D2D1Crop, false };
+    Effect2D m_cardShadow{ CLSID_D2D1Shadow };
+    D2D_RECT_F m_cardRect = {};
+
+    GlyphRunBatch m_textBatch;
+    ComPtr<IDWriteTextFormat> m_textFormat;
+    bool m_isTransparent = false;
+    bool m_isTimingOverlayVisible = false;
 
     struct TextLine
     {
         ComPtr<IDWriteTextLayout> textLayout;
+        float fontSize;
         float lineHeight;
     };
 
@@ -5,18 +5,37 @@
 #define NOMINMAX
 // Windows Header Files
 #include <windows.h>
+#include <windowsx.h>
 #include <dwrite_3.h>
 #include <d3d11_4.h>
+#include <dxgi1_6.h>
+#include <dcomp.h>
+#include <dwmapi.h>
 #include <d2d1_3.h>
 #include <d2d1_3helper.h>
+#include <wincodec.h>
 #include <wrl/client.h>
 
 // C RunTime Header Files
 #include <stdlib.h>
 #include <malloc.h>
 #include <memory.h>
+#include <math.h>
 #include <tchar.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
 #include <vector>
+#include <list>
+#include <deque>
+#include <string>
+#include <unordered_map>
 #include <memory>
 #include <algorithm>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <type_traits>